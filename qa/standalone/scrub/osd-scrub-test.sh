@@ -402,6 +402,124 @@ function TEST_deep_scrub_abort() {
     _scrub_abort $dir deep_scrub
 }
 
+# interrupt a deep scrub after it has checkpointed its progress, modify all
+# the objects (those below the checkpoint included), and check that the
+# resumed scrub reads them all again
+function TEST_deep_scrub_checkpoint_resume() {
+    local dir=$1
+    local poolname=test
+    local OSDS=2
+    local objects=50
+
+    TESTDATA="testdata.$$"
+
+    setup $dir || return 1
+    run_mon $dir a --osd_pool_default_size=2 || return 1
+    run_mgr $dir x || return 1
+    for osd in $(seq 0 $(expr $OSDS - 1))
+    do
+      run_osd $dir $osd --osd_pool_default_pg_autoscale_mode=off \
+	      --osd_deep_scrub_checkpoint=true \
+	      --osd_deep_scrub_checkpoint_interval=0 \
+	      --osd_scrub_chunk_min=5 \
+	      --osd_scrub_chunk_max=5 \
+	      --osd_scrub_sleep=1.0 \
+	      --osd_deep_scrub_interval=5 \
+	      --osd_scrub_min_interval=5 \
+	      --osd_scrub_max_interval=5 \
+	      --osd_deep_scrub_randomize_ratio=0.0 \
+	      --osd_scrub_interval_randomize_ratio=0 || return 1
+    done
+
+    # no scrubbing until the objects are in place. The deep scrub must be a
+    # scheduled one: operator-requested scrubs are not checkpointed.
+    ceph osd set noscrub || return 1
+    ceph osd set nodeep-scrub || return 1
+
+    # Create a pool with a single pg
+    create_pool $poolname 1 1
+    wait_for_clean || return 1
+    poolid=$(ceph osd dump | grep "^pool.*[']${poolname}[']" | awk '{ print $2 }')
+
+    dd if=/dev/urandom of=$TESTDATA bs=1032 count=1
+    for i in `seq 1 $objects`
+    do
+        rados -p $poolname put obj${i} $TESTDATA
+    done
+
+    local primary=$(get_primary $poolname obj1)
+    local pgid="${poolid}.0"
+    local last_deep_scrub=$(get_last_scrub_stamp $pgid last_deep_scrub_stamp)
+
+    ceph osd unset noscrub || return 1
+    ceph osd unset nodeep-scrub || return 1
+
+    # wait for a checkpoint, then interrupt the scrub
+    found="no"
+    for i in $(seq 0 120)
+    do
+      if grep -q "maybe_checkpoint at" $dir/osd.${primary}.log
+      then
+        found="yes"
+        break
+      fi
+      sleep 1
+    done
+    if test $found = "no";
+    then
+      echo "No checkpoint taken"
+      return 1
+    fi
+    ceph osd set noscrub || return 1
+    ceph osd set nodeep-scrub || return 1
+
+    set -o pipefail
+    for i in $(seq 0 200)
+    do
+      flush_pg_stats
+      if ceph pg dump pgs | grep ^$pgid | grep -q "scrubbing"
+      then
+        sleep 1
+        continue
+      fi
+      break
+    done
+    set +o pipefail
+    if ! grep -q "nodeep_scrub set, aborting" $dir/osd.${primary}.log
+    then
+      echo "Abort not seen in log"
+      return 1
+    fi
+    if test "$(get_last_scrub_stamp $pgid last_deep_scrub_stamp)" '>' "$last_deep_scrub"
+    then
+      echo "Deep scrub completed before being interrupted"
+      return 1
+    fi
+
+    # modify all the objects, and have each fail to be read on the replica:
+    # the resumed scrub must report all of them
+    dd if=/dev/urandom of=$TESTDATA bs=1032 count=1
+    for i in `seq 1 $objects`
+    do
+        rados -p $poolname put obj${i} $TESTDATA
+        inject_eio rep data $poolname obj${i} $dir 1 || return 1
+    done
+    rm -f $TESTDATA
+
+    for osd in $(seq 0 $(expr $OSDS - 1))
+    do
+      set_config osd $osd osd_scrub_sleep 0 || return 1
+    done
+    ceph osd unset noscrub || return 1
+    ceph osd unset nodeep-scrub || return 1
+    TIMEOUT=300 wait_for_scrub $pgid "$last_deep_scrub" last_deep_scrub_stamp || return 1
+
+    grep -q "rescrubbing modified objects" $dir/osd.${primary}.log || return 1
+    test "$(rados list-inconsistent-obj $pgid | jq '.inconsistents | length')" = "$objects" || return 1
+
+    teardown $dir || return 1
+}
+
 function TEST_scrub_permit_time() {
     local dir=$1
     local poolname=test
@@ -103,6 +103,12 @@ struct io_queue_t {
   virtual int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size,
 			   void *priv, int *retries) = 0;
   virtual int get_next_completed(int timeout_ms, aio_t **paio, int max) = 0;
+
+  /// get a buffer of 'len' bytes the queue can do I/O on without mapping
+  /// it for every request; false if there is none to spare
+  virtual bool get_fixed_buffer(size_t len, ceph::bufferptr *bp) {
+    return false;
+  }
 };
 
 struct aio_queue_t final : public io_queue_t {
@@ -32,6 +32,7 @@
 #endif
 #include "common/debug.h"
 #include "common/numa.h"
+#include "common/perf_counters.h"
 
 #include "global/global_context.h"
 #include "io_uring.h"
@@ -73,7 +74,13 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv, ai
   if (use_ioring && ioring_queue_t::supported()) {
     bool use_ioring_hipri = cct->_conf.get_val<bool>("bdev_ioring_hipri");
     bool use_ioring_sqthread_poll = cct->_conf.get_val<bool>("bdev_ioring_sqthread_poll");
-    io_queue = std::make_unique<ioring_queue_t>(iodepth, use_ioring_hipri, use_ioring_sqthread_poll);
+    auto q = std::make_unique<ioring_queue_t>(
+      iodepth, use_ioring_hipri, use_ioring_sqthread_poll,
+      cct->_conf.get_val<uint64_t>("bdev_ioring_sqthread_idle_ms"),
+      cct->_conf.get_val<uint64_t>("bdev_ioring_fixed_buffers"),
+      cct->_conf.get_val<Option::size_t>("bdev_ioring_fixed_buffer_size"));
+    ioring = q.get();
+    io_queue = std::move(q);
   } else {
     static bool once;
     if (use_ioring && !once) {
@@ -473,6 +480,9 @@ int KernelDevice::_aio_start()
 {
   if (aio) {
     dout(10) << __func__ << dendl;
+    if (ioring) {
+      _init_ioring_logger();
+    }
     int r = io_queue->init(fd_directs);
     if (r < 0) {
       if (r == -EAGAIN) {
@@ -481,6 +491,7 @@ int KernelDevice::_aio_start()
       } else {
 	derr << __func__ << " io_setup(2) failed: " << cpp_strerror(r) << dendl;
       }
+      _shutdown_ioring_logger();
       return r;
     }
     aio_thread.create("bstore_aio");
@@ -496,6 +507,37 @@ void KernelDevice::_aio_stop()
     aio_thread.join();
     aio_stop = false;
     io_queue->shutdown();
+    _shutdown_ioring_logger();
+  }
+}
+
+void KernelDevice::_init_ioring_logger()
+{
+  auto name = "bdev-" + path.substr(path.rfind('/') + 1);
+  PerfCountersBuilder b(cct, name,
+			l_bdev_ioring_first, l_bdev_ioring_last);
+  b.add_u64(l_bdev_ioring_inflight, "inflight",
+	    "I/Os submitted to the ring and not completed yet");
+  b.add_time_avg(l_bdev_ioring_submit_lat, "submit_lat",
+		 "Average time to submit a batch of I/Os");
+  b.add_u64_avg(l_bdev_ioring_submit_batch, "submit_batch",
+		"I/Os per submission");
+  b.add_u64_counter(l_bdev_ioring_fixed_ios, "fixed_ios",
+		    "I/Os done from registered buffers");
+  b.add_u64(l_bdev_ioring_fixed_buffers_free, "fixed_buffers_free",
+	    "Registered buffers available");
+  ioring_logger = b.create_perf_counters();
+  cct->get_perfcounters_collection()->add(ioring_logger);
+  ioring->logger = ioring_logger;
+}
+
+void KernelDevice::_shutdown_ioring_logger()
+{
+  if (ioring_logger) {
+    ioring->logger = nullptr;
+    cct->get_perfcounters_collection()->remove(ioring_logger);
+    delete ioring_logger;
+    ioring_logger = nullptr;
   }
 }
 
@@ -940,7 +982,17 @@ int KernelDevice::aio_write(
     return 0;
   }
 
-  if ((!buffered || bl.get_num_buffers() >= IOV_MAX) &&
+  ceph::bufferptr fixed;
+  if (aio && dio && !buffered &&
+      !bl.is_aligned_size_and_memory(block_size, block_size) &&
+      io_queue->get_fixed_buffer(len, &fixed)) {
+    // the data has to be copied anyway, make it to a buffer the queue
+    // needs not map for the write
+    bl.begin().copy(len, fixed.c_str());
+    bl.clear();
+    bl.append(std::move(fixed));
+    dout(20) << __func__ << " copied to a registered buffer" << dendl;
+  } else if ((!buffered || bl.get_num_buffers() >= IOV_MAX) &&
       bl.rebuild_aligned_size_and_memory(block_size, block_size, IOV_MAX)) {
     dout(20) << __func__ << " rebuilding buffer to be aligned" << dendl;
   }
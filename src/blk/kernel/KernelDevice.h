@@ -27,6 +27,9 @@
 
 #define RW_IO_MAX (INT_MAX & CEPH_PAGE_MASK)
 
+class PerfCounters;
+struct ioring_queue_t;
+
 class KernelDevice : public BlockDevice {
   std::vector<int> fd_directs, fd_buffereds;
   bool enable_wrt = true;
@@ -45,6 +48,8 @@ class KernelDevice : public BlockDevice {
   ceph::mutex flush_mutex = ceph::make_mutex("KernelDevice::flush_mutex");
 
   std::unique_ptr<io_queue_t> io_queue;
+  ioring_queue_t *ioring = nullptr;  ///< io_queue, if it is io_uring
+  PerfCounters *ioring_logger = nullptr;
   aio_callback_t discard_callback;
   void *discard_callback_priv;
   bool aio_stop;
@@ -84,6 +89,9 @@ class KernelDevice : public BlockDevice {
   int _aio_start();
   void _aio_stop();
 
+  void _init_ioring_logger();
+  void _shutdown_ioring_logger();
+
   int _discard_start();
   void _discard_stop();
 
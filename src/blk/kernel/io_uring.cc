@@ -7,13 +7,87 @@
 
 #include "liburing.h"
 #include <sys/epoll.h>
+#include <condition_variable>
+
+#include "common/deleter.h"
+#include "common/perf_counters.h"
+#include "include/intarith.h"
+
+/*
+ * A pool of buffers registered with the ring. I/O from these skips the
+ * mapping of the user pages the kernel would otherwise do for each request.
+ * The buffers handed out keep the pool alive, as they may outlive the ring.
+ */
+struct ioring_buffers {
+  char *base = nullptr;
+  uint64_t size = 0;
+  unsigned count = 0;
+  std::mutex lock;
+  std::vector<unsigned> free_list;
+  PerfCounters *logger = nullptr;
+
+  ~ioring_buffers() {
+    ::free(base);
+  }
+
+  int get(uint64_t len) {
+    if (len > size) {
+      return -1;
+    }
+    std::lock_guard l(lock);
+    if (free_list.empty()) {
+      return -1;
+    }
+    unsigned index = free_list.back();
+    free_list.pop_back();
+    if (logger) {
+      logger->set(l_bdev_ioring_fixed_buffers_free, free_list.size());
+    }
+    return index;
+  }
+  void put(unsigned index) {
+    std::lock_guard l(lock);
+    free_list.push_back(index);
+    if (logger) {
+      logger->set(l_bdev_ioring_fixed_buffers_free, free_list.size());
+    }
+  }
+  /// the index of the buffer 'p' lies in, if any
+  int find(const void *p) const {
+    auto c = static_cast<const char*>(p);
+    if (c < base || c >= base + size * count) {
+      return -1;
+    }
+    return (c - base) / size;
+  }
+};
+
+/*
+ * The aios of one submit_batch() call, as queued for the thread submitting.
+ * Lives on the caller's stack: the caller waits until it is done.
+ */
+struct ioring_sq_ticket {
+  std::vector<aio_t*> aios;
+  int r = 0;          ///< the result of the submission which took it
+  bool done = false;  ///< the aios were handed to the kernel (or failed to)
+};
 
 struct ioring_data {
   struct io_uring io_uring;
   pthread_mutex_t cq_mutex;
-  pthread_mutex_t sq_mutex;
   int epoll_fd = -1;
   std::map<int, int> fixed_fds_map;
+  std::shared_ptr<ioring_buffers> buffers;
+  PerfCounters *logger = nullptr;
+
+  // submitters queue their aios here, and the one that finds no submission
+  // in progress hands all those queued to the kernel, so that a single thread
+  // fills the submission queue and concurrent submits are batched together.
+  // The others wait for their ticket to be done, or for their turn.
+  std::mutex sq_lock;
+  std::condition_variable sq_cond;
+  std::vector<ioring_sq_ticket*> sq_pending;
+  bool submitting = false;
 };
 
 static int ioring_get_cqe(struct ioring_data *d, unsigned int max,
@@ -34,6 +108,8 @@ static int ioring_get_cqe(struct ioring_data *d, unsigned int max,
       break;
   }
   io_uring_cq_advance(ring, nr);
+  if (nr && d->logger)
+    d->logger->dec(l_bdev_ioring_inflight, nr);
 
   return nr;
 }
@@ -54,46 +130,104 @@ static void init_sqe(struct ioring_data *d, struct io_uring_sqe *sqe,
 
   ceph_assert(fixed_fd != -1);
 
-  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV)
-    io_uring_prep_writev(sqe, fixed_fd, &io->iov[0],
-			 io->iov.size(), io->offset);
-  else if (io->iocb.aio_lio_opcode == IO_CMD_PREADV)
-    io_uring_prep_readv(sqe, fixed_fd, &io->iov[0],
-			io->iov.size(), io->offset);
-  else
+  int buf_index = -1;
+  if (d->buffers && io->iov.size() == 1)
+    buf_index = d->buffers->find(io->iov[0].iov_base);
+
+  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV) {
+    if (buf_index >= 0)
+      io_uring_prep_write_fixed(sqe, fixed_fd, io->iov[0].iov_base,
+				io->iov[0].iov_len, io->offset, buf_index);
+    else
+      io_uring_prep_writev(sqe, fixed_fd, &io->iov[0],
+			   io->iov.size(), io->offset);
+  } else if (io->iocb.aio_lio_opcode == IO_CMD_PREADV) {
+    if (buf_index >= 0)
+      io_uring_prep_read_fixed(sqe, fixed_fd, io->iov[0].iov_base,
+			       io->iov[0].iov_len, io->offset, buf_index);
+    else
+      io_uring_prep_readv(sqe, fixed_fd, &io->iov[0],
+			  io->iov.size(), io->offset);
+  } else
     ceph_assert(0);
 
+  if (buf_index >= 0 && d->logger)
+    d->logger->inc(l_bdev_ioring_fixed_ios);
+
   io_uring_sqe_set_data(sqe, io);
   io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
 }
 
-static int ioring_queue(struct ioring_data *d, void *priv,
-			list<aio_t>::iterator beg, list<aio_t>::iterator end)
+static int ioring_submit(struct ioring_data *d, unsigned queued, int *retries)
 {
   struct io_uring *ring = &d->io_uring;
-  struct aio_t *io = nullptr;
-
-  ceph_assert(beg != end);
-
-  do {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
-    if (!sqe)
-      break;
-
-    io = &*beg;
-    io->priv = priv;
-
-    init_sqe(d, sqe, io);
+  // 2^16 * 125us = ~8 seconds, so max sleep is ~16 seconds
+  int attempts = 16;
+  int delay = 125;
 
-  } while (++beg != end);
+  if (d->logger) {
+    d->logger->inc(l_bdev_ioring_inflight, queued);
+    d->logger->inc(l_bdev_ioring_submit_batch, queued);
+  }
+  auto start = ceph::mono_clock::now();
+  int r;
+  while ((r = io_uring_submit(ring)) < 0) {
+    // -EBUSY: the completion queue overflowed, let the aio thread reap it
+    if ((r == -EAGAIN || r == -EBUSY) && attempts-- > 0) {
+      usleep(delay);
+      delay *= 2;
+      (*retries)++;
+      continue;
+    }
+    return r;
+  }
+  if (d->logger)
+    d->logger->tinc(l_bdev_ioring_submit_lat,
+		    ceph::mono_clock::now() - start);
+  return r;
+}
 
-  if (!io)
-    /* Queue is full, go and reap something first */
+/// queue the aios of all the tickets, and submit them; only called by the
+/// thread currently submitting
+static int ioring_queue(struct ioring_data *d,
+			const std::vector<ioring_sq_ticket*>& tickets,
+			int *retries)
+{
+  struct io_uring *ring = &d->io_uring;
+  unsigned queued = 0;
+  int r;
+
+  for (auto t : tickets) {
+    for (auto io : t->aios) {
+      struct io_uring_sqe *sqe;
+      int attempts = 16;
+      int delay = 125;
+      while (!(sqe = io_uring_get_sqe(ring))) {
+	/* Queue is full, have the kernel consume it first */
+	if (queued) {
+	  r = ioring_submit(d, queued, retries);
+	  if (r < 0)
+	    return r;
+	  queued = 0;
+	} else {
+	  /* the sq thread has yet to pick up what we submitted */
+	  if (attempts-- == 0)
+	    return -EAGAIN;
+	  usleep(delay);
+	  delay *= 2;
+	  (*retries)++;
+	}
+      }
+      init_sqe(d, sqe, io);
+      ++queued;
+    }
+  }
+  if (!queued)
     return 0;
 
-  return io_uring_submit(ring);
+  r = ioring_submit(d, queued, retries);
+  return r < 0 ? r : 0;
 }
-
 static void build_fixed_fds_map(struct ioring_data *d,
 				std::vector<int> &fds)
 {
@@ -103,11 +237,43 @@ static void build_fixed_fds_map(struct ioring_data *d,
   }
 }
 
-ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_) :
+static void register_fixed_buffers(struct ioring_data *d,
+				   unsigned count, uint64_t size)
+{
+  auto b = std::make_shared<ioring_buffers>();
+  size = p2roundup(size, (uint64_t)CEPH_PAGE_SIZE);
+  if (::posix_memalign((void **)&b->base, CEPH_PAGE_SIZE, size * count))
+    return;
+
+  std::vector<struct iovec> iovs(count);
+  for (unsigned i = 0; i < count; ++i) {
+    iovs[i].iov_base = b->base + i * size;
+    iovs[i].iov_len = size;
+    b->free_list.push_back(count - 1 - i);
+  }
+  if (io_uring_register_buffers(&d->io_uring, iovs.data(), count) < 0)
+    /* e.g. over RLIMIT_MEMLOCK, do without them */
+    return;
+
+  b->size = size;
+  b->count = count;
+  b->logger = d->logger;
+  if (b->logger)
+    b->logger->set(l_bdev_ioring_fixed_buffers_free, count);
+  d->buffers = std::move(b);
+}
+
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_,
+			       unsigned sq_thread_idle_ms_,
+			       unsigned fixed_buffers_,
+			       uint64_t fixed_buffer_size_) :
   d(make_unique<ioring_data>()),
   iodepth(iodepth_),
   hipri(hipri_),
-  sq_thread(sq_thread_)
+  sq_thread(sq_thread_),
+  sq_thread_idle_ms(sq_thread_idle_ms_),
+  fixed_buffers(fixed_buffers_),
+  fixed_buffer_size(fixed_buffer_size_)
 {
 }
 
@@ -117,17 +283,19 @@ ioring_queue_t::~ioring_queue_t()
 
 int ioring_queue_t::init(std::vector<int> &fds)
 {
-  unsigned flags = 0;
+  struct io_uring_params params;
 
+  memset(&params, 0, sizeof(params));
   pthread_mutex_init(&d->cq_mutex, NULL);
-  pthread_mutex_init(&d->sq_mutex, NULL);
 
   if (hipri)
-    flags |= IORING_SETUP_IOPOLL;
-  if (sq_thread)
-    flags |= IORING_SETUP_SQPOLL;
+    params.flags |= IORING_SETUP_IOPOLL;
+  if (sq_thread) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = sq_thread_idle_ms;
+  }
 
-  int ret = io_uring_queue_init(iodepth, &d->io_uring, flags);
+  int ret = io_uring_queue_init_params(iodepth, &d->io_uring, &params);
   if (ret < 0)
     return ret;
 
@@ -140,6 +308,10 @@ int ioring_queue_t::init(std::vector<int> &fds)
 
   build_fixed_fds_map(d.get(), fds);
 
+  d->logger = logger;
+  if (fixed_buffers && fixed_buffer_size)
+    register_fixed_buffers(d.get(), fixed_buffers, fixed_buffer_size);
+
   d->epoll_fd = epoll_create1(0);
   if (d->epoll_fd < 0) {
     ret = -errno;
@@ -160,6 +332,8 @@ close_epoll_fd:
   close(d->epoll_fd);
 close_ring_fd:
   io_uring_queue_exit(&d->io_uring);
+  d->buffers.reset();
+  d->logger = nullptr;
 
   return ret;
 }
@@ -170,18 +344,54 @@ void ioring_queue_t::shutdown()
   close(d->epoll_fd);
   d->epoll_fd = -1;
   io_uring_queue_exit(&d->io_uring);
+  if (d->buffers) {
+    /* buffers still held by their users go back to the pool only */
+    std::lock_guard l(d->buffers->lock);
+    d->buffers->logger = nullptr;
+  }
+  d->buffers.reset();
+  d->logger = nullptr;
 }
 
 int ioring_queue_t::submit_batch(aio_iter beg, aio_iter end,
                                  uint16_t aios_size, void *priv,
                                  int *retries)
 {
-  (void)aios_size;
-  (void)retries;
-
-  pthread_mutex_lock(&d->sq_mutex);
-  int rc = ioring_queue(d.get(), priv, beg, end);
-  pthread_mutex_unlock(&d->sq_mutex);
+  ioring_sq_ticket ticket;
+  ticket.aios.reserve(aios_size);
+
+  std::vector<ioring_sq_ticket*> tickets;
+  std::unique_lock l(d->sq_lock);
+  for (auto p = beg; p != end; ++p) {
+    p->priv = priv;
+    ticket.aios.push_back(&*p);
+  }
+  d->sq_pending.push_back(&ticket);
+  d->sq_cond.wait(l, [&] {
+    return !d->submitting || ticket.done;
+  });
+  if (ticket.done)
+    /* The thread submitting took ours along */
+    return ticket.r;
+
+  /*
+   * Take what is queued once only: those queuing while we submit wait for
+   * their turn, so that a steady stream of them can't keep us here.
+   */
+  d->submitting = true;
+  tickets.swap(d->sq_pending);
+  l.unlock();
+
+  int rc = ioring_queue(d.get(), tickets, retries);
+
+  l.lock();
+  d->submitting = false;
+  for (auto t : tickets) {
+    t->r = rc;
+    t->done = true;
+  }
+  l.unlock();
+  d->sq_cond.notify_all();
 
   return rc;
 }
@@ -206,6 +416,22 @@ get_cqe:
   return events;
 }
 
+bool ioring_queue_t::get_fixed_buffer(size_t len, ceph::bufferptr *bp)
+{
+  auto b = d->buffers;
+  if (!b)
+    return false;
+
+  int index = b->get(len);
+  if (index < 0)
+    return false;
+
+  *bp = ceph::bufferptr(ceph::buffer::claim_buffer(
+    len, b->base + index * b->size,
+    make_deleter([b, index] { b->put(index); })));
+  return true;
+}
+
 bool ioring_queue_t::supported()
 {
   struct io_uring ring;
@@ -221,7 +447,10 @@ bool ioring_queue_t::supported()
 
 struct ioring_data {};
 
-ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_)
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_,
+			       unsigned sq_thread_idle_ms_,
+			       unsigned fixed_buffers_,
+			       uint64_t fixed_buffer_size_)
 {
   ceph_assert(0);
 }
@@ -253,6 +482,11 @@ int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
   ceph_assert(0);
 }
 
+bool ioring_queue_t::get_fixed_buffer(size_t len, ceph::bufferptr *bp)
+{
+  ceph_assert(0);
+}
+
 bool ioring_queue_t::supported()
 {
   return false;
@@ -8,6 +8,18 @@
 #include "include/types.h"
 #include "aio/aio.h"
 
+class PerfCounters;
+
+enum {
+  l_bdev_ioring_first = 733000,
+  l_bdev_ioring_inflight,
+  l_bdev_ioring_submit_lat,
+  l_bdev_ioring_submit_batch,
+  l_bdev_ioring_fixed_ios,
+  l_bdev_ioring_fixed_buffers_free,
+  l_bdev_ioring_last
+};
+
 struct ioring_data;
 
 struct ioring_queue_t final : public io_queue_t {
@@ -15,13 +27,20 @@ struct ioring_queue_t final : public io_queue_t {
   unsigned iodepth = 0;
   bool hipri = false;
   bool sq_thread = false;
+  unsigned sq_thread_idle_ms = 0;
+  unsigned fixed_buffers = 0;     ///< number of registered buffers
+  uint64_t fixed_buffer_size = 0; ///< size of each registered buffer
+  PerfCounters *logger = nullptr; ///< optional, set before init()
 
   typedef std::list<aio_t>::iterator aio_iter;
 
   // Returns true if arch is x86-64 and kernel supports io_uring
   static bool supported();
 
-  ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_);
+  ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_,
+		 unsigned sq_thread_idle_ms_ = 0,
+		 unsigned fixed_buffers_ = 0,
+		 uint64_t fixed_buffer_size_ = 0);
   ~ioring_queue_t() final;
 
   int init(std::vector<int> &fds) final;
@@ -30,4 +49,5 @@ struct ioring_queue_t final : public io_queue_t {
   int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size,
                    void *priv, int *retries) final;
   int get_next_completed(int timeout_ms, aio_t **paio, int max) final;
+  bool get_fixed_buffer(size_t len, ceph::bufferptr *bp) final;
 };
@@ -24,7 +24,7 @@
 
 class MOSDRepScrub final : public MOSDFastDispatchOp {
 public:
-  static constexpr int HEAD_VERSION = 9;
+  static constexpr int HEAD_VERSION = 11;
   static constexpr int COMPAT_VERSION = 6;
 
   spg_t pgid;             // PG to scrub
@@ -38,6 +38,8 @@ public:
   bool allow_preemption = false;
   int32_t priority = 0;
   bool high_priority = false;
+  bool compact_map = false;  // the primary accepts a compact scrub map
+  bool deep_full_sweep = false;  // ignore the incremental deep scrub records
 
   epoch_t get_map_epoch() const override {
     return map_epoch;
@@ -88,6 +90,8 @@ public:
 	<< ",allow_preemption:" << (int)allow_preemption
 	<< ",priority=" << priority
 	<< (high_priority ? " (high)":"")
+	<< (compact_map ? " compact":"")
+	<< (deep_full_sweep ? " full_sweep":"")
 	<< ")";
   }
 
@@ -107,6 +111,8 @@ public:
     encode(allow_preemption, payload);
     encode(priority, payload);
     encode(high_priority, payload);
+    encode(compact_map, payload);
+    encode(deep_full_sweep, payload);
   }
   void decode_payload() override {
     using ceph::decode;
@@ -136,6 +142,12 @@ public:
       decode(priority, p);
       decode(high_priority, p);
     }
+    if (header.version >= 10) {
+      decode(compact_map, p);
+    }
+    if (header.version >= 11) {
+      decode(deep_full_sweep, p);
+    }
   }
 };
 
@@ -23,7 +23,7 @@
 
 class MOSDRepScrubMap final : public MOSDFastDispatchOp {
 public:
-  static constexpr int HEAD_VERSION = 2;
+  static constexpr int HEAD_VERSION = 3;
   static constexpr int COMPAT_VERSION = 1;
 
   spg_t pgid;            // primary spg_t
@@ -31,6 +31,9 @@ public:
   pg_shard_t from;   // whose scrubmap this is
   ceph::buffer::list scrub_map_bl;
   bool preempted = false;
+  /// the algorithm the scrub map was compressed with (compact maps only)
+  uint8_t compression = 0;  // Compressor::COMP_ALG_NONE
+  boost::optional<int32_t> compressor_message;
 
   epoch_t get_map_epoch() const override {
     return map_epoch;
@@ -56,7 +59,8 @@ public:
   void print(std::ostream& out) const override {
     out << "rep_scrubmap(" << pgid << " e" << map_epoch
 	<< " from shard " << from
-	<< (preempted ? " PREEMPTED":"") << ")";
+	<< (preempted ? " PREEMPTED":"")
+	<< (compression ? " compressed":"") << ")";
   }
 
   void encode_payload(uint64_t features) override {
@@ -65,6 +69,8 @@ public:
     encode(map_epoch, payload);
     encode(from, payload);
     encode(preempted, payload);
+    encode(compression, payload);
+    encode(compressor_message, payload);
   }
   void decode_payload() override {
     using ceph::decode;
@@ -75,6 +81,10 @@ public:
     if (header.version >= 2) {
       decode(preempted, p);
     }
+    if (header.version >= 3) {
+      decode(compression, p);
+      decode(compressor_message, p);
+    }
   }
 private:
   template<class T, typename... Args>
@@ -19,7 +19,7 @@
 
 class MOSDScrubReserve : public MOSDFastDispatchOp {
 private:
-  static constexpr int HEAD_VERSION = 1;
+  static constexpr int HEAD_VERSION = 2;
   static constexpr int COMPAT_VERSION = 1;
 public:
   spg_t pgid;
@@ -29,9 +29,15 @@ public:
     GRANT = 1,
     RELEASE = 2,
     REJECT = 3,
+    // host & failure-domain scrub slots. Exchanged with the bucket's coordinator
+    SLOT_REQUEST = 4,
+    SLOT_GRANT = 5,
+    SLOT_RELEASE = 6,
+    SLOT_REJECT = 7,
   };
   int32_t type;
   pg_shard_t from;
+  int32_t bucket = 0;  ///< the CRUSH bucket of a SLOT_* message
 
   epoch_t get_map_epoch() const override {
     return map_epoch;
@@ -50,6 +56,18 @@ public:
     : MOSDFastDispatchOp{MSG_OSD_SCRUB_RESERVE, HEAD_VERSION, COMPAT_VERSION},
       pgid(pgid), map_epoch(map_epoch),
       type(type), from(from) {}
+  MOSDScrubReserve(spg_t pgid,
+		   epoch_t map_epoch,
+		   int type,
+		   pg_shard_t from,
+		   int32_t bucket)
+    : MOSDScrubReserve(pgid, map_epoch, type, from) {
+    this->bucket = bucket;
+  }
+
+  bool is_slot_op() const {
+    return type >= SLOT_REQUEST;
+  }
 
   std::string_view get_type_name() const {
     return "MOSDScrubReserve";
@@ -70,6 +88,21 @@ public:
     case RELEASE:
       out << "RELEASE ";
       break;
+    case SLOT_REQUEST:
+      out << "SLOT_REQUEST ";
+      break;
+    case SLOT_GRANT:
+      out << "SLOT_GRANT ";
+      break;
+    case SLOT_RELEASE:
+      out << "SLOT_RELEASE ";
+      break;
+    case SLOT_REJECT:
+      out << "SLOT_REJECT ";
+      break;
+    }
+    if (is_slot_op()) {
+      out << "bucket " << bucket << " ";
     }
     out << "e" << map_epoch << ")";
     return;
@@ -82,6 +115,9 @@ public:
     decode(map_epoch, p);
     decode(type, p);
     decode(from, p);
+    if (header.version >= 2) {
+      decode(bucket, p);
+    }
   }
 
   void encode_payload(uint64_t features) {
@@ -90,6 +126,7 @@ public:
     encode(map_epoch, payload);
     encode(type, payload);
     encode(from, payload);
+    encode(bucket, payload);
   }
 private:
   template<class T, typename... Args>
@@ -544,6 +544,32 @@ public:
      return total;
    }
 
+  /**
+   * verify -- read a byte range of an object's data, verifying it against
+   * whatever checksums the store keeps, and accumulate its crc32c into
+   * 'digest' (as a ceph::buffer::hash would).
+   *
+   * Stores that keep crc32c checksums of their own may derive the digest from
+   * those instead of hashing the data again. The data is not returned.
+   *
+   * @param digest in: the digest of the preceding data. out: updated
+   * @returns number of bytes verified on success, or negative error code on failure.
+   */
+   virtual int verify(
+     CollectionHandle &c,
+     const ghobject_t& oid,
+     uint64_t offset,
+     size_t len,
+     uint32_t *digest,
+     uint32_t op_flags = 0) {
+     ceph::buffer::list bl;
+     int r = read(c, oid, offset, len, bl, op_flags);
+     if (r > 0) {
+       *digest = bl.crc32c(*digest);
+     }
+     return r;
+   }
+
   /**
    * dump_onode -- dumps onode metadata in human readable form,
      intended primiarily for debugging
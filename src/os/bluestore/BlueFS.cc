@@ -2707,7 +2707,8 @@ int BlueFS::_signal_dirty_to_log(FileWriter *h)
   return 0;
 }
 
-int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
+int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length,
+			 flush_io_t *io)
 {
   dout(10) << __func__ << " " << h << " pos 0x" << std::hex << h->pos
 	   << " 0x" << offset << "~" << length << std::dec
@@ -2719,11 +2720,14 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
 
   ceph_assert(h->file->num_readers.load() == 0);
 
-  bool buffered;
+  flush_io_t own_io;
+  if (!io) {
+    io = &own_io;
+  }
   if (h->file->fnode.ino == 1)
-    buffered = false;
+    io->buffered = false;
   else
-    buffered = cct->_conf->bluefs_buffered_io;
+    io->buffered = cct->_conf->bluefs_buffered_io;
 
   if (offset + length <= h->pos)
     return 0;
@@ -2782,6 +2786,37 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
     x_off -= partial;
     offset -= partial;
     length += partial;
+    io->wait_for_previous = true;
+  }
+
+  io->bl = h->flush_buffer(cct, partial, length, super);
+  ceph_assert(io->bl.length() >= length);
+  h->pos = offset + length;
+  length = io->bl.length();
+
+  // the data goes to these pieces of the file's extents; note them down
+  // now, as the data may be written out without holding the lock
+  while (length > 0) {
+    uint64_t x_len = std::min(p->length - x_off, length);
+    io->extents.emplace_back(p->bdev, p->offset + x_off, x_len);
+    h->dirty_devs[p->bdev] = true;
+    length -= x_len;
+    ++p;
+    x_off = 0;
+  }
+  vselector->add_usage(h->file->vselector_hint, h->file->fnode);
+  dout(20) << __func__ << " h " << h << " pos now 0x"
+           << std::hex << h->pos << std::dec << dendl;
+
+  if (io == &own_io) {
+    _flush_range_submit(h, own_io);
+  }
+  return 0;
+}
+
+void BlueFS::_flush_range_submit(FileWriter *h, flush_io_t& io)
+{
+  if (io.wait_for_previous) {
     dout(20) << __func__ << " waiting for previous aio to complete" << dendl;
     for (auto p : h->iocv) {
       if (p) {
@@ -2790,44 +2825,33 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
     }
   }
 
-  auto bl = h->flush_buffer(cct, partial, length, super);
-  ceph_assert(bl.length() >= length);
-  h->pos = offset + length;
-  length = bl.length();
-
   switch (h->writer_type) {
   case WRITER_WAL:
-    logger->inc(l_bluefs_bytes_written_wal, length);
+    logger->inc(l_bluefs_bytes_written_wal, io.bl.length());
     break;
   case WRITER_SST:
-    logger->inc(l_bluefs_bytes_written_sst, length);
+    logger->inc(l_bluefs_bytes_written_sst, io.bl.length());
     break;
   }
 
   dout(30) << "dump:\n";
-  bl.hexdump(*_dout);
+  io.bl.hexdump(*_dout);
   *_dout << dendl;
 
   uint64_t bloff = 0;
   uint64_t bytes_written_slow = 0;
-  while (length > 0) {
-    uint64_t x_len = std::min(p->length - x_off, length);
+  for (auto& e : io.extents) {
     bufferlist t;
-    t.substr_of(bl, bloff, x_len);
+    t.substr_of(io.bl, bloff, e.length);
     if (cct->_conf->bluefs_sync_write) {
-      bdev[p->bdev]->write(p->offset + x_off, t, buffered, h->write_hint);
+      bdev[e.bdev]->write(e.offset, t, io.buffered, h->write_hint);
     } else {
-      bdev[p->bdev]->aio_write(p->offset + x_off, t, h->iocv[p->bdev], buffered, h->write_hint);
+      bdev[e.bdev]->aio_write(e.offset, t, h->iocv[e.bdev], io.buffered, h->write_hint);
     }
-    h->dirty_devs[p->bdev] = true;
-    if (p->bdev == BDEV_SLOW) {
+    if (e.bdev == BDEV_SLOW) {
       bytes_written_slow += t.length();
     }
-
-    bloff += x_len;
-    length -= x_len;
-    ++p;
-    x_off = 0;
+    bloff += e.length;
   }
   if (bytes_written_slow) {
     logger->inc(l_bluefs_bytes_written_slow, bytes_written_slow);
@@ -2839,10 +2863,6 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
       }
     }
   }
-  vselector->add_usage(h->file->vselector_hint, h->file->fnode);
-  dout(20) << __func__ << " h " << h << " pos now 0x"
-           << std::hex << h->pos << std::dec << dendl;
-  return 0;
 }
 
 #ifdef HAVE_LIBAIO
@@ -2878,14 +2898,34 @@ void BlueFS::wait_for_aio(FileWriter *h)
 int BlueFS::_flush(FileWriter *h, bool force, std::unique_lock<ceph::mutex>& l)
 {
   bool flushed = false;
-  int r = _flush(h, force, &flushed);
+  int r = _flush_data(h, force, l, &flushed);
   if (r == 0 && flushed) {
     _maybe_compact_log(l);
   }
   return r;
 }
 
-int BlueFS::_flush(FileWriter *h, bool force, bool *flushed)
+int BlueFS::_flush_data(FileWriter *h, bool force,
+			std::unique_lock<ceph::mutex>& l, bool *flushed)
+{
+  // the log is flushed with the lock held, as it is shared by all.  The
+  // option may change at runtime: both ways, the flushes of h are
+  // serialized by h->lock
+  if (h->file->fnode.ino <= 1 || !cct->_conf->bluefs_concurrent_flush) {
+    return _flush(h, force, flushed);
+  }
+  // the caller holds h->lock, which keeps the other flushes of h out
+  flush_io_t io;
+  int r = _flush(h, force, flushed, &io);
+  if (r == 0 && io.bl.length()) {
+    l.unlock();
+    _flush_range_submit(h, io);
+    l.lock();
+  }
+  return r;
+}
+
+int BlueFS::_flush(FileWriter *h, bool force, bool *flushed, flush_io_t *io)
 {
   uint64_t length = h->get_buffer_length();
   uint64_t offset = h->pos;
@@ -2908,7 +2948,7 @@ int BlueFS::_flush(FileWriter *h, bool force, bool *flushed)
            << std::hex << offset << "~" << length << std::dec
 	   << " to " << h->file->fnode << dendl;
   ceph_assert(h->pos <= h->file->fnode.size);
-  int r = _flush_range(h, offset, length);
+  int r = _flush_range(h, offset, length, io);
   if (flushed) {
     *flushed = true;
   }
@@ -2956,7 +2996,7 @@ int BlueFS::_truncate(FileWriter *h, uint64_t offset)
 int BlueFS::_fsync(FileWriter *h, std::unique_lock<ceph::mutex>& l)
 {
   dout(10) << __func__ << " " << h << " " << h->file->fnode << dendl;
-  int r = _flush(h, true);
+  int r = _flush_data(h, true, l);
   if (r < 0)
      return r;
   if (h->file->is_dirty) {
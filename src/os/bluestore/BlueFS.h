@@ -299,6 +299,10 @@ public:
   };
 
 private:
+  // Protects everything but the data writes of the regular files (see
+  // _flush_data()): the log, the file map, the dirty lists and the file
+  // metadata.  Splitting it further, and flushing the log without holding
+  // it, is left to be done.  FileWriter::lock is taken before it.
   ceph::mutex lock = ceph::make_mutex("BlueFS::lock");
 
   PerfCounters *logger = nullptr;
@@ -388,9 +392,27 @@ private:
 
   /* signal replay log to include h->file in nearest log flush */
   int _signal_dirty_to_log(FileWriter *h);
-  int _flush_range(FileWriter *h, uint64_t offset, uint64_t length);
+
+  /// the data of a FileWriter flush, and where it goes on the devices
+  struct flush_io_t {
+    ceph::buffer::list bl;
+    std::vector<bluefs_extent_t> extents;
+    bool buffered = false;
+    bool wait_for_previous = false;  ///< rewrites the previous partial block
+  };
+  /// update h's file for the flush of offset~length; unless io is
+  /// given, also write the data out, otherwise leave that to the caller
+  int _flush_range(FileWriter *h, uint64_t offset, uint64_t length,
+		   flush_io_t *io = nullptr);
+  /// write out a flush prepared by _flush_range(); safe to call without
+  /// the lock, but serialized with the other flushes of h
+  void _flush_range_submit(FileWriter *h, flush_io_t& io);
   int _flush(FileWriter *h, bool force, std::unique_lock<ceph::mutex>& l);
-  int _flush(FileWriter *h, bool force, bool *flushed = nullptr);
+  int _flush(FileWriter *h, bool force, bool *flushed = nullptr,
+	     flush_io_t *io = nullptr);
+  /// as _flush(), but writes the data of regular files without the lock
+  int _flush_data(FileWriter *h, bool force, std::unique_lock<ceph::mutex>& l,
+		  bool *flushed = nullptr);
   int _fsync(FileWriter *h, std::unique_lock<ceph::mutex>& l);
 
 #ifdef HAVE_LIBAIO
@@ -571,6 +593,7 @@ public:
   void handle_discard(unsigned dev, interval_set<uint64_t>& to_release);
 
   void flush(FileWriter *h, bool force = false) {
+    std::lock_guard hl(h->lock);
     std::unique_lock l(lock);
     int r = _flush(h, force, l);
     ceph_assert(r == 0);
@@ -597,10 +620,12 @@ public:
     }
   }
   void flush_range(FileWriter *h, uint64_t offset, uint64_t length) {
+    std::lock_guard hl(h->lock);
     std::lock_guard l(lock);
     _flush_range(h, offset, length);
   }
   int fsync(FileWriter *h) {
+    std::lock_guard hl(h->lock);
     std::unique_lock l(lock);
     int r = _fsync(h, l);
     _maybe_compact_log(l);
@@ -629,6 +654,7 @@ public:
     return _preallocate(f, offset, len);
   }
   int truncate(FileWriter *h, uint64_t offset) {
+    std::lock_guard hl(h->lock);
     std::lock_guard l(lock);
     return _truncate(h, offset);
   }
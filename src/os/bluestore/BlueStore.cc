@@ -27,15 +27,18 @@
 #include "bluestore_common.h"
 #include "os/kv.h"
 #include "include/compat.h"
+#include "include/crc32c.h"
 #include "include/intarith.h"
 #include "include/stringify.h"
 #include "include/str_map.h"
 #include "include/util.h"
+#include "common/admin_socket.h"
 #include "common/errno.h"
 #include "common/safe_io.h"
 #include "common/PriorityCache.h"
 #include "common/url_escape.h"
 #include "Allocator.h"
+#include "ShardedAllocator.h"
 #include "FreelistManager.h"
 #include "BlueFS.h"
 #include "BlueRocksEnv.h"
@@ -133,6 +136,11 @@ const string PREFIX_ZONED_CL_INFO = "G";  // (per-zone cleaner metadata)
 
 const string BLUESTORE_GLOBAL_STATFS_KEY = "bluestore_statfs";
 
+// the allocator's free extents, saved in bluefs on umount when the freelist
+// is not maintained (see bluestore_allocation_from_file)
+const string ALLOC_SNAPSHOT_DIR = "bluestore.alloc";
+const string ALLOC_SNAPSHOT_FILE = "snapshot";
+
 // write a label in the first block.  always use this size.  note that
 // bluefs makes a matching assumption about the location of its
 // superblock (always the second block of the device).
@@ -341,6 +349,36 @@ static int get_key_shared_blob(const string& key, uint64_t *sbid)
   return 0;
 }
 
+// merges the refs a txc took on a shared blob it didn't load into the
+// blob's record. Both are encoded bluestore_shared_blob_t, with the refs
+// added up, so that the merged refs can be combined together as well.
+struct SharedBlobMergeOperator : public KeyValueDB::MergeOperator {
+  void merge_nonexistent(
+    const char *rdata, size_t rlen, std::string *new_value) override {
+    *new_value = std::string(rdata, rlen);
+  }
+  void merge(
+    const char *ldata, size_t llen,
+    const char *rdata, size_t rlen,
+    std::string *new_value) override {
+    bluestore_shared_blob_t l(0), r(0);
+    bufferlist lbl, rbl;
+    lbl.append(ldata, llen);
+    rbl.append(rdata, rlen);
+    auto lp = lbl.cbegin();
+    decode(l, lp);
+    auto rp = rbl.cbegin();
+    decode(r, rp);
+    l.ref_map.add(r.ref_map);
+    bufferlist bl;
+    encode(l, bl);
+    *new_value = bl.to_str();
+  }
+  const char *name() const override {
+    return "shared_blob_refs";
+  }
+};
+
 template<typename S>
 static void _key_encode_prefix(const ghobject_t& oid, S *key)
 {
@@ -598,6 +636,10 @@ void _dump_onode(CephContext *cct, const BlueStore::Onode& o)
 		  << ", " << o.extent_map.spanning_blob_map.size()
 		  << " spanning blobs"
 		  << dendl;
+  if (o.onode.has_inline_data()) {
+    dout(LogLevelV) << __func__ << "  inline data len 0x" << std::hex
+		    << o.onode.inline_data.length() << std::dec << dendl;
+  }
   for (auto p = o.onode.attrs.begin();
        p != o.onode.attrs.end();
        ++p) {
@@ -1138,6 +1180,188 @@ struct LruOnodeCacheShard : public BlueStore::OnodeCacheShard {
   }
 };
 
+// SlruOnodeCacheShard
+//
+// A segmented LRU: onodes enter the probationary segment, and are promoted
+// to the protected one once accessed again.  The protected segment gets
+// bluestore_onode_cache_protected_ratio of the shard, its least recently
+// used onodes being demoted back to the probationary segment, which is
+// trimmed first.  Thus a scan, accessing each onode once, doesn't push the
+// hot onodes out.
+//
+// Accesses in quick succession (e.g. the stat & getattrs of a scrub) are
+// correlated, and count as one: an onode is only re-referenced once it has
+// aged in the probationary segment, i.e. after enough accesses to other
+// onodes of the shard.
+//
+// Besides the number of onodes, the shard is bounded by their estimated
+// memory, so that the onodes with a large extent map count for more.
+struct SlruOnodeCacheShard : public BlueStore::OnodeCacheShard {
+  typedef boost::intrusive::list<
+    BlueStore::Onode,
+    boost::intrusive::member_hook<
+      BlueStore::Onode,
+      boost::intrusive::list_member_hook<>,
+      &BlueStore::Onode::lru_item> > list_t;
+
+  enum {
+    PROBATION = 0,
+    PROTECTED = 1,
+    NUM_SEGMENTS
+  };
+
+  list_t lru[NUM_SEGMENTS];         ///< unpinned onodes, per segment
+  uint64_t bytes[NUM_SEGMENTS] = {0}; ///< their estimated memory
+  uint32_t clock = 0;               ///< ticks at each onode access
+
+  explicit SlruOnodeCacheShard(CephContext *cct) : BlueStore::OnodeCacheShard(cct) {}
+
+  uint64_t _num_unpinned() const {
+    return lru[PROBATION].size() + lru[PROTECTED].size();
+  }
+  uint64_t _bytes() const {
+    return bytes[PROBATION] + bytes[PROTECTED];
+  }
+  void _insert(BlueStore::Onode* o, bool front)
+  {
+    o->cache_bytes = std::min<uint64_t>(o->estimate_memory(),
+					std::numeric_limits<uint32_t>::max());
+    bytes[o->cache_segment] += o->cache_bytes;
+    auto& l = lru[o->cache_segment];
+    front ? l.push_front(*o) : l.push_back(*o);
+  }
+  void _erase(BlueStore::Onode* o)
+  {
+    auto& l = lru[o->cache_segment];
+    l.erase(l.iterator_to(*o));
+    ceph_assert(bytes[o->cache_segment] >= o->cache_bytes);
+    bytes[o->cache_segment] -= o->cache_bytes;
+  }
+  // has 'o' aged since its last access?
+  bool _aged(const BlueStore::Onode* o) const
+  {
+    double ratio = cct->_conf->bluestore_onode_cache_protected_ratio;
+    uint32_t window = std::max<uint64_t>(1, max * (1 - ratio) / 8);
+    return static_cast<uint32_t>(clock - o->cache_stamp) >= window;
+  }
+  // demote the overflow of the protected segment
+  void _balance()
+  {
+    double ratio = cct->_conf->bluestore_onode_cache_protected_ratio;
+    uint64_t max_num = max * ratio;
+    uint64_t max_b = max_bytes * ratio;
+    while (!lru[PROTECTED].empty() &&
+	   (lru[PROTECTED].size() > max_num ||
+	    (max_b && bytes[PROTECTED] > max_b))) {
+      BlueStore::Onode *o = &lru[PROTECTED].back();
+      _erase(o);
+      o->cache_segment = PROBATION;
+      o->cache_refs = 1;
+      o->cache_stamp = clock;
+      bytes[PROBATION] += o->cache_bytes;
+      lru[PROBATION].push_front(*o);
+    }
+  }
+
+  void _add(BlueStore::Onode* o, int level) override
+  {
+    o->cache_segment = PROBATION;
+    o->cache_refs = 0;
+    o->cache_stamp = ++clock;
+    if (o->put_cache()) {
+      _insert(o, level > 0);
+    } else {
+      ++num_pinned;
+    }
+    ++num; // we count both pinned and unpinned entries
+    dout(20) << __func__ << " " << this << " " << o->oid << " added, num=" << num << dendl;
+  }
+  void _rm(BlueStore::Onode* o) override
+  {
+    if (o->pop_cache()) {
+      _erase(o);
+    } else {
+      ceph_assert(num_pinned);
+      --num_pinned;
+    }
+    ceph_assert(num);
+    --num;
+    dout(20) << __func__ << " " << this << " " << " " << o->oid << " removed, num=" << num << dendl;
+  }
+  void _pin(BlueStore::Onode* o) override
+  {
+    _erase(o);
+    ++num_pinned;
+    logger->inc(o->cache_segment == PROTECTED ?
+		l_bluestore_onode_protected_hits :
+		l_bluestore_onode_probation_hits);
+    dout(20) << __func__ << this << " " << " " << " " << o->oid << " pinned" << dendl;
+  }
+  void _unpin(BlueStore::Onode* o) override
+  {
+    if (o->cache_refs < std::numeric_limits<uint8_t>::max() &&
+	(o->cache_refs == 0 || _aged(o))) {
+      ++o->cache_refs;
+    }
+    o->cache_stamp = ++clock;
+    if (o->cache_segment == PROBATION && o->cache_refs > 1) {
+      o->cache_segment = PROTECTED;
+    }
+    _insert(o, true);
+    ceph_assert(num_pinned);
+    --num_pinned;
+    _balance();
+    dout(20) << __func__ << this << " " << " " << " " << o->oid << " unpinned" << dendl;
+  }
+  void _unpin_and_rm(BlueStore::Onode* o) override
+  {
+    o->pop_cache();
+    ceph_assert(num_pinned);
+    --num_pinned;
+    ceph_assert(num);
+    --num;
+  }
+  void _trim_to(uint64_t new_size) override
+  {
+    _balance();
+    uint64_t max_b = new_size ? max_bytes.load() : 0;
+    while (_num_unpinned() > new_size ||
+	   (max_b && _num_unpinned() && _bytes() > max_b)) {
+      auto& l = lru[PROBATION].empty() ? lru[PROTECTED] : lru[PROBATION];
+      BlueStore::Onode *o = &l.back();
+      dout(20) << __func__ << "  rm " << o->oid << " "
+               << o->nref << " " << o->cached << " " << o->pinned
+	       << " segment " << (int)o->cache_segment
+	       << " bytes " << o->cache_bytes << dendl;
+      _erase(o);
+      ceph_assert(num);
+      --num;
+      auto pinned = !o->pop_cache();
+      ceph_assert(!pinned);
+      o->c->onode_map._remove(o->oid);
+    }
+  }
+  void move_pinned(OnodeCacheShard *to, BlueStore::Onode *o) override
+  {
+    if (to == this) {
+      return;
+    }
+    ceph_assert(o->cached);
+    ceph_assert(o->pinned);
+    ceph_assert(num);
+    ceph_assert(num_pinned);
+    --num_pinned;
+    --num;
+    ++to->num_pinned;
+    ++to->num;
+  }
+  void add_stats(uint64_t *onodes, uint64_t *pinned_onodes) override
+  {
+    *onodes += num;
+    *pinned_onodes += num_pinned;
+  }
+};
+
 // OnodeCacheShard
 BlueStore::OnodeCacheShard *BlueStore::OnodeCacheShard::create(
     CephContext* cct,
@@ -1145,8 +1369,10 @@ BlueStore::OnodeCacheShard *BlueStore::OnodeCacheShard::create(
     PerfCounters *logger)
 {
   BlueStore::OnodeCacheShard *c = nullptr;
-  // Currently we only implement an LRU cache for onodes
-  c = new LruOnodeCacheShard(cct);
+  if (type == "slru")
+    c = new SlruOnodeCacheShard(cct);
+  else
+    c = new LruOnodeCacheShard(cct);
   c->logger = logger;
   return c;
 }
@@ -1944,6 +2170,23 @@ void BlueStore::OnodeSpace::rename(
   cache->_trim();
 }
 
+void BlueStore::OnodeSpace::discard(const ghobject_t& oid)
+{
+  OnodeRef o;  // released after the cache lock, see Onode::put()
+  std::lock_guard l(cache->lock);
+  auto p = onode_map.find(oid);
+  if (p == onode_map.end()) {
+    return;
+  }
+  ldout(cache->cct, 20) << __func__ << " " << oid << " " << p->second
+			<< dendl;
+  o = p->second;
+  if (o->cached) {
+    cache->_rm(o.get());
+  }
+  onode_map.erase(p);
+}
+
 bool BlueStore::OnodeSpace::map_any(std::function<bool(Onode*)> f)
 {
   std::lock_guard l(cache->lock);
@@ -2411,6 +2654,7 @@ void BlueStore::ExtentMap::dup(BlueStore* b, TransContext* txc,
     dout(20) << __func__ << "  src " << e << dendl;
     BlobRef cb;
     bool blob_duped = true;
+    bluestore_extent_ref_map_t *merged_refs = nullptr;
     if (e.blob->last_encoded_id >= 0) {
       cb = id_to_blob[e.blob->last_encoded_id];
       blob_duped = false;
@@ -2430,8 +2674,13 @@ void BlueStore::ExtentMap::dup(BlueStore* b, TransContext* txc,
         ceph_assert(e.logical_end() > 0);
         // -1 to exclude next potential shard
         dirty_range_end = e.logical_end() - 1;
-      } else {
-        c->load_shared_blob(e.blob->shared_blob);
+      } else if (!e.blob->shared_blob->is_loaded()) {
+	// take the refs without loading the shared blob, if they can be
+	// merged into its record instead
+	merged_refs = b->_merge_shared_blob_refs(txc, e.blob->shared_blob);
+	if (!merged_refs) {
+	  c->load_shared_blob(txc, e.blob->shared_blob);
+	}
       }
       cb = new Blob();
       e.blob->last_encoded_id = n;
@@ -2440,10 +2689,16 @@ void BlueStore::ExtentMap::dup(BlueStore* b, TransContext* txc,
       // bump the extent refs on the copied blob's extents
       for (auto p : blob.get_extents()) {
         if (p.is_valid()) {
-          e.blob->shared_blob->get_ref(p.offset, p.length);
+	  if (merged_refs) {
+	    merged_refs->get(p.offset, p.length);
+	  } else {
+	    e.blob->shared_blob->get_ref(p.offset, p.length);
+	  }
         }
       }
-      txc->write_shared_blob(e.blob->shared_blob);
+      if (!merged_refs) {
+	txc->write_shared_blob(e.blob->shared_blob);
+      }
       dout(20) << __func__ << "    new " << *cb << dendl;
     }
 
@@ -2489,8 +2744,8 @@ void BlueStore::ExtentMap::dup(BlueStore* b, TransContext* txc,
   }
   newo->extent_map.dirty_range(dstoff, length);
 }
-void BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
-                                  bool force)
+uint32_t BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
+                                      bool force)
 {
   auto cct = onode->c->store->cct; //used by dout
   dout(20) << __func__ << " " << onode->oid << (force ? " force" : "") << dendl;
@@ -2506,7 +2761,7 @@ void BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
 	       << " extents" << dendl;
       if (!force && len > cct->_conf->bluestore_extent_map_shard_max_size) {
 	request_reshard(0, OBJECT_MAX_SIZE);
-	return;
+	return 0;
       }
     }
     // will persist in the onode key.
@@ -2579,12 +2834,14 @@ void BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
       p = n;
     }
     if (needs_reshard()) {
-      return;
+      return 0;
     }
 
     // schedule DB update for dirty shards
+    uint32_t encoded_bytes = 0;
     string key;
     for (auto& it : encoded_shards) {
+      encoded_bytes += it.bl.length();
       it.shard->dirty = false;
       it.shard->shard_info->bytes = it.bl.length();
       generate_extent_shard_key_and_apply(
@@ -2596,7 +2853,9 @@ void BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
         }
       );
     }
+    return encoded_bytes;
   }
+  return 0;
 }
 
 bid_t BlueStore::ExtentMap::allocate_spanning_blob_id()
@@ -2697,6 +2956,37 @@ void BlueStore::ExtentMap::reshard(
   dout(20) << __func__ << "  extent_avg " << extent_avg << ", target " << target
 	   << ", slop " << slop << dendl;
 
+  if (cct->_conf->bluestore_extent_map_shard_adaptive &&
+      is_randomly_written()) {
+    // Each write re-encodes the shard it dirties, and the onode with its
+    // shard_info list; with B encoded extent map bytes in shards of S bytes
+    // that is about S + B / S * sizeof(shard_info) bytes, which is the
+    // smallest for S = sqrt(B * sizeof(shard_info)).
+    unsigned total = 0;
+    if (onode->onode.extent_map_shards.empty()) {
+      total = inline_bl.length();
+    } else {
+      for (auto& s : onode->onode.extent_map_shards) {
+	total += s.bytes;
+      }
+    }
+    // the shards must not be merged or split again right away
+    double ratio = 1 + cct->_conf->bluestore_extent_map_shard_target_size_slop;
+    unsigned lowest = std::max<unsigned>(
+      cct->_conf->bluestore_extent_map_shard_adaptive_min_size,
+      cct->_conf->bluestore_extent_map_shard_min_size * ratio);
+    unsigned highest = std::min<unsigned>(
+      cct->_conf->bluestore_extent_map_shard_adaptive_max_size,
+      cct->_conf->bluestore_extent_map_shard_max_size / ratio);
+    unsigned best = std::sqrt(double(total) *
+			      sizeof(bluestore_onode_t::shard_info));
+    target = std::max(lowest, std::min(highest, best));
+    slop = target * cct->_conf->bluestore_extent_map_shard_target_size_slop;
+    dout(20) << __func__ << "  randomly written, " << total
+	     << " bytes of extents: target " << target << ", slop " << slop
+	     << dendl;
+  }
+
   // reshard
   unsigned estimate = 0;
   unsigned offset = needs_reshard_begin;
@@ -3600,6 +3890,20 @@ BlueStore::Onode* BlueStore::Onode::decode(
   return on;
 }
 
+uint64_t BlueStore::Onode::estimate_memory() const
+{
+  uint64_t bytes = sizeof(Onode) + key.size() + oid.hobj.oid.name.size();
+  for (auto& i : onode.attrs) {
+    bytes += i.first.size() + i.second.length();
+  }
+  // count a blob per extent, as most of them aren't shared
+  bytes += extent_map.extent_map.size() * (sizeof(Extent) + sizeof(Blob));
+  bytes += extent_map.spanning_blob_map.size() * sizeof(Blob);
+  bytes += extent_map.shards.size() * sizeof(ExtentMap::Shard);
+  bytes += extent_map.inline_bl.length();
+  return bytes;
+}
+
 void BlueStore::Onode::flush()
 {
   if (flushing_count.load()) {
@@ -3897,26 +4201,67 @@ void BlueStore::Collection::open_shared_blob(uint64_t sbid, BlobRef b)
   }
 }
 
-void BlueStore::Collection::load_shared_blob(SharedBlobRef sb)
+void BlueStore::Collection::load_shared_blob(TransContext *txc,
+					     SharedBlobRef sb)
 {
   if (!sb->is_loaded()) {
+    load_shared_blobs(txc, {sb});
+  }
+}
 
-    bufferlist v;
-    string key;
+void BlueStore::Collection::load_shared_blobs(
+  TransContext *txc,
+  const std::vector<SharedBlobRef>& sbs)
+{
+  std::map<string, SharedBlobRef> to_load;
+  std::set<string> keys;
+  for (auto& sb : sbs) {
+    if (!sb->is_loaded()) {
+      string key;
+      get_shared_blob_key(sb->get_sbid(), &key);
+      keys.insert(key);
+      to_load.emplace(std::move(key), sb);
+    }
+  }
+  if (to_load.empty()) {
+    return;
+  }
+
+  // the refs not submitted yet are added to the records read, atomically
+  // with their submission (see _txc_apply_kv)
+  std::lock_guard l(store->shared_blob_merge_lock);
+  std::map<string, bufferlist> values;
+  store->db->get(PREFIX_SHARED_BLOB, keys, &values);
+  for (auto& [key, sb] : to_load) {
     auto sbid = sb->get_sbid();
-    get_shared_blob_key(sbid, &key);
-    int r = store->db->get(PREFIX_SHARED_BLOB, key, &v);
-    if (r < 0) {
-	lderr(store->cct) << __func__ << " sbid 0x" << std::hex << sbid
-			  << std::dec << " not found at key "
-			  << pretty_binary_string(key) << dendl;
+    auto v = values.find(key);
+    if (v == values.end()) {
+      lderr(store->cct) << __func__ << " sbid 0x" << std::hex << sbid
+			<< std::dec << " not found at key "
+			<< pretty_binary_string(key) << dendl;
       ceph_abort_msg("uh oh, missing shared_blob");
     }
 
     sb->loaded = true;
     sb->persistent = new bluestore_shared_blob_t(sbid);
-    auto p = v.cbegin();
+    auto p = v->second.cbegin();
     decode(*(sb->persistent), p);
+    auto m = store->shared_blob_merges.find(sbid);
+    if (m != store->shared_blob_merges.end()) {
+      for (auto t : m->second) {
+	sb->persistent->ref_map.add(t->shared_blob_refs.at(sb));
+      }
+      // our refs are part of the record we write now
+      auto& txcs = m->second;
+      if (auto i = std::find(txcs.begin(), txcs.end(), txc); i != txcs.end()) {
+	txcs.erase(i);
+	txc->shared_blob_refs.erase(sb);
+	txc->write_shared_blob(sb);
+      }
+      if (txcs.empty()) {
+	store->shared_blob_merges.erase(m);
+      }
+    }
     ldout(store->cct, 10) << __func__ << " sbid 0x" << std::hex << sbid
 			  << std::dec << " loaded shared_blob " << *sb << dendl;
   }
@@ -4278,6 +4623,7 @@ void BlueStore::MempoolThread::_resize_shards(bool interval_stats)
 
   for (auto i : store->onode_cache_shards) {
     i->set_max(max_shard_onodes);
+    i->set_max_bytes(meta_alloc / onode_shards);
   }
   for (auto i : store->buffer_cache_shards) {
     i->set_max(max_shard_buffer);
@@ -4503,6 +4849,7 @@ BlueStore::BlueStore(CephContext *cct,
 #ifdef HAVE_LIBZBD
     zoned_cleaner_thread(this),
 #endif
+    defrag_thread(this),
     min_alloc_size(_min_alloc_size),
     min_alloc_size_order(ctz(_min_alloc_size)),
     mempool_thread(this)
@@ -4928,6 +5275,8 @@ void BlueStore::_init_logger()
 		    "Sum for write-op padded bytes", NULL, 0, unit_t(UNIT_BYTES));
   b.add_u64_counter(l_bluestore_deferred_write_ops, "deferred_write_ops",
 		    "Sum for deferred write op");
+  b.add_u64_counter(l_bluestore_deferred_idle_submits, "deferred_idle_submits",
+		    "Deferred write batches submitted because the store was idle");
   b.add_u64_counter(l_bluestore_deferred_write_bytes, "deferred_write_bytes",
 		    "Sum for deferred write bytes", "def", 0, unit_t(UNIT_BYTES));
   b.add_u64_counter(l_bluestore_write_penalty_read_ops, "write_penalty_read_ops",
@@ -4953,6 +5302,14 @@ void BlueStore::_init_logger()
 		    "Sum for onode-lookups hit in the cache");
   b.add_u64_counter(l_bluestore_onode_misses, "bluestore_onode_misses",
 		    "Sum for onode-lookups missed in the cache");
+  b.add_u64_counter(l_bluestore_onode_probation_hits,
+		    "bluestore_onode_probation_hits",
+		    "Sum for onode-lookups hit in the probationary segment of "
+		    "the slru onode cache");
+  b.add_u64_counter(l_bluestore_onode_protected_hits,
+		    "bluestore_onode_protected_hits",
+		    "Sum for onode-lookups hit in the protected segment of "
+		    "the slru onode cache");
   b.add_u64_counter(l_bluestore_onode_shard_hits, "bluestore_onode_shard_hits",
 		    "Sum for onode-shard lookups hit in the cache");
   b.add_u64_counter(l_bluestore_onode_shard_misses,
@@ -4996,10 +5353,16 @@ void BlueStore::_init_logger()
 		    "cached) to fill out the block");
   b.add_u64_counter(l_bluestore_write_new, "bluestore_write_new",
 		    "Write into new blob");
+  b.add_u64_counter(l_bluestore_write_inline, "bluestore_write_inline",
+		    "Writes stored in the onode (inline data)");
 
   b.add_u64_counter(l_bluestore_txc, "bluestore_txc", "Transactions committed");
   b.add_u64_counter(l_bluestore_onode_reshard, "bluestore_onode_reshard",
 		    "Onode extent map reshard events");
+  b.add_u64_avg(l_bluestore_extent_map_encoded_bytes,
+		"bluestore_extent_map_encoded_bytes",
+		"Encoded extent map bytes written per onode update",
+		NULL, 0, unit_t(UNIT_BYTES));
   b.add_u64_counter(l_bluestore_blob_split, "bluestore_blob_split",
 		    "Sum for blob splitting due to resharding");
   b.add_u64_counter(l_bluestore_extent_compress, "bluestore_extent_compress",
@@ -5011,8 +5374,28 @@ void BlueStore::_init_logger()
                     "Read EIO errors propagated to high level callers");
   b.add_u64_counter(l_bluestore_reads_with_retries, "bluestore_reads_with_retries",
                     "Read operations that required at least one retry due to failed checksum validation");
+  b.add_u64_counter(l_bluestore_readahead_bytes, "bluestore_readahead_bytes",
+                    "Bytes read ahead of sequential read streams",
+                    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_readahead_hit_bytes, "bluestore_readahead_hit_bytes",
+                    "Bytes read ahead which were later read by the stream",
+                    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_readahead_wasted_bytes, "bluestore_readahead_wasted_bytes",
+                    "Bytes read ahead which were not read before the stream broke",
+                    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_read_copied_bytes, "bluestore_read_copied_bytes",
+                    "Bytes of read results copied rather than referenced (decompressed data and holes)",
+                    NULL, 0, unit_t(UNIT_BYTES));
   b.add_u64(l_bluestore_fragmentation, "bluestore_fragmentation_micros",
             "How fragmented bluestore free space is (free extents / max possible number of free extents) * 1000");
+  b.add_u64_counter(l_bluestore_defrag_onodes, "bluestore_defrag_onodes",
+                    "Onodes rewritten by the defragmenter");
+  b.add_u64_counter(l_bluestore_defrag_bytes, "bluestore_defrag_bytes",
+                    "Bytes rewritten by the defragmenter",
+                    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_defrag_extents_reclaimed,
+                    "bluestore_defrag_extents_reclaimed",
+                    "Physical extents merged by the defragmenter");
   b.add_time_avg(l_bluestore_omap_seek_to_first_lat, "omap_seek_to_first_lat",
     "Average omap iterator seek_to_first call latency");
   b.add_time_avg(l_bluestore_omap_upper_bound_lat, "omap_upper_bound_lat",
@@ -5316,6 +5699,14 @@ int BlueStore::_open_fm(KeyValueDB::Transaction t, bool read_only)
 #endif
     fm->create(bdev->get_size(), alloc_size, t);
 
+    if (cct->_conf->bluestore_allocation_from_file &&
+	_can_use_null_freelist()) {
+      dout(1) << __func__ << " allocations are not tracked by the freelist"
+	      << dendl;
+      t->set(PREFIX_SUPER, "null_freelist", bufferlist());
+      fm->set_null_manager();
+    }
+
     // allocate superblock reserved space.  note that we do not mark
     // bluefs space as allocated in the freelist; we instead rely on
     // bluefs doing that itself.
@@ -5376,6 +5767,12 @@ int BlueStore::_open_fm(KeyValueDB::Transaction t, bool read_only)
       fm = NULL;
       return r;
     }
+    bufferlist bl;
+    if (db->get(PREFIX_SUPER, "null_freelist", &bl) == 0) {
+      dout(1) << __func__ << " allocations are not tracked by the freelist"
+	      << dendl;
+      fm->set_null_manager();
+    }
   }
   // if space size tracked by free list manager is that higher than actual
   // dev size one can hit out-of-space allocation which will result
@@ -5433,9 +5830,14 @@ int BlueStore::_create_alloc()
   }
 #endif
   
+  unsigned shards = cct->_conf->bluestore_allocator_shards;
+  if (bdev->is_smr()) {
+    // the zoned allocator is used as such
+    shards = 0;
+  }
   shared_alloc.set(Allocator::create(cct, cct->_conf->bluestore_allocator,
     bdev->get_size(),
-    alloc_size, "block"));
+    alloc_size, shards ? "" : "block"));
 
   if (!shared_alloc.a) {
     lderr(cct) << __func__ << "Failed to create allocator:: "
@@ -5443,6 +5845,11 @@ int BlueStore::_create_alloc()
       << dendl;
     return -EINVAL;
   }
+  if (shards) {
+    shared_alloc.set(new ShardedAllocator(cct, shared_alloc.a, shards,
+      cct->_conf->bluestore_allocator_shard_cache_size,
+      cct->_conf->bluestore_allocator_shard_min_extent_size, "block"));
+  }
   return 0;
 }
 
@@ -5469,15 +5876,30 @@ int BlueStore::_init_alloc()
   uint64_t num = 0, bytes = 0;
 
   dout(1) << __func__ << " opening allocation metadata" << dendl;
-  // initialize from freelist
-  fm->enumerate_reset();
-  uint64_t offset, length;
-  while (fm->enumerate_next(db, &offset, &length)) {
-    shared_alloc.a->init_add_free(offset, length);
-    ++num;
-    bytes += length;
+  if (fm->is_null_manager()) {
+    r = _read_alloc_snapshot(&num, &bytes);
+    if (r < 0) {
+      dout(1) << __func__ << " no valid allocation snapshot ("
+	      << cpp_strerror(r) << "), rebuilding from the onodes" << dendl;
+      r = _rebuild_alloc_from_onodes(&num, &bytes);
+      if (r < 0) {
+	derr << __func__ << " failed to rebuild the allocations: "
+	     << cpp_strerror(r) << dendl;
+	_close_alloc();
+	return r;
+      }
+    }
+  } else {
+    // initialize from freelist
+    fm->enumerate_reset();
+    uint64_t offset, length;
+    while (fm->enumerate_next(db, &offset, &length)) {
+      shared_alloc.a->init_add_free(offset, length);
+      ++num;
+      bytes += length;
+    }
+    fm->enumerate_reset();
   }
-  fm->enumerate_reset();
 
   dout(1) << __func__
           << " loaded " << byte_u_t(bytes) << " in " << num << " extents"
@@ -5503,83 +5925,384 @@ void BlueStore::_close_alloc()
   shared_alloc.reset();
 }
 
-int BlueStore::_open_fsid(bool create)
+bool BlueStore::_can_use_null_freelist() const
 {
-  ceph_assert(fsid_fd < 0);
-  int flags = O_RDWR|O_CLOEXEC;
-  if (create)
-    flags |= O_CREAT;
-  fsid_fd = ::openat(path_fd, "fsid", flags, 0644);
-  if (fsid_fd < 0) {
-    int err = -errno;
-    derr << __func__ << " " << cpp_strerror(err) << dendl;
-    return err;
-  }
-  return 0;
+  // the snapshot lives in bluefs, and zoned devices keep their own state
+  return bluefs && !bdev->is_smr();
 }
 
-int BlueStore::_read_fsid(uuid_d *uuid)
+int BlueStore::_enable_null_freelist()
 {
-  char fsid_str[40];
-  memset(fsid_str, 0, sizeof(fsid_str));
-  int ret = safe_read(fsid_fd, fsid_str, sizeof(fsid_str));
-  if (ret < 0) {
-    derr << __func__ << " failed: " << cpp_strerror(ret) << dendl;
-    return ret;
+  if (!_can_use_null_freelist()) {
+    dout(1) << __func__ << " not supported by this store, keeping the freelist"
+	    << dendl;
+    return 0;
   }
-  if (ret > 36)
-    fsid_str[36] = 0;
-  else
-    fsid_str[ret] = 0;
-  if (!uuid->parse(fsid_str)) {
-    derr << __func__ << " unparsable uuid " << fsid_str << dendl;
-    return -EINVAL;
+  // the freelist is up to date at this point; from now on the allocations
+  // are only tracked by the snapshot, or rebuilt from the onodes
+  dout(1) << __func__ << " no longer tracking allocations in the freelist"
+	  << dendl;
+  KeyValueDB::Transaction t = db->get_transaction();
+  t->set(PREFIX_SUPER, "null_freelist", bufferlist());
+  int r = db->submit_transaction_sync(t);
+  if (r < 0) {
+    derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
+    return r;
   }
+  fm->set_null_manager();
   return 0;
 }
 
-int BlueStore::_write_fsid()
+/*
+ * The snapshot holds the allocator's free extents, plus those owned by bluefs
+ * on the shared device (as with the freelist, bluefs removes its own extents
+ * from the allocator once mounted). This also covers the extents allocated
+ * to the snapshot itself.
+ */
+int BlueStore::_write_alloc_snapshot()
 {
-  int r = ::ftruncate(fsid_fd, 0);
-  if (r < 0) {
-    r = -errno;
-    derr << __func__ << " fsid truncate failed: " << cpp_strerror(r) << dendl;
-    return r;
+  ceph_assert(bluefs);
+  utime_t start = ceph_clock_now();
+
+  // have the discarded extents returned to the allocator
+  bdev->discard_drain();
+
+  bufferlist payload;
+  uint64_t num = 0, bytes = 0;
+  auto add = [&](uint64_t offset, uint64_t length) {
+    encode(offset, payload);
+    encode(length, payload);
+    ++num;
+    bytes += length;
+  };
+  shared_alloc.a->dump(add);
+
+  interval_set<uint64_t> bluefs_extents;
+  int r = bluefs->get_block_extents(bluefs_layout.shared_bdev, &bluefs_extents);
+  ceph_assert(r == 0);
+  for (auto [offset, length] : bluefs_extents) {
+    add(offset, length);
   }
-  string str = stringify(fsid) + "\n";
-  r = safe_write(fsid_fd, str.c_str(), str.length());
+
+  bufferlist bl;
+  ENCODE_START(1, 1, bl);
+  encode(bdev->get_size(), bl);
+  encode((uint64_t)shared_alloc.a->get_block_size(), bl);
+  encode(num, bl);
+  encode(bytes, bl);
+  encode(payload.crc32c(-1), bl);
+  ENCODE_FINISH(bl);
+  bl.claim_append(payload);
+
+  if (!bluefs->dir_exists(ALLOC_SNAPSHOT_DIR)) {
+    r = bluefs->mkdir(ALLOC_SNAPSHOT_DIR);
+    if (r < 0) {
+      derr << __func__ << " failed to create " << ALLOC_SNAPSHOT_DIR << ": "
+	   << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+  BlueFS::FileWriter* h = nullptr;
+  r = bluefs->open_for_write(ALLOC_SNAPSHOT_DIR, ALLOC_SNAPSHOT_FILE, &h, false);
   if (r < 0) {
-    derr << __func__ << " fsid write failed: " << cpp_strerror(r) << dendl;
+    derr << __func__ << " failed to open the snapshot: " << cpp_strerror(r)
+	 << dendl;
     return r;
   }
-  r = ::fsync(fsid_fd);
+  bluefs->append_try_flush(h, bl.c_str(), bl.length());
+  r = bluefs->fsync(h);
+  bluefs->close_writer(h);
   if (r < 0) {
-    r = -errno;
-    derr << __func__ << " fsid fsync failed: " << cpp_strerror(r) << dendl;
+    derr << __func__ << " failed to sync the snapshot: " << cpp_strerror(r)
+	 << dendl;
     return r;
   }
+  dout(1) << __func__ << " saved " << byte_u_t(bytes) << " in " << num
+	  << " extents (" << byte_u_t(bl.length()) << ") in "
+	  << ceph_clock_now() - start << " seconds" << dendl;
   return 0;
 }
 
-void BlueStore::_close_fsid()
-{
-  VOID_TEMP_FAILURE_RETRY(::close(fsid_fd));
-  fsid_fd = -1;
-}
-
-int BlueStore::_lock_fsid()
+int BlueStore::_read_alloc_snapshot(uint64_t* num, uint64_t* bytes)
 {
-  struct flock l;
-  memset(&l, 0, sizeof(l));
-  l.l_type = F_WRLCK;
-  l.l_whence = SEEK_SET;
-  int r = ::fcntl(fsid_fd, F_SETLK, &l);
+  if (!bluefs) {
+    return -ENOENT;
+  }
+  uint64_t size = 0;
+  utime_t mtime;
+  int r = bluefs->stat(ALLOC_SNAPSHOT_DIR, ALLOC_SNAPSHOT_FILE, &size, &mtime);
   if (r < 0) {
-    int err = errno;
-    derr << __func__ << " failed to lock " << path << "/fsid"
-	 << " (is another ceph-osd still running?)"
-	 << cpp_strerror(err) << dendl;
-    return -err;
+    return r;
+  }
+  BlueFS::FileReader* h = nullptr;
+  r = bluefs->open_for_read(ALLOC_SNAPSHOT_DIR, ALLOC_SNAPSHOT_FILE, &h);
+  if (r < 0) {
+    return r;
+  }
+  bufferlist bl;
+  int64_t got = bluefs->read(h, 0, size, &bl, nullptr);
+  delete h;
+  if (got != (int64_t)size) {
+    derr << __func__ << " short read of the snapshot: " << got << " of "
+	 << size << dendl;
+    return -EIO;
+  }
+
+  uint64_t capacity, block_size, count, total;
+  uint32_t crc;
+  bufferlist payload;
+  try {
+    auto p = bl.cbegin();
+    DECODE_START(1, p);
+    decode(capacity, p);
+    decode(block_size, p);
+    decode(count, p);
+    decode(total, p);
+    decode(crc, p);
+    DECODE_FINISH(p);
+    p.copy(p.get_remaining(), payload);
+  } catch (ceph::buffer::error& e) {
+    derr << __func__ << " failed to decode the snapshot: " << e.what()
+	 << dendl;
+    return -EIO;
+  }
+  if (capacity != bdev->get_size() ||
+      block_size != (uint64_t)shared_alloc.a->get_block_size() ||
+      payload.length() != count * 2 * sizeof(uint64_t) ||
+      payload.crc32c(-1) != crc) {
+    derr << __func__ << " the snapshot does not match the store"
+	 << " (capacity 0x" << std::hex << capacity
+	 << ", block size 0x" << block_size << std::dec
+	 << ", " << count << " extents in " << payload.length() << " bytes)"
+	 << dendl;
+    return -EIO;
+  }
+
+  auto p = payload.cbegin();
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t offset, length;
+    decode(offset, p);
+    decode(length, p);
+    shared_alloc.a->init_add_free(offset, length);
+  }
+  *num = count;
+  *bytes = total;
+  return 0;
+}
+
+void BlueStore::_remove_alloc_snapshot()
+{
+  if (!bluefs ||
+      !bluefs->dir_exists(ALLOC_SNAPSHOT_DIR)) {
+    return;
+  }
+  uint64_t size;
+  utime_t mtime;
+  if (bluefs->stat(ALLOC_SNAPSHOT_DIR, ALLOC_SNAPSHOT_FILE,
+		   &size, &mtime) < 0) {
+    return;
+  }
+  dout(10) << __func__ << dendl;
+  int r = bluefs->unlink(ALLOC_SNAPSHOT_DIR, ALLOC_SNAPSHOT_FILE);
+  ceph_assert(r == 0);
+  bluefs->sync_metadata(false);
+}
+
+/*
+ * After an unclean shutdown: everything is free but the superblock, the
+ * extents referenced by the onodes, and those of pending deferred
+ * transactions. bluefs removes its own extents from the allocator later on.
+ */
+int BlueStore::_rebuild_alloc_from_onodes(uint64_t* num, uint64_t* bytes)
+{
+  utime_t start = ceph_clock_now();
+  auto alloc_size = fm->get_alloc_size();
+  mempool_dynamic_bitset used_blocks;
+  used_blocks.resize(fm->get_alloc_units());
+  auto mark_used = [&](uint64_t offset, uint64_t length) {
+    apply_for_bitset_range(
+      offset, length, alloc_size, used_blocks,
+      [&](uint64_t pos, mempool_dynamic_bitset& bs) {
+	ceph_assert(pos < bs.size());
+	bs.set(pos);
+      }
+    );
+  };
+  mark_used(0, std::max<uint64_t>(min_alloc_size, SUPER_RESERVED));
+
+  int r = _open_collections();
+  if (r < 0) {
+    return r;
+  }
+  uint64_t num_objects = 0;
+  KeyValueDB::Iterator it = db->get_iterator(PREFIX_OBJ,
+					     KeyValueDB::ITERATOR_NOCACHE);
+  CollectionRef c;
+  for (it->lower_bound(string()); it->valid(); it->next()) {
+    if (is_extent_shard_key(it->key())) {
+      // faulted in along with their onode
+      continue;
+    }
+    ghobject_t oid;
+    r = get_key_object(it->key(), &oid);
+    if (r < 0) {
+      derr << __func__ << " bad object key "
+	   << pretty_binary_string(it->key()) << dendl;
+      continue;
+    }
+    if (!c || !c->contains(oid)) {
+      c = nullptr;
+      for (auto& p : coll_map) {
+	if (p.second->contains(oid)) {
+	  c = p.second;
+	  break;
+	}
+      }
+      if (!c) {
+	derr << __func__ << " stray object " << oid
+	     << " not owned by any collection" << dendl;
+	continue;
+      }
+    }
+    OnodeRef o;
+    o.reset(Onode::decode(c, oid, it->key(), it->value()));
+    o->extent_map.fault_range(db, 0, OBJECT_MAX_SIZE);
+    Blob* last = nullptr;
+    for (auto& l : o->extent_map.extent_map) {
+      if (l.blob.get() == last) {
+	continue;
+      }
+      last = l.blob.get();
+      for (auto& e : l.blob->get_blob().get_extents()) {
+	if (e.is_valid()) {
+	  mark_used(e.offset, e.length);
+	}
+      }
+    }
+    ++num_objects;
+  }
+  c.reset();
+  _shutdown_cache();
+
+  it = db->get_iterator(PREFIX_DEFERRED, KeyValueDB::ITERATOR_NOCACHE);
+  for (it->lower_bound(string()); it->valid(); it->next()) {
+    bufferlist bl = it->value();
+    auto p = bl.cbegin();
+    bluestore_deferred_transaction_t wt;
+    try {
+      decode(wt, p);
+    } catch (ceph::buffer::error& e) {
+      derr << __func__ << " failed to decode deferred txn "
+	   << pretty_binary_string(it->key()) << dendl;
+      continue;
+    }
+    for (auto e = wt.released.begin(); e != wt.released.end(); ++e) {
+      mark_used(e.get_start(), e.get_len());
+    }
+  }
+
+  // the free runs, up to the end of the device
+  uint64_t end = p2align(bdev->get_size(), alloc_size);
+  used_blocks.flip();
+  size_t pos = used_blocks.find_first();
+  while (pos != decltype(used_blocks)::npos) {
+    size_t cur = pos;
+    size_t next = used_blocks.find_next(cur);
+    while (next == cur + 1) {
+      cur = next;
+      next = used_blocks.find_next(cur);
+    }
+    uint64_t offset = pos * alloc_size;
+    uint64_t length = std::min<uint64_t>((cur + 1) * alloc_size, end) - offset;
+    if (offset < end && length > 0) {
+      shared_alloc.a->init_add_free(offset, length);
+      ++(*num);
+      *bytes += length;
+    }
+    pos = next;
+  }
+  dout(1) << __func__ << " scanned " << num_objects << " objects in "
+	  << ceph_clock_now() - start << " seconds" << dendl;
+  return 0;
+}
+
+int BlueStore::_open_fsid(bool create)
+{
+  ceph_assert(fsid_fd < 0);
+  int flags = O_RDWR|O_CLOEXEC;
+  if (create)
+    flags |= O_CREAT;
+  fsid_fd = ::openat(path_fd, "fsid", flags, 0644);
+  if (fsid_fd < 0) {
+    int err = -errno;
+    derr << __func__ << " " << cpp_strerror(err) << dendl;
+    return err;
+  }
+  return 0;
+}
+
+int BlueStore::_read_fsid(uuid_d *uuid)
+{
+  char fsid_str[40];
+  memset(fsid_str, 0, sizeof(fsid_str));
+  int ret = safe_read(fsid_fd, fsid_str, sizeof(fsid_str));
+  if (ret < 0) {
+    derr << __func__ << " failed: " << cpp_strerror(ret) << dendl;
+    return ret;
+  }
+  if (ret > 36)
+    fsid_str[36] = 0;
+  else
+    fsid_str[ret] = 0;
+  if (!uuid->parse(fsid_str)) {
+    derr << __func__ << " unparsable uuid " << fsid_str << dendl;
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int BlueStore::_write_fsid()
+{
+  int r = ::ftruncate(fsid_fd, 0);
+  if (r < 0) {
+    r = -errno;
+    derr << __func__ << " fsid truncate failed: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  string str = stringify(fsid) + "\n";
+  r = safe_write(fsid_fd, str.c_str(), str.length());
+  if (r < 0) {
+    derr << __func__ << " fsid write failed: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  r = ::fsync(fsid_fd);
+  if (r < 0) {
+    r = -errno;
+    derr << __func__ << " fsid fsync failed: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  return 0;
+}
+
+void BlueStore::_close_fsid()
+{
+  VOID_TEMP_FAILURE_RETRY(::close(fsid_fd));
+  fsid_fd = -1;
+}
+
+int BlueStore::_lock_fsid()
+{
+  struct flock l;
+  memset(&l, 0, sizeof(l));
+  l.l_type = F_WRLCK;
+  l.l_whence = SEEK_SET;
+  int r = ::fcntl(fsid_fd, F_SETLK, &l);
+  if (r < 0) {
+    int err = errno;
+    derr << __func__ << " failed to lock " << path << "/fsid"
+	 << " (is another ceph-osd still running?)"
+	 << cpp_strerror(err) << dendl;
+    return -err;
   }
   return 0;
 }
@@ -5928,6 +6651,21 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
   if (r < 0) {
     goto out_alloc;
   }
+
+  if (!read_only) {
+    if (cct->_conf->bluestore_allocation_from_file &&
+	!fm->is_null_manager()) {
+      r = _enable_null_freelist();
+      if (r < 0) {
+	goto out_alloc;
+      }
+    }
+    // any change to the store makes the snapshot stale. A new one is
+    // saved on umount.
+    if (fm->is_null_manager()) {
+      _remove_alloc_snapshot();
+    }
+  }
   return 0;
 
 out_alloc:
@@ -6120,6 +6858,8 @@ int BlueStore::_prepare_db_environment(bool create, bool read_only,
 
   FreelistManager::setup_merge_operators(db, freelist_type);
   db->set_merge_operator(PREFIX_STAT, merge_op);
+  db->set_merge_operator(PREFIX_SHARED_BLOB,
+			 std::make_shared<SharedBlobMergeOperator>());
   db->set_cache_size(cache_kv_ratio * cache_size);
   return 0;
 }
@@ -6985,7 +7725,7 @@ void BlueStore::set_cache_shards(unsigned num)
   buffer_cache_shards.resize(num);
   for (unsigned i = oold; i < num; ++i) {
     onode_cache_shards[i] = 
-        OnodeCacheShard::create(cct, cct->_conf->bluestore_cache_type,
+        OnodeCacheShard::create(cct, cct->_conf->bluestore_onode_cache_type,
                                  logger);
   }
   for (unsigned i = bold; i < num; ++i) {
@@ -7048,6 +7788,7 @@ int BlueStore::_mount()
     goto out_stop;
 
   mempool_thread.init();
+  _defrag_start();
 
   if ((!per_pool_stat_collection || per_pool_omap != OMAP_PER_PG) &&
     cct->_conf->bluestore_fsck_quick_fix_on_mount == true) {
@@ -7094,6 +7835,7 @@ int BlueStore::umount()
 
   mounted = false;
   if (!_kv_only) {
+    _defrag_stop();
     mempool_thread.shutdown();
 #ifdef HAVE_LIBZBD
     if (bdev->is_smr()) {
@@ -7101,9 +7843,16 @@ int BlueStore::umount()
       _zoned_cleaner_stop();
     }
 #endif
+    // the read aheads complete in the finisher, stopped along with the kv
+    // threads
+    _readahead_drain();
     dout(20) << __func__ << " stopping kv thread" << dendl;
     _kv_stop();
     _shutdown_cache();
+    if (fm->is_null_manager()) {
+      // on failure, the allocations are rebuilt on the next mount
+      _write_alloc_snapshot();
+    }
     dout(20) << __func__ << " closing" << dendl;
 
   }
@@ -7170,7 +7919,8 @@ int BlueStore::_fsck_check_extents(
   uint64_t granularity,
   BlueStoreRepairer* repairer,
   store_statfs_t& expected_statfs,
-  FSCKDepth depth)
+  FSCKDepth depth,
+  ceph::mutex* used_blocks_lock)
 {
   dout(30) << __func__ << " oid " << oid << " extents " << extents << dendl;
   int errors = 0;
@@ -7183,6 +7933,10 @@ int BlueStore::_fsck_check_extents(
     }
     if (depth != FSCK_SHALLOW) {
       bool already = false;
+      // the below lock is optional and provided in multithreading mode only
+      if (used_blocks_lock) {
+        used_blocks_lock->lock();
+      }
       apply_for_bitset_range(
         e.offset, e.length, granularity, used_blocks,
         [&](uint64_t pos, mempool_dynamic_bitset &bs) {
@@ -7201,6 +7955,9 @@ int BlueStore::_fsck_check_extents(
 	  else
 	    bs.set(pos);
         });
+      if (used_blocks_lock) {
+        used_blocks_lock->unlock();
+      }
         if (repairer) {
 	  repairer->set_space_used(e.offset, e.length, cid, oid);
         }
@@ -7360,8 +8117,8 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
   // shards
   if (!o->extent_map.shards.empty()) {
     ++num_sharded_objects;
-    if (depth != FSCK_SHALLOW) {
-      ceph_assert(expecting_shards);
+    // in multithreading mode the shards are checked by the caller
+    if (depth != FSCK_SHALLOW && expecting_shards) {
       for (auto& s : o->extent_map.shards) {
         dout(20) << __func__ << "    shard " << *s.shard_info << dendl;
         expecting_shards->push_back(string());
@@ -7377,6 +8134,20 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
     }
   }
 
+  if (o->onode.has_inline_data()) {
+    if (o->onode.inline_data.length() != o->onode.size ||
+        !o->extent_map.extent_map.empty() ||
+        !o->extent_map.shards.empty()) {
+      derr << "fsck error: " << oid << " inline data 0x" << std::hex
+        << o->onode.inline_data.length() << " with size 0x" << o->onode.size
+        << std::dec << ", " << o->extent_map.extent_map.size()
+        << " lextents and " << o->extent_map.shards.size() << " shards"
+        << dendl;
+      ++errors;
+    }
+    res_statfs->data_stored += o->onode.inline_data.length();
+  }
+
   // lextents
   uint64_t pos = 0;
   mempool::bluestore_fsck::map<BlobRef,
@@ -7474,11 +8245,12 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
       ceph_assert(sbi.cid == coll_t() || sbi.cid == c->cid);
       ceph_assert(sbi.pool_id == INT64_MIN ||
         sbi.pool_id == oid.hobj.get_logical_pool());
-      sbi.cid = c->cid;
-      sbi.pool_id = oid.hobj.get_logical_pool();
-      sbi.sb = i.first->shared_blob;
-      sbi.oids.push_back(oid);
-      sbi.compressed = blob.is_compressed();
+      if (sbi.pool_id == INT64_MIN) {
+        sbi.cid = c->cid;
+        sbi.pool_id = oid.hobj.get_logical_pool();
+        sbi.oid = oid;
+        sbi.compressed = blob.is_compressed();
+      }
       for (auto e : blob.get_extents()) {
         if (e.is_valid()) {
           sbi.ref_map.get(e.offset, e.length);
@@ -7495,7 +8267,8 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
         fm->get_alloc_size(),
         repairer,
         *res_statfs,
-        depth);
+        depth,
+        ctx.used_blocks_lock);
     } else {
       errors += _fsck_sum_extents(
         blob.get_extents(),
@@ -7542,6 +8315,115 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
   return o;
 }
 
+bool BlueStore::_fsck_check_object_ids(
+  const ghobject_t& oid,
+  const bluestore_onode_t& onode,
+  uint64_t_btree_t& used_nids,
+  const BlueStore::FSCK_ObjectCtx& ctx)
+{
+  auto& errors = ctx.errors;
+
+  if (onode.nid) {
+    if (onode.nid > nid_max) {
+      derr << "fsck error: " << oid << " nid " << onode.nid
+        << " > nid_max " << nid_max << dendl;
+      ++errors;
+    }
+    if (used_nids.count(onode.nid)) {
+      derr << "fsck error: " << oid << " nid " << onode.nid
+        << " already in use" << dendl;
+      ++errors;
+      return false;
+    }
+    used_nids.insert(onode.nid);
+  }
+  // omap
+  if (onode.has_omap()) {
+    ceph_assert(ctx.used_omap_head);
+    if (ctx.used_omap_head->count(onode.nid)) {
+      derr << "fsck error: " << oid << " omap_head " << onode.nid
+           << " already in use" << dendl;
+      ++errors;
+    } else {
+      ctx.used_omap_head->insert(onode.nid);
+    }
+  } // if (onode.has_omap())
+  return true;
+}
+
+void BlueStore::fsck_check_object_data(
+  BlueStore::FSCKDepth depth,
+  BlueStore::CollectionRef c,
+  OnodeRef& o,
+  const map<BlobRef, bluestore_blob_t::unused_t>& referenced,
+  const BlueStore::FSCK_ObjectCtx& ctx)
+{
+  auto& errors = ctx.errors;
+  const ghobject_t& oid = o->oid;
+
+  ceph_assert(depth != FSCK_SHALLOW);
+  for (auto& i : referenced) {
+    dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
+      << std::dec << " for " << *i.first << dendl;
+    const bluestore_blob_t& blob = i.first->get_blob();
+    if (i.second & blob.unused) {
+      derr << "fsck error: " << oid << " blob claims unused 0x"
+        << std::hex << blob.unused
+        << " but extents reference 0x" << i.second << std::dec
+        << " on blob " << *i.first << dendl;
+      ++errors;
+    }
+    if (blob.has_csum()) {
+      uint64_t blob_len = blob.get_logical_length();
+      uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
+      unsigned csum_count = blob.get_csum_count();
+      unsigned csum_chunk_size = blob.get_csum_chunk_size();
+      for (unsigned p = 0; p < csum_count; ++p) {
+        unsigned pos = p * csum_chunk_size;
+        unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
+        unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
+        unsigned mask = 1u << firstbit;
+        for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
+          mask |= 1u << b;
+        }
+        if ((blob.unused & mask) == mask) {
+          // this csum chunk region is marked unused
+          if (blob.get_csum_item(p) != 0) {
+            derr << "fsck error: " << oid
+              << " blob claims csum chunk 0x" << std::hex << pos
+              << "~" << csum_chunk_size
+              << " is unused (mask 0x" << mask << " of unused 0x"
+              << blob.unused << ") but csum is non-zero 0x"
+              << blob.get_csum_item(p) << std::dec << " on blob "
+              << *i.first << dendl;
+            ++errors;
+          }
+        }
+      }
+    }
+  }
+  if (depth == FSCK_DEEP) {
+    bufferlist bl;
+    uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
+    uint64_t offset = 0;
+    do {
+      uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
+      int r = _do_read(c.get(), o, offset, l, bl,
+        CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+      if (r < 0) {
+        ++errors;
+        derr << "fsck error: " << oid << std::hex
+          << " error during read: "
+          << " " << offset << "~" << l
+          << " " << cpp_strerror(r) << std::dec
+          << dendl;
+        break;
+      }
+      offset += l;
+    } while (offset < o->onode.size);
+  } // deep
+}
+
 #include "common/WorkQueue.h"
 
 class ShallowFSCKThreadPool : public ThreadPool
@@ -7593,7 +8475,10 @@ public:
 
     size_t batchCount;
     BlueStore* store = nullptr;
+    BlueStore::FSCKDepth depth;
 
+    BlueStore::mempool_dynamic_bitset* used_blocks = nullptr;
+    ceph::mutex* used_blocks_lock = nullptr;
     ceph::mutex* sb_info_lock = nullptr;
     BlueStore::sb_info_map_t* sb_info = nullptr;
     BlueStoreRepairer* repairer = nullptr;
@@ -7605,12 +8490,18 @@ public:
     FSCKWorkQueue(std::string n,
                   size_t _batchCount,
                   BlueStore* _store,
+                  BlueStore::FSCKDepth _depth,
+                  BlueStore::mempool_dynamic_bitset* _used_blocks,
+                  ceph::mutex* _used_blocks_lock,
                   ceph::mutex* _sb_info_lock,
                   BlueStore::sb_info_map_t& _sb_info,
                   BlueStoreRepairer* _repairer) :
       WorkQueue_(n, ceph::timespan::zero(), ceph::timespan::zero()),
       batchCount(_batchCount),
       store(_store),
+      depth(_depth),
+      used_blocks(_used_blocks),
+      used_blocks_lock(_used_blocks_lock),
       sb_info_lock(_sb_info_lock),
       sb_info(&_sb_info),
       repairer(_repairer)
@@ -7653,6 +8544,8 @@ public:
     void _void_process(void* item, TPHandle& handle) override {
       Batch* batch = (Batch*)item;
 
+      // the batch's shared blobs are gathered apart, and merged once done
+      BlueStore::sb_info_map_t batch_sb_info;
       BlueStore::FSCK_ObjectCtx ctx(
         batch->errors,
         batch->warnings,
@@ -7661,28 +8554,34 @@ public:
         batch->num_blobs,
         batch->num_sharded_objects,
         batch->num_spanning_blobs,
-        nullptr, // used_blocks
-        nullptr, //used_omap_head
-        sb_info_lock,
-        *sb_info,
+        used_blocks,
+        nullptr, //used_omap_head - checked by the caller
+        nullptr, //sb_info_lock - batch_sb_info is ours
+        batch_sb_info,
         batch->expected_store_statfs,
         batch->expected_pool_statfs,
         repairer);
+      ctx.used_blocks_lock = used_blocks_lock;
 
       for (size_t i = 0; i < batch->entry_count; i++) {
         auto& entry = batch->entries[i];
 
-        store->fsck_check_objects_shallow(
-          BlueStore::FSCK_SHALLOW,
+        map<BlueStore::BlobRef, bluestore_blob_t::unused_t> referenced;
+        auto o = store->fsck_check_objects_shallow(
+          depth,
           entry.pool_id,
           entry.c,
           entry.oid,
           entry.key,
           entry.value,
-          nullptr, // expecting_shards - this will need a protection if passed
-          nullptr, // referenced
+          nullptr, // expecting_shards - checked by the caller
+          depth == BlueStore::FSCK_SHALLOW ? nullptr : &referenced,
           ctx);
+        if (depth != BlueStore::FSCK_SHALLOW) {
+          store->fsck_check_object_data(depth, entry.c, o, referenced, ctx);
+        }
       }
+      merge_sb_info(batch_sb_info);
       //std::cout << "processed " << batch << std::endl;
       batch->entry_count = 0;
       batch->running--;
@@ -7695,6 +8594,28 @@ public:
       ceph_assert(false);
     }
 
+    /// merge the shared blobs gathered by a batch. The result is the same
+    /// as if the objects had been checked in key order, whichever order the
+    /// batches complete in.
+    void merge_sb_info(BlueStore::sb_info_map_t& from) {
+      std::lock_guard l(*sb_info_lock);
+      for (auto& [sbid, f] : from) {
+        auto [p, inserted] = sb_info->try_emplace(sbid, std::move(f));
+        if (inserted) {
+          continue;
+        }
+        auto& sbi = p->second;
+        ceph_assert(sbi.cid == f.cid);
+        ceph_assert(sbi.pool_id == f.pool_id);
+        if (f.oid < sbi.oid) {
+          sbi.oid = f.oid;
+          sbi.compressed = f.compressed;
+        }
+        sbi.ref_map.add(f.ref_map);
+      }
+      from.clear();
+    }
+
     bool queue(
       int64_t pool_id,
       BlueStore::CollectionRef c,
@@ -7908,13 +8829,18 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
   auto it = db->get_iterator(PREFIX_OBJ, KeyValueDB::ITERATOR_NOCACHE);
   mempool::bluestore_fsck::list<string> expecting_shards;
   if (it) {
-    const size_t thread_count = cct->_conf->bluestore_fsck_quick_fix_threads;
+    const size_t thread_count = depth == FSCK_SHALLOW ?
+      cct->_conf->bluestore_fsck_quick_fix_threads :
+      cct->_conf->bluestore_fsck_threads;
     typedef ShallowFSCKThreadPool::FSCKWorkQueue<256> WQ;
     std::unique_ptr<WQ> wq(
       new WQ(
         "FSCKWorkQueue",
         (thread_count ? : 1) * 32,
         this,
+        depth,
+        ctx.used_blocks,
+        ctx.used_blocks_lock,
         sb_info_lock,
         sb_info,
         repairer));
@@ -7922,9 +8848,10 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
     ShallowFSCKThreadPool thread_pool(cct, "ShallowFSCKThreadPool", "ShallowFSCK", thread_count);
 
     thread_pool.add_work_queue(wq.get());
-    if (depth == FSCK_SHALLOW && thread_count > 0) {
+    if (thread_count > 0) {
       //not the best place but let's check anyway
       ceph_assert(sb_info_lock);
+      ceph_assert(depth == FSCK_SHALLOW || ctx.used_blocks_lock);
       thread_pool.start();
     }
 
@@ -8020,7 +8947,29 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
       }
 
       bool queued = false;
-      if (depth == FSCK_SHALLOW && thread_count > 0) {
+      if (thread_count > 0) {
+        if (depth != FSCK_SHALLOW) {
+          // the checks depending on the key order, or spanning multiple
+          // objects, are done here. The workers take care of the rest.
+          bufferlist v = it->value();
+          auto p = v.front().begin_deep();
+          bluestore_onode_t onode;
+          onode.decode(p);
+          for (auto& s : onode.extent_map_shards) {
+            expecting_shards.push_back(string());
+            get_extent_shard_key(it->key(), s.offset,
+              &expecting_shards.back());
+            if (s.offset >= onode.size) {
+              derr << "fsck error: " << oid << " shard 0x" << std::hex
+                << s.offset << " past EOF at 0x" << onode.size
+                << std::dec << dendl;
+              ++errors;
+            }
+          }
+          if (!_fsck_check_object_ids(oid, onode, used_nids, ctx)) {
+            continue; // go for next object
+          }
+        }
         queued = wq->queue(
           pool_id,
           c,
@@ -8028,114 +8977,33 @@ void BlueStore::_fsck_check_objects(FSCKDepth depth,
           it->key(),
           it->value());
       }
-      OnodeRef o;
-      map<BlobRef, bluestore_blob_t::unused_t> referenced;
-
       if (!queued) {
         ++processed_myself;
+        OnodeRef o;
+        map<BlobRef, bluestore_blob_t::unused_t> referenced;
 
-         o = fsck_check_objects_shallow(
+        o = fsck_check_objects_shallow(
           depth,
           pool_id,
           c,
           oid,
           it->key(),
           it->value(),
-          &expecting_shards,
+          thread_count > 0 ? nullptr : &expecting_shards,
           &referenced,
           ctx);
-      }
 
-      if (depth != FSCK_SHALLOW) {
-        ceph_assert(o != nullptr);
-        if (o->onode.nid) {
-          if (o->onode.nid > nid_max) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " > nid_max " << nid_max << dendl;
-            ++errors;
-          }
-          if (used_nids.count(o->onode.nid)) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " already in use" << dendl;
-            ++errors;
+        if (depth != FSCK_SHALLOW) {
+          ceph_assert(o != nullptr);
+          if (thread_count == 0 &&
+              !_fsck_check_object_ids(oid, o->onode, used_nids, ctx)) {
             continue; // go for next object
           }
-          used_nids.insert(o->onode.nid);
-        }
-        for (auto& i : referenced) {
-          dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
-            << std::dec << " for " << *i.first << dendl;
-          const bluestore_blob_t& blob = i.first->get_blob();
-          if (i.second & blob.unused) {
-            derr << "fsck error: " << oid << " blob claims unused 0x"
-              << std::hex << blob.unused
-              << " but extents reference 0x" << i.second << std::dec
-              << " on blob " << *i.first << dendl;
-            ++errors;
-          }
-          if (blob.has_csum()) {
-            uint64_t blob_len = blob.get_logical_length();
-            uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
-            unsigned csum_count = blob.get_csum_count();
-            unsigned csum_chunk_size = blob.get_csum_chunk_size();
-            for (unsigned p = 0; p < csum_count; ++p) {
-              unsigned pos = p * csum_chunk_size;
-              unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
-              unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
-              unsigned mask = 1u << firstbit;
-              for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
-                mask |= 1u << b;
-              }
-              if ((blob.unused & mask) == mask) {
-                // this csum chunk region is marked unused
-                if (blob.get_csum_item(p) != 0) {
-                  derr << "fsck error: " << oid
-                    << " blob claims csum chunk 0x" << std::hex << pos
-                    << "~" << csum_chunk_size
-                    << " is unused (mask 0x" << mask << " of unused 0x"
-                    << blob.unused << ") but csum is non-zero 0x"
-                    << blob.get_csum_item(p) << std::dec << " on blob "
-                    << *i.first << dendl;
-                  ++errors;
-                }
-              }
-            }
-          }
+          fsck_check_object_data(depth, c, o, referenced, ctx);
         }
-        // omap
-        if (o->onode.has_omap()) {
-          ceph_assert(ctx.used_omap_head);
-          if (ctx.used_omap_head->count(o->onode.nid)) {
-            derr << "fsck error: " << o->oid << " omap_head " << o->onode.nid
-                 << " already in use" << dendl;
-            ++errors;
-          } else {
-            ctx.used_omap_head->insert(o->onode.nid);
-          }
-        } // if (o->onode.has_omap())
-        if (depth == FSCK_DEEP) {
-          bufferlist bl;
-          uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
-          uint64_t offset = 0;
-          do {
-            uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
-            int r = _do_read(c.get(), o, offset, l, bl,
-              CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
-            if (r < 0) {
-              ++errors;
-              derr << "fsck error: " << oid << std::hex
-                << " error during read: "
-                << " " << offset << "~" << l
-                << " " << cpp_strerror(r) << std::dec
-                << dendl;
-              break;
-            }
-            offset += l;
-          } while (offset < o->onode.size);
-        } // deep
-      } //if (depth != FSCK_SHALLOW)
+      }
     } // for (it->lower_bound(string()); it->valid(); it->next())
-    if (depth == FSCK_SHALLOW && thread_count > 0) {
+    if (thread_count > 0) {
       wq->finalize(thread_pool, ctx);
       if (processed_myself) {
         // may be needs more threads?
@@ -8352,6 +9220,12 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
   {
     dout(1) << __func__ << " walking object keyspace" << dendl;
     ceph::mutex sb_info_lock =  ceph::make_mutex("BlueStore::fsck::sbinfo_lock");
+    ceph::mutex used_blocks_lock =
+      ceph::make_mutex("BlueStore::fsck::used_blocks_lock");
+    //no need for the below locks when in non-shallow mode unless
+    // bluestore_fsck_threads is set
+    bool multithreaded =
+      depth == FSCK_SHALLOW || cct->_conf->bluestore_fsck_threads > 0;
     BlueStore::FSCK_ObjectCtx ctx(
       errors,
       warnings,
@@ -8362,13 +9236,14 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
       num_spanning_blobs,
       &used_blocks,
       &used_omap_head,
-      //no need for the below lock when in non-shallow mode as
-      // there is no multithreading in this case
-      depth == FSCK_SHALLOW ? &sb_info_lock : nullptr,
+      multithreaded ? &sb_info_lock : nullptr,
       sb_info,
       expected_store_statfs,
       expected_pool_statfs,
       repair ? &repairer : nullptr);
+    if (depth != FSCK_SHALLOW && multithreaded) {
+      ctx.used_blocks_lock = &used_blocks_lock;
+    }
 
     _fsck_check_objects(depth, ctx);
   }
@@ -8423,7 +9298,8 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
           }
           continue;
         }	
-	dout(20) << __func__ << "  " << *sbi.sb << " " << shared_blob << dendl;
+	dout(20) << __func__ << "  sbid 0x" << std::hex << sbid << std::dec
+		 << " " << shared_blob << dendl;
 	if (shared_blob.ref_map != sbi.ref_map) {
 	  derr << "fsck error: shared blob 0x" << std::hex << sbid
 		<< std::dec << " ref_map " << shared_blob.ref_map
@@ -8439,7 +9315,7 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 	  expected_statfs = &expected_pool_statfs[sbi.pool_id];
 	}
 	errors += _fsck_check_extents(sbi.cid,
-				      p->second.oids.front(),
+				      sbi.oid,
 				      extents,
 				      p->second.compressed,
 				      used_blocks,
@@ -8652,22 +9528,24 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
     for (auto &p : sb_info) {
       sb_info_t& sbi = p.second;
       if (!sbi.passed) {
-        derr << "fsck error: missing " << *sbi.sb << dendl;
+        derr << "fsck error: missing shared blob 0x" << std::hex << p.first
+             << std::dec << " referenced by " << sbi.oid << dendl;
         ++errors;
       }
       if (repair && (!sbi.passed || sbi.updated)) {
         auto sbid = p.first;
         if (sbi.ref_map.empty()) {
 	  ceph_assert(sbi.passed);
-	  dout(20) << __func__ << " " << *sbi.sb
-		   << " is empty, removing" << dendl;
+	  dout(20) << __func__ << " shared blob 0x" << std::hex << sbid
+		   << std::dec << " is empty, removing" << dendl;
 	  repairer.fix_shared_blob(db, sbid, nullptr);
         } else {
 	  bufferlist bl;
 	  bluestore_shared_blob_t persistent(sbid, std::move(sbi.ref_map));
 	  encode(persistent, bl);
-	  dout(20) << __func__ << " " << *sbi.sb
-		   << " is " << bl.length() << " bytes, updating" << dendl;
+	  dout(20) << __func__ << " shared blob 0x" << std::hex << sbid
+		   << std::dec << " is " << bl.length() << " bytes, updating"
+		   << dendl;
 
 	  repairer.fix_shared_blob(db, sbid, &bl);
         }
@@ -8820,9 +9698,7 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 
     dout(1) << __func__ << " checking freelist vs allocated" << dendl;
     {
-      fm->enumerate_reset();
-      uint64_t offset, length;
-      while (fm->enumerate_next(db, &offset, &length)) {
+      auto check_free = [&](uint64_t offset, uint64_t length) {
         bool intersects = false;
         apply_for_bitset_range(
           offset, length, alloc_size, used_blocks,
@@ -8845,6 +9721,10 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 		  repairer.fix_false_free(db, fm,
 					  pos * min_alloc_size,
 					  min_alloc_size);
+		  if (fm->is_null_manager()) {
+		    shared_alloc.a->init_rm_free(pos * min_alloc_size,
+						 min_alloc_size);
+		  }
 	        }
 	      }
             } else {
@@ -8858,8 +9738,25 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 	        << " intersects allocated blocks" << dendl;
 	  ++errors;
         }
+      };
+      if (fm->is_null_manager()) {
+        // there is no freelist: check the allocator, as loaded from the
+        // snapshot or rebuilt from the onodes
+        std::vector<std::pair<uint64_t, uint64_t>> free_extents;
+        shared_alloc.a->dump([&](uint64_t offset, uint64_t length) {
+          free_extents.emplace_back(offset, length);
+        });
+        for (auto [offset, length] : free_extents) {
+          check_free(offset, length);
+        }
+      } else {
+        fm->enumerate_reset();
+        uint64_t offset, length;
+        while (fm->enumerate_next(db, &offset, &length)) {
+          check_free(offset, length);
+        }
+        fm->enumerate_reset();
       }
-      fm->enumerate_reset();
       size_t count = used_blocks.count();
       if (used_blocks.size() != count) {
         ceph_assert(used_blocks.size() > count);
@@ -8880,6 +9777,10 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 				    fm,
 				    start * min_alloc_size,
 				    (cur + 1 - start) * min_alloc_size);
+		if (fm->is_null_manager()) {
+		  shared_alloc.a->init_add_free(start * min_alloc_size,
+						(cur + 1 - start) * min_alloc_size);
+		}
 	      }
 	      start = next;
 	      break;
@@ -9391,8 +10292,8 @@ BlueStore::CollectionRef BlueStore::_get_collection(const coll_t& cid)
 void BlueStore::_queue_reap_collection(CollectionRef& c)
 {
   dout(10) << __func__ << " " << c << " " << c->cid << dendl;
-  // _reap_collections and this in the same thread,
-  // so no need a lock.
+  // the kv finalize threads of all the kv pipelines queue and reap
+  std::lock_guard l(removed_collections_lock);
   removed_collections.push_back(c);
 }
 
@@ -9401,8 +10302,7 @@ void BlueStore::_reap_collections()
 
   list<CollectionRef> removed_colls;
   {
-    // _queue_reap_collection and this in the same thread.
-    // So no need a lock.
+    std::lock_guard l(removed_collections_lock);
     if (!removed_collections.empty())
       removed_colls.swap(removed_collections);
     else
@@ -9432,6 +10332,7 @@ void BlueStore::_reap_collections()
   if (removed_colls.empty()) {
     dout(10) << __func__ << " all reaped" << dendl;
   } else {
+    std::lock_guard l(removed_collections_lock);
     removed_collections.splice(removed_collections.begin(), removed_colls);
   }
 }
@@ -9716,6 +10617,145 @@ void BlueStore::_read_cache(
   }
 }
 
+// A read starting where the previous read of the onode ended extends its
+// sequential stream.  Once the stream is bluestore_readahead_min_sequential
+// reads long, we keep up to bluestore_readahead_window of data past it in
+// the buffer cache, topping it up with max_blob_size aligned reads when
+// less than half of the window is left.
+void BlueStore::_readahead_range(
+  OnodeRef& o,
+  uint64_t offset,
+  size_t length,
+  uint64_t *ra_offset,
+  uint64_t *ra_length)
+{
+  uint64_t window = cct->_conf->bluestore_readahead_window;
+  if (!window) {
+    return;
+  }
+  uint64_t end = offset + length;
+  bool sequential = offset == o->readahead_next;
+  o->readahead_next = end;
+  o->readahead_seq = sequential ? o->readahead_seq + 1 : 0;
+
+  uint64_t pos = o->readahead_pos;
+  uint64_t ra_end = o->readahead_end;
+  if (pos < ra_end) {
+    if (!sequential) {
+      logger->inc(l_bluestore_readahead_wasted_bytes, ra_end - pos);
+      pos = ra_end;
+    } else if (end > pos) {
+      uint64_t hit = std::min(end, ra_end) - pos;
+      logger->inc(l_bluestore_readahead_hit_bytes, hit);
+      pos += hit;
+    }
+  }
+  if (pos >= ra_end) {
+    pos = ra_end = end;
+  }
+
+  if (sequential &&
+      o->readahead_seq >= cct->_conf->bluestore_readahead_min_sequential &&
+      ra_end < end + window / 2) {
+    uint64_t align = std::max<uint64_t>(max_blob_size, min_alloc_size);
+    uint64_t to = std::min<uint64_t>(o->onode.size,
+				     round_up_to(end + window, align));
+    if (to > ra_end) {
+      dout(20) << __func__ << " " << o->oid << " read ahead 0x" << std::hex
+	       << ra_end << "~" << (to - ra_end) << std::dec << dendl;
+      *ra_offset = ra_end;
+      *ra_length = to - ra_end;
+      logger->inc(l_bluestore_readahead_bytes, *ra_length);
+      ra_end = to;
+    }
+  }
+  o->readahead_pos = pos;
+  o->readahead_end = ra_end;
+}
+
+// The read ahead data only goes to the cache.  It is read with its own ioc,
+// so that its errors don't fail the read, and completes in the finisher,
+// without the reader waiting for it, nor the aio thread verifying the
+// checksums and decompressing it.
+struct BlueStore::ReadaheadContext : public BlueStore::AioContext {
+  struct C_Finish : public Context {
+    BlueStore *store;
+    ReadaheadContext *ra;
+    C_Finish(BlueStore *store, ReadaheadContext *ra) : store(store), ra(ra) {}
+    void finish(int r) override {
+      store->_readahead_finish(ra);
+    }
+  };
+
+  CollectionRef c;
+  OnodeRef o;
+  uint64_t offset;
+  uint64_t length;
+  uint64_t gen;  ///< o->readahead_gen when the read was prepared
+  ready_regions_t ready_regions;
+  blobs2read_t blobs2read;
+  vector<bufferlist> compressed_blob_bls;
+  IOContext ioc;
+
+  ReadaheadContext(CephContext *cct, Collection *c, OnodeRef& o,
+		   uint64_t offset, uint64_t length)
+    : c(c), o(o), offset(offset), length(length), gen(o->readahead_gen),
+      ioc(cct, static_cast<AioContext*>(this), true) {}
+
+  void aio_finish(BlueStore *store) override {
+    store->finisher.queue(new C_Finish(store, this));
+  }
+};
+
+void BlueStore::_readahead_submit(std::unique_ptr<ReadaheadContext> ra)
+{
+  {
+    std::lock_guard l(readahead_lock);
+    ++readahead_in_flight;
+  }
+  bdev->aio_submit(&ra.release()->ioc);
+}
+
+void BlueStore::_readahead_finish(ReadaheadContext *ra)
+{
+  // Keep the writers out while populating the cache, and give up if the
+  // object has changed (or moved) since the read was prepared.  Rather than
+  // waiting for the collection lock, which the writers may hold for a
+  // while, the read ahead is dropped.
+  Collection *c = ra->c.get();
+  std::shared_lock l(c->lock, std::try_to_lock);
+  if (l.owns_lock() &&
+      ra->ioc.get_return_value() == 0 &&
+      ra->o->exists &&
+      ra->o->c == c &&
+      ra->o->readahead_gen == ra->gen) {
+    bool csum_error = false;
+    bufferlist bl;
+    _generate_read_result_bl(ra->o, ra->offset, ra->length, ra->ready_regions,
+			     ra->compressed_blob_bls, ra->blobs2read,
+			     true, &csum_error, bl);
+  } else {
+    dout(20) << __func__ << " " << ra->o->oid << " dropping 0x" << std::hex
+	     << ra->offset << "~" << ra->length << std::dec << dendl;
+  }
+  if (l.owns_lock()) {
+    l.unlock();
+  }
+  delete ra;
+
+  std::lock_guard rl(readahead_lock);
+  ceph_assert(readahead_in_flight > 0);
+  if (--readahead_in_flight == 0) {
+    readahead_cond.notify_all();
+  }
+}
+
+void BlueStore::_readahead_drain()
+{
+  std::unique_lock l(readahead_lock);
+  readahead_cond.wait(l, [this] { return readahead_in_flight == 0; });
+}
+
 int BlueStore::_prepare_read_ioc(
   blobs2read_t& blobs2read,
   vector<bufferlist>* compressed_blob_bls,
@@ -9794,8 +10834,14 @@ int BlueStore::_generate_read_result_bl(
   blobs2read_t& blobs2read,
   bool buffered,
   bool* csum_error,
-  bufferlist& bl)
+  bufferlist& bl,
+  uint64_t* copied_bytes)
 {
+  // Uncompressed data is handed over as references to the (page aligned)
+  // device or cache buffers, so that it reaches the caller, and eventually
+  // the messenger, without being copied. Only the decompressed data and the
+  // zero filled holes are materialized here; account for them.
+  uint64_t copied = 0;
  // enumerate and decompress desired blobs
   auto p = compressed_blob_bls.begin();
   blobs2read_t::iterator b2r_it = blobs2read.begin();
@@ -9824,6 +10870,7 @@ int BlueStore::_generate_read_result_bl(
         for (auto& r : req.regs) {
           ready_regions[r.logical_offset].substr_of(
             raw_bl, r.blob_xoffset, r.length);
+          copied += r.length;
         }
       }
     } else {
@@ -9869,12 +10916,18 @@ int BlueStore::_generate_read_result_bl(
                << ": zeros for 0x" << (pos + offset) << "~" << l
                << std::dec << dendl;
       bl.append_zero(l);
+      copied += l;
       pos += l;
     }
   }
   ceph_assert(bl.length() == length);
   ceph_assert(pos == length);
   ceph_assert(pr == pr_end);
+  dout(20) << __func__ << " 0x" << std::hex << offset << "~" << length
+           << " copied 0x" << copied << std::dec << dendl;
+  if (copied_bytes) {
+    *copied_bytes += copied;
+  }
   return 0;
 }
 
@@ -9916,6 +10969,10 @@ int BlueStore::_do_read(
   if (offset + length > o->onode.size) {
     length = o->onode.size - offset;
   }
+  if (o->onode.has_inline_data()) {
+    bl.substr_of(o->onode.inline_data, offset, length);
+    return bl.length();
+  }
 
   auto start = mono_clock::now();
   o->extent_map.fault_range(db, offset, length);
@@ -9937,6 +10994,41 @@ int BlueStore::_do_read(
   blobs2read_t blobs2read;
   _read_cache(o, offset, length, read_cache_policy, ready_regions, blobs2read);
 
+  uint64_t ra_offset = 0, ra_length = 0;
+  std::unique_ptr<ReadaheadContext> ra;
+  if (retry_count == 0 &&
+      read_cache_policy == 0 &&
+      (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+		   CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0) {
+    _readahead_range(o, offset, length, &ra_offset, &ra_length);
+  }
+  if (ra_length) {
+    ra = std::make_unique<ReadaheadContext>(cct, c, o, ra_offset, ra_length);
+    o->extent_map.fault_range(db, ra_offset, ra_length);
+    _read_cache(o, ra_offset, ra_length, read_cache_policy, ra->ready_regions,
+		ra->blobs2read);
+    // compressed blobs are read whole, once is enough
+    for (auto p = ra->blobs2read.begin(); p != ra->blobs2read.end(); ) {
+      if (p->first->get_blob().is_compressed() && blobs2read.count(p->first)) {
+	p = ra->blobs2read.erase(p);
+      } else {
+	++p;
+      }
+    }
+    if (_prepare_read_ioc(ra->blobs2read, &ra->compressed_blob_bls, &ra->ioc) < 0) {
+      ra.reset();
+    } else if (!ra->ioc.has_pending_aios()) {
+      // nothing to read, or read synchronously (bdev_aio off)
+      if (!ra->blobs2read.empty()) {
+	bool ra_csum_error = false;
+	bufferlist ra_bl;
+	_generate_read_result_bl(o, ra_offset, ra_length, ra->ready_regions,
+				 ra->compressed_blob_bls, ra->blobs2read,
+				 true, &ra_csum_error, ra_bl);
+      }
+      ra.reset();
+    }
+  }
 
   // read raw blob data.
   start = mono_clock::now(); // for the sake of simplicity
@@ -9950,9 +11042,16 @@ int BlueStore::_do_read(
     return r;
 
   int64_t num_ios = blobs2read.size();
-  if (ioc.has_pending_aios()) {
+  bool pending = ioc.has_pending_aios();
+  if (pending) {
     num_ios = ioc.get_num_ios();
     bdev->aio_submit(&ioc);
+  }
+  // queued behind the read, and not waited for
+  if (ra) {
+    _readahead_submit(std::move(ra));
+  }
+  if (pending) {
     dout(20) << __func__ << " waiting for aio" << dendl;
     ioc.aio_wait();
     r = ioc.get_return_value();
@@ -9969,9 +11068,10 @@ int BlueStore::_do_read(
   );
 
   bool csum_error = false;
+  uint64_t copied = 0;
   r = _generate_read_result_bl(o, offset, length, ready_regions,
                               compressed_blob_bls, blobs2read,
-                              buffered, &csum_error, bl);
+                              buffered, &csum_error, bl, &copied);
   if (csum_error) {
     // Handles spurious read errors caused by a kernel bug.
     // We sometimes get all-zero pages as a result of the read under
@@ -9984,6 +11084,7 @@ int BlueStore::_do_read(
     return _do_read(c, o, offset, length, bl, op_flags, retry_count + 1);
   }
   r = bl.length();
+  logger->inc(l_bluestore_read_copied_bytes, copied);
   if (retry_count) {
     logger->inc(l_bluestore_reads_with_retries);
     dout(5) << __func__ << " read at 0x" << std::hex << offset << "~" << length
@@ -9995,6 +11096,231 @@ int BlueStore::_do_read(
   return r;
 }
 
+int BlueStore::verify(
+  CollectionHandle &c_,
+  const ghobject_t& oid,
+  uint64_t offset,
+  size_t length,
+  uint32_t *digest,
+  uint32_t op_flags)
+{
+  auto start = mono_clock::now();
+  Collection *c = static_cast<Collection *>(c_.get());
+  const coll_t &cid = c->get_cid();
+  dout(15) << __func__ << " " << cid << " " << oid
+	   << " 0x" << std::hex << offset << "~" << length << std::dec
+	   << dendl;
+  if (!c->exists)
+    return -ENOENT;
+
+  int r;
+  {
+    std::shared_lock l(c->lock);
+    OnodeRef o = c->get_onode(oid, false);
+    if (!o || !o->exists) {
+      r = -ENOENT;
+      goto out;
+    }
+
+    r = _do_verify(c, o, offset, length, digest, op_flags);
+    if (r == -EIO) {
+      logger->inc(l_bluestore_read_eio);
+    }
+  }
+
+ out:
+  if (r >= 0 && _debug_data_eio(oid)) {
+    r = -EIO;
+    derr << __func__ << " " << c->cid << " " << oid << " INJECT EIO" << dendl;
+  }
+  dout(10) << __func__ << " " << cid << " " << oid
+	   << " 0x" << std::hex << offset << "~" << length
+	   << " digest 0x" << *digest << std::dec
+	   << " = " << r << dendl;
+  log_latency(__func__,
+    l_bluestore_read_lat,
+    mono_clock::now() - start,
+    cct->_conf->bluestore_log_op_age);
+  return r;
+}
+
+/*
+ * Same as _do_read(), but instead of assembling the data, the crc32c of each
+ * verified region is derived from the blob's checksums where possible, and the
+ * results are chained in logical order:
+ *   crc32c(buf, v') = crc32c(buf, v) ^ crc32c(0*len(buf), v ^ v')
+ * (see buffer::list::crc32c())
+ */
+int BlueStore::_do_verify(
+  Collection *c,
+  OnodeRef o,
+  uint64_t offset,
+  size_t length,
+  uint32_t *digest,
+  uint32_t op_flags,
+  uint64_t retry_count)
+{
+  FUNCTRACE(cct);
+  dout(20) << __func__ << " 0x" << std::hex << offset << "~" << length
+           << " size 0x" << o->onode.size << " (" << std::dec
+           << o->onode.size << ")" << dendl;
+
+  if (offset >= o->onode.size) {
+    return 0;
+  }
+  if (offset + length > o->onode.size) {
+    length = o->onode.size - offset;
+  }
+  if (o->onode.has_inline_data()) {
+    bufferlist t;
+    t.substr_of(o->onode.inline_data, offset, length);
+    *digest = t.crc32c(*digest);
+    return length;
+  }
+
+  o->extent_map.fault_range(db, offset, length);
+
+  // we are verifying what's on the disk. Only dirty buffers are taken
+  // from the cache.
+  ready_regions_t ready_regions;
+  blobs2read_t blobs2read;
+  _read_cache(o, offset, length, BufferSpace::BYPASS_CLEAN_CACHE, ready_regions,
+	      blobs2read);
+
+  vector<bufferlist> compressed_blob_bls;
+  IOContext ioc(cct, NULL, true); // allow EIO
+  int r = _prepare_read_ioc(blobs2read, &compressed_blob_bls, &ioc);
+  if (r < 0)
+    return r;
+  if (ioc.has_pending_aios()) {
+    bdev->aio_submit(&ioc);
+    ioc.aio_wait();
+    r = ioc.get_return_value();
+    if (r < 0) {
+      ceph_assert(r == -EIO); // no other errors allowed
+      return -EIO;
+    }
+  }
+
+  // the crc32c (seeded with -1) and length of each region, by logical offset
+  std::map<uint64_t, std::pair<uint32_t, uint64_t>> region_crcs;
+  for (auto& [l_off, region_bl] : ready_regions) {
+    region_crcs[l_off] = {region_bl.crc32c(-1), region_bl.length()};
+  }
+
+  bool csum_error = false;
+  auto p = compressed_blob_bls.begin();
+  for (auto& [bptr, r2r] : blobs2read) {
+    const bluestore_blob_t& blob = bptr->get_blob();
+    if (blob.is_compressed()) {
+      ceph_assert(p != compressed_blob_bls.end());
+      bufferlist& compressed_bl = *p++;
+      if (_verify_csum(o, &blob, 0, compressed_bl,
+                       r2r.front().regs.front().logical_offset) < 0) {
+        csum_error = true;
+        break;
+      }
+      bufferlist raw_bl;
+      r = _decompress(compressed_bl, &raw_bl);
+      if (r < 0)
+        return r;
+      for (auto& req : r2r) {
+        for (auto& reg : req.regs) {
+          bufferlist t;
+          t.substr_of(raw_bl, reg.blob_xoffset, reg.length);
+          region_crcs[reg.logical_offset] = {t.crc32c(-1), reg.length};
+        }
+      }
+    } else {
+      for (auto& req : r2r) {
+        if (_verify_csum(o, &blob, req.r_off, req.bl,
+                         req.regs.front().logical_offset) < 0) {
+          csum_error = true;
+          break;
+        }
+        for (const auto& reg : req.regs) {
+          region_crcs[reg.logical_offset] = {
+            _verified_crc32c(blob, reg.blob_xoffset, req.bl, reg.front,
+                             reg.length),
+            reg.length};
+        }
+      }
+      if (csum_error) {
+        break;
+      }
+    }
+  }
+  if (csum_error) {
+    // see _do_read()
+    if (retry_count >= cct->_conf->bluestore_retry_disk_reads) {
+      return -EIO;
+    }
+    return _do_verify(c, o, offset, length, digest, op_flags, retry_count + 1);
+  }
+  if (retry_count) {
+    logger->inc(l_bluestore_reads_with_retries);
+    dout(5) << __func__ << " read at 0x" << std::hex << offset << "~" << length
+            << " failed " << std::dec << retry_count << " times before succeeding" << dendl;
+    stringstream s;
+    s << " reads with retries: " << logger->get(l_bluestore_reads_with_retries);
+    _set_spurious_read_errors_alert(s.str());
+  }
+
+  // chain the regions, and the holes in between
+  uint32_t crc = *digest;
+  uint64_t pos = offset;
+  for (const auto& [l_off, region] : region_crcs) {
+    const auto& [region_crc, region_len] = region;
+    ceph_assert(l_off >= pos);
+    if (l_off > pos) {
+      crc = ceph_crc32c(crc, nullptr, l_off - pos);
+    }
+    crc = region_crc ^ ceph_crc32c(crc ^ -1, nullptr, region_len);
+    pos = l_off + region_len;
+  }
+  if (pos < offset + length) {
+    crc = ceph_crc32c(crc, nullptr, offset + length - pos);
+  }
+  *digest = crc;
+  return length;
+}
+
+uint32_t BlueStore::_verified_crc32c(
+  const bluestore_blob_t& blob,
+  uint64_t b_off,
+  const bufferlist& bl,
+  uint64_t bl_off,
+  uint64_t len) const
+{
+  auto crc_of = [&bl](uint64_t off, uint64_t l, uint32_t seed) {
+    bufferlist t;
+    t.substr_of(bl, off, l);
+    return t.crc32c(seed);
+  };
+
+  if (blob.csum_type != Checksummer::CSUM_CRC32C ||
+      cct->_conf->bluestore_ignore_data_csum) {
+    return crc_of(bl_off, len, -1);
+  }
+
+  // the checksum of each full chunk is crc32c(chunk, -1)
+  const uint64_t chunk = blob.get_csum_chunk_size();
+  uint32_t crc = -1;
+  uint64_t done = std::min(len, p2nphase(b_off, chunk));
+  if (done) {
+    crc = crc_of(bl_off, done, crc);
+  }
+  while (len - done >= chunk) {
+    uint32_t chunk_crc = blob.get_csum_item((b_off + done) / chunk);
+    crc = chunk_crc ^ ceph_crc32c(crc ^ -1, nullptr, chunk);
+    done += chunk;
+  }
+  if (done < len) {
+    crc = crc_of(bl_off + done, len - done, crc);
+  }
+  return crc;
+}
+
 int BlueStore::_verify_csum(OnodeRef& o,
 			    const bluestore_blob_t* blob, uint64_t blob_xoffset,
 			    const bufferlist& bl,
@@ -10113,6 +11439,12 @@ int BlueStore::_fiemap(
     if (offset + length > o->onode.size) {
       length = o->onode.size - offset;
     }
+    if (o->onode.has_inline_data()) {
+      destset.insert(offset, length);
+      offset += length;
+      length = 0;
+      goto out;
+    }
 
     o->extent_map.fault_range(db, offset, length);
     eend = o->extent_map.extent_map.end();
@@ -10281,6 +11613,14 @@ int BlueStore::_do_readv(
   // call fiemap first!
   ceph_assert(m.range_start() <= o->onode.size);
   ceph_assert(m.range_end() <= o->onode.size);
+  if (o->onode.has_inline_data()) {
+    for (auto p = m.begin(); p != m.end(); ++p) {
+      bufferlist t;
+      t.substr_of(o->onode.inline_data, p.get_start(), p.get_len());
+      bl.claim_append(t);
+    }
+    return bl.length();
+  }
   auto start = mono_clock::now();
   o->extent_map.fault_range(db, m.range_start(), m.range_end() - m.range_start());
   log_latency(__func__,
@@ -10323,6 +11663,7 @@ int BlueStore::_do_readv(
   );
 
   ceph_assert(raw_results.size() == (size_t)m.num_intervals());
+  uint64_t copied = 0;
   i = 0;
   for (auto p = m.begin(); p != m.end(); p++, i++) {
     bool csum_error = false;
@@ -10331,7 +11672,7 @@ int BlueStore::_do_readv(
                                  std::get<0>(raw_results[i]),
                                  std::get<1>(raw_results[i]),
                                  std::get<2>(raw_results[i]),
-                                 buffered, &csum_error, t);
+                                 buffered, &csum_error, t, &copied);
     if (csum_error) {
       // Handles spurious read errors caused by a kernel bug.
       // We sometimes get all-zero pages as a result of the read under
@@ -10345,6 +11686,7 @@ int BlueStore::_do_readv(
     }
     bl.claim_append(t);
   }
+  logger->inc(l_bluestore_read_copied_bytes, copied);
   if (retry_count) {
     logger->inc(l_bluestore_reads_with_retries);
     dout(5) << __func__ << " read fiemap " << m
@@ -11019,6 +12361,7 @@ void BlueStore::_prepare_ondisk_format_super(KeyValueDB::Transaction& t)
 {
   dout(10) << __func__ << " ondisk_format " << ondisk_format
 	   << " min_compat_ondisk_format " << min_compat_ondisk_format
+	   << " stored " << stored_compat_ondisk_format
 	   << dendl;
   ceph_assert(ondisk_format == latest_ondisk_format);
   {
@@ -11027,8 +12370,11 @@ void BlueStore::_prepare_ondisk_format_super(KeyValueDB::Transaction& t)
     t->set(PREFIX_SUPER, "ondisk_format", bl);
   }
   {
+    // keep what was raised for the records written already
+    int32_t compat = std::max<int32_t>(min_compat_ondisk_format,
+				       stored_compat_ondisk_format);
     bufferlist bl;
-    encode(min_compat_ondisk_format, bl);
+    encode(compat, bl);
     t->set(PREFIX_SUPER, "min_compat_ondisk_format", bl);
   }
 }
@@ -11126,6 +12472,7 @@ int BlueStore::_open_super_meta()
 	 << latest_ondisk_format << dendl;
     return -EPERM;
   }
+  stored_compat_ondisk_format = compat_ondisk_format;
 
   {
     bufferlist bl;
@@ -11208,6 +12555,20 @@ int BlueStore::_upgrade_super()
       ceph_assert(r == 0);
       ondisk_format = 4;
     }
+    if (ondisk_format == 4) {
+      // changes:
+      // - onode may hold the object's data (FLAG_INLINE_DATA). The
+      //   min_compat_ondisk_format is only raised once the first such onode
+      //   is written.
+      ondisk_format = 5;
+    }
+    if (ondisk_format == 5) {
+      // changes:
+      // - shared blob records may have refs merged into them
+      //   (bluestore_shared_blob_merge_refs). The min_compat_ondisk_format
+      //   is only raised once the first such ref is written.
+      ondisk_format = 6;
+    }
     // This to be the last operation
     _prepare_ondisk_format_super(t);
     int r = db->submit_transaction_sync(t);
@@ -11239,6 +12600,26 @@ uint64_t BlueStore::_assign_blobid(TransContext *txc)
   return bid;
 }
 
+bluestore_extent_ref_map_t *BlueStore::_merge_shared_blob_refs(
+  TransContext *txc,
+  SharedBlobRef& sb)
+{
+  ceph_assert(!sb->is_loaded());
+  auto p = txc->shared_blob_refs.find(sb);
+  if (p != txc->shared_blob_refs.end()) {
+    return &p->second;
+  }
+  if (!cct->_conf->bluestore_shared_blob_merge_refs ||
+      !_require_compat_ondisk_format(shared_blob_merge_compat_ondisk_format)) {
+    return nullptr;
+  }
+  dout(20) << __func__ << " sbid 0x" << std::hex << sb->get_sbid() << std::dec
+	   << dendl;
+  std::lock_guard l(shared_blob_merge_lock);
+  shared_blob_merges[sb->get_sbid()].push_back(txc);
+  return &txc->shared_blob_refs[sb];
+}
+
 void BlueStore::get_db_statistics(Formatter *f)
 {
   db->get_statistics(f);
@@ -11379,7 +12760,21 @@ void BlueStore::_txc_state_proc(TransContext *txc)
 	  _txc_apply_kv(txc, true);
 	}
       }
-      {
+      if (KVSyncShard *shard = _get_kv_sync_shard(txc->osr.get())) {
+	std::lock_guard l(shard->lock);
+	shard->queue.push_back(txc);
+	if (!shard->in_progress) {
+	  shard->in_progress = true;
+	  shard->cond.notify_one();
+	}
+	if (txc->get_state() != TransContext::STATE_KV_SUBMITTED) {
+	  shard->queue_unsubmitted.push_back(txc);
+	  ++txc->osr->kv_committing_serially;
+	}
+	if (txc->had_ios)
+	  shard->ios++;
+	shard->throttle_costs += txc->cost;
+      } else {
 	std::lock_guard l(kv_lock);
 	kv_queue.push_back(txc);
 	if (!kv_sync_in_progress) {
@@ -11508,6 +12903,30 @@ void BlueStore::_txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t)
       t->set(PREFIX_SHARED_BLOB, key, bl);
     }
   }
+  for (auto& [sb, refs] : txc->shared_blob_refs) {
+    string key;
+    auto sbid = sb->get_sbid();
+    get_shared_blob_key(sbid, &key);
+    bluestore_shared_blob_t merged(sbid);
+    merged.ref_map = refs;
+    bufferlist bl;
+    encode(merged, bl);
+    dout(20) << __func__ << " shared_blob 0x" << std::hex << sbid << std::dec
+	     << " merging " << refs << dendl;
+    t->merge(PREFIX_SHARED_BLOB, key, bl);
+  }
+}
+
+void BlueStore::_txc_journal_deferred(TransContext *txc)
+{
+  if (txc->deferred_txn) {
+    txc->deferred_txn->seq = ++deferred_seq;
+    bufferlist bl;
+    encode(*txc->deferred_txn, bl);
+    string key;
+    get_deferred_key(txc->deferred_txn->seq, &key);
+    txc->t->set(PREFIX_DEFERRED, key, bl);
+  }
 }
 
 void BlueStore::BSPerfTracker::update_from_perfcounters(
@@ -11607,42 +13026,46 @@ void BlueStore::_txc_finalize_kv(TransContext *txc, KeyValueDB::Transaction t)
 	   << " released 0x" << txc->released
 	   << std::dec << dendl;
 
-  // We have to handle the case where we allocate *and* deallocate the
-  // same region in this transaction.  The freelist doesn't like that.
-  // (Actually, the only thing that cares is the BitmapFreelistManager
-  // debug check. But that's important.)
-  interval_set<uint64_t> tmp_allocated, tmp_released;
-  interval_set<uint64_t> *pallocated = &txc->allocated;
-  interval_set<uint64_t> *preleased = &txc->released;
-  if (!txc->allocated.empty() && !txc->released.empty()) {
-    interval_set<uint64_t> overlap;
-    overlap.intersection_of(txc->allocated, txc->released);
-    if (!overlap.empty()) {
-      tmp_allocated = txc->allocated;
-      tmp_allocated.subtract(overlap);
-      tmp_released = txc->released;
-      tmp_released.subtract(overlap);
-      dout(20) << __func__ << "  overlap 0x" << std::hex << overlap
-	       << ", new allocated 0x" << tmp_allocated
-	       << " released 0x" << tmp_released << std::dec
-	       << dendl;
-      pallocated = &tmp_allocated;
-      preleased = &tmp_released;
+  // the allocations are not tracked in the kv store once the allocator
+  // state is persisted in a snapshot
+  if (!fm->is_null_manager()) {
+    // We have to handle the case where we allocate *and* deallocate the
+    // same region in this transaction.  The freelist doesn't like that.
+    // (Actually, the only thing that cares is the BitmapFreelistManager
+    // debug check. But that's important.)
+    interval_set<uint64_t> tmp_allocated, tmp_released;
+    interval_set<uint64_t> *pallocated = &txc->allocated;
+    interval_set<uint64_t> *preleased = &txc->released;
+    if (!txc->allocated.empty() && !txc->released.empty()) {
+      interval_set<uint64_t> overlap;
+      overlap.intersection_of(txc->allocated, txc->released);
+      if (!overlap.empty()) {
+	tmp_allocated = txc->allocated;
+	tmp_allocated.subtract(overlap);
+	tmp_released = txc->released;
+	tmp_released.subtract(overlap);
+	dout(20) << __func__ << "  overlap 0x" << std::hex << overlap
+		 << ", new allocated 0x" << tmp_allocated
+		 << " released 0x" << tmp_released << std::dec
+		 << dendl;
+	pallocated = &tmp_allocated;
+	preleased = &tmp_released;
+      }
     }
-  }
 
-  // update freelist with non-overlap sets
-  for (interval_set<uint64_t>::iterator p = pallocated->begin();
-       p != pallocated->end();
-       ++p) {
-    fm->allocate(p.get_start(), p.get_len(), t);
-  }
-  for (interval_set<uint64_t>::iterator p = preleased->begin();
-       p != preleased->end();
-       ++p) {
-    dout(20) << __func__ << " release 0x" << std::hex << p.get_start()
-	     << "~" << p.get_len() << std::dec << dendl;
-    fm->release(p.get_start(), p.get_len(), t);
+    // update freelist with non-overlap sets
+    for (interval_set<uint64_t>::iterator p = pallocated->begin();
+	 p != pallocated->end();
+	 ++p) {
+      fm->allocate(p.get_start(), p.get_len(), t);
+    }
+    for (interval_set<uint64_t>::iterator p = preleased->begin();
+	 p != preleased->end();
+	 ++p) {
+      dout(20) << __func__ << " release 0x" << std::hex << p.get_start()
+	       << "~" << p.get_len() << std::dec << dendl;
+      fm->release(p.get_start(), p.get_len(), t);
+    }
   }
 
 #ifdef HAVE_LIBZBD
@@ -11668,11 +13091,33 @@ void BlueStore::_txc_apply_kv(TransContext *txc, bool sync_submit_transaction)
     }
 #endif
 
-    int r = cct->_conf->bluestore_debug_omit_kv_commit ? 0 : db->submit_transaction(txc->t);
-    ceph_assert(r == 0);
-    txc->set_state(TransContext::STATE_KV_SUBMITTED);
-    if (txc->osr->kv_submitted_waiters) {
-      std::lock_guard l(txc->osr->qlock);
+    int r = 0;
+    if (txc->shared_blob_refs.empty()) {
+      if (!cct->_conf->bluestore_debug_omit_kv_commit) {
+	r = db->submit_transaction(txc->t);
+      }
+    } else {
+      // the merged refs are either in the records loaded, or added to them
+      // (see Collection::load_shared_blobs)
+      std::lock_guard l(shared_blob_merge_lock);
+      if (!cct->_conf->bluestore_debug_omit_kv_commit) {
+	r = db->submit_transaction(txc->t);
+      }
+      for (auto& [sb, refs] : txc->shared_blob_refs) {
+	auto p = shared_blob_merges.find(sb->get_sbid());
+	ceph_assert(p != shared_blob_merges.end());
+	auto& txcs = p->second;
+	txcs.erase(std::find(txcs.begin(), txcs.end(), txc));
+	if (txcs.empty()) {
+	  shared_blob_merges.erase(p);
+	}
+      }
+      txc->shared_blob_refs.clear();
+    }
+    ceph_assert(r == 0);
+    txc->set_state(TransContext::STATE_KV_SUBMITTED);
+    if (txc->osr->kv_submitted_waiters) {
+      std::lock_guard l(txc->osr->qlock);
       txc->osr->qcond.notify_all();
     }
 
@@ -11996,11 +13441,44 @@ void BlueStore::_kv_start()
   finisher.start();
   kv_sync_thread.create("bstore_kv_sync");
   kv_finalize_thread.create("bstore_kv_final");
+
+  ceph_assert(kv_sync_shards.empty());
+  unsigned num_shards = cct->_conf->bluestore_kv_sync_shards;
+  for (unsigned i = 1; i < num_shards; ++i) {
+    auto shard = std::make_unique<KVSyncShard>(this, i);
+    shard->sync_thread.create(("bstore_kvsync" + std::to_string(i)).c_str());
+    shard->finalize_thread.create(("bstore_kvfin" + std::to_string(i)).c_str());
+    kv_sync_shards.push_back(std::move(shard));
+  }
+  if (!kv_sync_shards.empty()) {
+    dout(10) << __func__ << " " << num_shards << " kv pipelines" << dendl;
+  }
 }
 
 void BlueStore::_kv_stop()
 {
   dout(10) << __func__ << dendl;
+  for (auto& shard : kv_sync_shards) {
+    {
+      std::unique_lock l{shard->lock};
+      while (!shard->started) {
+	shard->cond.wait(l);
+      }
+      shard->stop = true;
+      shard->cond.notify_all();
+    }
+    {
+      std::unique_lock l{shard->finalize_lock};
+      while (!shard->finalize_started) {
+	shard->finalize_cond.wait(l);
+      }
+      shard->finalize_stop = true;
+      shard->finalize_cond.notify_all();
+    }
+    shard->sync_thread.join();
+    shard->finalize_thread.join();
+  }
+  kv_sync_shards.clear();
   {
     std::unique_lock l{kv_lock};
     while (!kv_sync_started) {
@@ -12064,7 +13542,7 @@ void BlueStore::_kv_sync_thread()
     ceph_assert(kv_committing.empty());
     if (kv_queue.empty() &&
 	((deferred_done_queue.empty() && deferred_stable_queue.empty()) ||
-	 !deferred_aggressive)) {
+	 (!deferred_aggressive && kv_sync_shards.empty()))) {
       if (kv_stop)
 	break;
       dout(20) << __func__ << " sleep" << dendl;
@@ -12144,23 +13622,27 @@ void BlueStore::_kv_sync_thread()
       // it.  in either case, we increase the max in the earlier txn
       // we submit.
       uint64_t new_nid_max = 0, new_blobid_max = 0;
-      if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max) {
-	KeyValueDB::Transaction t =
-	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
-	bufferlist bl;
-	encode(new_nid_max, bl);
-	t->set(PREFIX_SUPER, "nid_max", bl);
-	dout(10) << __func__ << " new_nid_max " << new_nid_max << dendl;
-      }
-      if (blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
-	KeyValueDB::Transaction t =
-	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
-	bufferlist bl;
-	encode(new_blobid_max, bl);
-	t->set(PREFIX_SUPER, "blobid_max", bl);
-	dout(10) << __func__ << " new_blobid_max " << new_blobid_max << dendl;
+      if (!kv_sync_shards.empty()) {
+	_kv_preallocate_ids(&new_nid_max, &new_blobid_max);
+      } else {
+	if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max) {
+	  KeyValueDB::Transaction t =
+	    kv_submitting.empty() ? synct : kv_submitting.front()->t;
+	  new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
+	  bufferlist bl;
+	  encode(new_nid_max, bl);
+	  t->set(PREFIX_SUPER, "nid_max", bl);
+	  dout(10) << __func__ << " new_nid_max " << new_nid_max << dendl;
+	}
+	if (blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
+	  KeyValueDB::Transaction t =
+	    kv_submitting.empty() ? synct : kv_submitting.front()->t;
+	  new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
+	  bufferlist bl;
+	  encode(new_blobid_max, bl);
+	  t->set(PREFIX_SUPER, "blobid_max", bl);
+	  dout(10) << __func__ << " new_blobid_max " << new_blobid_max << dendl;
+	}
       }
 
       for (auto txc : kv_committing) {
@@ -12258,14 +13740,7 @@ void BlueStore::_kv_sync_thread()
 	}
       }
 
-      if (new_nid_max) {
-	nid_max = new_nid_max;
-	dout(10) << __func__ << " nid_max now " << nid_max << dendl;
-      }
-      if (new_blobid_max) {
-	blobid_max = new_blobid_max;
-	dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
-      }
+      _kv_raise_ids_max(new_nid_max, new_blobid_max);
 
       {
 	auto finish = mono_clock::now();
@@ -12348,12 +13823,7 @@ void BlueStore::_kv_finalize_thread()
       }
       deferred_stable.clear();
 
-      if (!deferred_aggressive) {
-	if (deferred_queue_size >= deferred_batch_ops.load() ||
-	    throttle.should_submit_deferred()) {
-	  deferred_try_submit();
-	}
-      }
+      _deferred_maybe_submit();
 
       // this is as good a place as any ...
       _reap_collections();
@@ -12369,89 +13839,748 @@ void BlueStore::_kv_finalize_thread()
       l.lock();
     }
   }
-  dout(10) << __func__ << " finish" << dendl;
-  kv_finalize_started = false;
-}
+  dout(10) << __func__ << " finish" << dendl;
+  kv_finalize_started = false;
+}
+
+BlueStore::KVSyncShard *BlueStore::_get_kv_sync_shard(const OpSequencer *osr)
+{
+  if (kv_sync_shards.empty()) {
+    return nullptr;
+  }
+  unsigned n = osr->get_sequencer_id() % (kv_sync_shards.size() + 1);
+  return n ? kv_sync_shards[n - 1].get() : nullptr;
+}
+
+// With several kv pipelines, a {nid,blobid}_max update can't ride along
+// with the first txc being submitted: another pipeline could submit a
+// larger max before it, and have it overwritten.  The updates are thus
+// submitted on their own, in order, before the txcs of the calling
+// pipeline.  The in-memory max is only raised once the update is stable
+// (see _kv_raise_ids_max()), so the txcs of other pipelines using ids past
+// it keep being submitted by their own kv thread, after its own update.
+void BlueStore::_kv_preallocate_ids(uint64_t *new_nid_max,
+				    uint64_t *new_blobid_max)
+{
+  std::lock_guard l(kv_id_max_lock);
+  KeyValueDB::Transaction t = db->get_transaction();
+  if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max) {
+    *new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
+    bufferlist bl;
+    encode(*new_nid_max, bl);
+    t->set(PREFIX_SUPER, "nid_max", bl);
+    dout(10) << __func__ << " new_nid_max " << *new_nid_max << dendl;
+  }
+  if (blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
+    *new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
+    bufferlist bl;
+    encode(*new_blobid_max, bl);
+    t->set(PREFIX_SUPER, "blobid_max", bl);
+    dout(10) << __func__ << " new_blobid_max " << *new_blobid_max << dendl;
+  }
+  if (*new_nid_max || *new_blobid_max) {
+    int r = db->submit_transaction(t);
+    ceph_assert(r == 0);
+  }
+}
+
+void BlueStore::_kv_raise_ids_max(uint64_t new_nid_max,
+				  uint64_t new_blobid_max)
+{
+  if (!new_nid_max && !new_blobid_max) {
+    return;
+  }
+  std::lock_guard l(kv_id_max_lock);
+  if (new_nid_max > nid_max) {
+    nid_max = new_nid_max;
+    dout(10) << __func__ << " nid_max now " << nid_max << dendl;
+  }
+  if (new_blobid_max > blobid_max) {
+    blobid_max = new_blobid_max;
+    dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
+  }
+}
+
+void BlueStore::_kv_shard_sync_thread(KVSyncShard *shard)
+{
+  dout(10) << __func__ << " " << shard->id << " start" << dendl;
+  std::unique_lock l{shard->lock};
+  ceph_assert(!shard->started);
+  shard->started = true;
+  shard->cond.notify_all();
+
+  while (true) {
+    if (shard->queue.empty()) {
+      if (shard->stop)
+	break;
+      dout(20) << __func__ << " " << shard->id << " sleep" << dendl;
+      shard->in_progress = false;
+      shard->cond.wait(l);
+      dout(20) << __func__ << " " << shard->id << " wake" << dendl;
+    } else {
+      deque<TransContext*> kv_committing, kv_submitting;
+      dout(20) << __func__ << " " << shard->id
+	       << " committing " << shard->queue.size()
+	       << " submitting " << shard->queue_unsubmitted.size()
+	       << dendl;
+      kv_committing.swap(shard->queue);
+      kv_submitting.swap(shard->queue_unsubmitted);
+      uint64_t aios = shard->ios;
+      uint64_t costs = shard->throttle_costs;
+      shard->ios = 0;
+      shard->throttle_costs = 0;
+      l.unlock();
+
+      dout(30) << __func__ << " committing " << kv_committing << dendl;
+      dout(30) << __func__ << " submitting " << kv_submitting << dendl;
+
+      auto start = mono_clock::now();
+      // deferred ios are left to pipeline 0, we only have to make
+      // our own txcs' data stable.
+      if (aios) {
+	dout(20) << __func__ << " " << shard->id << " num_aios=" << aios
+		 << ", flushing" << dendl;
+	bdev->flush();
+      }
+      auto after_flush = mono_clock::now();
+
+      uint64_t new_nid_max = 0, new_blobid_max = 0;
+      _kv_preallocate_ids(&new_nid_max, &new_blobid_max);
+
+      for (auto txc : kv_committing) {
+	throttle.log_state_latency(*txc, logger, l_bluestore_state_kv_queued_lat);
+	if (txc->get_state() == TransContext::STATE_KV_QUEUED) {
+	  _txc_apply_kv(txc, false);
+	  --txc->osr->kv_committing_serially;
+	} else {
+	  ceph_assert(txc->get_state() == TransContext::STATE_KV_SUBMITTED);
+	}
+	if (txc->had_ios) {
+	  --txc->osr->txc_with_unstable_io;
+	}
+      }
+
+      throttle.release_kv_throttle(costs);
+
+      KeyValueDB::Transaction synct = db->get_transaction();
+      int r = cct->_conf->bluestore_debug_omit_kv_commit ? 0 : db->submit_transaction_sync(synct);
+      ceph_assert(r == 0);
+
+      int committing_size = kv_committing.size();
+      {
+	std::lock_guard m{shard->finalize_lock};
+	shard->committing_to_finalize.insert(
+	  shard->committing_to_finalize.end(),
+	  kv_committing.begin(),
+	  kv_committing.end());
+	kv_committing.clear();
+	if (!shard->finalize_in_progress) {
+	  shard->finalize_in_progress = true;
+	  shard->finalize_cond.notify_one();
+	}
+      }
+
+      _kv_raise_ids_max(new_nid_max, new_blobid_max);
+
+      {
+	auto finish = mono_clock::now();
+	ceph::timespan dur_flush = after_flush - start;
+	ceph::timespan dur_kv = finish - after_flush;
+	ceph::timespan dur = finish - start;
+	dout(20) << __func__ << " " << shard->id
+	  << " committed " << committing_size
+	  << " in " << dur
+	  << " (" << dur_flush << " flush + " << dur_kv << " kv commit)"
+	  << dendl;
+	log_latency("kv_flush",
+	  l_bluestore_kv_flush_lat,
+	  dur_flush,
+	  cct->_conf->bluestore_log_op_age);
+	log_latency("kv_commit",
+	  l_bluestore_kv_commit_lat,
+	  dur_kv,
+	  cct->_conf->bluestore_log_op_age);
+	log_latency("kv_sync",
+	  l_bluestore_kv_sync_lat,
+	  dur,
+	  cct->_conf->bluestore_log_op_age);
+      }
+
+      l.lock();
+    }
+  }
+  dout(10) << __func__ << " " << shard->id << " finish" << dendl;
+  shard->started = false;
+}
+
+void BlueStore::_kv_shard_finalize_thread(KVSyncShard *shard)
+{
+  deque<TransContext*> kv_committed;
+  dout(10) << __func__ << " " << shard->id << " start" << dendl;
+  std::unique_lock l(shard->finalize_lock);
+  ceph_assert(!shard->finalize_started);
+  shard->finalize_started = true;
+  shard->finalize_cond.notify_all();
+  while (true) {
+    ceph_assert(kv_committed.empty());
+    if (shard->committing_to_finalize.empty()) {
+      if (shard->finalize_stop)
+	break;
+      dout(20) << __func__ << " " << shard->id << " sleep" << dendl;
+      shard->finalize_in_progress = false;
+      shard->finalize_cond.wait(l);
+      dout(20) << __func__ << " " << shard->id << " wake" << dendl;
+    } else {
+      kv_committed.swap(shard->committing_to_finalize);
+      l.unlock();
+      dout(20) << __func__ << " kv_committed " << kv_committed << dendl;
+
+      auto start = mono_clock::now();
+
+      while (!kv_committed.empty()) {
+	TransContext *txc = kv_committed.front();
+	ceph_assert(txc->get_state() == TransContext::STATE_KV_SUBMITTED);
+	_txc_state_proc(txc);
+	kv_committed.pop_front();
+      }
+
+      _deferred_maybe_submit();
+
+      _reap_collections();
+
+      log_latency("kv_final",
+	l_bluestore_kv_final_lat,
+	mono_clock::now() - start,
+	cct->_conf->bluestore_log_op_age);
+
+      l.lock();
+    }
+  }
+  dout(10) << __func__ << " " << shard->id << " finish" << dendl;
+  shard->finalize_started = false;
+}
+
+#ifdef HAVE_LIBZBD
+void BlueStore::_zoned_cleaner_start() {
+  dout(10) << __func__ << dendl;
+
+  auto f = dynamic_cast<ZonedFreelistManager*>(fm);
+  ceph_assert(f);
+
+  auto zones_to_clean = f->get_cleaning_in_progress_zones(db);
+  if (!zones_to_clean.empty()) {
+    dout(10) << __func__ << " resuming cleaning after unclean shutdown." << dendl;
+    for (auto zone_num : zones_to_clean) {
+      _zoned_clean_zone(zone_num);
+    }
+    bdev->reset_zones(zones_to_clean);
+    f->mark_zones_to_clean_free(zones_to_clean, db);
+  }
+
+  zoned_cleaner_thread.create("bstore_zcleaner");
+}
+
+void BlueStore::_zoned_cleaner_stop() {
+  dout(10) << __func__ << dendl;
+  {
+    std::unique_lock l{zoned_cleaner_lock};
+    while (!zoned_cleaner_started) {
+      zoned_cleaner_cond.wait(l);
+    }
+    zoned_cleaner_stop = true;
+    zoned_cleaner_cond.notify_all();
+  }
+  zoned_cleaner_thread.join();
+  {
+    std::lock_guard l{zoned_cleaner_lock};
+    zoned_cleaner_stop = false;
+  }
+  dout(10) << __func__ << " done" << dendl;
+}
+
+void BlueStore::_zoned_cleaner_thread() {
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock l{zoned_cleaner_lock};
+  ceph_assert(!zoned_cleaner_started);
+  zoned_cleaner_started = true;
+  zoned_cleaner_cond.notify_all();
+  auto a = dynamic_cast<ZonedAllocator*>(shared_alloc.a);
+  ceph_assert(a);
+  auto f = dynamic_cast<ZonedFreelistManager*>(fm);
+  ceph_assert(f);
+  while (true) {
+    const auto *zones_to_clean = a->get_zones_to_clean();
+    if (!zones_to_clean) {
+      if (zoned_cleaner_stop) {
+	break;
+      }
+      dout(20) << __func__ << " sleep" << dendl;
+      zoned_cleaner_cond.wait(l);
+      dout(20) << __func__ << " wake" << dendl;
+    } else {
+      l.unlock();
+      f->mark_zones_to_clean_in_progress(*zones_to_clean, db);
+      for (auto zone_num : *zones_to_clean) {
+	_zoned_clean_zone(zone_num);
+      }
+      bdev->reset_zones(*zones_to_clean);
+      f->mark_zones_to_clean_free(*zones_to_clean, db);
+      a->mark_zones_to_clean_free();
+      l.lock();
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+  zoned_cleaner_started = false;
+}
+
+void BlueStore::_zoned_clean_zone(uint64_t zone_num) {
+  dout(10) << __func__ << " cleaning zone " << zone_num << dendl;
+  // TODO: (1) copy live objects from zone_num to a new zone, (2) issue a RESET
+  // ZONE operation to the device for the corresponding zone.
+}
+#endif
+
+// =======================================================
+// defragmentation
+
+class BlueStore::DefragSocketHook : public AdminSocketHook {
+  BlueStore *store;
+public:
+  static DefragSocketHook* create(BlueStore *store)
+  {
+    DefragSocketHook *hook = nullptr;
+    AdminSocket *admin_socket = store->cct->get_admin_socket();
+    if (admin_socket) {
+      hook = new DefragSocketHook(store);
+      int r = admin_socket->register_command(
+	"bluestore defrag status", hook,
+	"show the progress of the current (or last) defragmentation pass");
+      if (r != 0) {
+	// another store of this process has them
+	delete hook;
+	return nullptr;
+      }
+      r = admin_socket->register_command(
+	"bluestore defrag start", hook,
+	"start a defragmentation pass, regardless of the fragmentation");
+      ceph_assert(r == 0);
+    }
+    return hook;
+  }
+  ~DefragSocketHook() {
+    AdminSocket *admin_socket = store->cct->get_admin_socket();
+    admin_socket->unregister_commands(this);
+  }
+private:
+  explicit DefragSocketHook(BlueStore *store) : store(store) {}
+  int call(std::string_view command, const cmdmap_t& cmdmap,
+	   Formatter *f,
+	   std::ostream& ss,
+	   bufferlist& out) override {
+    if (command == "bluestore defrag status") {
+      store->dump_defrag_status(f);
+    } else if (command == "bluestore defrag start") {
+      store->request_defrag();
+      f->open_object_section("defrag");
+      f->dump_bool("requested", true);
+      f->close_section();
+    } else {
+      ss << "Invalid command" << std::endl;
+      return -ENOSYS;
+    }
+    return 0;
+  }
+};
+
+void BlueStore::defrag_progress_t::dump(Formatter *f) const
+{
+  f->dump_bool("running", running);
+  f->dump_stream("started") << started;
+  f->dump_stream("finished") << finished;
+  f->dump_float("fragmentation_score", fragmentation_score);
+  f->dump_stream("collection") << cid;
+  f->dump_unsigned("onodes_scanned", onodes_scanned);
+  f->dump_unsigned("onodes_rewritten", onodes_rewritten);
+  f->dump_unsigned("bytes_rewritten", bytes_rewritten);
+  f->dump_unsigned("extents_before", extents_before);
+  f->dump_unsigned("extents_after", extents_after);
+}
+
+void BlueStore::request_defrag()
+{
+  std::lock_guard l{defrag_lock};
+  defrag_requested = true;
+  defrag_cond.notify_all();
+}
+
+void BlueStore::dump_defrag_status(Formatter *f)
+{
+  std::lock_guard l{defrag_lock};
+  f->open_object_section("defrag");
+  defrag_progress.dump(f);
+  f->close_section();
+}
+
+void BlueStore::_defrag_start()
+{
+  if (!cct->_conf->bluestore_defrag) {
+    return;
+  }
+  if (bdev->is_smr()) {
+    // zoned devices are cleaned instead
+    return;
+  }
+  dout(10) << __func__ << dendl;
+  defrag_asok_hook = DefragSocketHook::create(this);
+  defrag_thread.create("bstore_defrag");
+}
+
+void BlueStore::_defrag_stop()
+{
+  if (!defrag_thread.is_started()) {
+    return;
+  }
+  dout(10) << __func__ << dendl;
+  delete defrag_asok_hook;
+  defrag_asok_hook = nullptr;
+  {
+    std::lock_guard l{defrag_lock};
+    defrag_stop = true;
+    defrag_cond.notify_all();
+  }
+  defrag_thread.join();
+  {
+    std::lock_guard l{defrag_lock};
+    defrag_stop = false;
+    defrag_requested = false;
+  }
+  dout(10) << __func__ << " done" << dendl;
+}
+
+void BlueStore::_defrag_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock l{defrag_lock};
+  while (!defrag_stop) {
+    if (!defrag_requested) {
+      defrag_cond.wait_for(
+	l, ceph::make_timespan(cct->_conf->bluestore_defrag_check_interval));
+      if (defrag_stop) {
+	continue;
+      }
+    }
+    bool requested = defrag_requested;
+    defrag_requested = false;
+    l.unlock();
+    double score = shared_alloc.a->get_fragmentation_score();
+    double threshold = cct->_conf->bluestore_defrag_fragmentation_threshold;
+    dout(10) << __func__ << " fragmentation score " << score
+	     << (requested ? ", requested" : "") << dendl;
+    if (requested || score >= threshold) {
+      _defrag_pass(score);
+    }
+    l.lock();
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void BlueStore::_defrag_pass(double score)
+{
+  dout(1) << __func__ << " start, fragmentation score " << score << dendl;
+  {
+    std::lock_guard l{defrag_lock};
+    defrag_progress = defrag_progress_t();
+    defrag_progress.running = true;
+    defrag_progress.started = ceph_clock_now();
+    defrag_progress.fragmentation_score = score;
+  }
+
+  std::vector<CollectionRef> colls;
+  {
+    std::shared_lock l(coll_lock);
+    for (auto& [cid, c] : coll_map) {
+      colls.push_back(c);
+    }
+  }
+  for (auto& c : colls) {
+    {
+      std::lock_guard l{defrag_lock};
+      defrag_progress.cid = c->cid;
+    }
+    CollectionHandle ch = c;
+    ghobject_t next;
+    while (true) {
+      std::vector<ghobject_t> ls;
+      int r = collection_list(ch, next, ghobject_t::get_max(),
+			      cct->_conf->bluestore_defrag_list_batch,
+			      &ls, &next);
+      if (r < 0 || ls.empty()) {
+	break;
+      }
+      for (auto& oid : ls) {
+	{
+	  std::lock_guard l{defrag_lock};
+	  if (defrag_stop) {
+	    goto out;
+	  }
+	}
+	_defrag_onode(c, oid);
+      }
+      if (next.is_max()) {
+	break;
+      }
+    }
+  }
 
-#ifdef HAVE_LIBZBD
-void BlueStore::_zoned_cleaner_start() {
-  dout(10) << __func__ << dendl;
+ out:
+  std::lock_guard l{defrag_lock};
+  defrag_progress.running = false;
+  defrag_progress.finished = ceph_clock_now();
+  dout(1) << __func__ << " finish, rewrote "
+	  << defrag_progress.onodes_rewritten << "/"
+	  << defrag_progress.onodes_scanned << " onodes, "
+	  << defrag_progress.bytes_rewritten << " bytes, "
+	  << defrag_progress.extents_before << " extents to "
+	  << defrag_progress.extents_after << dendl;
+}
 
-  auto f = dynamic_cast<ZonedFreelistManager*>(fm);
-  ceph_assert(f);
+bool BlueStore::_defrag_wait(uint64_t bytes)
+{
+  std::unique_lock l{defrag_lock};
+  uint64_t rate = cct->_conf->bluestore_defrag_max_bytes_per_sec;
+  if (bytes && rate && !defrag_stop) {
+    defrag_cond.wait_for(l, ceph::make_timespan((double)bytes / rate));
+  }
+  // only rewrite while no transaction is in flight
+  while (!defrag_stop && !throttle.is_kv_idle()) {
+    defrag_cond.wait_for(l, std::chrono::milliseconds(100));
+  }
+  return !defrag_stop;
+}
 
-  auto zones_to_clean = f->get_cleaning_in_progress_zones(db);
-  if (!zones_to_clean.empty()) {
-    dout(10) << __func__ << " resuming cleaning after unclean shutdown." << dendl;
-    for (auto zone_num : zones_to_clean) {
-      _zoned_clean_zone(zone_num);
+bool BlueStore::_defrag_check(OnodeRef& o, interval_set<uint64_t> *ranges,
+			      uint64_t *extents)
+{
+  o->extent_map.fault_range(db, 0, o->onode.size);
+  *extents = 0;
+  uint64_t end = 0;
+  for (auto& e : o->extent_map.extent_map) {
+    const bluestore_blob_t& b = e.blob->get_blob();
+    if (b.is_compressed() || b.is_shared()) {
+      // rewriting would inflate them
+      return false;
     }
-    bdev->reset_zones(zones_to_clean);
-    f->mark_zones_to_clean_free(zones_to_clean, db);
+    ranges->union_insert(e.logical_offset, e.length);
+    b.map(e.blob_offset, e.length, [&](uint64_t offset, uint64_t length) {
+      if (!*extents || offset != end) {
+	++(*extents);
+      }
+      end = offset + length;
+      return 0;
+    });
   }
+  return true;
+}
 
-  zoned_cleaner_thread.create("bstore_zcleaner");
+bool BlueStore::_defrag_owns(Collection *c, const ghobject_t& oid)
+{
+  // a split or merge may have moved the object away since it was listed
+  if (!c->contains(oid)) {
+    return false;
+  }
+  std::shared_lock l(coll_lock);
+  auto p = coll_map.find(c->cid);
+  return c->exists && p != coll_map.end() && p->second == c;
 }
 
-void BlueStore::_zoned_cleaner_stop() {
-  dout(10) << __func__ << dendl;
+void BlueStore::_defrag_discard(TransContext *txc, OnodeRef& o)
+{
+  // nothing has been submitted yet: hand the new extents back and keep the
+  // old ones
+  if (!txc->allocated.empty()) {
+    shared_alloc.a->release(txc->allocated);
+    txc->allocated.clear();
+  }
+  txc->released.clear();
+  txc->statfs_delta.reset();
+  txc->ioc.pending_aios.clear();
+  txc->ioc.num_pending = 0;
+  delete txc->deferred_txn;
+  txc->deferred_txn = nullptr;
+  txc->onodes.clear();
+  txc->modified_objects.clear();
+  txc->shared_blobs.clear();
+#ifdef HAVE_LIBZBD
+  txc->zoned_onode_to_offset_map.clear();
+#endif
+  // the data went to new blobs only, whose buffers would otherwise stay in
+  // the writing state for good
+  for (auto& sb : txc->shared_blobs_written) {
+    sb->bc.discard(sb->get_cache(), 0, std::numeric_limits<uint32_t>::max());
+  }
+  txc->shared_blobs_written.clear();
+  // the cached onode has been partially rewritten, while the stored one is
+  // current (see the flush in _defrag_onode)
+  ++o->readahead_gen;
+  o->c->onode_map.discard(o->oid);
+}
+
+void BlueStore::_defrag_onode(CollectionRef& c, const ghobject_t& oid)
+{
+  uint64_t min_extents = cct->_conf->bluestore_defrag_min_extents;
+  uint64_t min_extent_size = cct->_conf->bluestore_defrag_min_extent_size;
+  auto is_fragmented = [&](const interval_set<uint64_t>& ranges,
+			   uint64_t extents) {
+    return extents >= min_extents &&
+      ranges.size() < extents * min_extent_size;
+  };
+  auto lookup = [&]() {
+    OnodeRef o;
+    if (_defrag_owns(c.get(), oid)) {
+      o = c->get_onode(oid, false);
+    }
+    return o;
+  };
+
+  // have a look first, without blocking the writes. The onode is kept
+  // pinned in the cache until we are done, and any update in between, or a
+  // removal or rename which leaves us with another onode, makes us give up
+  interval_set<uint64_t> ranges;
+  uint64_t extents_before = 0;
+  OnodeRef first;
+  uint64_t gen;
+  auto changed = [&](const OnodeRef& o) {
+    return !o || o != first || !o->exists || o->update_gen != gen;
+  };
   {
-    std::unique_lock l{zoned_cleaner_lock};
-    while (!zoned_cleaner_started) {
-      zoned_cleaner_cond.wait(l);
+    std::shared_lock l(c->lock);
+    OnodeRef o = lookup();
+    if (!o || !o->exists) {
+      return;
     }
-    zoned_cleaner_stop = true;
-    zoned_cleaner_cond.notify_all();
+    {
+      std::lock_guard dl{defrag_lock};
+      ++defrag_progress.onodes_scanned;
+    }
+    if (!_defrag_check(o, &ranges, &extents_before) ||
+	!is_fragmented(ranges, extents_before)) {
+      return;
+    }
+    if (shared_alloc.a->get_free() < 2 * ranges.size()) {
+      dout(10) << __func__ << " " << oid << " not enough free space" << dendl;
+      return;
+    }
+    first = o;
+    gen = o->update_gen;
   }
-  zoned_cleaner_thread.join();
-  {
-    std::lock_guard l{zoned_cleaner_lock};
-    zoned_cleaner_stop = false;
+  if (!_defrag_wait(0)) {
+    return;
   }
-  dout(10) << __func__ << " done" << dendl;
-}
+  dout(20) << __func__ << " " << oid << " " << extents_before
+	   << " extents for 0x" << std::hex << ranges.size() << std::dec
+	   << dendl;
 
-void BlueStore::_zoned_cleaner_thread() {
-  dout(10) << __func__ << " start" << dendl;
-  std::unique_lock l{zoned_cleaner_lock};
-  ceph_assert(!zoned_cleaner_started);
-  zoned_cleaner_started = true;
-  zoned_cleaner_cond.notify_all();
-  auto a = dynamic_cast<ZonedAllocator*>(shared_alloc.a);
-  ceph_assert(a);
-  auto f = dynamic_cast<ZonedFreelistManager*>(fm);
-  ceph_assert(f);
-  while (true) {
-    const auto *zones_to_clean = a->get_zones_to_clean();
-    if (!zones_to_clean) {
-      if (zoned_cleaner_stop) {
-	break;
-      }
-      dout(20) << __func__ << " sleep" << dendl;
-      zoned_cleaner_cond.wait(l);
-      dout(20) << __func__ << " wake" << dendl;
+  // read the data one range at a time, so that the writes are only held up
+  // as long as a client read would
+  std::map<uint64_t, bufferlist> data;
+  for (auto [offset, length] : ranges) {
+    std::shared_lock l(c->lock);
+    OnodeRef o = lookup();
+    if (changed(o)) {
+      dout(20) << __func__ << " " << oid << " changed, skipping" << dendl;
+      return;
+    }
+    int r = _do_read(c.get(), o, offset, length, data[offset],
+		     CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+    if (r < 0) {
+      derr << __func__ << " " << oid << " failed to read 0x" << std::hex
+	   << offset << "~" << length << std::dec << ": "
+	   << cpp_strerror(r) << dendl;
+      return;
+    }
+  }
+
+  // rewrite it under the collection lock, taken before the txc is queued
+  // and held until the onode is encoded, so that the txcs of the
+  // collection commit the updates in the order they made them
+  C_SaferCond committed;
+  std::list<Context*> on_commit{&committed};
+  TransContext *txc;
+  uint64_t bytes = 0;
+  uint64_t extents_after = 0;
+  {
+    std::unique_lock l(c->lock);
+    OnodeRef o = lookup();
+    if (changed(o)) {
+      dout(20) << __func__ << " " << oid << " changed, skipping" << dendl;
+      return;
+    }
+    txc = _txc_create(c.get(), c->osr.get(), &on_commit);
+    if (c->osr->has_preparing_before(txc)) {
+      // it will update the collection after us, yet commit before us
+      dout(20) << __func__ << " " << oid << " raced a transaction, skipping"
+	       << dendl;
     } else {
-      l.unlock();
-      f->mark_zones_to_clean_in_progress(*zones_to_clean, db);
-      for (auto zone_num : *zones_to_clean) {
-	_zoned_clean_zone(zone_num);
+      // make sure the stored onode is current, in case we have to give up
+      o->flush();
+      int r = 0;
+      for (auto& [offset, bl] : data) {
+	uint64_t length = bl.length();
+	// never in place, nor deferred: that would keep the fragments
+	r = _do_write(txc, c, o, offset, length, bl,
+		      CEPH_OSD_OP_FLAG_FADVISE_DONTNEED, true);
+	if (r < 0) {
+	  derr << __func__ << " " << oid << " failed to rewrite 0x" << std::hex
+	       << offset << "~" << length << std::dec << ": "
+	       << cpp_strerror(r) << ", giving up" << dendl;
+	  break;
+	}
+	bytes += length;
+      }
+      if (r < 0) {
+	_defrag_discard(txc, o);
+	bytes = 0;
+      } else if (bytes) {
+	txc->write_onode(o);
+	interval_set<uint64_t> unused;
+	_defrag_check(o, &unused, &extents_after);
       }
-      bdev->reset_zones(*zones_to_clean);
-      f->mark_zones_to_clean_free(*zones_to_clean, db);
-      a->mark_zones_to_clean_free();
-      l.lock();
     }
+    _txc_calc_cost(txc);
+    _txc_write_nodes(txc, txc->t);
   }
-  dout(10) << __func__ << " finish" << dendl;
-  zoned_cleaner_started = false;
-}
 
-void BlueStore::_zoned_clean_zone(uint64_t zone_num) {
-  dout(10) << __func__ << " cleaning zone " << zone_num << dendl;
-  // TODO: (1) copy live objects from zone_num to a new zone, (2) issue a RESET
-  // ZONE operation to the device for the corresponding zone.
+  _txc_journal_deferred(txc);
+  _txc_finalize_kv(txc, txc->t);
+  auto tstart = mono_clock::now();
+  if (!throttle.try_start_transaction(*db, *txc, tstart)) {
+    deferred_try_submit();
+    throttle.finish_start_transaction(*db, *txc, tstart);
+  }
+  logger->inc(l_bluestore_txc);
+  _txc_state_proc(txc);
+  committed.wait();
+
+  if (bytes) {
+    dout(10) << __func__ << " " << oid << " rewrote 0x" << std::hex << bytes
+	     << std::dec << ", " << extents_before << " extents to "
+	     << extents_after << dendl;
+    logger->inc(l_bluestore_defrag_onodes);
+    logger->inc(l_bluestore_defrag_bytes, bytes);
+    if (extents_after < extents_before) {
+      logger->inc(l_bluestore_defrag_extents_reclaimed,
+		  extents_before - extents_after);
+    }
+    {
+      std::lock_guard l{defrag_lock};
+      ++defrag_progress.onodes_rewritten;
+      defrag_progress.bytes_rewritten += bytes;
+      defrag_progress.extents_before += extents_before;
+      defrag_progress.extents_after += extents_after;
+    }
+    _defrag_wait(bytes);
+  }
 }
-#endif
 
 bluestore_deferred_op_t *BlueStore::_get_deferred_op(
   TransContext *txc)
@@ -12508,6 +14637,26 @@ void BlueStore::_deferred_queue(TransContext *txc)
   }
  }
 
+void BlueStore::_deferred_maybe_submit()
+{
+  if (deferred_aggressive) {
+    return;
+  }
+  if (deferred_queue_size >= deferred_batch_ops.load() ||
+      throttle.should_submit_deferred()) {
+    deferred_try_submit();
+  } else if (deferred_queue_size &&
+	     cct->_conf->bluestore_deferred_submit_on_idle &&
+	     throttle.is_kv_idle()) {
+    // nothing else is waiting for the device, don't let the batches wait
+    // for more
+    dout(20) << __func__ << " idle, submitting " << deferred_queue_size
+	     << " txcs" << dendl;
+    logger->inc(l_bluestore_deferred_idle_submits);
+    deferred_try_submit();
+  }
+}
+
 void BlueStore::deferred_try_submit()
 {
   dout(20) << __func__ << " " << deferred_queue.size() << " osrs, "
@@ -12522,6 +14671,28 @@ void BlueStore::deferred_try_submit()
     }
   }
 
+  // submit the batches in the order of their device offsets, so that the
+  // device sweeps over them rather than seeking back and forth
+  if (osrs.size() > 1) {
+    vector<pair<uint64_t, OpSequencerRef>> by_offset;
+    by_offset.reserve(osrs.size());
+    for (auto& osr : osrs) {
+      std::lock_guard l(osr->deferred_lock);
+      uint64_t offset = std::numeric_limits<uint64_t>::max();
+      if (osr->deferred_pending && !osr->deferred_pending->iomap.empty()) {
+	offset = osr->deferred_pending->iomap.begin()->first;
+      }
+      by_offset.emplace_back(offset, osr);
+    }
+    std::stable_sort(by_offset.begin(), by_offset.end(),
+		     [](const auto& a, const auto& b) {
+		       return a.first < b.first;
+		     });
+    for (size_t i = 0; i < osrs.size(); ++i) {
+      osrs[i] = std::move(by_offset[i].second);
+    }
+  }
+
   for (auto& osr : osrs) {
     osr->deferred_lock.lock();
     if (osr->deferred_pending) {
@@ -12657,8 +14828,10 @@ void BlueStore::_deferred_aio_finish(OpSequencer *osr)
     deferred_done_queue.emplace_back(b);
 
     // in the normal case, do not bother waking up the kv thread; it will
-    // catch us on the next commit anyway.
-    if (deferred_aggressive && !kv_sync_in_progress) {
+    // catch us on the next commit anyway.  Unless the commits may all go
+    // through the other kv pipelines.
+    if ((deferred_aggressive || !kv_sync_shards.empty()) &&
+	!kv_sync_in_progress) {
 	kv_sync_in_progress = true;
 	kv_cond.notify_one();
     }
@@ -12751,17 +14924,7 @@ int BlueStore::queue_transactions(
   _txc_calc_cost(txc);
 
   _txc_write_nodes(txc, txc->t);
-
-  // journal deferred items
-  if (txc->deferred_txn) {
-    txc->deferred_txn->seq = ++deferred_seq;
-    bufferlist bl;
-    encode(*txc->deferred_txn, bl);
-    string key;
-    get_deferred_key(txc->deferred_txn->seq, &key);
-    txc->t->set(PREFIX_DEFERRED, key, bl);
-  }
-
+  _txc_journal_deferred(txc);
   _txc_finalize_kv(txc, txc->t);
 
 #ifdef WITH_BLKIN
@@ -13345,6 +15508,18 @@ void BlueStore::_do_write_small(
   }
 #endif
 
+  if (wctx->new_alloc) {
+    // no reuse, and no direct or deferred write into existing blobs
+    BlobRef b = c->new_blob();
+    uint64_t b_off = p2phase<uint64_t>(offset, alloc_len);
+    uint64_t b_off0 = b_off;
+    _pad_zeros(&bl, &b_off0, block_size);
+    o->extent_map.punch_hole(c, offset, length, &wctx->old_extents);
+    wctx->write(offset, b, alloc_len, b_off0, bl, b_off, length,
+		min_alloc_size != block_size, true);
+    return;
+  }
+
   // Look for an existing mutable blob we can use.
   auto begin = o->extent_map.extent_map.begin();
   auto end = o->extent_map.extent_map.end();
@@ -13812,7 +15987,7 @@ void BlueStore::_do_write_big(
     uint32_t b_off = 0;
 
     //attempting to reuse existing blob
-    if (!wctx->compress) {
+    if (!wctx->compress && !wctx->new_alloc) {
       auto end = o->extent_map.extent_map.end();
 
       if (prefer_deferred_size_snapshot &&
@@ -14256,7 +16431,7 @@ int BlueStore::_do_alloc_write(
 
     // queue io
     if (!g_conf()->bluestore_debug_omit_block_device_write) {
-      if (l->length() <= prefer_deferred_size.load()) {
+      if (!wctx->new_alloc && l->length() <= prefer_deferred_size.load()) {
 	dout(20) << __func__ << " deferring 0x" << std::hex
 		 << l->length() << std::dec << " write via deferred" << dendl;
 	bluestore_deferred_op_t *op = _get_deferred_op(txc);
@@ -14292,6 +16467,16 @@ void BlueStore::_wctx_finish(
   WriteContext *wctx,
   set<SharedBlob*> *maybe_unshared_blobs)
 {
+  // load the shared blobs we drop refs of at once
+  std::vector<SharedBlobRef> sbs;
+  for (auto& lo : wctx->old_extents) {
+    if (!lo.r.empty() && lo.e.blob->get_blob().is_shared() &&
+	!lo.e.blob->shared_blob->is_loaded()) {
+      sbs.push_back(lo.e.blob->shared_blob);
+    }
+  }
+  c->load_shared_blobs(txc, sbs);
+
   auto oep = wctx->old_extents.begin();
   while (oep != wctx->old_extents.end()) {
     auto &lo = *oep;
@@ -14311,7 +16496,7 @@ void BlueStore::_wctx_finish(
       dout(20) << __func__ << "  blob " << *b << " release " << r << dendl;
       if (blob.is_shared()) {
 	PExtentVector final;
-        c->load_shared_blob(b->shared_blob);
+        c->load_shared_blob(txc, b->shared_blob);
 	bool unshare = false;
 	bool* unshare_ptr =
 	  !maybe_unshared_blobs || b->is_referenced() ? nullptr : &unshare;
@@ -14565,7 +16750,8 @@ int BlueStore::_do_write(
   uint64_t offset,
   uint64_t length,
   bufferlist& bl,
-  uint32_t fadvise_flags)
+  uint32_t fadvise_flags,
+  bool new_alloc)
 {
   int r = 0;
 
@@ -14586,6 +16772,17 @@ int BlueStore::_do_write(
   if (length == 0) {
     return 0;
   }
+  if (_can_write_inline(o, std::max(o->onode.size, offset + length))) {
+    _do_write_inline(txc, o, offset, length, &bl);
+    return 0;
+  }
+  if (o->onode.has_inline_data()) {
+    r = _do_uninline(txc, c, o);
+    if (r < 0) {
+      return r;
+    }
+  }
+  o->extent_map.note_write(offset, length);
 
   uint64_t end = offset + length;
 
@@ -14596,6 +16793,7 @@ int BlueStore::_do_write(
 
   WriteContext wctx;
   _choose_write_options(c, o, fadvise_flags, &wctx);
+  wctx.new_alloc = new_alloc;
   o->extent_map.fault_range(db, offset, length);
   _do_write_data(txc, c, o, offset, length, bl, &wctx);
   r = _do_alloc_write(txc, c, o, &wctx);
@@ -14664,6 +16862,141 @@ int BlueStore::_do_write(
   return r;
 }
 
+bool BlueStore::_can_write_inline(OnodeRef& o, uint64_t new_size)
+{
+  if (new_size > cct->_conf->bluestore_inline_data_max_size) {
+    return false;
+  }
+  if (o->onode.has_inline_data()) {
+    return true;
+  }
+  // only the objects written to while empty are moved into the onode
+  return o->onode.size == 0 &&
+    o->onode.extent_map_shards.empty() &&
+    o->extent_map.extent_map.empty() &&
+    // older releases skip the inline data of the onodes they decode
+    _require_compat_ondisk_format(inline_data_compat_ondisk_format);
+}
+
+bool BlueStore::_require_compat_ondisk_format(int32_t format)
+{
+  if (stored_compat_ondisk_format >= format) {
+    return true;
+  }
+  std::lock_guard l(compat_ondisk_format_lock);
+  if (stored_compat_ondisk_format < format) {
+    // keep the older releases from mounting us, before we write the first
+    // record they can't read
+    dout(1) << __func__ << " raising min_compat_ondisk_format to " << format
+	    << dendl;
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist bl;
+    encode(format, bl);
+    t->set(PREFIX_SUPER, "min_compat_ondisk_format", bl);
+    int r = db->submit_transaction_sync(t);
+    if (r < 0) {
+      derr << __func__ << " failed to update the superblock: "
+	   << cpp_strerror(r) << dendl;
+      return false;
+    }
+    stored_compat_ondisk_format = format;
+  }
+  return true;
+}
+
+void BlueStore::_do_write_inline(
+  TransContext *txc,
+  OnodeRef& o,
+  uint64_t offset,
+  uint64_t length,
+  const bufferlist* bl)
+{
+  auto& data = o->onode.inline_data;
+  dout(20) << __func__ << " " << o->oid
+	   << " 0x" << std::hex << offset << "~" << length
+	   << " inline 0x" << data.length() << std::dec << dendl;
+  if (!o->onode.has_inline_data()) {
+    ceph_assert(o->onode.size == 0);
+    o->onode.set_flag(bluestore_onode_t::FLAG_INLINE_DATA);
+  }
+  ceph_assert(data.length() == o->onode.size);
+
+  uint64_t end = offset + length;
+  bufferlist n;
+  if (offset <= data.length()) {
+    n.substr_of(data, 0, offset);
+  } else {
+    n.append(data);
+    n.append_zero(offset - data.length());
+  }
+  if (bl) {
+    bufferlist t;
+    t.substr_of(*bl, 0, length);
+    n.claim_append(t);
+  } else {
+    n.append_zero(length);
+  }
+  if (end < data.length()) {
+    bufferlist t;
+    t.substr_of(data, end, data.length() - end);
+    n.claim_append(t);
+  }
+  // a single buffer of the right size, rather than pieces of the (larger)
+  // transaction buffers, is what stays in the onode cache
+  n.rebuild();
+  n.reassign_to_mempool(mempool::mempool_bluestore_inline_bl);
+  txc->statfs_delta.stored() += (int64_t)n.length() - (int64_t)data.length();
+  data.swap(n);
+  o->onode.size = data.length();
+  logger->inc(l_bluestore_write_inline);
+  txc->write_onode(o);
+}
+
+void BlueStore::_do_truncate_inline(
+  TransContext *txc,
+  OnodeRef& o,
+  uint64_t offset)
+{
+  auto& data = o->onode.inline_data;
+  dout(20) << __func__ << " " << o->oid << " 0x" << std::hex << offset
+	   << " inline 0x" << data.length() << std::dec << dendl;
+  bufferlist n;
+  if (offset == 0) {
+    // an empty object is a regular one
+    o->onode.clear_flag(bluestore_onode_t::FLAG_INLINE_DATA);
+  } else {
+    if (offset <= data.length()) {
+      n.substr_of(data, 0, offset);
+    } else {
+      n.append(data);
+      n.append_zero(offset - data.length());
+    }
+    n.rebuild();
+    n.reassign_to_mempool(mempool::mempool_bluestore_inline_bl);
+  }
+  txc->statfs_delta.stored() += (int64_t)n.length() - (int64_t)data.length();
+  data.swap(n);
+  o->onode.size = offset;
+  txc->write_onode(o);
+}
+
+int BlueStore::_do_uninline(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef& o)
+{
+  bufferlist bl;
+  bl.swap(o->onode.inline_data);
+  o->onode.clear_flag(bluestore_onode_t::FLAG_INLINE_DATA);
+  txc->statfs_delta.stored() -= bl.length();
+  dout(20) << __func__ << " " << o->oid << " 0x" << std::hex << bl.length()
+	   << std::dec << dendl;
+  // NB: an object with inline data is never empty, so the write below
+  // doesn't go back into the onode
+  ceph_assert(bl.length() == o->onode.size && bl.length() > 0);
+  return _do_write(txc, c, o, 0, bl.length(), bl, 0);
+}
+
 int BlueStore::_write(TransContext *txc,
 		      CollectionRef& c,
 		      OnodeRef& o,
@@ -14721,6 +17054,19 @@ int BlueStore::_do_zero(TransContext *txc,
 
   _dump_onode<30>(cct, *o);
 
+  if (o->onode.has_inline_data()) {
+    if (_can_write_inline(o, std::max(o->onode.size, offset + length))) {
+      if (length > 0) {
+	_do_write_inline(txc, o, offset, length, nullptr);
+      }
+      return r;
+    }
+    r = _do_uninline(txc, c, o);
+    if (r < 0) {
+      return r;
+    }
+  }
+
   WriteContext wctx;
   o->extent_map.fault_range(db, offset, length);
   o->extent_map.punch_hole(c, offset, length, &wctx.old_extents);
@@ -14752,6 +17098,15 @@ void BlueStore::_do_truncate(
   if (offset == o->onode.size)
     return;
 
+  if (o->onode.has_inline_data()) {
+    if (_can_write_inline(o, offset)) {
+      _do_truncate_inline(txc, o, offset);
+      return;
+    }
+    int r = _do_uninline(txc, c, o);
+    ceph_assert(r == 0);
+  }
+
   WriteContext wctx;
   if (offset < o->onode.size) {
     uint64_t length = o->onode.size - offset;
@@ -15245,7 +17600,7 @@ int BlueStore::_clone(TransContext *txc,
   // clone data
   oldo->flush();
   _do_truncate(txc, c, newo, 0);
-  if (cct->_conf->bluestore_clone_cow) {
+  if (cct->_conf->bluestore_clone_cow && !oldo->onode.has_inline_data()) {
     _do_clone_range(txc, c, oldo, newo, 0, oldo->onode.size, 0);
   } else {
     bufferlist bl;
@@ -15356,7 +17711,9 @@ int BlueStore::_clone_range(TransContext *txc,
   _assign_nid(txc, newo);
 
   if (length > 0) {
-    if (cct->_conf->bluestore_clone_cow) {
+    if (cct->_conf->bluestore_clone_cow &&
+	!oldo->onode.has_inline_data() &&
+	!newo->onode.has_inline_data()) {
       _do_zero(txc, c, newo, dstoff, length);
       _do_clone_range(txc, c, oldo, newo, srcoff, length, dstoff);
     } else {
@@ -16019,10 +18376,10 @@ void BlueStore::_apply_padding(uint64_t head_pad,
 void BlueStore::_record_onode(OnodeRef &o, KeyValueDB::Transaction &txn)
 {
   // finalize extent_map shards
-  o->extent_map.update(txn, false);
+  uint64_t extent_bytes = o->extent_map.update(txn, false);
   if (o->extent_map.needs_reshard()) {
     o->extent_map.reshard(db, txn);
-    o->extent_map.update(txn, true);
+    extent_bytes += o->extent_map.update(txn, true);
     if (o->extent_map.needs_reshard()) {
       dout(20) << __func__ << " warning: still wants reshard, check options?"
 		<< dendl;
@@ -16061,6 +18418,8 @@ void BlueStore::_record_onode(OnodeRef &o, KeyValueDB::Transaction &txn)
 	    << dendl;
 
 
+  logger->inc(l_bluestore_extent_map_encoded_bytes, extent_bytes + extent_part);
+
   txn->set(PREFIX_OBJ, o->key.c_str(), o->key.size(), bl);
 }
 
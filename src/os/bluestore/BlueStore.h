@@ -100,6 +100,7 @@ enum {
   l_bluestore_write_pad_bytes,
   l_bluestore_deferred_write_ops,
   l_bluestore_deferred_write_bytes,
+  l_bluestore_deferred_idle_submits,
   l_bluestore_write_penalty_read_ops,
   l_bluestore_allocated,
   l_bluestore_stored,
@@ -110,6 +111,8 @@ enum {
   l_bluestore_pinned_onodes,
   l_bluestore_onode_hits,
   l_bluestore_onode_misses,
+  l_bluestore_onode_probation_hits,
+  l_bluestore_onode_protected_hits,
   l_bluestore_onode_shard_hits,
   l_bluestore_onode_shard_misses,
   l_bluestore_extents,
@@ -128,14 +131,23 @@ enum {
   l_bluestore_write_deferred,
   l_bluestore_write_small_pre_read,
   l_bluestore_write_new,
+  l_bluestore_write_inline,
   l_bluestore_txc,
   l_bluestore_onode_reshard,
+  l_bluestore_extent_map_encoded_bytes,
   l_bluestore_blob_split,
   l_bluestore_extent_compress,
   l_bluestore_gc_merged,
   l_bluestore_read_eio,
   l_bluestore_reads_with_retries,
+  l_bluestore_readahead_bytes,
+  l_bluestore_readahead_hit_bytes,
+  l_bluestore_readahead_wasted_bytes,
+  l_bluestore_read_copied_bytes,
   l_bluestore_fragmentation,
+  l_bluestore_defrag_onodes,
+  l_bluestore_defrag_bytes,
+  l_bluestore_defrag_extents_reclaimed,
   l_bluestore_omap_seek_to_first_lat,
   l_bluestore_omap_upper_bound_lat,
   l_bluestore_omap_lower_bound_lat,
@@ -808,6 +820,27 @@ public:
     uint32_t needs_reshard_begin = 0;
     uint32_t needs_reshard_end = 0;
 
+    /// write locality, for bluestore_extent_map_shard_adaptive: the end of
+    /// the last write and a saturating count of the recent writes which
+    /// didn't follow the previous one
+    static constexpr uint8_t RANDOM_WRITES_MAX = 16;
+    uint32_t last_write_end = 0;
+    uint8_t random_writes = 0;
+
+    void note_write(uint32_t offset, uint32_t length) {
+      if (offset == last_write_end) {
+	if (random_writes) {
+	  --random_writes;
+	}
+      } else if (random_writes < RANDOM_WRITES_MAX) {
+	++random_writes;
+      }
+      last_write_end = offset + length;
+    }
+    bool is_randomly_written() const {
+      return random_writes >= RANDOM_WRITES_MAX / 2;
+    }
+
     void dup(BlueStore* b, TransContext*, CollectionRef&, OnodeRef&, OnodeRef&,
       uint64_t&, uint64_t&, uint64_t&);
 
@@ -858,7 +891,8 @@ public:
       return p->second;
     }
 
-    void update(KeyValueDB::Transaction t, bool force);
+    /// @returns the encoded bytes of the shards scheduled for writing
+    uint32_t update(KeyValueDB::Transaction t, bool force);
     decltype(BlueStore::Blob::id) allocate_spanning_blob_id();
     void reshard(
       KeyValueDB *db,
@@ -1079,8 +1113,23 @@ public:
                               /// of it at the moment though)
     std::atomic_bool pinned;  ///< Onode is pinned
                               /// (or should be pinned when cached)
+    uint8_t cache_segment = 0; ///< cache policy specific list we are in
+    uint8_t cache_refs = 0;    ///< accesses since we were cached
+    uint32_t cache_bytes = 0;  ///< memory accounted for us by the cache
+    uint32_t cache_stamp = 0;  ///< the cache's access clock at our last access
     ExtentMap extent_map;
 
+    // sequential read stream detection, see _readahead_range()
+    std::atomic<uint64_t> readahead_next = {0}; ///< where a sequential read starts
+    std::atomic<uint32_t> readahead_seq = {0};  ///< consecutive sequential reads
+    std::atomic<uint64_t> readahead_pos = {0};  ///< [pos, end) read ahead
+    std::atomic<uint64_t> readahead_end = {0};  ///< but not yet read
+    /// bumped by each update, so that a read ahead racing it can tell that
+    /// the data has changed
+    std::atomic<uint64_t> readahead_gen = {0};
+    /// bumped by each update, see _defrag_onode()
+    std::atomic<uint64_t> update_gen = {0};
+
     // track txc's that have not been committed to kv store (and whose
     // effects cannot be read via the kvdb read methods)
     std::atomic<int> flushing_count = {0};
@@ -1135,6 +1184,9 @@ public:
     void get();
     void put();
 
+    /// estimate of the memory used by the onode and its loaded extent map
+    uint64_t estimate_memory() const;
+
     inline bool put_cache() {
       ceph_assert(!cached);
       cached = true;
@@ -1221,6 +1273,8 @@ public:
   /// A Generic onode Cache Shard
   struct OnodeCacheShard : public CacheShard {
     std::atomic<uint64_t> num_pinned = {0};
+    /// memory budget of the shard, for the policies accounting it (0: none)
+    std::atomic<uint64_t> max_bytes = {0};
 
     std::array<std::pair<ghobject_t, ceph::mono_clock::time_point>, 64> dumped_onodes;
 
@@ -1237,6 +1291,9 @@ public:
 
     virtual void move_pinned(OnodeCacheShard *to, Onode *o) = 0;
     virtual void add_stats(uint64_t *onodes, uint64_t *pinned_onodes) = 0;
+    void set_max_bytes(uint64_t max_bytes_) {
+      max_bytes = max_bytes_;
+    }
     bool empty() {
       return _get_num() == 0;
     }
@@ -1297,6 +1354,7 @@ public:
     friend struct Collection; // for split_cache()
     friend struct Onode; // for put()
     friend struct LruOnodeCacheShard;
+    friend struct SlruOnodeCacheShard;
     void _remove(const ghobject_t& oid);
   public:
     OnodeSpace(OnodeCacheShard *c) : cache(c) {}
@@ -1309,6 +1367,9 @@ public:
     void rename(OnodeRef& o, const ghobject_t& old_oid,
 		const ghobject_t& new_oid,
 		const mempool::bluestore_cache_meta::string& new_okey);
+    /// drop the cached onode, so that the next lookup reloads it from the
+    /// kv store
+    void discard(const ghobject_t& oid);
     void clear();
     bool empty();
 
@@ -1359,7 +1420,10 @@ public:
     //  shared = blob_t shared flag is std::set; SharedBlob is hashed.
     //  loaded = SharedBlob::shared_blob_t is loaded from kv store
     void open_shared_blob(uint64_t sbid, BlobRef b);
-    void load_shared_blob(SharedBlobRef sb);
+    void load_shared_blob(TransContext *txc, SharedBlobRef sb);
+    /// load them with a single kv lookup
+    void load_shared_blobs(TransContext *txc,
+			   const std::vector<SharedBlobRef>& sbs);
     void make_blob_shared(uint64_t sbid, BlobRef b);
     uint64_t make_blob_unshared(SharedBlob *sb);
 
@@ -1596,6 +1660,9 @@ public:
 #endif
     
     std::set<SharedBlobRef> shared_blobs;  ///< these need to be updated/written
+    /// refs taken on shared blobs that aren't loaded, merged into their kv
+    /// records instead
+    std::map<SharedBlobRef, bluestore_extent_ref_map_t> shared_blob_refs;
     std::set<SharedBlobRef> shared_blobs_written; ///< update these on io completion
 
     KeyValueDB::Transaction t; ///< then we will commit this
@@ -1648,6 +1715,8 @@ public:
     }
 
     void write_onode(OnodeRef &o) {
+      ++o->readahead_gen;
+      ++o->update_gen;
       onodes.insert(o);
     }
     void write_shared_blob(SharedBlobRef &sb) {
@@ -1796,6 +1865,10 @@ public:
     bool should_submit_deferred() {
       return throttle_deferred_bytes.past_midpoint();
     }
+    /// no txc between submit and kv commit
+    bool is_kv_idle() const {
+      return throttle_bytes.get_current() == 0;
+    }
     void reset_throttle(const ConfigProxy &conf) {
       throttle_bytes.reset_max(conf->bluestore_throttle_bytes);
       throttle_deferred_bytes.reset_max(
@@ -1899,6 +1972,20 @@ public:
 	qcond.wait(l);
     }
 
+    /// true if a txc queued ahead of txc is still being prepared
+    bool has_preparing_before(TransContext *txc) {
+      std::lock_guard l(qlock);
+      for (auto& i : q) {
+	if (&i == txc) {
+	  break;
+	}
+	if (i.get_state() == TransContext::STATE_PREPARE) {
+	  return true;
+	}
+      }
+      return false;
+    }
+
     bool _is_all_kv_submitted() {
       // caller must hold qlock & q.empty() must not empty
       ceph_assert(!q.empty());
@@ -1996,6 +2083,57 @@ public:
     }
   };
 
+  /// an additional kv commit pipeline (bluestore_kv_sync_shards > 1).  The
+  /// pipelines split the OpSequencers between them, so that all the txcs of
+  /// a collection go through the same one, in order.  Pipeline 0 is the
+  /// kv_sync_thread/kv_finalize_thread pair, which also retires the deferred
+  /// ios of all of them, and is woken up for it as they complete; the others
+  /// only commit the txcs queued to them.
+  struct KVSyncShard {
+    struct SyncThread : public Thread {
+      KVSyncShard *shard;
+      explicit SyncThread(KVSyncShard *s) : shard(s) {}
+      void *entry() override {
+	shard->store->_kv_shard_sync_thread(shard);
+	return NULL;
+      }
+    };
+    struct FinalizeThread : public Thread {
+      KVSyncShard *shard;
+      explicit FinalizeThread(KVSyncShard *s) : shard(s) {}
+      void *entry() override {
+	shard->store->_kv_shard_finalize_thread(shard);
+	return NULL;
+      }
+    };
+
+    BlueStore *store;
+    const unsigned id;
+
+    SyncThread sync_thread;
+    ceph::mutex lock = ceph::make_mutex("BlueStore::KVSyncShard::lock");
+    ceph::condition_variable cond;
+    bool started = false;
+    bool stop = false;
+    bool in_progress = false;
+    std::deque<TransContext*> queue;             ///< ready, already submitted
+    std::deque<TransContext*> queue_unsubmitted; ///< ready, need submit by kv thread
+    uint64_t ios = 0;
+    uint64_t throttle_costs = 0;
+
+    FinalizeThread finalize_thread;
+    ceph::mutex finalize_lock =
+      ceph::make_mutex("BlueStore::KVSyncShard::finalize_lock");
+    ceph::condition_variable finalize_cond;
+    bool finalize_started = false;
+    bool finalize_stop = false;
+    bool finalize_in_progress = false;
+    std::deque<TransContext*> committing_to_finalize; ///< pending finalization
+
+    KVSyncShard(BlueStore *store, unsigned id)
+      : store(store), id(id), sync_thread(this), finalize_thread(this) {}
+  };
+
 #ifdef HAVE_LIBZBD
   struct ZonedCleanerThread : public Thread {
     BlueStore *store;
@@ -2006,6 +2144,32 @@ public:
     }
   };
 #endif
+
+  struct DefragThread : public Thread {
+    BlueStore *store;
+    explicit DefragThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_defrag_thread();
+      return nullptr;
+    }
+  };
+  class DefragSocketHook;
+
+  /// progress of the current (or last) defragmentation pass
+  struct defrag_progress_t {
+    bool running = false;
+    utime_t started;
+    utime_t finished;
+    double fragmentation_score = 0;
+    coll_t cid;                     ///< the collection being scanned
+    uint64_t onodes_scanned = 0;
+    uint64_t onodes_rewritten = 0;
+    uint64_t bytes_rewritten = 0;
+    uint64_t extents_before = 0;    ///< extents of the rewritten onodes ...
+    uint64_t extents_after = 0;     ///< ... and once rewritten
+
+    void dump(ceph::Formatter *f) const;
+  };
   
   struct BigDeferredWriteContext {
     uint64_t off = 0;     // original logical offset
@@ -2097,6 +2261,11 @@ private:
   std::deque<DeferredBatch*> deferred_stable_to_finalize; ///< pending finalization
   bool kv_finalize_in_progress = false;
 
+  /// pipelines 1..n of the kv commit, empty unless bluestore_kv_sync_shards > 1
+  std::vector<std::unique_ptr<KVSyncShard>> kv_sync_shards;
+  /// serializes the {nid,blobid}_max updates of the kv pipelines
+  ceph::mutex kv_id_max_lock = ceph::make_mutex("BlueStore::kv_id_max_lock");
+
 #ifdef HAVE_LIBZBD
   ZonedCleanerThread zoned_cleaner_thread;
   ceph::mutex zoned_cleaner_lock = ceph::make_mutex("BlueStore::zoned_cleaner_lock");
@@ -2106,8 +2275,28 @@ private:
   std::deque<uint64_t> zoned_cleaner_queue;
 #endif
 
+  /// the txcs with refs to merge into shared blob records, until they're
+  /// submitted to the kv store: loading the shared blobs adds them up
+  ceph::mutex shared_blob_merge_lock =
+    ceph::make_mutex("BlueStore::shared_blob_merge_lock");
+  std::map<uint64_t, std::vector<TransContext*>> shared_blob_merges; ///< by sbid
+
+  ceph::mutex readahead_lock = ceph::make_mutex("BlueStore::readahead_lock");
+  ceph::condition_variable readahead_cond;
+  uint64_t readahead_in_flight = 0;  ///< read aheads still being read
+
+  DefragThread defrag_thread;
+  DefragSocketHook *defrag_asok_hook = nullptr;
+  ceph::mutex defrag_lock = ceph::make_mutex("BlueStore::defrag_lock");
+  ceph::condition_variable defrag_cond;
+  bool defrag_stop = false;
+  bool defrag_requested = false;  ///< run a pass regardless of fragmentation
+  defrag_progress_t defrag_progress;
+
   PerfCounters *logger = nullptr;
 
+  ceph::mutex removed_collections_lock =
+    ceph::make_mutex("BlueStore::removed_collections_lock");
   std::list<CollectionRef> removed_collections;
 
   ceph::shared_mutex debug_read_error_lock =
@@ -2388,6 +2577,14 @@ private:
   int _create_alloc();
   int _init_alloc();
   void _close_alloc();
+
+  // allocation snapshot (bluestore_allocation_from_file)
+  bool _can_use_null_freelist() const;
+  int _enable_null_freelist();
+  int _write_alloc_snapshot();
+  int _read_alloc_snapshot(uint64_t* num, uint64_t* bytes);
+  void _remove_alloc_snapshot();
+  int _rebuild_alloc_from_onodes(uint64_t* num, uint64_t* bytes);
   int _open_collections();
   void _fsck_collections(int64_t* errors);
   void _close_collections();
@@ -2432,6 +2629,10 @@ private:
 
   void _assign_nid(TransContext *txc, OnodeRef o);
   uint64_t _assign_blobid(TransContext *txc);
+  /// where to take refs on an unloaded shared blob, if they can be merged
+  /// into its kv record instead of loading it; nullptr otherwise
+  bluestore_extent_ref_map_t *_merge_shared_blob_refs(TransContext *txc,
+						      SharedBlobRef& sb);
 
   template <int LogLevelV>
   friend void _dump_onode(CephContext *cct, const Onode& o);
@@ -2447,6 +2648,7 @@ private:
   void _txc_add_transaction(TransContext *txc, Transaction *t);
   void _txc_calc_cost(TransContext *txc);
   void _txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t);
+  void _txc_journal_deferred(TransContext *txc);
   void _txc_state_proc(TransContext *txc);
   void _txc_aio_submit(TransContext *txc);
 public:
@@ -2471,6 +2673,11 @@ private:
   void _kv_stop();
   void _kv_sync_thread();
   void _kv_finalize_thread();
+  KVSyncShard *_get_kv_sync_shard(const OpSequencer *osr);
+  void _kv_shard_sync_thread(KVSyncShard *shard);
+  void _kv_shard_finalize_thread(KVSyncShard *shard);
+  void _kv_preallocate_ids(uint64_t *new_nid_max, uint64_t *new_blobid_max);
+  void _kv_raise_ids_max(uint64_t new_nid_max, uint64_t new_blobid_max);
 
 #ifdef HAVE_LIBZBD
   void _zoned_cleaner_start();
@@ -2479,8 +2686,27 @@ private:
   void _zoned_clean_zone(uint64_t zone_num);
 #endif
 
+  void _defrag_start();
+  void _defrag_stop();
+  void _defrag_thread();
+  void _defrag_pass(double score);
+  /// throttle the rewrite of 'bytes', then wait for the store to be idle.
+  /// Returns false once stopping.
+  bool _defrag_wait(uint64_t bytes);
+  /// the logical ranges of the onode's data, and the number of physically
+  /// contiguous extents backing them. Returns false if it can't be rewritten.
+  bool _defrag_check(OnodeRef& o, interval_set<uint64_t> *ranges,
+		     uint64_t *extents);
+  /// true if c still holds oid; the caller holds c->lock
+  bool _defrag_owns(Collection *c, const ghobject_t& oid);
+  /// undo a rewrite that failed half way
+  void _defrag_discard(TransContext *txc, OnodeRef& o);
+  /// rewrite the onode's data if it's fragmented
+  void _defrag_onode(CollectionRef& c, const ghobject_t& oid);
+
   bluestore_deferred_op_t *_get_deferred_op(TransContext *txc);
   void _deferred_queue(TransContext *txc);
+  void _deferred_maybe_submit();
 public:
   void deferred_try_submit();
 private:
@@ -2514,7 +2740,8 @@ private:
     uint64_t granularity,
     BlueStoreRepairer* repairer,
     store_statfs_t& expected_statfs,
-    FSCKDepth depth);
+    FSCKDepth depth,
+    ceph::mutex* used_blocks_lock = nullptr);
 
   void _fsck_check_pool_statfs(
     per_pool_statfs& expected_pool_statfs,
@@ -2558,13 +2785,25 @@ private:
 
   // -- ondisk version ---
 public:
-  const int32_t latest_ondisk_format = 4;        ///< our version
+  const int32_t latest_ondisk_format = 6;        ///< our version
   const int32_t min_readable_ondisk_format = 1;  ///< what we can read
   const int32_t min_compat_ondisk_format = 3;    ///< who can read us
+  /// who can read us, once an onode holds inline data
+  const int32_t inline_data_compat_ondisk_format = 5;
+  /// who can read us, once shared blob refs are merged into their records
+  const int32_t shared_blob_merge_compat_ondisk_format = 6;
 
 private:
   int32_t ondisk_format = 0;  ///< value detected on mount
 
+  /// min_compat_ondisk_format as stored
+  std::atomic<int32_t> stored_compat_ondisk_format = {0};
+  ceph::mutex compat_ondisk_format_lock =
+    ceph::make_mutex("BlueStore::compat_ondisk_format_lock");
+  /// raise the stored min_compat_ondisk_format to (at least) format, before
+  /// writing the first record older releases can't read
+  bool _require_compat_ondisk_format(int32_t format);
+
   int _upgrade_super();  ///< upgrade (called during open_super)
   uint64_t _get_ondisk_reserved() const;
   void _prepare_ondisk_format_super(KeyValueDB::Transaction& t);
@@ -2621,6 +2860,10 @@ public:
   }
   int umount() override;
 
+  /// start a defragmentation pass, regardless of the fragmentation
+  void request_defrag();
+  void dump_defrag_status(ceph::Formatter *f);
+
   int open_db_environment(KeyValueDB **pdb, bool to_repair);
   int close_db_environment();
 
@@ -2781,6 +3024,19 @@ private:
     blobs2read_t& blobs2read);
 
 
+  void _readahead_range(
+    OnodeRef& o,
+    uint64_t offset,
+    size_t length,
+    uint64_t *ra_offset,
+    uint64_t *ra_length);
+
+  /// a read ahead, completing asynchronously into the buffer cache
+  struct ReadaheadContext;
+  void _readahead_submit(std::unique_ptr<ReadaheadContext> ra);
+  void _readahead_finish(ReadaheadContext *ra);
+  void _readahead_drain();
+
   int _prepare_read_ioc(
     blobs2read_t& blobs2read,
     std::vector<ceph::buffer::list>* compressed_blob_bls,
@@ -2795,7 +3051,8 @@ private:
     blobs2read_t& blobs2read,
     bool buffered,
     bool* csum_error,
-    ceph::buffer::list& bl);
+    ceph::buffer::list& bl,
+    uint64_t* copied_bytes = nullptr);
 
   int _do_read(
     Collection *c,
@@ -2814,6 +3071,24 @@ private:
     uint32_t op_flags = 0,
     uint64_t retry_count = 0);
 
+  int _do_verify(
+    Collection *c,
+    OnodeRef o,
+    uint64_t offset,
+    size_t len,
+    uint32_t *digest,
+    uint32_t op_flags = 0,
+    uint64_t retry_count = 0);
+
+  /// the crc32c (seeded with -1) of bl[bl_off, bl_off + len), found at blob
+  /// offset 'b_off' and already verified, using the blob's checksums if possible
+  uint32_t _verified_crc32c(
+    const bluestore_blob_t& blob,
+    uint64_t b_off,
+    const ceph::buffer::list& bl,
+    uint64_t bl_off,
+    uint64_t len) const;
+
   int _fiemap(CollectionHandle &c_, const ghobject_t& oid,
 	      uint64_t offset, size_t len, interval_set<uint64_t>& destset);
 public:
@@ -2829,6 +3104,14 @@ public:
     ceph::buffer::list& bl,
     uint32_t op_flags) override;
 
+  int verify(
+    CollectionHandle &c_,
+    const ghobject_t& oid,
+    uint64_t offset,
+    size_t len,
+    uint32_t *digest,
+    uint32_t op_flags) override;
+
   int dump_onode(CollectionHandle &c, const ghobject_t& oid,
     const std::string& section_name, ceph::Formatter *f) override;
 
@@ -3106,6 +3389,7 @@ private:
   struct WriteContext {
     bool buffered = false;          ///< buffered write
     bool compress = false;          ///< compressed write
+    bool new_alloc = false;         ///< only write to newly allocated space
     uint64_t target_blob_size = 0;  ///< target (max) blob size
     unsigned csum_order = 0;        ///< target checksum chunk order
 
@@ -3155,6 +3439,7 @@ private:
     void fork(const WriteContext& other) {
       buffered = other.buffered;
       compress = other.compress;
+      new_alloc = other.new_alloc;
       target_blob_size = other.target_blob_size;
       csum_order = other.csum_order;
     }
@@ -3245,7 +3530,21 @@ private:
 		OnodeRef o,
 		uint64_t offset, uint64_t length,
 		ceph::buffer::list& bl,
-		uint32_t fadvise_flags);
+		uint32_t fadvise_flags,
+		bool new_alloc = false);
+
+  // inline data, see bluestore_inline_data_max_size
+  bool _can_write_inline(OnodeRef& o, uint64_t new_size);
+  void _do_write_inline(TransContext *txc,
+			OnodeRef& o,
+			uint64_t offset, uint64_t length,
+			const ceph::buffer::list* bl); ///< nullptr: zeros
+  void _do_truncate_inline(TransContext *txc,
+			   OnodeRef& o,
+			   uint64_t offset);
+  int _do_uninline(TransContext *txc,
+		   CollectionRef& c,
+		   OnodeRef& o);
   void _do_write_data(TransContext *txc,
                       CollectionRef& c,
                       OnodeRef o,
@@ -3371,11 +3670,13 @@ private:
   inline bool _use_rotational_settings();
 
 public:
+  /// what fsck learns of a shared blob from the objects referencing it.
+  /// NB: there is one per shared blob in the store, so keep it compact: no
+  /// per reference entries and no reference to the in-memory SharedBlob.
   struct sb_info_t {
     coll_t cid;
     int64_t pool_id = INT64_MIN;
-    std::list<ghobject_t> oids;
-    BlueStore::SharedBlobRef sb;
+    ghobject_t oid;  ///< the first object found referencing the blob
     bluestore_extent_ref_map_t ref_map;
     bool compressed = false;
     bool passed = false;
@@ -3397,6 +3698,8 @@ public:
 
     mempool_dynamic_bitset* used_blocks;
     uint64_t_btree_t* used_omap_head;
+    // set when the objects are checked by multiple threads
+    ceph::mutex* used_blocks_lock = nullptr;
 
     ceph::mutex* sb_info_lock;
     sb_info_map_t& sb_info;
@@ -3447,7 +3750,22 @@ public:
     std::map<BlobRef, bluestore_blob_t::unused_t>* referenced,
     const BlueStore::FSCK_ObjectCtx& ctx);
 
+  /// the regular and deep checks following fsck_check_objects_shallow()
+  void fsck_check_object_data(
+    FSCKDepth depth,
+    CollectionRef c,
+    OnodeRef& o,
+    const std::map<BlobRef, bluestore_blob_t::unused_t>& referenced,
+    const BlueStore::FSCK_ObjectCtx& ctx);
+
 private:
+  /// @returns false if the object's nid is already in use
+  bool _fsck_check_object_ids(
+    const ghobject_t& oid,
+    const bluestore_onode_t& onode,
+    uint64_t_btree_t& used_nids,
+    const BlueStore::FSCK_ObjectCtx& ctx);
+
   void _fsck_check_object_omap(FSCKDepth depth,
     OnodeRef& o,
     const BlueStore::FSCK_ObjectCtx& ctx);
@@ -50,6 +50,17 @@ public:
 
   virtual void get_meta(uint64_t target_size,
     std::vector<std::pair<string, string>>*) const = 0;
+
+  /// stop tracking allocations; the allocator state is persisted elsewhere
+  void set_null_manager() {
+    null_manager = true;
+  }
+  bool is_null_manager() const {
+    return null_manager;
+  }
+
+protected:
+  bool null_manager = false;
 };
 
 
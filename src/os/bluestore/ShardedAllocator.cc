@@ -0,0 +1,275 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "ShardedAllocator.h"
+
+#include <limits>
+#include <thread>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "common/debug.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef dout_prefix
+#define dout_prefix *_dout << "sharded_alloc 0x" << this << " "
+
+ShardedAllocator::ShardedAllocator(CephContext* _cct,
+				   Allocator* _backend,
+				   unsigned _num_shards,
+				   uint64_t _cache_size,
+				   uint64_t _min_extent_size,
+				   std::string_view name)
+  : Allocator(name, _backend->get_capacity(), _backend->get_block_size()),
+    cct(_cct),
+    backend(_backend),
+    cache_size(p2roundup(_cache_size, (uint64_t)_backend->get_block_size())),
+    min_extent_size(p2roundup(_min_extent_size,
+			      (uint64_t)_backend->get_block_size())),
+    num_shards(_num_shards),
+    shards(new shard_t[_num_shards])
+{
+  ceph_assert(num_shards > 0);
+  ldout(cct, 10) << __func__ << " " << num_shards << " shards of 0x"
+		 << std::hex << cache_size << ", min extent 0x" << min_extent_size
+		 << std::dec << " in front of " << backend->get_type() << dendl;
+}
+
+ShardedAllocator::~ShardedAllocator()
+{
+}
+
+ShardedAllocator::shard_t& ShardedAllocator::get_shard()
+{
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return shards[cpu % num_shards];
+  }
+#endif
+  auto h = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  return shards[h % num_shards];
+}
+
+void ShardedAllocator::_insert(shard_t& s, uint64_t offset, uint64_t length,
+			       interval_set<uint64_t>* to_release)
+{
+  s.free.insert(offset, length);
+  uint64_t start = 0, len = 0;
+  bool found = s.free.contains(offset, &start, &len);
+  ceph_assert(found);
+  if (len < min_extent_size) {
+    s.free.erase(start, len);
+    to_release->insert(start, len);
+  }
+}
+
+uint64_t ShardedAllocator::_take(shard_t& s, uint64_t want,
+				 uint64_t max_alloc_size,
+				 PExtentVector* extents)
+{
+  uint64_t got = 0;
+  interval_set<uint64_t> to_release;
+  while (got < want && !s.free.empty()) {
+    auto p = s.free.begin();
+    uint64_t offset = p.get_start();
+    uint64_t left = p.get_len();
+    uint64_t length = std::min(left, want - got);
+    s.free.erase(offset, length);
+    left -= length;
+    if (left && left < min_extent_size) {
+      // don't keep what is left of the extent
+      s.free.erase(offset + length, left);
+      to_release.insert(offset + length, left);
+    }
+    got += length;
+    while (length > 0) {
+      uint64_t l = std::min(length, max_alloc_size);
+      extents->emplace_back(offset, l);
+      offset += l;
+      length -= l;
+    }
+  }
+  cached -= got + to_release.size();
+  if (!to_release.empty()) {
+    backend->release(to_release);
+  }
+  return got;
+}
+
+void ShardedAllocator::_trim(shard_t& s, uint64_t keep)
+{
+  interval_set<uint64_t> to_release;
+  for (auto p = s.free.begin();
+       p != s.free.end() && s.free.size() - to_release.size() > keep;
+       ++p) {
+    to_release.insert(p.get_start(), p.get_len());
+  }
+  if (to_release.empty()) {
+    return;
+  }
+  s.free.subtract(to_release);
+  cached -= to_release.size();
+  backend->release(to_release);
+}
+
+void ShardedAllocator::drain()
+{
+  for (unsigned i = 0; i < num_shards; ++i) {
+    std::lock_guard l(shards[i].lock);
+    _trim(shards[i], 0);
+  }
+}
+
+int64_t ShardedAllocator::allocate(
+  uint64_t want,
+  uint64_t unit,
+  uint64_t max_alloc_size,
+  int64_t  hint,
+  PExtentVector* extents)
+{
+  ldout(cct, 20) << __func__ << std::hex
+		 << " want 0x" << want
+		 << " unit 0x" << unit
+		 << " max_alloc_size 0x" << max_alloc_size
+		 << " hint 0x" << hint
+		 << std::dec << dendl;
+  if (unit == (uint64_t)block_size && want <= cache_size) {
+    if (max_alloc_size == 0) {
+      max_alloc_size = want;
+    }
+    if (constexpr auto cap = std::numeric_limits<decltype(bluestore_pextent_t::length)>::max();
+	max_alloc_size >= cap) {
+      max_alloc_size = p2align(uint64_t(cap), unit);
+    }
+    auto& s = get_shard();
+    std::lock_guard l(s.lock);
+    if (s.free.size() < want) {
+      PExtentVector refill;
+      backend->allocate(cache_size, unit, 0, hint, &refill);
+      interval_set<uint64_t> to_release;
+      for (auto& e : refill) {
+	cached += e.length;
+	_insert(s, e.offset, e.length, &to_release);
+      }
+      if (!to_release.empty()) {
+	cached -= to_release.size();
+	backend->release(to_release);
+      }
+    }
+    if (s.free.size() >= want) {
+      return _take(s, want, max_alloc_size, extents);
+    }
+  }
+
+  // the allocator is (nearly) out of space, or this is not for the caches
+  size_t old_size = extents->size();
+  int64_t r = backend->allocate(want, unit, max_alloc_size, hint, extents);
+  if (r < (int64_t)want && cached > 0) {
+    // have the free space held by the caches back, and retry
+    ldout(cct, 10) << __func__ << " 0x" << std::hex << want
+		   << " short, draining 0x" << cached.load() << std::dec
+		   << " cached" << dendl;
+    if (extents->size() > old_size) {
+      PExtentVector partial(extents->begin() + old_size, extents->end());
+      extents->resize(old_size);
+      backend->release(partial);
+    }
+    drain();
+    r = backend->allocate(want, unit, max_alloc_size, hint, extents);
+  }
+  return r;
+}
+
+void ShardedAllocator::release(const interval_set<uint64_t>& release_set)
+{
+  if (release_set.size() > cache_size) {
+    backend->release(release_set);
+    return;
+  }
+  auto& s = get_shard();
+  std::lock_guard l(s.lock);
+  interval_set<uint64_t> to_release;
+  cached += release_set.size();
+  for (auto [offset, length] : release_set) {
+    ldout(cct, 20) << __func__ << std::hex
+		   << " 0x" << offset << "~" << length
+		   << std::dec << dendl;
+    _insert(s, offset, length, &to_release);
+  }
+  if (!to_release.empty()) {
+    cached -= to_release.size();
+    backend->release(to_release);
+  }
+  if (s.free.size() > 2 * cache_size) {
+    _trim(s, cache_size);
+  }
+}
+
+double ShardedAllocator::get_fragmentation()
+{
+  // the allocators rate it as (free extents - 1) / (free blocks - 1), to
+  // which the extents held by the caches are added
+  uint64_t cached_extents = 0;
+  uint64_t cached_blocks = 0;
+  for (unsigned i = 0; i < num_shards; ++i) {
+    std::lock_guard l(shards[i].lock);
+    cached_extents += shards[i].free.num_intervals();
+    cached_blocks += shards[i].free.size() / block_size;
+  }
+  double rating = backend->get_fragmentation();
+  if (!cached_extents) {
+    return rating;
+  }
+  uint64_t free_blocks = backend->get_free() / block_size;
+  double extents = free_blocks ? rating * (free_blocks - 1) + 1 : 0;
+  extents += cached_extents;
+  free_blocks += cached_blocks;
+  if (free_blocks <= 1) {
+    return .0;
+  }
+  return (extents - 1) / (free_blocks - 1);
+}
+
+void ShardedAllocator::dump()
+{
+  backend->dump();
+  for (unsigned i = 0; i < num_shards; ++i) {
+    std::lock_guard l(shards[i].lock);
+    ldout(cct, 0) << __func__ << " shard " << i << " cached 0x" << std::hex
+		  << shards[i].free.size() << " " << shards[i].free
+		  << std::dec << dendl;
+  }
+}
+
+void ShardedAllocator::dump(
+  std::function<void(uint64_t offset, uint64_t length)> notify)
+{
+  backend->dump(notify);
+  for (unsigned i = 0; i < num_shards; ++i) {
+    std::lock_guard l(shards[i].lock);
+    for (auto [offset, length] : shards[i].free) {
+      notify(offset, length);
+    }
+  }
+}
+
+void ShardedAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  backend->init_add_free(offset, length);
+}
+
+void ShardedAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  // the range may be cached
+  drain();
+  backend->init_rm_free(offset, length);
+}
+
+void ShardedAllocator::shutdown()
+{
+  drain();
+  backend->shutdown();
+}
@@ -0,0 +1,85 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "Allocator.h"
+#include "common/ceph_mutex.h"
+#include "include/intarith.h"
+
+/*
+ * A front-end to another allocator, keeping per-CPU caches of free extents.
+ *
+ * Allocations and releases of up to 'cache_size' bytes in units of the
+ * allocator's block size are served from the cache of the CPU the caller runs
+ * on, so that concurrent writers mostly take their own shard's lock rather
+ * than the allocator's one. An empty cache is refilled with 'cache_size' bytes
+ * at once, and a cache grown over twice this size hands the excess back. When
+ * the allocator runs dry the other caches are drained, so that no free space
+ * is held back from a request. Cached extents shorter than 'min_extent_size'
+ * go back to the allocator too, which can merge them with their neighbours,
+ * rather than being handed out in pieces.
+ *
+ * Larger requests, and those in other units (bluefs), go to the allocator.
+ */
+class ShardedAllocator : public Allocator {
+  CephContext* cct;
+  std::unique_ptr<Allocator> backend;
+  const uint64_t cache_size;
+  const uint64_t min_extent_size;
+
+  struct alignas(64) shard_t {
+    ceph::mutex lock = ceph::make_mutex("ShardedAllocator::shard_t::lock");
+    interval_set<uint64_t> free;
+  };
+  const unsigned num_shards;
+  std::unique_ptr<shard_t[]> shards;
+  /// the bytes held by all the caches
+  std::atomic<uint64_t> cached = {0};
+
+  shard_t& get_shard();
+  /// add an extent to the shard, or to 'to_release' if what it ends up in is
+  /// too short; called with its lock held
+  void _insert(shard_t& s, uint64_t offset, uint64_t length,
+	       interval_set<uint64_t>* to_release);
+  /// take up to 'want' bytes from the shard; called with its lock held
+  uint64_t _take(shard_t& s, uint64_t want, uint64_t max_alloc_size,
+		 PExtentVector* extents);
+  /// hand the shard's cache back to the allocator, down to 'keep' bytes
+  void _trim(shard_t& s, uint64_t keep);
+  void drain();
+
+public:
+  ShardedAllocator(CephContext* cct, Allocator* backend,
+		   unsigned num_shards, uint64_t cache_size,
+		   uint64_t min_extent_size, std::string_view name);
+  ~ShardedAllocator() override;
+
+  const char* get_type() const override
+  {
+    return backend->get_type();
+  }
+  int64_t allocate(
+    uint64_t want, uint64_t unit, uint64_t max_alloc_size,
+    int64_t hint, PExtentVector* extents) override;
+
+  void release(const interval_set<uint64_t>& release_set) override;
+  using Allocator::release;
+
+  uint64_t get_free() override
+  {
+    return backend->get_free() + cached;
+  }
+  double get_fragmentation() override;
+
+  void dump() override;
+  void dump(std::function<void(uint64_t offset, uint64_t length)> notify) override;
+
+  void init_add_free(uint64_t offset, uint64_t length) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+
+  void shutdown() override;
+};
@@ -197,6 +197,15 @@ void bluestore_extent_ref_map_t::get(uint64_t offset, uint32_t length)
   //_check();
 }
 
+void bluestore_extent_ref_map_t::add(const bluestore_extent_ref_map_t& o)
+{
+  for (auto& [offset, r] : o.ref_map) {
+    for (uint32_t i = 0; i < r.refs; ++i) {
+      get(offset, r.length);
+    }
+  }
+}
+
 void bluestore_extent_ref_map_t::put(
   uint64_t offset, uint32_t length,
   PExtentVector *release,
@@ -1103,11 +1112,18 @@ void bluestore_onode_t::dump(Formatter *f) const
   f->dump_unsigned("expected_object_size", expected_object_size);
   f->dump_unsigned("expected_write_size", expected_write_size);
   f->dump_unsigned("alloc_hint_flags", alloc_hint_flags);
+  if (has_inline_data()) {
+    f->dump_unsigned("inline_data_len", inline_data.length());
+  }
 }
 
 void bluestore_onode_t::generate_test_instances(list<bluestore_onode_t*>& o)
 {
   o.push_back(new bluestore_onode_t());
+  o.push_back(new bluestore_onode_t());
+  o.back()->size = 5;
+  o.back()->set_flag(FLAG_INLINE_DATA);
+  o.back()->inline_data.append("hello");
   // FIXME
 }
 
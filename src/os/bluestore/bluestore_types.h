@@ -172,6 +172,8 @@ struct bluestore_extent_ref_map_t {
   }
 
   void get(uint64_t offset, uint32_t len);
+  /// get all the refs of o
+  void add(const bluestore_extent_ref_map_t& o);
   void put(uint64_t offset, uint32_t len, PExtentVector *release,
 	   bool *maybe_unshared);
 
@@ -960,11 +962,15 @@ struct bluestore_onode_t {
 
   uint8_t flags = 0;
 
+  /// object data, if stored in the onode (FLAG_INLINE_DATA)
+  ceph::buffer::list inline_data;
+
   enum {
     FLAG_OMAP = 1,         ///< object may have omap data
     FLAG_PGMETA_OMAP = 2,  ///< omap data is in meta omap prefix
     FLAG_PERPOOL_OMAP = 4, ///< omap data is in per-pool prefix; per-pool keys
     FLAG_PERPG_OMAP = 8,   ///< omap data is in per-pg prefix; per-pg keys
+    FLAG_INLINE_DATA = 16, ///< data is in inline_data, not in extents
   };
 
   std::string get_flags_string() const {
@@ -981,6 +987,9 @@ struct bluestore_onode_t {
     if (flags & FLAG_PERPG_OMAP) {
       s += "+per_pg_omap";
     }
+    if (flags & FLAG_INLINE_DATA) {
+      s += "+inline_data";
+    }
     return s;
   }
 
@@ -1008,6 +1017,9 @@ struct bluestore_onode_t {
   bool is_perpg_omap() const {
     return has_flag(FLAG_PERPG_OMAP);
   }
+  bool has_inline_data() const {
+    return has_flag(FLAG_INLINE_DATA);
+  }
 
   void set_omap_flags() {
     set_flag(FLAG_OMAP | FLAG_PERPOOL_OMAP | FLAG_PERPG_OMAP);
@@ -1021,7 +1033,8 @@ struct bluestore_onode_t {
   }
 
   DENC(bluestore_onode_t, v, p) {
-    DENC_START(1, 1, p);
+    // the inline data can't be skipped: see inline_data_compat_ondisk_format
+    DENC_START(2, v.has_inline_data() ? 2 : 1, p);
     denc_varint(v.nid, p);
     denc_varint(v.size, p);
     denc(v.attrs, p);
@@ -1030,6 +1043,9 @@ struct bluestore_onode_t {
     denc_varint(v.expected_object_size, p);
     denc_varint(v.expected_write_size, p);
     denc_varint(v.alloc_hint_flags, p);
+    if (struct_v >= 2 && v.has_inline_data()) {
+      denc(v.inline_data, p);
+    }
     DENC_FINISH(p);
   }
   void dump(ceph::Formatter *f) const;
@@ -51,73 +51,48 @@ interval_t AllocatorLevel01Loose::_get_longest_from_l0(uint64_t pos0,
   *tail = interval_t();
 
   auto d = bits_per_slot;
-  slot_t bits = l0[pos / d];
-  bits >>= pos % d;
-  bool end_loop = false;
   auto min_granules = min_length / l0_granularity;
-
-  do {
-    if ((pos % d) == 0) {
-      bits = l0[pos / d];
-      if (pos1 - pos >= d) {
-        switch(bits) {
-	  case all_slot_set:
-	    // slot is totally free
-	    if (!res_candidate.length) {
-	      res_candidate.offset = pos;
-	    }
-	    res_candidate.length += d;
-	    pos += d;
-	    end_loop = pos >= pos1;
-	    if (end_loop) {
-	      *tail = res_candidate;
-	      res_candidate = _align2units(res_candidate.offset,
-		res_candidate.length, min_granules);
-	      if(res.length < res_candidate.length) {
-		res = res_candidate;
-	      }
-	    }
-	    continue;
-	  case all_slot_clear:
-	    // slot is totally allocated
-	    res_candidate = _align2units(res_candidate.offset,
-	      res_candidate.length, min_granules);
-	    if (res.length < res_candidate.length) {
-	      res = res_candidate;
-	    }
-	    res_candidate = interval_t();
-	    pos += d;
-	    end_loop = pos >= pos1;
-	    continue;
+  auto close_candidate = [&]() {
+    res_candidate = _align2units(res_candidate.offset,
+      res_candidate.length, min_granules);
+    if (res.length < res_candidate.length) {
+      res = res_candidate;
+    }
+    res_candidate = interval_t();
+  };
+
+  // walk the runs of free and allocated items a slot at a time
+  while (pos < pos1) {
+    slot_t bits = l0[pos / d] >> (pos % d);
+    uint64_t left = std::min<uint64_t>(d - pos % d, pos1 - pos);
+    while (left) {
+      uint64_t run;
+      if (bits & 1) {
+	// items are free
+	run = std::min<uint64_t>(count_1s(bits, 0), left);
+	if (!res_candidate.length) {
+	  res_candidate.offset = pos;
 	}
-      }
-    } //if ((pos % d) == 0)
-
-    end_loop = ++pos >= pos1;
-    if (bits & 1) {
-      // item is free
-      if (!res_candidate.length) {
-	res_candidate.offset = pos - 1;
-      }
-      ++res_candidate.length;
-      if (end_loop) {
-	*tail = res_candidate;
-	res_candidate = _align2units(res_candidate.offset,
-	  res_candidate.length, min_granules);
-	if (res.length < res_candidate.length) {
-	  res = res_candidate;
+	res_candidate.length += run;
+      } else {
+	// items are allocated
+	run = std::min<uint64_t>(count_0s(bits, 0), left);
+	if (res_candidate.length) {
+	  close_candidate();
 	}
       }
-    } else {
-      res_candidate = _align2units(res_candidate.offset,
-	res_candidate.length, min_granules);
-      if (res.length < res_candidate.length) {
-	res = res_candidate;
+      pos += run;
+      left -= run;
+      if (left) {
+	bits >>= run;
       }
-      res_candidate = interval_t();
     }
-    bits >>= 1;
-  } while (!end_loop);
+  }
+  if (res_candidate.length) {
+    // free till the end, to be continued by the next call
+    *tail = res_candidate;
+    close_candidate();
+  }
   res.offset *= l0_granularity;
   res.length *= l0_granularity;
   tail->offset *= l0_granularity;
@@ -142,8 +117,12 @@ void AllocatorLevel01Loose::_analyze_partials(uint64_t pos_start,
   uint64_t next_free_l1_pos = 0;
   for (auto pos = pos_start / d; pos < pos_end / d; ++pos) {
     slot_t slot_val = l1[pos];
-    // FIXME minor: code below can be optimized to check slot_val against
-    // all_slot_set(_clear) value
+    if (slot_val == all_slot_clear) {
+      // all the entries are full
+      prev_tail = empty_tail;
+      l1_pos += d;
+      continue;
+    }
 
     for (auto c = 0; c < d; c++) {
       switch (slot_val & L1_ENTRY_MASK) {
@@ -285,25 +264,20 @@ void AllocatorLevel01Loose::_mark_alloc_l0(int64_t l0_pos_start,
   auto d0 = L0_ENTRIES_PER_SLOT;
 
   int64_t pos = l0_pos_start;
-  slot_t bits = (slot_t)1 << (l0_pos_start % d0);
   slot_t* val_s = l0.data() + (pos / d0);
   int64_t pos_e = std::min(l0_pos_end, p2roundup<int64_t>(l0_pos_start + 1, d0));
-  while (pos < pos_e) {
-    (*val_s) &= ~bits;
-    bits <<= 1;
-    pos++;
+  if (pos < pos_e) {
+    (*val_s) &= ~slot_bits(pos % d0, pos_e - pos);
+    pos = pos_e;
   }
   pos_e = std::min(l0_pos_end, p2align<int64_t>(l0_pos_end, d0));
   while (pos < pos_e) {
     *(++val_s) = all_slot_clear;
     pos += d0;
   }
-  bits = 1;
   ++val_s;
-  while (pos < l0_pos_end) {
-    (*val_s) &= ~bits;
-    bits <<= 1;
-    pos++;
+  if (pos < l0_pos_end) {
+    (*val_s) &= ~slot_bits(0, l0_pos_end - pos);
   }
 }
 
@@ -68,6 +68,14 @@ inline size_t find_next_set_bit(slot_t slot_val, size_t start_pos)
   return start_pos;
 }
 
+// the mask of 'count' bits starting at 'start_pos'
+inline slot_t slot_bits(size_t start_pos, size_t count)
+{
+  if (count >= bits_per_slot) {
+    return all_slot_set;
+  }
+  return ((slot_t(1) << count) - 1) << start_pos;
+}
 
 class AllocatorLevel
 {
@@ -339,26 +347,21 @@ protected:
     auto d0 = L0_ENTRIES_PER_SLOT;
 
     auto pos = l0_pos_start;
-    slot_t bits = (slot_t)1 << (l0_pos_start % d0);
-    slot_t* val_s = &l0[pos / d0];
+    slot_t* val_s = l0.data() + (pos / d0);
     int64_t pos_e = std::min(l0_pos_end,
                              p2roundup<int64_t>(l0_pos_start + 1, d0));
-    while (pos < pos_e) {
-      *val_s |=  bits;
-      bits <<= 1;
-      pos++;
+    if (pos < pos_e) {
+      *val_s |= slot_bits(pos % d0, pos_e - pos);
+      pos = pos_e;
     }
     pos_e = std::min(l0_pos_end, p2align<int64_t>(l0_pos_end, d0));
     while (pos < pos_e) {
       *(++val_s) = all_slot_set;
       pos += d0;
     }
-    bits = 1;
     ++val_s;
-    while (pos < l0_pos_end) {
-      *val_s |= bits;
-      bits <<= 1;
-      pos++;
+    if (pos < l0_pos_end) {
+      *val_s |= slot_bits(0, l0_pos_end - pos);
     }
   }
 
@@ -669,6 +669,8 @@ public:
     ObjectStore::Transaction *t) override;
 
   bool auto_repair_supported() const override { return true; }
+  // the shards' digests are not those recorded in the object info
+  bool incremental_deep_scrub_supported() const override { return false; }
 
   int be_deep_scrub(
     const hobject_t &poid,
@@ -116,6 +116,7 @@
 
 #include "messages/MOSDScrub.h"
 #include "messages/MOSDScrub2.h"
+#include "messages/MOSDScrubReserve.h"
 #include "messages/MOSDRepScrub.h"
 
 #include "messages/MCommand.h"
@@ -267,8 +268,8 @@ OSDService::OSDService(OSD *osd, ceph::async::io_context_pool& poolctx) :
   publish_lock{ceph::make_mutex("OSDService::publish_lock")},
   pre_publish_lock{ceph::make_mutex("OSDService::pre_publish_lock")},
   max_oldest_map(0),
-  scrubs_local(0),
-  scrubs_remote(0),
+  m_scrub_queue{cct},
+  m_scrub_hasher{cct},
   agent_valid_iterator(false),
   agent_ops(0),
   flush_mode_high_count(0),
@@ -526,6 +527,8 @@ void OSDService::shutdown()
     f->stop();
   }
 
+  m_scrub_hasher.stop();
+
   publish_map(OSDMapRef());
   next_osdmap = OSDMapRef();
 }
@@ -546,6 +549,7 @@ void OSDService::init()
   mono_timer.resume();
 
   agent_thread.create("osd_srv_agent");
+  m_scrub_hasher.start();
 
   if (cct->_conf->osd_recovery_delay_start)
     defer_recovery(cct->_conf->osd_recovery_delay_start);
@@ -1267,79 +1271,6 @@ void OSDService::prune_pg_created()
 // --------------------------------------
 // dispatch
 
-bool OSDService::can_inc_scrubs()
-{
-  bool can_inc = false;
-  std::lock_guard l(sched_scrub_lock);
-
-  if (scrubs_local + scrubs_remote < cct->_conf->osd_max_scrubs) {
-    dout(20) << __func__ << " == true " << scrubs_local << " local + " << scrubs_remote
-	     << " remote < max " << cct->_conf->osd_max_scrubs << dendl;
-    can_inc = true;
-  } else {
-    dout(20) << __func__ << " == false " << scrubs_local << " local + " << scrubs_remote
-	     << " remote >= max " << cct->_conf->osd_max_scrubs << dendl;
-  }
-
-  return can_inc;
-}
-
-bool OSDService::inc_scrubs_local()
-{
-  bool result = false;
-  std::lock_guard l{sched_scrub_lock};
-  if (scrubs_local + scrubs_remote < cct->_conf->osd_max_scrubs) {
-    dout(20) << __func__ << " " << scrubs_local << " -> " << (scrubs_local+1)
-	     << " (max " << cct->_conf->osd_max_scrubs << ", remote " << scrubs_remote << ")" << dendl;
-    result = true;
-    ++scrubs_local;
-  } else {
-    dout(20) << __func__ << " " << scrubs_local << " local + " << scrubs_remote << " remote >= max " << cct->_conf->osd_max_scrubs << dendl;
-  }
-  return result;
-}
-
-void OSDService::dec_scrubs_local()
-{
-  std::lock_guard l{sched_scrub_lock};
-  dout(20) << __func__ << " " << scrubs_local << " -> " << (scrubs_local-1)
-	   << " (max " << cct->_conf->osd_max_scrubs << ", remote " << scrubs_remote << ")" << dendl;
-  --scrubs_local;
-  ceph_assert(scrubs_local >= 0);
-}
-
-bool OSDService::inc_scrubs_remote()
-{
-  bool result = false;
-  std::lock_guard l{sched_scrub_lock};
-  if (scrubs_local + scrubs_remote < cct->_conf->osd_max_scrubs) {
-    dout(20) << __func__ << " " << scrubs_remote << " -> " << (scrubs_remote+1)
-	     << " (max " << cct->_conf->osd_max_scrubs << ", local " << scrubs_local << ")" << dendl;
-    result = true;
-    ++scrubs_remote;
-  } else {
-    dout(20) << __func__ << " " << scrubs_local << " local + " << scrubs_remote << " remote >= max " << cct->_conf->osd_max_scrubs << dendl;
-  }
-  return result;
-}
-
-void OSDService::dec_scrubs_remote()
-{
-  std::lock_guard l{sched_scrub_lock};
-  dout(20) << __func__ << " " << scrubs_remote << " -> " << (scrubs_remote-1)
-	   << " (max " << cct->_conf->osd_max_scrubs << ", local " << scrubs_local << ")" << dendl;
-  --scrubs_remote;
-  ceph_assert(scrubs_remote >= 0);
-}
-
-void OSDService::dump_scrub_reservations(Formatter *f)
-{
-  std::lock_guard l{sched_scrub_lock};
-  f->dump_int("scrubs_local", scrubs_local);
-  f->dump_int("scrubs_remote", scrubs_remote);
-  f->dump_int("osd_max_scrubs", cct->_conf->osd_max_scrubs);
-}
-
 void OSDService::retrieve_epochs(epoch_t *_boot_epoch, epoch_t *_up_epoch,
                                  epoch_t *_bind_epoch) const
 {
@@ -1754,7 +1685,7 @@ void OSDService::queue_scrub_event_msg(PG* pg,
   dout(15) << "queue a scrub event (" << *msg << ") for " << *pg << ". Epoch: " << epoch << dendl;
 
   enqueue_back(OpSchedulerItem(
-    unique_ptr<OpSchedulerItem::OpQueueable>(msg), cct->_conf->osd_scrub_cost,
+    unique_ptr<OpSchedulerItem::OpQueueable>(msg), pg->scrub_requeue_cost(),
     pg->scrub_requeue_priority(with_priority, qu_priority), ceph_clock_now(), 0, epoch));
 }
 
@@ -1766,7 +1697,7 @@ void OSDService::queue_scrub_event_msg(PG* pg, Scrub::scrub_prio_t with_priority
   dout(15) << "queue a scrub event (" << *msg << ") for " << *pg << ". Epoch: " << epoch << dendl;
 
   enqueue_back(OpSchedulerItem(
-    unique_ptr<OpSchedulerItem::OpQueueable>(msg), cct->_conf->osd_scrub_cost,
+    unique_ptr<OpSchedulerItem::OpQueueable>(msg), pg->scrub_requeue_cost(),
     pg->scrub_requeue_priority(with_priority), ceph_clock_now(), 0, epoch));
 }
 
@@ -7294,6 +7225,18 @@ void OSD::ms_fast_dispatch(Message *m)
   case MSG_OSD_SCRUB2:
     handle_fast_scrub(static_cast<MOSDScrub2*>(m));
     return;
+  case MSG_OSD_SCRUB_RESERVE:
+    {
+      // slot requests are addressed to us as a bucket's coordinator, and not
+      // to any PG of ours
+      auto sm = static_cast<MOSDScrubReserve*>(m);
+      if (sm->type == MOSDScrubReserve::SLOT_REQUEST ||
+	  sm->type == MOSDScrubReserve::SLOT_RELEASE) {
+	handle_fast_scrub_slot(sm);
+	return;
+      }
+    }
+    break;
   case MSG_OSD_PG_CREATE2:
     return handle_fast_pg_create(static_cast<MOSDPGCreate2*>(m));
   case MSG_OSD_PG_NOTIFY:
@@ -7559,69 +7502,49 @@ void OSD::handle_fast_scrub(MOSDScrub2 *m)
   m->put();
 }
 
-bool OSD::scrub_random_backoff()
+void OSD::handle_fast_scrub_slot(MOSDScrubReserve *m)
 {
-  bool coin_flip = (rand() / (double)RAND_MAX >=
-		    cct->_conf->osd_scrub_backoff_ratio);
-  if (!coin_flip) {
-    dout(20) << "scrub_random_backoff lost coin flip, randomly backing off" << dendl;
-    return true;
+  dout(10) << __func__ << " " << *m << dendl;
+  if (!require_osd_peer(m)) {
+    m->put();
+    return;
+  }
+  auto& scrub_queue = service.get_scrub_services();
+  if (m->type == MOSDScrubReserve::SLOT_RELEASE) {
+    scrub_queue.release_slot(m->bucket, m->pgid.pgid);
+    m->put();
+    return;
   }
-  return false;
-}
-
-OSDService::ScrubJob::ScrubJob(CephContext* cct,
-			       const spg_t& pg, const utime_t& timestamp,
-			       double pool_scrub_min_interval,
-			       double pool_scrub_max_interval, bool must)
-  : cct(cct),
-    pgid(pg),
-    sched_time(timestamp),
-    deadline(timestamp)
-{
-  // if not explicitly requested, postpone the scrub with a random delay
-  if (!must) {
-    double scrub_min_interval = pool_scrub_min_interval > 0 ?
-      pool_scrub_min_interval : cct->_conf->osd_scrub_min_interval;
-    double scrub_max_interval = pool_scrub_max_interval > 0 ?
-      pool_scrub_max_interval : cct->_conf->osd_scrub_max_interval;
-
-    sched_time += scrub_min_interval;
-    double r = rand() / (double)RAND_MAX;
-    sched_time +=
-      scrub_min_interval * cct->_conf->osd_scrub_interval_randomize_ratio * r;
-    if (scrub_max_interval == 0) {
-      deadline = utime_t();
-    } else {
-      deadline += scrub_max_interval;
-    }
 
+  // the requesting primary may be using a different map. We only grant slots
+  // of the buckets we coordinate according to ours.
+  bool granted = false;
+  auto osdmap = service.get_osdmap();
+  if (ScrubQueue::get_slot_coordinator(*osdmap, m->bucket) == whoami) {
+    auto limit = scrub_queue.get_slot_limit(*osdmap, m->bucket);
+    granted = !limit || scrub_queue.grant_slot(m->bucket, m->pgid.pgid,
+					       m->from.osd, limit);
   }
-}
+  dout(15) << __func__ << " " << m->pgid << " bucket " << m->bucket << " granted? "
+	   << granted << dendl;
 
-bool OSDService::ScrubJob::ScrubJob::operator<(const OSDService::ScrubJob& rhs) const {
-  if (sched_time < rhs.sched_time)
-    return true;
-  if (sched_time > rhs.sched_time)
-    return false;
-  return pgid < rhs.pgid;
+  auto reply = new MOSDScrubReserve(
+    m->pgid, m->map_epoch,
+    granted ? MOSDScrubReserve::SLOT_GRANT : MOSDScrubReserve::SLOT_REJECT,
+    pg_shard_t(whoami, shard_id_t::NO_SHARD), m->bucket);
+  service.send_message_osd_cluster(reply, m->get_connection());
+  m->put();
 }
 
-void OSDService::dumps_scrub(ceph::Formatter *f)
+bool OSD::scrub_random_backoff()
 {
-  ceph_assert(f != nullptr);
-  std::lock_guard l(sched_scrub_lock);
-
-  f->open_array_section("scrubs");
-  for (const auto &i: sched_scrub_pg) {
-    f->open_object_section("scrub");
-    f->dump_stream("pgid") << i.pgid;
-    f->dump_stream("sched_time") << i.sched_time;
-    f->dump_stream("deadline") << i.deadline;
-    f->dump_bool("forced", i.sched_time == PgScrubber::scrub_must_stamp());
-    f->close_section();
+  bool coin_flip = (rand() / (double)RAND_MAX >=
+		    cct->_conf->osd_scrub_backoff_ratio);
+  if (!coin_flip) {
+    dout(20) << "scrub_random_backoff lost coin flip, randomly backing off" << dendl;
+    return true;
   }
-  f->close_section();
+  return false;
 }
 
 double OSD::scrub_sleep_time(bool must_scrub)
@@ -7745,62 +7668,54 @@ void OSD::sched_scrub()
   bool load_is_low = scrub_load_below_threshold();
   dout(20) << "sched_scrub load_is_low=" << (int)load_is_low << dendl;
 
-  OSDService::ScrubJob scrub_job;
-  if (service.first_scrub_stamp(&scrub_job)) {
-    do {
-      dout(30) << "sched_scrub examine " << scrub_job.pgid << " at " << scrub_job.sched_time << dendl;
-
-      if (scrub_job.sched_time > now) {
-	// save ourselves some effort
-	dout(20) << "sched_scrub " << scrub_job.pgid << " scheduled at " << scrub_job.sched_time
-		 << " > " << now << dendl;
-	break;
-      }
-
-      if ((scrub_job.deadline.is_zero() || scrub_job.deadline >= now) && !(time_permit && load_is_low)) {
-        dout(15) << __func__ << " not scheduling scrub for " << scrub_job.pgid << " due to "
-                 << (!time_permit ? "time not permit" : "high load") << dendl;
-        continue;
-      }
+  auto& scrub_queue = service.get_scrub_services();
+  for (const auto& scrub_job : scrub_queue.ready_jobs(now)) {
+    dout(30) << "sched_scrub examine " << scrub_job.pgid << " at " << scrub_job.sched_time
+	     << " (" << scrub_job.urgency(now) << ")" << dendl;
 
-      PGRef pg = _lookup_lock_pg(scrub_job.pgid);
-      if (!pg) {
-	dout(20) << __func__ << " pg  " << scrub_job.pgid << " not found" << dendl;
-	continue;
-      }
+    if ((scrub_job.deadline.is_zero() || scrub_job.deadline >= now) && !(time_permit && load_is_low)) {
+      dout(15) << __func__ << " not scheduling scrub for " << scrub_job.pgid << " due to "
+	       << (!time_permit ? "time not permit" : "high load") << dendl;
+      continue;
+    }
 
-      // This has already started, so go on to the next scrub job
-      if (pg->is_scrub_active()) {
-	pg->unlock();
-	dout(20) << __func__ << ": already in progress pgid " << scrub_job.pgid << dendl;
-	continue;
-      }
-      // Skip other kinds of scrubbing if only explicitly requested repairing is allowed
-      if (allow_requested_repair_only && !pg->m_planned_scrub.must_repair) {
-        pg->unlock();
-        dout(10) << __func__ << " skip " << scrub_job.pgid
-                 << " because repairing is not explicitly requested on it"
-                 << dendl;
-        continue;
-      }
+    PGRef pg = _lookup_lock_pg(scrub_job.pgid);
+    if (!pg) {
+      dout(20) << __func__ << " pg  " << scrub_job.pgid << " not found" << dendl;
+      continue;
+    }
 
-      // If it is reserving, let it resolve before going to the next scrub job
-      if (pg->m_scrubber->is_reserving()) {
-	pg->unlock();
-	dout(10) << __func__ << ": reserve in progress pgid " << scrub_job.pgid << dendl;
-	break;
-      }
-      dout(15) << "sched_scrub scrubbing " << scrub_job.pgid << " at " << scrub_job.sched_time
-	       << (pg->get_must_scrub() ? ", explicitly requested" :
-		   (load_is_low ? ", load_is_low" : " deadline < now"))
+    // This has already started, so go on to the next scrub job
+    if (pg->is_scrub_active()) {
+      pg->unlock();
+      dout(20) << __func__ << ": already in progress pgid " << scrub_job.pgid << dendl;
+      continue;
+    }
+    // Skip other kinds of scrubbing if only explicitly requested repairing is allowed
+    if (allow_requested_repair_only && !pg->m_planned_scrub.must_repair) {
+      pg->unlock();
+      dout(10) << __func__ << " skip " << scrub_job.pgid
+	       << " because repairing is not explicitly requested on it"
 	       << dendl;
-      if (pg->sched_scrub()) {
-	pg->unlock();
-        dout(10) << __func__ << " scheduled a scrub!" << " (~" << scrub_job.pgid << "~)" << dendl;
-	break;
-      }
+      continue;
+    }
+
+    // If it is reserving, let it resolve before going to the next scrub job
+    if (pg->m_scrubber->is_reserving()) {
+      pg->unlock();
+      dout(10) << __func__ << ": reserve in progress pgid " << scrub_job.pgid << dendl;
+      break;
+    }
+    dout(15) << "sched_scrub scrubbing " << scrub_job.pgid << " at " << scrub_job.sched_time
+	     << (pg->get_must_scrub() ? ", explicitly requested" :
+		 (load_is_low ? ", load_is_low" : " deadline < now"))
+	     << dendl;
+    if (pg->sched_scrub()) {
       pg->unlock();
-    } while (service.next_scrub_stamp(scrub_job, &scrub_job));
+      dout(10) << __func__ << " scheduled a scrub!" << " (~" << scrub_job.pgid << "~)" << dendl;
+      break;
+    }
+    pg->unlock();
   }
   dout(20) << "sched_scrub done" << dendl;
 }
@@ -7808,16 +7723,7 @@ void OSD::sched_scrub()
 void OSD::resched_all_scrubs()
 {
   dout(10) << __func__ << ": start" << dendl;
-  const vector<spg_t> pgs = [this] {
-    vector<spg_t> pgs;
-    OSDService::ScrubJob job;
-    if (service.first_scrub_stamp(&job)) {
-      do {
-        pgs.push_back(job.pgid);
-      } while (service.next_scrub_stamp(job, &job));
-    }
-    return pgs;
-  }();
+  const vector<spg_t> pgs = service.get_scrub_services().list_registered_jobs();
   for (auto& pgid : pgs) {
       dout(20) << __func__ << ": examine " << pgid << dendl;
       PGRef pg = _lookup_lock_pg(pgid);
@@ -8968,6 +8874,16 @@ void OSD::consume_map()
   service.await_reserved_maps();
   service.publish_map(osdmap);
 
+  // drop the scrub slots we can no longer vouch for: held by OSDs that are no
+  // longer their PG's primary, or of buckets we no longer coordinate
+  service.get_scrub_services().prune_slots(
+    [this, &osdmap](int bucket, pg_t pgid, int holder) {
+      int primary = -1;
+      osdmap->pg_to_acting_osds(pgid, nullptr, &primary);
+      return primary == holder &&
+	     ScrubQueue::get_slot_coordinator(*osdmap, bucket) == whoami;
+    });
+
   // prime splits and merges
   set<pair<spg_t,epoch_t>> newly_split;  // splits, and when
   set<pair<spg_t,epoch_t>> merge_pgs;    // merge participants, and when
@@ -10238,12 +10154,47 @@ void OSD::maybe_override_max_osd_capacity_for_qos()
         cct->_conf.set_val(
           "osd_mclock_max_capacity_iops_ssd", std::to_string(iops));
       }
+    }
 
-      // Override the max osd capacity for all shards
-      for (auto& shard : shards) {
-        shard->update_scheduler_config();
+    // Write 100MiB with blocksize 4MiB, to measure the sequential
+    // bandwidth the scrub allocations are derived from. Unless it was
+    // configured: the bench is not worth its 100MiB then.
+    const char *bandwidth_key = store_is_rotational ?
+      "osd_mclock_max_sequential_bandwidth_hdd" :
+      "osd_mclock_max_sequential_bandwidth_ssd";
+    const Option *bandwidth_opt = cct->_conf.get_schema(bandwidth_key);
+    ceph_assert(bandwidth_opt);
+    if (cct->_conf.get_val<Option::size_t>(bandwidth_key) !=
+	std::get<Option::size_t>(bandwidth_opt->value)) {
+      dout(1) << __func__ << " " << bandwidth_key << " is set, "
+              << "not measuring the sequential bandwidth" << dendl;
+    } else {
+      count = 104857600;
+      bsize = 4194304;
+      onum = 25;
+      ss.str("");
+      ret = run_osd_bench_test(count, bsize, osize, onum, &elapsed, ss);
+      if (ret != 0) {
+        derr << __func__
+             << " osd bench (bandwidth) err: " << ret
+             << " osd bench errstr: " << ss.str()
+             << dendl;
+      } else {
+        uint64_t rate = count / elapsed;
+        dout(1) << __func__
+                << " osd bench result -"
+                << std::fixed << std::setprecision(3)
+                << " sequential bandwidth (MiB/sec): " << rate / (1024.0 * 1024)
+                << " elapsed_sec: " << elapsed
+                << dendl;
+        cct->_conf.set_val(bandwidth_key, std::to_string(rate));
       }
     }
+
+    // Override the max osd capacity for all shards
+    for (auto& shard : shards) {
+      shard->update_scheduler_config();
+    }
   }
 }
 
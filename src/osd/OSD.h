@@ -52,6 +52,8 @@
 #include "messages/MOSDOp.h"
 #include "common/EventTrace.h"
 #include "osd/osd_perf_counters.h"
+#include "osd/ScrubHasher.h"
+#include "osd/osd_scrub_sched.h"
 #include "common/Finisher.h"
 
 #define CEPH_OSD_PROTOCOL    10 /* cluster internal */
@@ -262,29 +264,18 @@ public:
 
 private:
   // -- scrub scheduling --
-  ceph::mutex sched_scrub_lock = ceph::make_mutex("OSDService::sched_scrub_lock");
-  int scrubs_local;
-  int scrubs_remote;
+  ScrubQueue m_scrub_queue;
+
+  /// computes deep-scrub digests off the PG lock (if so configured)
+  Scrub::ScrubHasher m_scrub_hasher;
 
 public:
-  struct ScrubJob {
-    CephContext* cct;
-    /// pg to be scrubbed
-    spg_t pgid;
-    /// a time scheduled for scrub. but the scrub could be delayed if system
-    /// load is too high or it fails to fall in the scrub hours
-    utime_t sched_time;
-    /// the hard upper bound of scrub time
-    utime_t deadline;
-    ScrubJob() : cct(nullptr) {}
-    explicit ScrubJob(CephContext* cct, const spg_t& pg,
-		      const utime_t& timestamp,
-		      double pool_scrub_min_interval = 0,
-		      double pool_scrub_max_interval = 0, bool must = true);
-    /// order the jobs by sched_time
-    bool operator<(const ScrubJob& rhs) const;
-  };
-  std::set<ScrubJob> sched_scrub_pg;
+  ScrubQueue& get_scrub_services() { return m_scrub_queue; }
+
+  /// nullptr if the deep-scrub digests are to be computed inline
+  Scrub::ScrubHasher* get_scrub_hasher() {
+    return m_scrub_hasher.is_enabled() ? &m_scrub_hasher : nullptr;
+  }
 
   /// @returns the scrub_reg_stamp used for unregistering the scrub job
   utime_t reg_pg_scrub(spg_t pgid,
@@ -292,47 +283,24 @@ public:
 		       double pool_scrub_min_interval,
 		       double pool_scrub_max_interval,
 		       bool must) {
-    ScrubJob scrub_job(cct, pgid, t, pool_scrub_min_interval, pool_scrub_max_interval,
-		       must);
-    std::lock_guard l(OSDService::sched_scrub_lock);
-    sched_scrub_pg.insert(scrub_job);
-    return scrub_job.sched_time;
-  }
-
-  void unreg_pg_scrub(spg_t pgid, utime_t t) {
-    std::lock_guard l(sched_scrub_lock);
-    size_t removed = sched_scrub_pg.erase(ScrubJob(cct, pgid, t));
-    ceph_assert(removed);
+    return m_scrub_queue.register_job(pgid, t, pool_scrub_min_interval,
+				      pool_scrub_max_interval, must);
   }
 
-  bool first_scrub_stamp(ScrubJob *out) {
-    std::lock_guard l(sched_scrub_lock);
-    if (sched_scrub_pg.empty())
-      return false;
-    std::set<ScrubJob>::iterator iter = sched_scrub_pg.begin();
-    *out = *iter;
-    return true;
-  }
-  bool next_scrub_stamp(const ScrubJob& next,
-			ScrubJob *out) {
-    std::lock_guard l(sched_scrub_lock);
-    if (sched_scrub_pg.empty())
-      return false;
-    std::set<ScrubJob>::const_iterator iter = sched_scrub_pg.upper_bound(next);
-    if (iter == sched_scrub_pg.cend())
-      return false;
-    *out = *iter;
-    return true;
+  void unreg_pg_scrub(spg_t pgid) {
+    m_scrub_queue.remove_job(pgid);
   }
 
-  void dumps_scrub(ceph::Formatter* f);
+  void dumps_scrub(ceph::Formatter* f) { m_scrub_queue.dump_scrubs(f); }
 
-  bool can_inc_scrubs();
-  bool inc_scrubs_local();
-  void dec_scrubs_local();
-  bool inc_scrubs_remote();
-  void dec_scrubs_remote();
-  void dump_scrub_reservations(ceph::Formatter *f);
+  bool can_inc_scrubs() { return m_scrub_queue.can_inc_scrubs(); }
+  bool inc_scrubs_local() { return m_scrub_queue.inc_scrubs_local(); }
+  void dec_scrubs_local() { m_scrub_queue.dec_scrubs_local(); }
+  bool inc_scrubs_remote() { return m_scrub_queue.inc_scrubs_remote(); }
+  void dec_scrubs_remote() { m_scrub_queue.dec_scrubs_remote(); }
+  void dump_scrub_reservations(ceph::Formatter *f) {
+    m_scrub_queue.dump_scrub_reservations(f);
+  }
 
   void reply_op_error(OpRequestRef op, int err);
   void reply_op_error(OpRequestRef op, int err, eversion_t v, version_t uv,
@@ -2088,6 +2056,7 @@ private:
 
   void handle_scrub(class MOSDScrub *m);
   void handle_fast_scrub(class MOSDScrub2 *m);
+  void handle_fast_scrub_slot(class MOSDScrubReserve *m);
   void handle_osd_ping(class MOSDPing *m);
 
   size_t get_num_cache_shards();
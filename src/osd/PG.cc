@@ -21,6 +21,7 @@
 #include "OSD.h"
 #include "OpRequest.h"
 #include "ScrubStore.h"
+#include "ScrubVerifiedStore.h"
 #include "pg_scrubber.h"
 #include "Session.h"
 #include "osd/scheduler/OpSchedulerItem.h"
@@ -577,6 +578,11 @@ void PG::merge_from(map<spg_t,PGRef>& sources, PeeringCtx &rctx,
     // wipe out source's pgmeta
     rctx.transaction.remove(source->coll, source->pgmeta_oid);
 
+    // and move its deep scrub verification records to ours
+    if (source->get_verified_store().merge_into(&rctx.transaction, info.pgid)) {
+      get_verified_store().records_added();
+    }
+
     // merge (and destroy source collection)
     rctx.transaction.merge_collection(source->coll, coll, split_bits);
   }
@@ -1201,6 +1207,28 @@ void PG::update_snap_map(
   }
 }
 
+void PG::forget_scrub_verified(
+  const vector<pg_log_entry_t> &log_entries,
+  ObjectStore::Transaction &t)
+{
+  vector<hobject_t> removed;
+  for (const auto& e : log_entries) {
+    if (e.is_delete()) {
+      removed.push_back(e.soid);
+    }
+  }
+  get_verified_store().forget(&t, removed);
+}
+
+Scrub::VerifiedStore& PG::get_verified_store()
+{
+  if (!m_verified_store) {
+    m_verified_store =
+      std::make_unique<Scrub::VerifiedStore>(osd->store, info.pgid);
+  }
+  return *m_verified_store;
+}
+
 /**
  * filter trimming|trimmed snaps out of snapcontext
  */
@@ -1314,6 +1342,11 @@ unsigned int PG::scrub_requeue_priority(Scrub::scrub_prio_t with_priority, unsig
   return m_scrubber->scrub_requeue_priority(with_priority, suggested_priority);
 }
 
+int PG::scrub_requeue_cost() const
+{
+  return m_scrubber->scrub_requeue_cost();
+}
+
 // ==========================================================================================
 // SCRUB
 
@@ -1671,6 +1704,10 @@ void PG::on_active_exit()
 
 void PG::on_active_advmap(const OSDMapRef &osdmap)
 {
+  if (is_primary() && m_scrubber) {
+    m_scrubber->on_active_advmap(*osdmap);
+  }
+
   const auto& new_removed_snaps = osdmap->get_new_removed_snaps();
   auto i = new_removed_snaps.find(get_pgid().pool());
   if (i != new_removed_snaps.end()) {
@@ -2630,6 +2667,7 @@ std::pair<ghobject_t, bool> PG::do_delete_work(
     {
       PGRef pgref(this);
       PGLog::clear_info_log(info.pgid, &t);
+      Scrub::VerifiedStore::remove(&t, info.pgid);
       t.remove_collection(coll);
       t.register_on_commit(new ContainerContext<PGRef>(pgref));
       t.register_on_applied(new ContainerContext<PGRef>(pgref));
@@ -65,6 +65,7 @@ class PgScrubber;
 
 namespace Scrub {
   class Store;
+  class VerifiedStore;
   class ReplicaReservations;
   class LocalReservation;
   class ReservedByRemotePrimary;
@@ -175,12 +176,16 @@ public:
   const spg_t pg_id;
 
   std::unique_ptr<ScrubPgIF> m_scrubber;
+  std::unique_ptr<Scrub::VerifiedStore> m_verified_store;
 
   /// flags detailing scheduling/operation characteristics of the next scrub 
   requested_scrub_t m_planned_scrub;
   /// scrubbing state for both Primary & replicas
   bool is_scrub_active() const { return m_scrubber->is_scrub_active(); }
 
+  /// the deep scrub verification records of this PG shard
+  Scrub::VerifiedStore& get_verified_store();
+
 public:
   // -- members --
   const coll_t coll;
@@ -626,6 +631,7 @@ public:
   unsigned int scrub_requeue_priority(Scrub::scrub_prio_t with_priority, unsigned int suggested_priority) const;
   /// the version that refers to flags_.priority
   unsigned int scrub_requeue_priority(Scrub::scrub_prio_t with_priority) const;
+  int scrub_requeue_cost() const;
 private:
   // auxiliaries used by sched_scrub():
   double next_deepscrub_interval() const;
@@ -1269,6 +1275,12 @@ protected:
     const std::vector<pg_log_entry_t> &log_entries,
     ObjectStore::Transaction& t);
 
+  /// drop the deep scrub verification records of the objects removed by
+  /// 'log_entries'
+  void forget_scrub_verified(
+    const std::vector<pg_log_entry_t> &log_entries,
+    ObjectStore::Transaction& t);
+
   void filter_snapc(std::vector<snapid_t> &snaps);
 
   virtual void kick_snap_trim() = 0;
@@ -616,25 +616,40 @@ int PGBackend::be_scan_list(
   ceph_assert(pos.pos < pos.ls.size());
   hobject_t& poid = pos.ls[pos.pos];
 
+  // an object whose deep scrub spans several calls is only stat'ed once
+  const bool stat_done = pos.object_stat_done && map.objects.count(poid);
   struct stat st;
-  int r = store->stat(
-    ch,
-    ghobject_t(
-      poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
-    &st,
-    true);
-  if (r == 0) {
-    ScrubMap::object &o = map.objects[poid];
-    o.size = st.st_size;
-    ceph_assert(!o.negative);
-    store->getattrs(
+  int r = 0;
+  if (!stat_done) {
+    r = store->stat(
       ch,
       ghobject_t(
 	poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
-      o.attrs);
+      &st,
+      true);
+  }
+  if (r == 0) {
+    ScrubMap::object &o = map.objects[poid];
+    if (!stat_done) {
+      o.size = st.st_size;
+      ceph_assert(!o.negative);
+      store->getattrs(
+	ch,
+	ghobject_t(
+	  poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
+	o.attrs);
+    }
 
     if (pos.deep) {
-      r = be_deep_scrub(poid, map, pos, o);
+      if (pos.incremental && pos.data_pos == 0 && pos.omap_pos.empty() &&
+	  be_reuse_verified(poid, map, pos, o)) {
+	r = 0;
+      } else {
+	r = be_deep_scrub(poid, map, pos, o);
+	if (r == 0 && pos.incremental) {
+	  be_note_verified(poid, pos, o);
+	}
+      }
     }
     dout(25) << __func__ << "  " << poid << dendl;
   } else if (r == -ENOENT) {
@@ -650,12 +665,113 @@ int PGBackend::be_scan_list(
     ceph_abort();
   }
   if (r == -EINPROGRESS) {
+    pos.object_stat_done = true;
     return -EINPROGRESS;
   }
   pos.next_object();
   return 0;
 }
 
+namespace {
+/// the object info of a scanned object, if present & decodable
+std::optional<object_info_t> scrubbed_object_info(const ScrubMap::object &o)
+{
+  auto k = o.attrs.find(OI_ATTR);
+  if (k == o.attrs.end()) {
+    return std::nullopt;
+  }
+  bufferlist bl;
+  bl.push_back(k->second);
+  object_info_t oi;
+  try {
+    auto bliter = bl.cbegin();
+    decode(oi, bliter);
+  } catch (...) {
+    return std::nullopt;
+  }
+  return oi;
+}
+}
+
+bool PGBackend::be_reuse_verified(
+  const hobject_t &poid,
+  ScrubMap &map,
+  ScrubMapBuilder &pos,
+  ScrubMap::object &o)
+{
+  auto rec = pos.verified.find(poid);
+  if (rec == pos.verified.end()) {
+    return false;
+  }
+  const scrub_verified_t& v = rec->second;
+  if (v.stamp < pos.verified_since) {
+    dout(20) << __func__ << " " << poid << " verified at " << v.stamp
+	     << ", too long ago" << dendl;
+    return false;
+  }
+
+  // the object must not have changed since it was verified. We also insist
+  // on the object info still carrying the digests we have verified the data
+  // against: that is what we are going to report.
+  auto oi = scrubbed_object_info(o);
+  if (!oi || oi->version != v.version ||
+      !oi->is_data_digest() || oi->data_digest != v.data_digest ||
+      !oi->is_omap_digest() || oi->omap_digest != v.omap_digest ||
+      oi->size != o.size) {
+    dout(20) << __func__ << " " << poid << " modified since verified ("
+	     << v.version << ")" << dendl;
+    return false;
+  }
+
+  o.digest = v.data_digest;
+  o.digest_present = true;
+  o.omap_digest = v.omap_digest;
+  o.omap_digest_present = true;
+
+  if (v.omap_keys > cct->_conf->
+	osd_deep_scrub_large_omap_object_key_threshold ||
+      v.omap_bytes > cct->_conf->
+	osd_deep_scrub_large_omap_object_value_sum_threshold) {
+    o.large_omap_object_found = true;
+    o.large_omap_object_key_count = v.omap_keys;
+    o.large_omap_object_value_size = v.omap_bytes;
+    map.has_large_omap_object_errors = true;
+  }
+  if (v.omap_keys > 0 || v.omap_bytes > 0) {
+    map.has_omap_keys = true;
+    o.object_omap_bytes = v.omap_bytes;
+    o.object_omap_keys = v.omap_keys;
+  }
+  dout(20) << __func__ << " " << poid << " verified at " << v.stamp
+	   << ", not re-read" << dendl;
+  return true;
+}
+
+void PGBackend::be_note_verified(
+  const hobject_t &poid,
+  ScrubMapBuilder &pos,
+  const ScrubMap::object &o)
+{
+  if (o.read_error || !o.digest_present || !o.omap_digest_present) {
+    return;
+  }
+  auto oi = scrubbed_object_info(o);
+  if (!oi || !oi->is_data_digest() || oi->data_digest != o.digest ||
+      !oi->is_omap_digest() || oi->omap_digest != o.omap_digest ||
+      oi->size != o.size) {
+    // nothing we can vouch for: the next deep scrub will read it again
+    return;
+  }
+
+  scrub_verified_t& v = pos.newly_verified[poid];
+  v.version = oi->version;
+  v.data_digest = o.digest;
+  v.omap_digest = o.omap_digest;
+  v.omap_keys = pos.omap_keys;
+  v.omap_bytes = pos.omap_bytes;
+  v.stamp = ceph_clock_now();
+}
+
 bool PGBackend::be_compare_scrub_objects(
   pg_shard_t auth_shard,
   const ScrubMap::object &auth,
@@ -807,39 +923,55 @@ bool PGBackend::be_compare_scrub_objects(
 		<< " is too large";
     obj_result.set_size_too_large();
   }
-  for (map<string,bufferptr>::const_iterator i = auth.attrs.begin();
-       i != auth.attrs.end();
-       ++i) {
-    // We check system keys seperately
-    if (i->first == OI_ATTR || i->first[0] != '_')
-      continue;
-    if (!candidate.attrs.count(i->first)) {
+  // We check system keys seperately. The user xattrs of a compact replica map
+  // are represented by their digests.
+  auto is_user_attr = [](const string& name) {
+    return name != OI_ATTR && name[0] == '_';
+  };
+  auto check_auth_attr = [&](const string& name) {
+    if (!is_user_attr(name))
+      return;
+    if (!candidate.has_attr(name)) {
       if (error != CLEAN)
         errorstream << ", ";
       error = FOUND_ERROR;
-      errorstream << "attr name mismatch '" << i->first << "'";
+      errorstream << "attr name mismatch '" << name << "'";
       obj_result.set_attr_name_mismatch();
-    } else if (candidate.attrs.find(i->first)->second.cmp(i->second)) {
+      return;
+    }
+    auto a = auth.attrs.find(name);
+    auto c = candidate.attrs.find(name);
+    bool match = (a != auth.attrs.end() && c != candidate.attrs.end())
+      ? !c->second.cmp(a->second)
+      : candidate.get_attr_digest(name) == auth.get_attr_digest(name);
+    if (!match) {
       if (error != CLEAN)
         errorstream << ", ";
       error = FOUND_ERROR;
-      errorstream << "attr value mismatch '" << i->first << "'";
+      errorstream << "attr value mismatch '" << name << "'";
       obj_result.set_attr_value_mismatch();
     }
-  }
-  for (map<string,bufferptr>::const_iterator i = candidate.attrs.begin();
-       i != candidate.attrs.end();
-       ++i) {
-    // We check system keys seperately
-    if (i->first == OI_ATTR || i->first[0] != '_')
-      continue;
-    if (!auth.attrs.count(i->first)) {
+  };
+  auto check_candidate_attr = [&](const string& name) {
+    if (is_user_attr(name) && !auth.has_attr(name)) {
       if (error != CLEAN)
         errorstream << ", ";
       error = FOUND_ERROR;
-      errorstream << "attr name mismatch '" << i->first << "'";
+      errorstream << "attr name mismatch '" << name << "'";
       obj_result.set_attr_name_mismatch();
     }
+  };
+  for (const auto& [name, value] : auth.attrs) {
+    check_auth_attr(name);
+  }
+  for (const auto& [name, digest] : auth.attr_digests) {
+    check_auth_attr(name);
+  }
+  for (const auto& [name, value] : candidate.attrs) {
+    check_candidate_attr(name);
+  }
+  for (const auto& [name, digest] : candidate.attr_digests) {
+    check_candidate_attr(name);
   }
   return error == FOUND_ERROR;
 }
@@ -581,6 +581,8 @@ typedef std::shared_ptr<const OSDMap> OSDMapRef;
      Context *on_complete, bool fast_read = false) = 0;
 
    virtual bool auto_repair_supported() const = 0;
+   /// can deep scrubs skip objects verified earlier (osd_deep_scrub_incremental)?
+   virtual bool incremental_deep_scrub_supported() const = 0;
    int be_scan_list(
      ScrubMap &map,
      ScrubMapBuilder &pos);
@@ -622,6 +624,21 @@ typedef std::shared_ptr<const OSDMap> OSDMapRef;
      ScrubMap &map,
      ScrubMapBuilder &pos,
      ScrubMap::object &o) = 0;
+   /**
+    * incremental deep scrub: if 'poid' was verified recently enough, and was
+    * not modified since, fill in its digests from the verification record.
+    * \returns true if the object does not have to be read
+    */
+   bool be_reuse_verified(
+     const hobject_t &poid,
+     ScrubMap &map,
+     ScrubMapBuilder &pos,
+     ScrubMap::object &o);
+   /// note a fully-read object whose digests match its object info
+   void be_note_verified(
+     const hobject_t &poid,
+     ScrubMapBuilder &pos,
+     const ScrubMap::object &o);
    void be_omap_checks(
      const std::map<pg_shard_t,ScrubMap*> &maps,
      const std::set<hobject_t> &master_set,
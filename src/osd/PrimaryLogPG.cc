@@ -1935,6 +1935,10 @@ void PrimaryLogPG::do_request(
       case MOSDScrubReserve::RELEASE:
 	m_scrubber->handle_scrub_reserve_release(op);
 	break;
+      case MOSDScrubReserve::SLOT_GRANT:
+      case MOSDScrubReserve::SLOT_REJECT:
+	m_scrubber->handle_scrub_slot_reply(op);
+	break;
       }
     }
     break;
@@ -492,6 +492,7 @@ public:
     }
     if (transaction_applied) {
       update_snap_map(logv, t);
+      forget_scrub_verified(logv, t);
     }
     auto last = logv.rbegin();
     if (is_primary() && last != logv.rend()) {
@@ -1556,6 +1557,7 @@ public:
       seed,
       target);
     init_pg_ondisk(t, child, pool);
+    get_verified_store().split(&t, child, split_bits);
   }
 private:
 
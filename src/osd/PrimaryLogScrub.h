@@ -77,4 +77,9 @@ class PrimaryLogScrub : public PgScrubber {
   // handle our part in stats collection
   object_stat_collection_t m_scrub_cstat;
   void _scrub_clear_state() final;  // which just clears the stats
+  object_stat_collection_t _scrub_get_stats() const final { return m_scrub_cstat; }
+  void _scrub_restore_stats(const object_stat_collection_t& stats) final
+  {
+    m_scrub_cstat = stats;
+  }
 };
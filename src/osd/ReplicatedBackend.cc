@@ -13,6 +13,7 @@
  */
 #include "common/errno.h"
 #include "ReplicatedBackend.h"
+#include "ScrubHasher.h"
 #include "messages/MOSDOp.h"
 #include "messages/MOSDRepOp.h"
 #include "messages/MOSDRepOpReply.h"
@@ -647,116 +648,205 @@ int ReplicatedBackend::be_deep_scrub(
     sleeptime.sleep();
   }
 
+  // park the chunk until no more than 'max_pending' segments of 'digest' are
+  // still being hashed. The hashing pool requeues it via pos.hasher_wake.
+  auto wait_for_hasher = [&](Scrub::PendingDigest& digest, size_t max_pending) {
+    if (!digest.wait_for(max_pending, std::function<void()>{pos.hasher_wake})) {
+      return false;
+    }
+    dout(20) << __func__ << "  " << poid << " waiting for digests" << dendl;
+    pos.hasher_wait = true;
+    return true;
+  };
+  const size_t max_strides = std::max<uint64_t>(
+    cct->_conf.get_val<uint64_t>("osd_scrub_hash_max_pending"), 1);
+
   ceph_assert(poid == pos.ls[pos.pos]);
   if (!pos.data_done()) {
+    // let the store verify the data against its own checksums, and derive the
+    // digest from those. No data is returned in this case.
+    const bool verify_in_store = store->has_builtin_csum() &&
+      cct->_conf.get_val<bool>("osd_deep_scrub_verify_in_store");
+
     if (pos.data_pos == 0) {
       pos.data_hash = bufferhash(-1);
+      if (pos.hasher && pos.hasher_wake && !verify_in_store) {
+	pos.data_digest = std::make_shared<Scrub::PendingDigest>();
+      }
+    } else if (pos.data_digest &&
+	       wait_for_hasher(*pos.data_digest, max_strides - 1)) {
+      return -EINPROGRESS;
     }
 
     bufferlist bl;
-    r = store->read(
-      ch,
-      ghobject_t(
-	poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
-      pos.data_pos,
-      cct->_conf->osd_deep_scrub_stride, bl,
-      fadvise_flags);
+    if (verify_in_store) {
+      uint32_t crc = pos.data_hash.digest();
+      r = store->verify(
+	ch,
+	ghobject_t(
+	  poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
+	pos.data_pos,
+	cct->_conf->osd_deep_scrub_stride, &crc,
+	fadvise_flags);
+      pos.data_hash = bufferhash(crc);
+    } else {
+      r = store->read(
+	ch,
+	ghobject_t(
+	  poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
+	pos.data_pos,
+	cct->_conf->osd_deep_scrub_stride, bl,
+	fadvise_flags);
+    }
     if (r < 0) {
       dout(20) << __func__ << "  " << poid << " got "
 	       << r << " on read, read_error" << dendl;
       o.read_error = true;
       return 0;
     }
-    if (r > 0) {
-      pos.data_hash << bl;
-    }
     pos.data_pos += r;
+    pos.bytes_read += r;
     if (static_cast<uint64_t>(r) == cct->_conf->osd_deep_scrub_stride) {
-      dout(20) << __func__ << "  " << poid << " more data, digest so far 0x"
-	       << std::hex << pos.data_hash.digest() << std::dec << dendl;
+      if (pos.data_digest) {
+	// hashed while we read the next stride
+	pos.hasher->queue(pos.data_digest, std::move(bl));
+	dout(20) << __func__ << "  " << poid << " more data" << dendl;
+      } else {
+	pos.data_hash << bl;
+	dout(20) << __func__ << "  " << poid << " more data, digest so far 0x"
+		 << std::hex << pos.data_hash.digest() << std::dec << dendl;
+      }
       return -EINPROGRESS;
     }
-    // done with bytes
+    // done with bytes. No point in queuing the last stride.
+    if (pos.data_digest) {
+      pos.data_digest->append(bl);
+    } else {
+      if (r > 0) {
+	pos.data_hash << bl;
+      }
+      o.digest = pos.data_hash.digest();
+      o.digest_present = true;
+      dout(20) << __func__ << "  " << poid << " done with data, digest 0x"
+	       << std::hex << o.digest << std::dec << dendl;
+    }
     pos.data_pos = -1;
-    o.digest = pos.data_hash.digest();
-    o.digest_present = true;
-    dout(20) << __func__ << "  " << poid << " done with data, digest 0x"
-	     << std::hex << o.digest << std::dec << dendl;
   }
 
-  // omap header
-  if (pos.omap_pos.empty()) {
-    pos.omap_hash = bufferhash(-1);
+  if (!pos.omap_done) {
+    // omap header
+    if (pos.omap_pos.empty()) {
+      pos.omap_hash = bufferhash(-1);
+      if (pos.hasher && pos.hasher_wake) {
+	pos.omap_digest = std::make_shared<Scrub::PendingDigest>();
+      }
+
+      bufferlist hdrbl;
+      r = store->omap_get_header(
+	ch,
+	ghobject_t(
+	  poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
+	&hdrbl, true);
+      if (r == -EIO) {
+	dout(20) << __func__ << "  " << poid << " got "
+		 << r << " on omap header read, read_error" << dendl;
+	o.read_error = true;
+	return 0;
+      }
+      if (r == 0 && hdrbl.length()) {
+	bool encoded = false;
+	dout(25) << "CRC header " << cleanbin(hdrbl, encoded, true) << dendl;
+	if (pos.omap_digest) {
+	  pos.omap_digest->append(hdrbl);
+	} else {
+	  pos.omap_hash << hdrbl;
+	}
+      }
+    }
 
-    bufferlist hdrbl;
-    r = store->omap_get_header(
+    // omap
+    if (pos.omap_pos.length() && pos.omap_digest &&
+	wait_for_hasher(*pos.omap_digest, max_strides - 1)) {
+      return -EINPROGRESS;
+    }
+    ObjectMap::ObjectMapIterator iter = store->get_omap_iterator(
       ch,
       ghobject_t(
-	poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
-      &hdrbl, true);
-    if (r == -EIO) {
-      dout(20) << __func__ << "  " << poid << " got "
-	       << r << " on omap header read, read_error" << dendl;
-      o.read_error = true;
-      return 0;
-    }
-    if (r == 0 && hdrbl.length()) {
-      bool encoded = false;
-      dout(25) << "CRC header " << cleanbin(hdrbl, encoded, true) << dendl;
-      pos.omap_hash << hdrbl;
+	poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard));
+    ceph_assert(iter);
+    if (pos.omap_pos.length()) {
+      iter->lower_bound(pos.omap_pos);
+    } else {
+      iter->seek_to_first();
     }
-  }
-
-  // omap
-  ObjectMap::ObjectMapIterator iter = store->get_omap_iterator(
-    ch,
-    ghobject_t(
-      poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard));
-  ceph_assert(iter);
-  if (pos.omap_pos.length()) {
-    iter->lower_bound(pos.omap_pos);
-  } else {
-    iter->seek_to_first();
-  }
-  int max = g_conf()->osd_deep_scrub_keys;
-  while (iter->status() == 0 && iter->valid()) {
-    pos.omap_bytes += iter->value().length();
-    ++pos.omap_keys;
-    --max;
-    // fixme: we can do this more efficiently.
-    bufferlist bl;
-    encode(iter->key(), bl);
-    encode(iter->value(), bl);
-    pos.omap_hash << bl;
+    int max = g_conf()->osd_deep_scrub_keys;
+    // when using the hashing pool, the keys are hashed in batches
+    bufferlist batch;
+    while (iter->status() == 0 && iter->valid()) {
+      pos.omap_bytes += iter->value().length();
+      pos.bytes_read += iter->key().length() + iter->value().length();
+      ++pos.omap_keys;
+      --max;
+      if (pos.omap_digest) {
+	encode(iter->key(), batch);
+	encode(iter->value(), batch);
+      } else {
+	// fixme: we can do this more efficiently.
+	bufferlist bl;
+	encode(iter->key(), bl);
+	encode(iter->value(), bl);
+	pos.omap_hash << bl;
+      }
 
-    iter->next();
+      iter->next();
 
-    if (iter->valid() && max == 0) {
-      pos.omap_pos = iter->key();
-      return -EINPROGRESS;
+      if (iter->valid() && max == 0) {
+	pos.omap_pos = iter->key();
+	if (pos.omap_digest) {
+	  pos.hasher->queue(pos.omap_digest, std::move(batch));
+	}
+	return -EINPROGRESS;
+      }
+      if (iter->status() < 0) {
+	dout(25) << __func__ << "  " << poid
+		 << " on omap scan, db status error" << dendl;
+	o.read_error = true;
+	return 0;
+      }
     }
-    if (iter->status() < 0) {
-      dout(25) << __func__ << "  " << poid
-	       << " on omap scan, db status error" << dendl;
-      o.read_error = true;
-      return 0;
+    if (pos.omap_digest) {
+      pos.omap_digest->append(batch);
     }
+
+    if (pos.omap_keys > cct->_conf->
+	  osd_deep_scrub_large_omap_object_key_threshold ||
+	pos.omap_bytes > cct->_conf->
+	  osd_deep_scrub_large_omap_object_value_sum_threshold) {
+      dout(25) << __func__ << " " << poid
+	       << " large omap object detected. Object has " << pos.omap_keys
+	       << " keys and size " << pos.omap_bytes << " bytes" << dendl;
+      o.large_omap_object_found = true;
+      o.large_omap_object_key_count = pos.omap_keys;
+      o.large_omap_object_value_size = pos.omap_bytes;
+      map.has_large_omap_object_errors = true;
+    }
+    pos.omap_done = true;
   }
 
-  if (pos.omap_keys > cct->_conf->
-	osd_deep_scrub_large_omap_object_key_threshold ||
-      pos.omap_bytes > cct->_conf->
-	osd_deep_scrub_large_omap_object_value_sum_threshold) {
-    dout(25) << __func__ << " " << poid
-	     << " large omap object detected. Object has " << pos.omap_keys
-	     << " keys and size " << pos.omap_bytes << " bytes" << dendl;
-    o.large_omap_object_found = true;
-    o.large_omap_object_key_count = pos.omap_keys;
-    o.large_omap_object_value_size = pos.omap_bytes;
-    map.has_large_omap_object_errors = true;
+  // are the hashing threads done with this object?
+  if ((pos.data_digest && wait_for_hasher(*pos.data_digest, 0)) ||
+      (pos.omap_digest && wait_for_hasher(*pos.omap_digest, 0))) {
+    return -EINPROGRESS;
+  }
+  if (pos.data_digest) {
+    o.digest = pos.data_digest->digest();
+    o.digest_present = true;
+    dout(20) << __func__ << "  " << poid << " done with data, digest 0x"
+	     << std::hex << o.digest << std::dec << dendl;
   }
 
-  o.omap_digest = pos.omap_hash.digest();
+  o.omap_digest =
+    pos.omap_digest ? pos.omap_digest->digest() : pos.omap_hash.digest();
   o.omap_digest_present = true;
   dout(20) << __func__ << " done with " << poid << " omap_digest "
 	   << std::hex << o.omap_digest << std::dec << dendl;
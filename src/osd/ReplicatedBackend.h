@@ -424,6 +424,7 @@ private:
 
   void repop_commit(RepModifyRef rm);
   bool auto_repair_supported() const override { return store->has_builtin_csum(); }
+  bool incremental_deep_scrub_supported() const override { return true; }
 
 
   int be_deep_scrub(
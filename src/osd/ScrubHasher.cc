@@ -0,0 +1,134 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "ScrubHasher.h"
+
+#include "common/debug.h"
+#include "include/Context.h"
+#include "include/crc32c.h"
+
+#define dout_context (cct)
+#define dout_subsys ceph_subsys_osd
+#undef dout_prefix
+#define dout_prefix *_dout << "osd-scrub-hasher " << __func__ << ": "
+
+using ceph::bufferlist;
+
+namespace Scrub {
+
+// ////////////////////////////////////////////////////////////////////////// //
+// PendingDigest
+
+size_t PendingDigest::add_segment(uint32_t len)
+{
+  std::lock_guard l{lock};
+  m_segments.push_back(segment_t{len, 0});
+  ++m_pending;
+  return m_segments.size() - 1;
+}
+
+void PendingDigest::set_segment(size_t idx, uint32_t crc)
+{
+  std::function<void()> wake;
+  {
+    std::lock_guard l{lock};
+    ceph_assert(idx < m_segments.size());
+    m_segments[idx].crc = crc;
+    ceph_assert(m_pending > 0);
+    --m_pending;
+    if (m_wake && m_pending <= m_wake_at) {
+      wake.swap(m_wake);
+    }
+  }
+  if (wake) {
+    wake();
+  }
+}
+
+void PendingDigest::append(const bufferlist& bl)
+{
+  auto idx = add_segment(bl.length());
+  set_segment(idx, bl.crc32c(0));
+}
+
+bool PendingDigest::is_done() const
+{
+  std::lock_guard l{lock};
+  return m_pending == 0;
+}
+
+bool PendingDigest::wait_for(size_t max_pending, std::function<void()>&& wake)
+{
+  std::lock_guard l{lock};
+  if (m_pending <= max_pending) {
+    return false;
+  }
+  ceph_assert(!m_wake);
+  m_wake_at = max_pending;
+  m_wake = std::move(wake);
+  return true;
+}
+
+uint32_t PendingDigest::digest() const
+{
+  std::lock_guard l{lock};
+  ceph_assert(m_pending == 0);
+
+  uint32_t crc = -1;
+  for (const auto& seg : m_segments) {
+    if (seg.len) {
+      crc = seg.crc ^ ceph_crc32c(crc, nullptr, seg.len);
+    }
+  }
+  return crc;
+}
+
+// ////////////////////////////////////////////////////////////////////////// //
+// ScrubHasher
+
+ScrubHasher::ScrubHasher(CephContext* cct) : cct{cct} {}
+
+ScrubHasher::~ScrubHasher()
+{
+  ceph_assert(!m_tp);
+}
+
+void ScrubHasher::start()
+{
+  const auto threads = cct->_conf.get_val<uint64_t>("osd_scrub_hash_threads");
+  if (!threads) {
+    dout(10) << "deep-scrub digests are computed inline" << dendl;
+    return;
+  }
+
+  m_tp = std::make_unique<ThreadPool>(cct, "OSD::scrub_hash_tp", "tp_scrub_hash",
+				      threads);
+  m_wq = std::make_unique<ContextWQ>(
+    "OSD::scrub_hash_wq", ceph::make_timespan(cct->_conf->osd_op_thread_timeout),
+    m_tp.get());
+  m_tp->start();
+  dout(10) << threads << " hashing threads started" << dendl;
+}
+
+void ScrubHasher::stop()
+{
+  if (!m_tp) {
+    return;
+  }
+  m_tp->drain();
+  m_tp->stop();
+  m_wq.reset();
+  m_tp.reset();
+}
+
+void ScrubHasher::queue(std::shared_ptr<PendingDigest> digest, bufferlist&& bl)
+{
+  ceph_assert(m_wq);
+  auto idx = digest->add_segment(bl.length());
+  m_wq->queue(new LambdaContext(
+    [digest = std::move(digest), idx, bl = std::move(bl)](int) {
+      digest->set_segment(idx, bl.crc32c(0));
+    }));
+}
+
+}  // namespace Scrub
@@ -0,0 +1,88 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "common/WorkQueue.h"
+#include "common/ceph_mutex.h"
+#include "include/buffer.h"
+
+namespace Scrub {
+
+/**
+ * The crc32c digest of a sequence of buffers (an object's data, or its omap),
+ * hashed out of order.
+ *
+ * Each segment is hashed with a zero seed, and the results are chained once all
+ * of them are available, using:
+ *   crc32c(B, s) = crc32c(B, 0) ^ crc32c(0 * len(B), s)
+ * (see buffer::list::crc32c()). The result equals that of a bufferhash(-1) fed
+ * with the same buffers, in order.
+ */
+class PendingDigest {
+ public:
+  /// reserve the next segment. @returns its index
+  size_t add_segment(uint32_t len);
+
+  void set_segment(size_t idx, uint32_t crc);
+
+  /// add the next segment, hashing it in the calling thread
+  void append(const ceph::buffer::list& bl);
+
+  bool is_done() const;
+
+  /**
+   * if more than 'max_pending' segments are still being hashed, arrange for
+   * 'wake' to be called (by the hashing thread) once no more than that are
+   * left, and return true. Otherwise, return false.
+   * Only one waiter is supported.
+   */
+  bool wait_for(size_t max_pending, std::function<void()>&& wake);
+
+  /// all segments must be done
+  uint32_t digest() const;
+
+ private:
+  struct segment_t {
+    uint32_t len;
+    uint32_t crc;
+  };
+
+  mutable ceph::mutex lock = ceph::make_mutex("Scrub::PendingDigest::lock");
+  std::vector<segment_t> m_segments;
+  size_t m_pending{0};
+  size_t m_wake_at{0};
+  std::function<void()> m_wake;
+};
+
+/**
+ * A pool of threads computing the deep-scrub digests (osd_scrub_hash_threads),
+ * so that the PG work item - holding the PG lock and occupying its OSD shard -
+ * only has to read the data. The digest of a stride is computed while the next
+ * one is being read.
+ */
+class ScrubHasher {
+ public:
+  explicit ScrubHasher(CephContext* cct);
+  ~ScrubHasher();
+
+  void start();
+  void stop();
+
+  /// false if configured with no threads. The digests are then computed inline.
+  bool is_enabled() const { return !!m_tp; }
+
+  /// hash 'bl' (in the background) as the next segment of 'digest'
+  void queue(std::shared_ptr<PendingDigest> digest, ceph::buffer::list&& bl);
+
+ private:
+  CephContext* cct;
+  std::unique_ptr<ThreadPool> m_tp;
+  std::unique_ptr<ContextWQ> m_wq;
+};
+
+}  // namespace Scrub
@@ -103,20 +103,23 @@ Store*
 Store::create(ObjectStore* store,
 	      ObjectStore::Transaction* t,
 	      const spg_t& pgid,
-	      const coll_t& coll)
+	      const coll_t& coll,
+	      uint64_t max_cached)
 {
   ceph_assert(store);
   ceph_assert(t);
   ghobject_t oid = make_scrub_object(pgid);
   t->touch(coll, oid);
-  return new Store{coll, oid, store};
+  return new Store{coll, oid, store, max_cached};
 }
 
-Store::Store(const coll_t& coll, const ghobject_t& oid, ObjectStore* store)
+Store::Store(const coll_t& coll, const ghobject_t& oid, ObjectStore* store,
+	     uint64_t max_cached)
   : coll(coll),
     hoid(oid),
     driver(store, coll, hoid),
-    backend(&driver)
+    backend(&driver),
+    max_cached(max_cached)
 {}
 
 Store::~Store()
@@ -145,10 +148,36 @@ bool Store::empty() const
 
 void Store::flush(ObjectStore::Transaction* t)
 {
-  if (t) {
-    OSDriver::OSTransaction txn = driver.get_transaction(t);
-    backend.set_keys(results, &txn);
+  if (!t) {
+    results.clear();
+    return;
   }
+
+  if (cached) {
+    for (auto& [key, bl] : results) {
+      auto [it, inserted] = index.try_emplace(key);
+      if (!inserted) {
+	index_bytes -= it->second.length();
+      }
+      index_bytes += bl.length();
+      it->second = std::move(bl);
+      it->second.try_assign_to_mempool(mempool::mempool_osd);
+    }
+    results.clear();
+    if (index_bytes <= max_cached) {
+      return;
+    }
+    // too large to be held in memory: spill all errors found so far
+    cached = false;
+    for (auto& [key, bl] : index) {
+      results.emplace(key, std::move(bl));
+    }
+    index.clear();
+    index_bytes = 0;
+  }
+
+  OSDriver::OSTransaction txn = driver.get_transaction(t);
+  backend.set_keys(results, &txn);
   results.clear();
 }
 
@@ -185,6 +214,15 @@ Store::get_errors(const string& begin,
 		  uint64_t max_return) const
 {
   vector<bufferlist> errors;
+  if (cached) {
+    for (auto it = index.upper_bound(begin);
+	 max_return && it != index.end() && it->first < end;
+	 ++it, --max_return) {
+      errors.push_back(it->second);
+    }
+    return errors;
+  }
+
   auto next = std::make_pair(begin, bufferlist{});
   while (max_return && !backend.get_next(next.first, &next)) {
     if (next.first >= end)
@@ -6,6 +6,7 @@
 
 #include "SnapMapper.h"		// for OSDriver
 #include "common/map_cacher.hpp"
+#include "include/mempool.h"
 
 namespace librados {
   struct object_id_t;
@@ -16,16 +17,28 @@ struct inconsistent_snapset_wrapper;
 
 namespace Scrub {
 
+/**
+ * The inconsistencies found by the running (or last) scrub of the PG, as listed
+ * by 'rados list-inconsistent-obj/snapset'.
+ *
+ * The errors of each chunk are collected, then committed together by flush().
+ * As long as their encoded size is below 'max_cached' bytes, they are only
+ * kept in an in-memory index, from which the listing is served. Once that
+ * size is exceeded, the index is spilled into the omap of a temp object in a
+ * single transaction, and the errors of the following chunks are written there.
+ */
 class Store {
 public:
   ~Store();
   static Store* create(ObjectStore* store,
 		       ObjectStore::Transaction* t,
 		       const spg_t& pgid,
-		       const coll_t& coll);
+		       const coll_t& coll,
+		       uint64_t max_cached);
   void add_object_error(int64_t pool, const inconsistent_obj_wrapper& e);
   void add_snap_error(int64_t pool, const inconsistent_snapset_wrapper& e);
   bool empty() const;
+  /// commit the errors of the chunk. Discards them if 't' is null.
   void flush(ObjectStore::Transaction *);
   void cleanup(ObjectStore::Transaction *);
   std::vector<ceph::buffer::list> get_snap_errors(int64_t pool,
@@ -35,7 +48,8 @@ public:
 					    const librados::object_id_t& start,
 					    uint64_t max_return) const;
 private:
-  Store(const coll_t& coll, const ghobject_t& oid, ObjectStore* store);
+  Store(const coll_t& coll, const ghobject_t& oid, ObjectStore* store,
+	uint64_t max_cached);
   std::vector<ceph::buffer::list> get_errors(const std::string& start, const std::string& end,
 				     uint64_t max_return) const;
 private:
@@ -45,7 +59,14 @@ private:
   // scrubbing
   OSDriver driver;
   mutable MapCacher::MapCacher<std::string, ceph::buffer::list> backend;
+  // the errors of the current chunk
   std::map<std::string, ceph::buffer::list> results;
+
+  // all committed errors - while 'cached' is set
+  mempool::osd::map<std::string, ceph::buffer::list> index;
+  uint64_t index_bytes = 0;
+  const uint64_t max_cached;
+  bool cached = true;
 };
 }
 
@@ -0,0 +1,268 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "ScrubVerifiedStore.h"
+
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+using ceph::bufferlist;
+
+namespace {
+const string FULL_SWEEP_KEY = "FULL_SWEEP";
+const string CHECKPOINT_KEY = "CHECKPOINT";
+const string VERIFIED_PREFIX = "VERIFIED_";
+
+ghobject_t make_verified_object(const spg_t& pgid)
+{
+  std::ostringstream ss;
+  ss << "scrub_verified_" << pgid;
+  return ghobject_t(hobject_t(sobject_t(object_t(ss.str()), 0)));
+}
+
+string to_verified_key(const hobject_t& hoid)
+{
+  return VERIFIED_PREFIX + hoid.to_str();
+}
+
+/// the hash of the object a record key is for (see hobject_t::to_str())
+std::optional<uint32_t> verified_key_hash(const string& key)
+{
+  // <prefix><16 hex digits pool>.<8 hex digits nibble-reversed hash>.
+  const auto pos = VERIFIED_PREFIX.size() + 17;
+  if (key.size() < pos + 8 || key[pos - 1] != '.') {
+    return std::nullopt;
+  }
+  char* end = nullptr;
+  const string rev = key.substr(pos, 8);
+  uint32_t revhash = strtoul(rev.c_str(), &end, 16);
+  if (*end != '\0') {
+    return std::nullopt;
+  }
+  return hobject_t::_reverse_nibbles(revhash);
+}
+}  // namespace
+
+namespace Scrub {
+
+VerifiedStore::VerifiedStore(ObjectStore* store, const spg_t& pgid)
+    : m_os(store)
+    , m_ch(store->open_collection(coll_t()))
+    , m_hoid(make_verified_object(pgid))
+    , m_driver(store, coll_t(), m_hoid)
+{}
+
+bool VerifiedStore::exists()
+{
+  if (!m_exists) {
+    map<string, bufferlist> got;
+    m_exists = m_driver.get_keys({}, &got) >= 0;
+  }
+  return *m_exists;
+}
+
+void VerifiedStore::created(ObjectStore::Transaction* t)
+{
+  t->touch(coll_t(), m_hoid);
+  m_exists = true;
+}
+
+map<hobject_t, scrub_verified_t> VerifiedStore::load(const vector<hobject_t>& ls)
+{
+  map<hobject_t, scrub_verified_t> records;
+  map<string, hobject_t> keys;
+  set<string> to_get;
+  for (const auto& hoid : ls) {
+    auto key = to_verified_key(hoid);
+    to_get.insert(key);
+    keys.emplace(std::move(key), hoid);
+  }
+
+  map<string, bufferlist> got;
+  if (m_driver.get_keys(to_get, &got) < 0) {
+    // no records yet (or not readable): nothing can be skipped
+    return records;
+  }
+
+  for (const auto& [key, bl] : got) {
+    auto k = keys.find(key);
+    if (k == keys.end()) {
+      continue;
+    }
+    scrub_verified_t rec;
+    try {
+      auto p = bl.cbegin();
+      decode(rec, p);
+    } catch (const ceph::buffer::error&) {
+      continue;
+    }
+    records.emplace(k->second, rec);
+  }
+  return records;
+}
+
+std::optional<utime_t> VerifiedStore::get_last_full_sweep()
+{
+  if (m_last_full_sweep) {
+    return *m_last_full_sweep;
+  }
+  m_last_full_sweep.emplace();
+  map<string, bufferlist> got;
+  if (m_driver.get_keys({FULL_SWEEP_KEY}, &got) < 0 || got.empty()) {
+    return std::nullopt;
+  }
+  utime_t stamp;
+  try {
+    auto p = got.begin()->second.cbegin();
+    decode(stamp, p);
+  } catch (const ceph::buffer::error&) {
+    return std::nullopt;
+  }
+  m_last_full_sweep.emplace(stamp);
+  return stamp;
+}
+
+void VerifiedStore::persist(ObjectStore::Transaction* t,
+			    const map<hobject_t, scrub_verified_t>& records)
+{
+  if (records.empty()) {
+    return;
+  }
+  map<string, bufferlist> to_set;
+  for (const auto& [hoid, rec] : records) {
+    encode(rec, to_set[to_verified_key(hoid)]);
+  }
+  created(t);
+  OSDriver::OSTransaction txn = m_driver.get_transaction(t);
+  txn.set_keys(to_set);
+}
+
+void VerifiedStore::set_last_full_sweep(ObjectStore::Transaction* t, utime_t stamp)
+{
+  map<string, bufferlist> to_set;
+  encode(stamp, to_set[FULL_SWEEP_KEY]);
+  created(t);
+  OSDriver::OSTransaction txn = m_driver.get_transaction(t);
+  txn.set_keys(to_set);
+  m_last_full_sweep.emplace(stamp);
+}
+
+std::optional<scrub_checkpoint_t> VerifiedStore::get_checkpoint()
+{
+  map<string, bufferlist> got;
+  if (m_driver.get_keys({CHECKPOINT_KEY}, &got) < 0 || got.empty()) {
+    return std::nullopt;
+  }
+  scrub_checkpoint_t ckpt;
+  try {
+    auto p = got.begin()->second.cbegin();
+    decode(ckpt, p);
+  } catch (const ceph::buffer::error&) {
+    return std::nullopt;
+  }
+  return ckpt;
+}
+
+void VerifiedStore::set_checkpoint(ObjectStore::Transaction* t,
+				   const scrub_checkpoint_t& ckpt)
+{
+  map<string, bufferlist> to_set;
+  encode(ckpt, to_set[CHECKPOINT_KEY]);
+  created(t);
+  OSDriver::OSTransaction txn = m_driver.get_transaction(t);
+  txn.set_keys(to_set);
+}
+
+void VerifiedStore::clear_checkpoint(ObjectStore::Transaction* t)
+{
+  created(t);
+  OSDriver::OSTransaction txn = m_driver.get_transaction(t);
+  txn.remove_keys({CHECKPOINT_KEY});
+}
+
+void VerifiedStore::forget(ObjectStore::Transaction* t,
+			   const vector<hobject_t>& removed)
+{
+  if (removed.empty() || m_exists == false) {
+    return;
+  }
+  if (!m_exists) {
+    // rather than reading the store to find out whether we have any records:
+    // make sure the object exists, as part of the same transaction
+    created(t);
+  }
+  set<string> to_remove;
+  for (const auto& hoid : removed) {
+    to_remove.insert(to_verified_key(hoid));
+  }
+  OSDriver::OSTransaction txn = m_driver.get_transaction(t);
+  txn.remove_keys(to_remove);
+}
+
+bool VerifiedStore::move_records(ObjectStore::Transaction* t,
+				 const spg_t& to,
+				 std::function<bool(uint32_t hash)> filter)
+{
+  if (!exists()) {
+    return false;
+  }
+  auto iter = m_os->get_omap_iterator(m_ch, m_hoid);
+  if (!iter) {
+    return false;
+  }
+  map<string, bufferlist> to_set;
+  set<string> to_remove;
+  for (iter->lower_bound(VERIFIED_PREFIX);
+       iter->valid() && iter->key().compare(0, VERIFIED_PREFIX.size(),
+					    VERIFIED_PREFIX) == 0;
+       iter->next()) {
+    auto hash = verified_key_hash(iter->key());
+    if (!hash) {
+      // not ours to interpret. Drop it.
+      to_remove.insert(iter->key());
+    } else if (filter(*hash)) {
+      to_set.emplace(iter->key(), iter->value());
+      to_remove.insert(iter->key());
+    }
+  }
+  if (!to_set.empty()) {
+    const ghobject_t target = make_verified_object(to);
+    t->touch(coll_t(), target);
+    t->omap_setkeys(coll_t(), target, to_set);
+  }
+  if (!to_remove.empty()) {
+    OSDriver::OSTransaction txn = m_driver.get_transaction(t);
+    txn.remove_keys(to_remove);
+  }
+  return !to_set.empty();
+}
+
+bool VerifiedStore::split(ObjectStore::Transaction* t,
+			  const spg_t& child,
+			  int split_bits)
+{
+  const uint32_t ps = child.pgid.ps();
+  return move_records(t, child, [split_bits, ps](uint32_t hash) {
+    return hobject_t::match_hash(hash, split_bits, ps);
+  });
+}
+
+bool VerifiedStore::merge_into(ObjectStore::Transaction* t, const spg_t& target)
+{
+  bool moved = move_records(t, target, [](uint32_t) { return true; });
+  if (exists()) {
+    t->remove(coll_t(), m_hoid);
+    m_exists = false;
+  }
+  m_last_full_sweep.emplace();
+  return moved;
+}
+
+void VerifiedStore::remove(ObjectStore::Transaction* t, const spg_t& pgid)
+{
+  t->remove(coll_t(), make_verified_object(pgid));
+}
+
+}  // namespace Scrub
@@ -0,0 +1,91 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "SnapMapper.h"		// for OSDriver
+#include "osd_types.h"
+
+namespace Scrub {
+
+/**
+ * The persistent part of incremental deep scrubbing (osd_deep_scrub_incremental).
+ *
+ * Holds, per PG shard, a scrub_verified_t record for each object that was fully
+ * read by a deep scrub and found to match its object-info digests, and the time
+ * of the last full (non-incremental) deep scrub of the shard.
+ * On the primary, it also holds the progress of an interrupted deep scrub
+ * (osd_deep_scrub_checkpoint).
+ *
+ * The records are omap entries of a per-PG object in the meta collection (the
+ * same arrangement used by the snap-mapper), so that they are neither listed with
+ * the PG's objects nor subject to temp-objects cleanup. The records of removed
+ * objects are dropped with them; on a split the records of the objects moving to
+ * the child are moved to its store, and on a merge the source's records are moved
+ * to the target's. The object is removed with the PG.
+ */
+class VerifiedStore {
+ public:
+  VerifiedStore(ObjectStore* store, const spg_t& pgid);
+
+  /// fetch whatever records exist for the listed objects
+  std::map<hobject_t, scrub_verified_t> load(const std::vector<hobject_t>& ls);
+
+  /// the time the last full deep scrub of this shard was completed, if known.
+  /// Read once, then kept in memory.
+  std::optional<utime_t> get_last_full_sweep();
+
+  void persist(ObjectStore::Transaction* t,
+	       const std::map<hobject_t, scrub_verified_t>& records);
+
+  void set_last_full_sweep(ObjectStore::Transaction* t, utime_t stamp);
+
+  std::optional<scrub_checkpoint_t> get_checkpoint();
+
+  void set_checkpoint(ObjectStore::Transaction* t, const scrub_checkpoint_t& ckpt);
+
+  void clear_checkpoint(ObjectStore::Transaction* t);
+
+  /// drop the records of objects that were removed. Called when logging the
+  /// removal: does not read the store.
+  void forget(ObjectStore::Transaction* t, const std::vector<hobject_t>& removed);
+
+  /// move the records of the objects now belonging to 'child' (split off with
+  /// 'split_bits') to the child's store. Returns true if any was moved.
+  bool split(ObjectStore::Transaction* t, const spg_t& child, int split_bits);
+
+  /// move all the records to the store of 'target', which this PG is merged
+  /// into, and remove ours. Returns true if any was moved.
+  bool merge_into(ObjectStore::Transaction* t, const spg_t& target);
+
+  /// records were moved to our object by another store's split()/merge_into()
+  void records_added() { m_exists = true; }
+
+  /// discard all records of the PG (called when the PG is removed)
+  static void remove(ObjectStore::Transaction* t, const spg_t& pgid);
+
+ private:
+  ObjectStore* m_os;
+  ObjectStore::CollectionHandle m_ch;
+  const ghobject_t m_hoid;
+  OSDriver m_driver;
+  /// does our object exist? Unknown until checked or written to.
+  std::optional<bool> m_exists;
+  /// the cached last full sweep stamp. Unknown until read or written.
+  std::optional<std::optional<utime_t>> m_last_full_sweep;
+
+  bool exists();
+  void created(ObjectStore::Transaction* t);
+
+  /// move the records accepted by 'filter' to the store of 'to'
+  bool move_records(ObjectStore::Transaction* t,
+		    const spg_t& to,
+		    std::function<bool(uint32_t hash)> filter);
+};
+
+}  // namespace Scrub
@@ -0,0 +1,482 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "./osd_scrub_sched.h"
+
+#include <algorithm>
+
+#include "common/Formatter.h"
+#include "common/dout.h"
+#include "osd/OSDMap.h"
+#include "osd/pg_scrubber.h"
+
+#define dout_context (cct)
+#define dout_subsys ceph_subsys_osd
+#undef dout_prefix
+#define dout_prefix *_dout << "osd-scrub-queue " << __func__ << ": "
+
+using std::vector;
+
+// ////////////////////////////////////////////////////////////////////////// //
+// ScrubJob
+
+ScrubQueue::ScrubJob::ScrubJob(CephContext* cct,
+			       const spg_t& pg,
+			       const utime_t& timestamp,
+			       double pool_scrub_min_interval,
+			       double pool_scrub_max_interval,
+			       bool must)
+    : pgid(pg), sched_time(timestamp), deadline(timestamp)
+{
+  // if not explicitly requested, postpone the scrub with a random delay
+  if (!must) {
+    double scrub_min_interval = pool_scrub_min_interval > 0
+				  ? pool_scrub_min_interval
+				  : cct->_conf->osd_scrub_min_interval;
+    double scrub_max_interval = pool_scrub_max_interval > 0
+				  ? pool_scrub_max_interval
+				  : cct->_conf->osd_scrub_max_interval;
+
+    sched_time += scrub_min_interval;
+    double r = rand() / (double)RAND_MAX;
+    sched_time += scrub_min_interval * cct->_conf->osd_scrub_interval_randomize_ratio * r;
+    if (scrub_max_interval == 0) {
+      deadline = utime_t();
+    } else {
+      deadline += scrub_max_interval;
+    }
+  }
+}
+
+ScrubQueue::urgency_t ScrubQueue::ScrubJob::urgency(utime_t now) const
+{
+  if (sched_time == PgScrubber::scrub_must_stamp()) {
+    return urgency_t::must_scrub;
+  }
+  if (!deadline.is_zero() && deadline < now) {
+    return urgency_t::overdue;
+  }
+  return urgency_t::regular;
+}
+
+void ScrubQueue::ScrubJob::dump(ceph::Formatter* f) const
+{
+  f->dump_stream("pgid") << pgid;
+  f->dump_stream("sched_time") << sched_time;
+  f->dump_stream("deadline") << deadline;
+  f->dump_bool("forced", sched_time == PgScrubber::scrub_must_stamp());
+  f->dump_int("penalty_count", penalty_count);
+  f->dump_stream("penalized_until") << penalized_until;
+}
+
+std::ostream& operator<<(std::ostream& out, ScrubQueue::urgency_t u)
+{
+  switch (u) {
+    case ScrubQueue::urgency_t::must_scrub:
+      return out << "must-scrub";
+    case ScrubQueue::urgency_t::overdue:
+      return out << "overdue";
+    case ScrubQueue::urgency_t::regular:
+      return out << "regular";
+  }
+  return out << "?";
+}
+
+// ////////////////////////////////////////////////////////////////////////// //
+// ScrubQueue - the jobs
+
+ScrubQueue::ScrubQueue(CephContext* cct) : cct{cct} {}
+
+utime_t ScrubQueue::register_job(spg_t pgid,
+				 utime_t t,
+				 double pool_scrub_min_interval,
+				 double pool_scrub_max_interval,
+				 bool must)
+{
+  ScrubJob job{cct, pgid, t, pool_scrub_min_interval, pool_scrub_max_interval, must};
+
+  std::lock_guard l{jobs_lock};
+  auto [it, is_new] = m_jobs.try_emplace(pgid, job);
+  if (is_new) {
+    m_by_time.emplace(job.not_before(), pgid);
+  } else {
+    // a new schedule is a fresh start: the reservation failures that led to
+    // the penalty were against the previous one
+    auto old_key = std::make_pair(it->second.not_before(), pgid);
+    it->second.sched_time = job.sched_time;
+    it->second.deadline = job.deadline;
+    it->second.penalty_count = 0;
+    it->second.penalized_until = utime_t{};
+    reindex(it->second, old_key);
+  }
+
+  dout(15) << pgid << " scheduled at " << job.sched_time << " deadline "
+	   << job.deadline << (is_new ? "" : " (updated)") << dendl;
+  return job.sched_time;
+}
+
+void ScrubQueue::remove_job(spg_t pgid)
+{
+  std::lock_guard l{jobs_lock};
+  auto it = m_jobs.find(pgid);
+  if (it == m_jobs.end()) {
+    dout(10) << pgid << " not registered" << dendl;
+    return;
+  }
+  m_by_time.erase(std::make_pair(it->second.not_before(), pgid));
+  m_jobs.erase(it);
+  dout(15) << pgid << " removed" << dendl;
+}
+
+void ScrubQueue::reindex(const ScrubJob& job, const std::pair<utime_t, spg_t>& old_key)
+{
+  auto new_key = std::make_pair(job.not_before(), job.pgid);
+  if (new_key != old_key) {
+    m_by_time.erase(old_key);
+    m_by_time.insert(new_key);
+  }
+}
+
+vector<ScrubQueue::ScrubJob> ScrubQueue::ready_jobs(utime_t now) const
+{
+  vector<ScrubJob> ready;
+  {
+    std::lock_guard l{jobs_lock};
+    for (const auto& [not_before, pgid] : m_by_time) {
+      if (not_before > now) {
+	break;
+      }
+      ready.push_back(m_jobs.at(pgid));
+    }
+  }
+
+  // already ordered by time. Only the urgency level is left to sort by.
+  std::stable_sort(ready.begin(), ready.end(),
+		   [now](const ScrubJob& lhs, const ScrubJob& rhs) {
+		     return lhs.urgency(now) < rhs.urgency(now);
+		   });
+  dout(20) << ready.size() << " jobs ready (out of " << size() << ")" << dendl;
+  return ready;
+}
+
+vector<spg_t> ScrubQueue::list_registered_jobs() const
+{
+  vector<spg_t> pgs;
+  std::lock_guard l{jobs_lock};
+  pgs.reserve(m_jobs.size());
+  for (const auto& [pgid, job] : m_jobs) {
+    pgs.push_back(pgid);
+  }
+  return pgs;
+}
+
+void ScrubQueue::penalize(spg_t pgid, utime_t now)
+{
+  std::lock_guard l{jobs_lock};
+  auto it = m_jobs.find(pgid);
+  if (it == m_jobs.end()) {
+    return;
+  }
+  auto& job = it->second;
+  if (job.urgency(now) == urgency_t::must_scrub) {
+    // operator-requested scrubs and repairs are retried at the next tick
+    dout(10) << pgid << " failed to reserve replicas. Not penalized (must scrub)"
+	     << dendl;
+    return;
+  }
+  auto old_key = std::make_pair(job.not_before(), pgid);
+
+  const double base = cct->_conf.get_val<double>("osd_scrub_reservation_backoff");
+  const double max_delay =
+    cct->_conf.get_val<double>("osd_scrub_reservation_backoff_max");
+  double delay = base * (1ULL << std::min(job.penalty_count, 20));
+  delay = std::min(delay, max_delay);
+
+  ++job.penalty_count;
+  job.penalized_until = now;
+  job.penalized_until += delay;
+  reindex(job, old_key);
+  dout(10) << pgid << " failed to reserve replicas (" << job.penalty_count
+	   << " times). Delayed until " << job.penalized_until << dendl;
+}
+
+void ScrubQueue::clear_penalty(spg_t pgid)
+{
+  std::lock_guard l{jobs_lock};
+  auto it = m_jobs.find(pgid);
+  if (it == m_jobs.end() || !it->second.penalty_count) {
+    return;
+  }
+  auto& job = it->second;
+  auto old_key = std::make_pair(job.not_before(), pgid);
+  job.penalty_count = 0;
+  job.penalized_until = utime_t{};
+  reindex(job, old_key);
+  dout(15) << pgid << " penalty cleared" << dendl;
+}
+
+size_t ScrubQueue::size() const
+{
+  std::lock_guard l{jobs_lock};
+  return m_jobs.size();
+}
+
+void ScrubQueue::dump_scrubs(ceph::Formatter* f) const
+{
+  ceph_assert(f != nullptr);
+  const utime_t now = ceph_clock_now();
+  std::lock_guard l{jobs_lock};
+
+  f->open_array_section("scrubs");
+  for (const auto& [not_before, pgid] : m_by_time) {
+    const auto& job = m_jobs.at(pgid);
+    f->open_object_section("scrub");
+    job.dump(f);
+    f->dump_stream("not_before") << not_before;
+    f->dump_stream("urgency") << job.urgency(now);
+    f->close_section();
+  }
+  f->close_section();
+}
+
+// ////////////////////////////////////////////////////////////////////////// //
+// ScrubQueue - scrub resource management
+
+bool ScrubQueue::can_inc_scrubs() const
+{
+  bool can_inc = false;
+  std::lock_guard l{resource_lock};
+
+  if (scrubs_local + scrubs_remote < cct->_conf->osd_max_scrubs) {
+    dout(20) << " == true " << scrubs_local << " local + " << scrubs_remote
+	     << " remote < max " << cct->_conf->osd_max_scrubs << dendl;
+    can_inc = true;
+  } else {
+    dout(20) << " == false " << scrubs_local << " local + " << scrubs_remote
+	     << " remote >= max " << cct->_conf->osd_max_scrubs << dendl;
+  }
+
+  return can_inc;
+}
+
+bool ScrubQueue::inc_scrubs_local()
+{
+  bool result = false;
+  std::lock_guard l{resource_lock};
+  if (scrubs_local + scrubs_remote < cct->_conf->osd_max_scrubs) {
+    dout(20) << scrubs_local << " -> " << (scrubs_local + 1) << " (max "
+	     << cct->_conf->osd_max_scrubs << ", remote " << scrubs_remote << ")"
+	     << dendl;
+    result = true;
+    ++scrubs_local;
+  } else {
+    dout(20) << scrubs_local << " local + " << scrubs_remote << " remote >= max "
+	     << cct->_conf->osd_max_scrubs << dendl;
+  }
+  return result;
+}
+
+void ScrubQueue::dec_scrubs_local()
+{
+  std::lock_guard l{resource_lock};
+  dout(20) << scrubs_local << " -> " << (scrubs_local - 1) << " (max "
+	   << cct->_conf->osd_max_scrubs << ", remote " << scrubs_remote << ")"
+	   << dendl;
+  --scrubs_local;
+  ceph_assert(scrubs_local >= 0);
+}
+
+bool ScrubQueue::inc_scrubs_remote()
+{
+  bool result = false;
+  std::lock_guard l{resource_lock};
+  if (scrubs_local + scrubs_remote < cct->_conf->osd_max_scrubs) {
+    dout(20) << scrubs_remote << " -> " << (scrubs_remote + 1) << " (max "
+	     << cct->_conf->osd_max_scrubs << ", local " << scrubs_local << ")"
+	     << dendl;
+    result = true;
+    ++scrubs_remote;
+  } else {
+    dout(20) << scrubs_local << " local + " << scrubs_remote << " remote >= max "
+	     << cct->_conf->osd_max_scrubs << dendl;
+  }
+  return result;
+}
+
+void ScrubQueue::dec_scrubs_remote()
+{
+  std::lock_guard l{resource_lock};
+  dout(20) << scrubs_remote << " -> " << (scrubs_remote - 1) << " (max "
+	   << cct->_conf->osd_max_scrubs << ", local " << scrubs_local << ")"
+	   << dendl;
+  --scrubs_remote;
+  ceph_assert(scrubs_remote >= 0);
+}
+
+void ScrubQueue::dump_scrub_reservations(ceph::Formatter* f) const
+{
+  std::lock_guard l{resource_lock};
+  f->dump_int("scrubs_local", scrubs_local);
+  f->dump_int("scrubs_remote", scrubs_remote);
+  f->dump_int("osd_max_scrubs", cct->_conf->osd_max_scrubs);
+
+  f->open_array_section("granted_slots");
+  for (const auto& [bucket, pgs] : m_slots) {
+    f->open_object_section("bucket");
+    f->dump_int("id", bucket);
+    f->open_array_section("pgs");
+    for (const auto& [pgid, holder] : pgs) {
+      f->open_object_section("slot");
+      f->dump_stream("pgid") << pgid;
+      f->dump_int("holder", holder);
+      f->close_section();
+    }
+    f->close_section();
+    f->close_section();
+  }
+  f->close_section();
+}
+
+// ////////////////////////////////////////////////////////////////////////// //
+// ScrubQueue - host & failure-domain scrub slots
+
+namespace {
+/// the capped CRUSH bucket types, and their caps
+std::vector<std::pair<std::string, unsigned>> slot_levels(CephContext* cct)
+{
+  std::vector<std::pair<std::string, unsigned>> levels;
+  const auto& conf = cct->_conf;
+  if (auto limit = conf.get_val<uint64_t>("osd_scrub_max_per_host"); limit) {
+    levels.emplace_back("host", limit);
+  }
+  if (auto limit = conf.get_val<uint64_t>("osd_scrub_max_per_failure_domain"); limit) {
+    levels.emplace_back(conf.get_val<std::string>("osd_scrub_failure_domain"), limit);
+  }
+  return levels;
+}
+}  // namespace
+
+vector<ScrubQueue::slot_bucket_t> ScrubQueue::get_slot_buckets(
+  const OSDMap& osdmap,
+  const std::set<int>& osds) const
+{
+  std::map<int, slot_bucket_t> buckets;
+  const auto& crush = osdmap.crush;
+  for (const auto& [type_name, limit] : slot_levels(cct)) {
+    int type = crush->get_type_id(type_name);
+    if (type <= 0) {
+      // unknown, or the 'osd' type (already capped by osd_max_scrubs)
+      continue;
+    }
+    for (int osd : osds) {
+      int bucket = crush->get_parent_of_type(osd, type);
+      if (bucket >= 0) {
+	continue;
+      }
+      if (auto b = buckets.find(bucket); b != buckets.end()) {
+	// the host is also the failure domain
+	b->second.limit = std::min(b->second.limit, limit);
+	continue;
+      }
+      int coordinator = get_slot_coordinator(osdmap, bucket);
+      if (coordinator >= 0) {
+	buckets.emplace(bucket, slot_bucket_t{bucket, coordinator, limit});
+      }
+    }
+  }
+
+  vector<slot_bucket_t> res;
+  res.reserve(buckets.size());
+  for (const auto& [bucket, b] : buckets) {
+    res.push_back(b);
+  }
+  return res;
+}
+
+int ScrubQueue::get_slot_coordinator(const OSDMap& osdmap, int bucket)
+{
+  std::set<int> children;
+  if (osdmap.crush->get_all_children(bucket, &children) < 0) {
+    return -1;
+  }
+  // the OSDs (non-negative IDs) are ordered after the buckets
+  for (auto c = children.lower_bound(0); c != children.end(); ++c) {
+    if (osdmap.is_up(*c)) {
+      return *c;
+    }
+  }
+  return -1;
+}
+
+unsigned ScrubQueue::get_slot_limit(const OSDMap& osdmap, int bucket) const
+{
+  const auto& crush = osdmap.crush;
+  if (!crush->bucket_exists(bucket)) {
+    return 0;
+  }
+  const char* type_name = crush->get_type_name(crush->get_bucket_type(bucket));
+  unsigned res = 0;
+  for (const auto& [level, limit] : slot_levels(cct)) {
+    if (type_name && level == type_name && (!res || limit < res)) {
+      res = limit;
+    }
+  }
+  return res;
+}
+
+bool ScrubQueue::grant_slot(int bucket, pg_t pgid, int holder, unsigned limit)
+{
+  std::lock_guard l{resource_lock};
+  auto& granted = m_slots[bucket];
+  if (auto it = granted.find(pgid); it != granted.end()) {
+    // re-requested (possibly by a new primary)
+    it->second = holder;
+    return true;
+  }
+  if (granted.size() >= limit) {
+    dout(20) << "bucket " << bucket << ": all " << limit << " slots are taken"
+	     << dendl;
+    return false;
+  }
+  granted.emplace(pgid, holder);
+  dout(20) << "bucket " << bucket << ": " << granted.size() << "/" << limit
+	   << " slots taken (" << pgid << " by osd." << holder << ")" << dendl;
+  return true;
+}
+
+void ScrubQueue::release_slot(int bucket, pg_t pgid)
+{
+  std::lock_guard l{resource_lock};
+  auto it = m_slots.find(bucket);
+  if (it == m_slots.end()) {
+    return;
+  }
+  it->second.erase(pgid);
+  dout(20) << "bucket " << bucket << ": " << pgid << " released. "
+	   << it->second.size() << " slots taken" << dendl;
+  if (it->second.empty()) {
+    m_slots.erase(it);
+  }
+}
+
+void ScrubQueue::prune_slots(std::function<bool(int, pg_t, int)> keep)
+{
+  std::lock_guard l{resource_lock};
+  for (auto b = m_slots.begin(); b != m_slots.end();) {
+    auto& granted = b->second;
+    for (auto it = granted.begin(); it != granted.end();) {
+      if (keep(b->first, it->first, it->second)) {
+	++it;
+      } else {
+	dout(10) << "bucket " << b->first << ": dropping the slot of " << it->first
+		 << " (osd." << it->second << ")" << dendl;
+	it = granted.erase(it);
+      }
+    }
+    if (granted.empty()) {
+      b = m_slots.erase(b);
+    } else {
+      ++b;
+    }
+  }
+}
@@ -0,0 +1,182 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+/**
+ * The OSD's scrub scheduling queue.
+ *
+ * Each primary PG registers a single ScrubJob, keyed by its pgid, carrying the
+ * time it should be scrubbed at ('sched_time') and the time by which it must
+ * be scrubbed regardless of load or time-of-day restrictions ('deadline').
+ *
+ * The jobs are indexed both by pgid and by their 'not before' time, which is the
+ * scheduled time - pushed forward for PGs that are penalized following a failure
+ * to reserve their replicas' scrub resources. Thus (re)registering, removing or
+ * penalizing a job is O(log n), and collecting the jobs that are ready for
+ * scrubbing only touches those jobs.
+ *
+ * A penalized PG's delay is doubled on each consecutive reservation failure (up
+ * to osd_scrub_reservation_backoff_max), and is cleared once its replicas are
+ * successfully reserved, or the PG is re-registered. Jobs that must be scrubbed
+ * are never penalized.
+ *
+ * The OSD's scrub resources counters (the number of scrubs we are performing as
+ * a primary, and those we have granted to remote primaries) are maintained here
+ * as well, under their own lock.
+ *
+ * Scrub slots: the number of concurrent scrubs involving the OSDs of a single
+ * host (osd_scrub_max_per_host) or of a single CRUSH failure domain
+ * (osd_scrub_max_per_failure_domain) may be capped. Each such CRUSH bucket has a
+ * coordinator - its lowest-numbered 'up' OSD - that grants slots to the
+ * primaries, as part of their replicas reservation. The granted slots are held
+ * here, and are dropped once their holder is no longer the PG's primary.
+ */
+
+#include <functional>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "common/ceph_mutex.h"
+#include "include/utime.h"
+#include "osd/osd_types.h"
+
+class OSDMap;
+
+class ScrubQueue {
+ public:
+  /// the order in which ready jobs are offered to the OSD
+  enum class urgency_t {
+    must_scrub,	 ///< operator-requested, or auto-repair
+    overdue,	 ///< past its deadline
+    regular
+  };
+
+  struct ScrubJob {
+    /// pg to be scrubbed
+    spg_t pgid;
+    /// a time scheduled for scrub. but the scrub could be delayed if system
+    /// load is too high or it fails to fall in the scrub hours
+    utime_t sched_time;
+    /// the hard upper bound of scrub time
+    utime_t deadline;
+    /// consecutive failures to reserve the replicas
+    int penalty_count{0};
+    /// the job will not be offered for scrubbing before this time
+    utime_t penalized_until;
+
+    ScrubJob() = default;
+    ScrubJob(CephContext* cct,
+	     const spg_t& pg,
+	     const utime_t& timestamp,
+	     double pool_scrub_min_interval = 0,
+	     double pool_scrub_max_interval = 0,
+	     bool must = true);
+
+    utime_t not_before() const { return std::max(sched_time, penalized_until); }
+
+    urgency_t urgency(utime_t now) const;
+
+    void dump(ceph::Formatter* f) const;
+  };
+
+  explicit ScrubQueue(CephContext* cct);
+
+  /**
+   * add the PG to the queue, or update its scheduling parameters.
+   * Any penalty imposed on the PG is cleared.
+   * @returns the scheduled time
+   */
+  utime_t register_job(spg_t pgid,
+		       utime_t t,
+		       double pool_scrub_min_interval,
+		       double pool_scrub_max_interval,
+		       bool must);
+
+  void remove_job(spg_t pgid);
+
+  /**
+   * the jobs that may be scrubbed now, most urgent first (and in the order
+   * of their scheduled times within each urgency level).
+   * Note: returns copies. The PGs must be (re)examined by the caller.
+   */
+  std::vector<ScrubJob> ready_jobs(utime_t now) const;
+
+  /// all registered PGs, in no particular order
+  std::vector<spg_t> list_registered_jobs() const;
+
+  /// the PG's replicas have refused to reserve scrub resources. Jobs that
+  /// must be scrubbed (operator-requested, or auto-repair) are not penalized.
+  void penalize(spg_t pgid, utime_t now);
+
+  /// the PG's replicas are reserved. Forgive previous failures.
+  void clear_penalty(spg_t pgid);
+
+  size_t size() const;
+
+  void dump_scrubs(ceph::Formatter* f) const;
+
+  // -- the OSD's scrub resources
+
+  bool can_inc_scrubs() const;
+  bool inc_scrubs_local();
+  void dec_scrubs_local();
+  bool inc_scrubs_remote();
+  void dec_scrubs_remote();
+  void dump_scrub_reservations(ceph::Formatter* f) const;
+
+  // -- host & failure-domain scrub slots
+
+  /// a CRUSH bucket whose concurrent scrubs are capped
+  struct slot_bucket_t {
+    int bucket;
+    int coordinator;  ///< the OSD granting the bucket's slots
+    unsigned limit;
+  };
+
+  /// the capped buckets containing any of 'osds' (the PG's acting set)
+  std::vector<slot_bucket_t> get_slot_buckets(const OSDMap& osdmap,
+					      const std::set<int>& osds) const;
+
+  /// the coordinator of 'bucket', or -1 if none of its OSDs is up
+  static int get_slot_coordinator(const OSDMap& osdmap, int bucket);
+
+  /// the cap on the concurrent scrubs of 'bucket' (0: not capped)
+  unsigned get_slot_limit(const OSDMap& osdmap, int bucket) const;
+
+  /**
+   * as the coordinator of 'bucket': grant a slot to the scrub of 'pgid',
+   * performed by 'holder'. A slot already held by the PG is re-granted.
+   * @returns false if all of the bucket's slots are taken
+   */
+  bool grant_slot(int bucket, pg_t pgid, int holder, unsigned limit);
+
+  void release_slot(int bucket, pg_t pgid);
+
+  /// drop the granted slots for which 'keep(bucket, pgid, holder)' is false
+  void prune_slots(std::function<bool(int, pg_t, int)> keep);
+
+ private:
+  CephContext* cct;
+
+  mutable ceph::mutex jobs_lock = ceph::make_mutex("ScrubQueue::jobs_lock");
+  std::map<spg_t, ScrubJob> m_jobs;
+  /// the registered jobs, ordered by their 'not before' time
+  std::set<std::pair<utime_t, spg_t>> m_by_time;
+
+  /// re-index the job after its 'not before' time has changed. Called
+  /// with the jobs_lock held, and 'old_key' being the previous index key.
+  void reindex(const ScrubJob& job, const std::pair<utime_t, spg_t>& old_key);
+
+  mutable ceph::mutex resource_lock =
+    ceph::make_mutex("ScrubQueue::resource_lock");
+  int scrubs_local{0};
+  int scrubs_remote{0};
+
+  /// the slots we have granted as a coordinator: bucket -> pg -> holding OSD
+  std::map<int, std::map<pg_t, int>> m_slots;
+};
+
+std::ostream& operator<<(std::ostream& out, ScrubQueue::urgency_t u);
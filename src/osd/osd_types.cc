@@ -6841,7 +6841,7 @@ void ScrubMap::generate_test_instances(list<ScrubMap*>& o)
 void ScrubMap::object::encode(ceph::buffer::list& bl) const
 {
   bool compat_read_error = read_error || ec_hash_mismatch || ec_size_mismatch;
-  ENCODE_START(10, 7, bl);
+  ENCODE_START(11, 7, bl);
   encode(size, bl);
   encode(negative, bl);
   encode(attrs, bl);
@@ -6861,12 +6861,13 @@ void ScrubMap::object::encode(ceph::buffer::list& bl) const
   encode(large_omap_object_value_size, bl);
   encode(object_omap_bytes, bl);
   encode(object_omap_keys, bl);
+  encode(attr_digests, bl);
   ENCODE_FINISH(bl);
 }
 
 void ScrubMap::object::decode(ceph::buffer::list::const_iterator& bl)
 {
-  DECODE_START(10, bl);
+  DECODE_START(11, bl);
   decode(size, bl);
   bool tmp, compat_read_error = false;
   decode(tmp, bl);
@@ -6908,6 +6909,9 @@ void ScrubMap::object::decode(ceph::buffer::list::const_iterator& bl)
     decode(object_omap_bytes, bl);
     decode(object_omap_keys, bl);
   }
+  if (struct_v >= 11) {
+    decode(attr_digests, bl);
+  }
   DECODE_FINISH(bl);
 }
 
@@ -6923,6 +6927,39 @@ void ScrubMap::object::dump(Formatter *f) const
     f->close_section();
   }
   f->close_section();
+  f->open_array_section("attr_digests");
+  for (const auto& [name, digest] : attr_digests) {
+    f->open_object_section("attr");
+    f->dump_string("name", name);
+    f->dump_unsigned("digest", digest);
+    f->close_section();
+  }
+  f->close_section();
+}
+
+__u32 ScrubMap::object::get_attr_digest(std::string_view name) const
+{
+  if (auto d = attr_digests.find(name); d != attr_digests.end()) {
+    return d->second;
+  }
+  bufferlist bl;
+  bl.push_back(attrs.find(name)->second);
+  return bl.crc32c(-1);
+}
+
+void ScrubMap::object::digest_attrs(size_t min_len)
+{
+  for (auto p = attrs.begin(); p != attrs.end();) {
+    // the system xattrs are used in full by the primary
+    if (p->first == OI_ATTR || p->first[0] != '_' || p->second.length() < min_len) {
+      ++p;
+      continue;
+    }
+    bufferlist bl;
+    bl.push_back(p->second);
+    attr_digests[p->first] = bl.crc32c(-1);
+    p = attrs.erase(p);
+  }
 }
 
 void ScrubMap::object::generate_test_instances(list<object*>& o)
@@ -6934,6 +6971,120 @@ void ScrubMap::object::generate_test_instances(list<object*>& o)
   o.back()->size = 123;
   o.back()->attrs["foo"] = ceph::buffer::copy("foo", 3);
   o.back()->attrs["bar"] = ceph::buffer::copy("barval", 6);
+  o.push_back(new object);
+  o.back()->size = 456;
+  o.back()->attrs["_"] = ceph::buffer::copy("oi", 2);
+  o.back()->attr_digests["_user.rgw.manifest"] = 0x1234abcd;
+}
+
+// -- scrub_verified_t --
+
+void scrub_verified_t::encode(ceph::buffer::list& bl) const
+{
+  ENCODE_START(1, 1, bl);
+  encode(version, bl);
+  encode(data_digest, bl);
+  encode(omap_digest, bl);
+  encode(omap_keys, bl);
+  encode(omap_bytes, bl);
+  encode(stamp, bl);
+  ENCODE_FINISH(bl);
+}
+
+void scrub_verified_t::decode(ceph::buffer::list::const_iterator& bl)
+{
+  DECODE_START(1, bl);
+  decode(version, bl);
+  decode(data_digest, bl);
+  decode(omap_digest, bl);
+  decode(omap_keys, bl);
+  decode(omap_bytes, bl);
+  decode(stamp, bl);
+  DECODE_FINISH(bl);
+}
+
+void scrub_verified_t::dump(Formatter *f) const
+{
+  f->dump_stream("version") << version;
+  f->dump_unsigned("data_digest", data_digest);
+  f->dump_unsigned("omap_digest", omap_digest);
+  f->dump_unsigned("omap_keys", omap_keys);
+  f->dump_unsigned("omap_bytes", omap_bytes);
+  f->dump_stream("stamp") << stamp;
+}
+
+void scrub_verified_t::generate_test_instances(list<scrub_verified_t*>& o)
+{
+  o.push_back(new scrub_verified_t);
+  o.push_back(new scrub_verified_t);
+  o.back()->version = eversion_t(3, 17);
+  o.back()->data_digest = 0x1234;
+  o.back()->omap_digest = 0xffffffff;
+  o.back()->omap_keys = 2;
+  o.back()->omap_bytes = 100;
+  o.back()->stamp = utime_t(5, 6);
+}
+
+// -- scrub_checkpoint_t --
+
+void scrub_checkpoint_t::encode(ceph::buffer::list& bl) const
+{
+  ENCODE_START(1, 1, bl);
+  encode(boundary, bl);
+  encode(version, bl);
+  encode(started, bl);
+  encode(stamp, bl);
+  encode(full_sweep, bl);
+  encode(cstat, bl);
+  encode(large_omap_objects, bl);
+  encode(omap_bytes, bl);
+  encode(omap_keys, bl);
+  ENCODE_FINISH(bl);
+}
+
+void scrub_checkpoint_t::decode(ceph::buffer::list::const_iterator& bl)
+{
+  DECODE_START(1, bl);
+  decode(boundary, bl);
+  decode(version, bl);
+  decode(started, bl);
+  decode(stamp, bl);
+  decode(full_sweep, bl);
+  decode(cstat, bl);
+  decode(large_omap_objects, bl);
+  decode(omap_bytes, bl);
+  decode(omap_keys, bl);
+  DECODE_FINISH(bl);
+}
+
+void scrub_checkpoint_t::dump(Formatter *f) const
+{
+  f->dump_stream("boundary") << boundary;
+  f->dump_stream("version") << version;
+  f->dump_stream("started") << started;
+  f->dump_stream("stamp") << stamp;
+  f->dump_bool("full_sweep", full_sweep);
+  f->open_object_section("cstat");
+  cstat.dump(f);
+  f->close_section();
+  f->dump_unsigned("large_omap_objects", large_omap_objects);
+  f->dump_unsigned("omap_bytes", omap_bytes);
+  f->dump_unsigned("omap_keys", omap_keys);
+}
+
+void scrub_checkpoint_t::generate_test_instances(list<scrub_checkpoint_t*>& o)
+{
+  o.push_back(new scrub_checkpoint_t);
+  o.push_back(new scrub_checkpoint_t);
+  o.back()->boundary = hobject_t(object_t("foo"), "", 1, 0x7f, 3, "");
+  o.back()->version = eversion_t(3, 17);
+  o.back()->started = utime_t(5, 6);
+  o.back()->stamp = utime_t(7, 8);
+  o.back()->full_sweep = false;
+  o.back()->cstat.sum.num_objects = 12;
+  o.back()->cstat.sum.num_bytes = 4096;
+  o.back()->omap_keys = 2;
+  o.back()->omap_bytes = 100;
 }
 
 // -- OSDOp --
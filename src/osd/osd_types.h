@@ -21,6 +21,7 @@
 #include <atomic>
 #include <sstream>
 #include <cstdio>
+#include <functional>
 #include <memory>
 #include <string_view>
 
@@ -6072,6 +6073,9 @@ struct ScrubMap {
     uint64_t large_omap_object_value_size = 0;
     uint64_t object_omap_bytes = 0;
     uint64_t object_omap_keys = 0;
+    /// user xattrs sent by a replica as their crc32c instead of their value
+    /// (compact scrub maps. See osd_scrub_compact_replica_maps)
+    std::map<std::string, __u32, std::less<>> attr_digests;
 
     object() :
       // Init invalid size so it won't match if we get a stat EIO error
@@ -6080,6 +6084,15 @@ struct ScrubMap {
       read_error(false), stat_error(false), ec_hash_mismatch(false),
       ec_size_mismatch(false), large_omap_object_found(false) {}
 
+    bool has_attr(std::string_view name) const {
+      return attrs.count(name) || attr_digests.count(name);
+    }
+    /// the crc32c of the xattr, which must exist
+    __u32 get_attr_digest(std::string_view name) const;
+    /// replace the values of the user xattrs of at least 'min_len' bytes
+    /// with their digests
+    void digest_attrs(size_t min_len);
+
     void encode(ceph::buffer::list& bl) const;
     void decode(ceph::buffer::list::const_iterator& bl);
     void dump(ceph::Formatter *f) const;
@@ -6115,6 +6128,55 @@ struct ScrubMap {
 WRITE_CLASS_ENCODER(ScrubMap::object)
 WRITE_CLASS_ENCODER(ScrubMap)
 
+/**
+ * scrub_verified_t - the last time an object's data and omap were read in full
+ * by a deep scrub on this shard, and found to match the digests recorded in
+ * its object_info_t. Used by incremental deep scrubs
+ * (osd_deep_scrub_incremental) to skip re-reading unchanged objects.
+ */
+struct scrub_verified_t {
+  eversion_t version;		///< the object version that was verified
+  __u32 data_digest = 0;
+  __u32 omap_digest = 0;
+  uint64_t omap_keys = 0;
+  uint64_t omap_bytes = 0;
+  utime_t stamp;		///< when was the object verified
+
+  void encode(ceph::buffer::list& bl) const;
+  void decode(ceph::buffer::list::const_iterator& bl);
+  void dump(ceph::Formatter *f) const;
+  static void generate_test_instances(std::list<scrub_verified_t*>& o);
+};
+WRITE_CLASS_ENCODER(scrub_verified_t)
+
+/**
+ * scrub_checkpoint_t - the progress of an interrupted deep scrub
+ * (osd_deep_scrub_checkpoint). All objects below 'boundary' were scrubbed, with
+ * no errors found, when the PG's last_update was 'version'.
+ */
+struct scrub_checkpoint_t {
+  hobject_t boundary;		///< the end of the last compared chunk
+  eversion_t version;		///< the PG's last_update at that point
+  utime_t started;		///< when was the (first attempt of the) scrub started
+  utime_t stamp;		///< when was the checkpoint written
+  bool full_sweep = true;	///< is this an incremental deep scrub's full sweep
+  object_stat_collection_t cstat;  ///< the stats of the objects below 'boundary'
+  uint64_t large_omap_objects = 0;
+  uint64_t omap_bytes = 0;
+  uint64_t omap_keys = 0;
+
+  void encode(ceph::buffer::list& bl) const;
+  void decode(ceph::buffer::list::const_iterator& bl);
+  void dump(ceph::Formatter *f) const;
+  static void generate_test_instances(std::list<scrub_checkpoint_t*>& o);
+};
+WRITE_CLASS_ENCODER(scrub_checkpoint_t)
+
+namespace Scrub {
+class PendingDigest;
+class ScrubHasher;
+}
+
 struct ScrubMapBuilder {
   bool deep = false;
   std::vector<hobject_t> ls;
@@ -6126,6 +6188,28 @@ struct ScrubMapBuilder {
   uint64_t omap_keys = 0;
   uint64_t omap_bytes = 0;
 
+  /// incremental deep scrub: objects verified at or after 'verified_since'
+  /// (and unmodified since) are not re-read
+  bool incremental = false;
+  utime_t verified_since;
+  std::map<hobject_t, scrub_verified_t> verified;  ///< loaded for 'ls'
+  std::map<hobject_t, scrub_verified_t> newly_verified;  ///< to be persisted
+
+  /// if set: deep-scrub digests are computed by the OSD's hashing pool.
+  /// 'data_hash' & 'omap_hash' are then replaced by the following:
+  Scrub::ScrubHasher* hasher = nullptr;
+  std::shared_ptr<Scrub::PendingDigest> data_digest, omap_digest;
+  bool omap_done = false;  ///< omap read. Possibly still waiting for digests
+  /// requeues the scrubber, once the hashing pool has made progress
+  std::function<void()> hasher_wake;
+  /// set by the backend when the scan is waiting for the hashing pool, and
+  /// 'hasher_wake' will be called: the scrubber should not requeue itself
+  bool hasher_wait = false;
+  /// the object's stat & attrs were already collected (scanning its strides)
+  bool object_stat_done = false;
+  /// data & omap bytes read by the deep scrub of the chunk so far
+  uint64_t bytes_read = 0;
+
   bool empty() {
     return ls.empty();
   }
@@ -6146,6 +6230,10 @@ struct ScrubMapBuilder {
     omap_pos.clear();
     omap_keys = 0;
     omap_bytes = 0;
+    data_digest.reset();
+    omap_digest.reset();
+    omap_done = false;
+    object_stat_done = false;
   }
 
   friend std::ostream& operator<<(std::ostream& out, const ScrubMapBuilder& pos) {
@@ -6162,6 +6250,9 @@ struct ScrubMapBuilder {
     if (pos.deep) {
       out << " deep";
     }
+    if (pos.incremental) {
+      out << " incremental";
+    }
     if (pos.ret) {
       out << " ret " << pos.ret;
     }
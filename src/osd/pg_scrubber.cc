@@ -4,11 +4,13 @@
 #include "./pg_scrubber.h"  // the '.' notation used to affect clang-format order
 
 #include <iostream>
+#include <limits>
 #include <vector>
 
 #include "debug.h"
 
 #include "common/errno.h"
+#include "compressor/Compressor.h"
 #include "messages/MOSDOp.h"
 #include "messages/MOSDRepScrub.h"
 #include "messages/MOSDRepScrubMap.h"
@@ -431,6 +433,25 @@ unsigned int PgScrubber::scrub_requeue_priority(Scrub::scrub_prio_t with_priorit
   return suggested_priority;
 }
 
+int PgScrubber::scrub_requeue_cost() const
+{
+  const auto& conf = get_pg_cct()->_conf;
+  if (conf.get_val<std::string>("osd_op_queue") != "mclock_scheduler") {
+    return conf->osd_scrub_cost;
+  }
+
+  // the mClock scheduler charges scrubs by the amount of data they read. A
+  // step scans any number of objects - up to a whole chunk of them - and
+  // (when deep) reads up to a stride of the last one. Charge the next step
+  // what the previous one actually read, or the worst case before that.
+  if (m_last_step_cost) {
+    return m_last_step_cost;
+  }
+  const uint64_t cost = conf->osd_scrub_chunk_max * CEPH_PAGE_SIZE +
+    (m_is_deep ? conf->osd_deep_scrub_stride : 0);
+  return static_cast<int>(std::min<uint64_t>(cost, std::numeric_limits<int>::max()));
+}
+
 // ///////////////////////////////////////////////////////////////////// //
 // scrub-op registration handling
 
@@ -488,7 +509,7 @@ void PgScrubber::unreg_next_scrub()
   dout(10) << __func__ << " existing-" << m_scrub_reg_stamp << ". was registered? "
 	   << is_scrub_registered() << dendl;
   if (is_scrub_registered()) {
-    m_osds->unreg_pg_scrub(m_pg->info.pgid, m_scrub_reg_stamp);
+    m_osds->unreg_pg_scrub(m_pg->info.pgid);
     m_scrub_reg_stamp = utime_t{};
   }
 }
@@ -559,21 +580,12 @@ void PgScrubber::set_subset_last_update(eversion_t e)
 }
 
 /*
- * The selected range is set directly into 'm_start' and 'm_end'
- * setting:
- * - m_subset_last_update
- * - m_max_end
- * - end
- * - start
+ * The end of a chunk starting at 'start', sized according to the configuration
+ * and to the preemption state.
  */
-bool PgScrubber::select_range()
+hobject_t PgScrubber::select_chunk_end(const hobject_t& start) const
 {
-  m_primary_scrubmap = ScrubMap{};
-  m_received_maps.clear();
-
-  /* get the start and end of our scrub chunk
-   *
-   * Our scrub chunk has an important restriction we're going to need to
+  /* Our scrub chunk has an important restriction we're going to need to
    * respect. We can't let head be start or end.
    * Using a half-open interval means that if end == head,
    * we'd scrub/lock head and the clone right next to head in different
@@ -596,7 +608,6 @@ bool PgScrubber::select_range()
   dout(10) << __func__ << " Min: " << min_idx << " Max: " << max_idx
 	   << " Div: " << preemption_data.chunk_divisor() << dendl;
 
-  hobject_t start = m_start;
   hobject_t candidate_end;
   std::vector<hobject_t> objects;
   int ret = m_pg->get_pgbackend()->objects_list_partial(start, min_idx, max_idx, &objects,
@@ -626,6 +637,37 @@ bool PgScrubber::select_range()
     ceph_assert(candidate_end.is_max());
   }
 
+  return candidate_end;
+}
+
+/*
+ * The selected range is set directly into 'm_start' and 'm_end'
+ * setting:
+ * - m_subset_last_update
+ * - m_max_end
+ * - end
+ * - start
+ */
+bool PgScrubber::select_range()
+{
+  m_primary_scrubmap = ScrubMap{};
+  m_received_maps.clear();
+
+  // prefetched chunks we have skipped over (following a preemption) are of no use
+  m_prefetched.drop_before(m_start);
+
+  hobject_t candidate_end;
+  if (auto prefetched_end = m_prefetched.front_end(m_start); prefetched_end) {
+    // the replicas were already asked to scan this chunk
+    candidate_end = *prefetched_end;
+  } else {
+    candidate_end = select_chunk_end(m_start);
+    if (candidate_end > m_prefetched.front_start()) {
+      // keep aligned with the chunks that were prefetched
+      candidate_end = m_prefetched.front_start();
+    }
+  }
+
   // is that range free for us? if not - we will be rescheduled later by whoever
   // triggered us this time
 
@@ -766,11 +808,17 @@ void PgScrubber::add_delayed_scheduling()
 }
 
 eversion_t PgScrubber::search_log_for_updates() const
+{
+  return search_log_for_updates(m_start, m_end);
+}
+
+eversion_t PgScrubber::search_log_for_updates(const hobject_t& start,
+					       const hobject_t& end) const
 {
   auto& projected = m_pg->projected_log.log;
   auto pi = find_if(
     projected.crbegin(), projected.crend(),
-    [this](const auto& e) -> bool { return e.soid >= m_start && e.soid < m_end; });
+    [&](const auto& e) -> bool { return e.soid >= start && e.soid < end; });
 
   if (pi != projected.crend())
     return pi->version;
@@ -778,8 +826,8 @@ eversion_t PgScrubber::search_log_for_updates() const
   // there was no relevant update entry in the log
 
   auto& log = m_pg->recovery_state.get_pg_log().get_log().log;
-  auto p = find_if(log.crbegin(), log.crend(), [this](const auto& e) -> bool {
-    return e.soid >= m_start && e.soid < m_end;
+  auto p = find_if(log.crbegin(), log.crend(), [&](const auto& e) -> bool {
+    return e.soid >= start && e.soid < end;
   });
 
   if (p == log.crend())
@@ -797,13 +845,38 @@ void PgScrubber::get_replicas_maps(bool replica_can_preempt)
 
   m_primary_scrubmap_pos.reset();
 
+  // were the replicas already asked to scan this chunk?
+  auto prefetched = m_prefetched.pop_front(m_start);
+  if (prefetched && !is_prefetched_chunk_valid(*prefetched)) {
+    dout(10) << __func__ << " discarding the maps prefetched for " << m_start
+	     << dendl;
+    prefetched.reset();
+  }
+
   // ask replicas to scan and send maps
   for (const auto& i : m_pg->get_acting_recovery_backfill()) {
 
     if (i == m_pg_whoami)
       continue;
 
+    if (prefetched) {
+      if (auto m = prefetched->maps.find(i); m != prefetched->maps.end()) {
+	m_received_maps[i] = std::move(m->second);
+	continue;
+      }
+      if (prefetched->requested.count(i)) {
+	// the replica is still scanning this chunk
+	m_maps_status.mark_replica_map_request(i);
+	continue;
+      }
+    }
+
     m_maps_status.mark_replica_map_request(i);
+    if (m_repl_scanning.count(i)) {
+      // still busy with a chunk we will not use. Will be asked once done.
+      m_deferred_requests.insert(i);
+      continue;
+    }
     _request_scrub_map(i, m_subset_last_update, m_start, m_end, m_is_deep,
 		       replica_can_preempt);
   }
@@ -811,6 +884,51 @@ void PgScrubber::get_replicas_maps(bool replica_can_preempt)
   dout(10) << __func__ << " awaiting" << m_maps_status << dendl;
 }
 
+bool PgScrubber::is_prefetched_chunk_valid(
+  const Scrub::prefetched_chunk_t& chunk) const
+{
+  return chunk.is_valid(m_end, m_subset_last_update,
+			m_pg->recovery_state.get_pg_log().get_tail(),
+			m_pg->is_clean());
+}
+
+/*
+ * Called when a replica has sent us a map, and is thus free to scan the next
+ * chunk. We ask it for the first chunk in the pipeline window it was not yet
+ * asked for, selecting a new chunk if needed.
+ */
+void PgScrubber::prefetch_next_chunk(pg_shard_t replica)
+{
+  const auto depth =
+    get_pg_cct()->_conf.get_val<uint64_t>("osd_scrub_pipeline_depth");
+  if (!depth || preemption_data.was_preempted() || !m_pg->is_clean() ||
+      m_repl_scanning.count(replica)) {
+    return;
+  }
+
+  auto chunk = m_prefetched.request_next(
+    replica, depth, std::max(m_start, m_end), [this](const hobject_t& start) {
+      Scrub::prefetched_chunk_t next;
+      next.start = start;
+      next.end = select_chunk_end(start);
+      next.subset_last_update = search_log_for_updates(next.start, next.end);
+      next.selected_at = m_pg->info.last_update;
+      if (next.end > m_max_end) {
+	m_max_end = next.end;
+      }
+      dout(15) << "prefetch_next_chunk chunk selected: " << next.start
+	       << " //// " << next.end << dendl;
+      return next;
+    });
+  if (!chunk) {
+    return;
+  }
+
+  // the chunk is not write-blocked, so must not be preempted
+  _request_scrub_map(replica, chunk->subset_last_update, chunk->start, chunk->end,
+		     m_is_deep, false);
+}
+
 bool PgScrubber::was_epoch_changed() const
 {
   // for crimson we have m_pg->get_info().history.same_interval_since
@@ -854,12 +972,17 @@ void PgScrubber::_request_scrub_map(pg_shard_t replica,
 {
   ceph_assert(replica != m_pg_whoami);
   dout(10) << __func__ << " scrubmap from osd." << replica
-	   << (deep ? " deep" : " shallow") << dendl;
+	   << (deep ? " deep" : " shallow") << " starting at " << start << dendl;
+
+  m_repl_scanning[replica] = start;
 
   auto repscrubop =
     new MOSDRepScrub(spg_t(m_pg->info.pgid.pgid, replica.shard), version,
 		     get_osdmap_epoch(), m_pg->get_last_peering_reset(), start, end, deep,
 		     allow_preemption, m_flags.priority, m_pg->ops_blocked_by_scrub());
+  repscrubop->compact_map =
+    get_pg_cct()->_conf.get_val<bool>("osd_scrub_compact_replica_maps");
+  repscrubop->deep_full_sweep = deep && m_deep_full_sweep;
 
   // default priority. We want the replica-scrub processed prior to any recovery
   // or client io messages (we are holding a lock!)
@@ -898,11 +1021,17 @@ void PgScrubber::on_init()
     ObjectStore::Transaction t;
     cleanup_store(&t);
     m_store.reset(
-      Scrub::Store::create(m_pg->osd->store, &t, m_pg->info.pgid, m_pg->coll));
+      Scrub::Store::create(m_pg->osd->store, &t, m_pg->info.pgid, m_pg->coll,
+			   get_pg_cct()->_conf.get_val<Option::size_t>(
+			     "osd_scrub_error_cache_size")));
     m_pg->osd->store->queue_transaction(m_pg->ch, std::move(t), nullptr);
   }
 
   m_start = m_pg->info.pgid.pgid.get_hobj_start();
+  m_scrub_started = ceph_clock_now();
+  m_last_checkpoint = m_scrub_started;
+  m_sweep_from_start = true;
+  maybe_resume_from_checkpoint();
   m_active = true;
 }
 
@@ -1015,11 +1144,15 @@ int PgScrubber::build_primary_map_chunk()
   epoch_t map_building_since = m_pg->get_osdmap_epoch();
   dout(20) << __func__ << ": initiated at epoch " << map_building_since << dendl;
 
+  if (m_is_deep && !m_primary_scrubmap_pos.hasher_wake) {
+    m_primary_scrubmap_pos.hasher_wake = hasher_waker(false);
+  }
   auto ret = build_scrub_map_chunk(m_primary_scrubmap, m_primary_scrubmap_pos, m_start,
 				   m_end, m_is_deep);
 
-  if (ret == -EINPROGRESS) {
+  if (ret == -EINPROGRESS && !m_primary_scrubmap_pos.hasher_wait) {
     // reschedule another round of asking the backend to collect the scrub data
+    // (unless the hashing pool will wake us up when it is done)
     m_osds->queue_for_scrub_resched(m_pg, Scrub::scrub_prio_t::low_priority);
   }
   return ret;
@@ -1030,12 +1163,19 @@ int PgScrubber::build_replica_map_chunk()
   dout(10) << __func__ << " interval start: " << m_interval_start
 	   << " epoch: " << m_epoch_start << " deep: " << m_is_deep << dendl;
 
+  if (m_is_deep && !replica_scrubmap_pos.hasher_wake) {
+    replica_scrubmap_pos.hasher_wake = hasher_waker(true);
+  }
   auto ret = build_scrub_map_chunk(replica_scrubmap, replica_scrubmap_pos, m_start, m_end,
 				   m_is_deep);
 
   switch (ret) {
 
     case -EINPROGRESS:
+      if (replica_scrubmap_pos.hasher_wait) {
+	// the hashing pool will requeue us once the pending digests are done
+	break;
+      }
       // must wait for the backend to finish. No external event source.
       // (note: previous version used low priority here. Now switched to using the
       // priority of the original message)
@@ -1087,6 +1227,7 @@ int PgScrubber::build_scrub_map_chunk(
   while (pos.empty()) {
 
     pos.deep = deep;
+    pos.hasher = deep ? m_osds->get_scrub_hasher() : nullptr;
     map.valid_through = m_pg->info.last_update;
 
     // objects
@@ -1099,6 +1240,9 @@ int PgScrubber::build_scrub_map_chunk(
       return pos.ret;
     }
     dout(10) << __func__ << " pos.ls.empty()? " << (pos.ls.empty() ? "+" : "-") << dendl;
+    if (deep) {
+      prepare_incremental_scan(pos);
+    }
     if (pos.ls.empty()) {
       break;
     }
@@ -1108,24 +1252,257 @@ int PgScrubber::build_scrub_map_chunk(
   }
 
   // scan objects
+  pos.hasher_wait = false;
+  const auto first_obj = pos.pos;
+  const auto bytes_before = pos.bytes_read;
+  // the cost of this step: each object's metadata, and the data read
+  auto note_step_cost = [&] {
+    const uint64_t cost = (pos.pos - first_obj + (pos.done() ? 0 : 1)) * CEPH_PAGE_SIZE +
+      (pos.bytes_read - bytes_before);
+    m_last_step_cost =
+      static_cast<int>(std::min<uint64_t>(cost, std::numeric_limits<int>::max()));
+  };
   while (!pos.done()) {
 
     int r = m_pg->get_pgbackend()->be_scan_list(map, pos);
     if (r == -EINPROGRESS) {
       dout(20) << __func__ << " in progress" << dendl;
+      note_step_cost();
       return r;
     }
   }
+  note_step_cost();
 
   // finish
   dout(20) << __func__ << " finishing" << dendl;
   ceph_assert(pos.done());
   m_pg->_repair_oinfo_oid(map);
+  if (pos.incremental) {
+    persist_verified(pos, end);
+  }
 
   dout(20) << __func__ << " done, got " << map.objects.size() << " items" << dendl;
   return 0;
 }
 
+std::function<void()> PgScrubber::hasher_waker(bool replica) const
+{
+  // called by the hashing pool, without the PG lock, once a chunk that
+  // was waiting for its digests can proceed. Captures no scrubber state:
+  // the scrub may be gone by then, and a reset PG discards the event.
+  return [pg = PGRef{m_pg}, epoch = m_pg->get_osdmap_epoch(), replica,
+	  op_prio = m_replica_request_priority, qu_prio = m_flags.priority] {
+    pg->lock();
+    if (!pg->pg_has_reset_since(epoch)) {
+      if (replica) {
+	pg->osd->queue_for_rep_scrub_resched(pg.get(), op_prio, qu_prio);
+      } else {
+	pg->osd->queue_for_scrub_resched(pg.get(), Scrub::scrub_prio_t::low_priority);
+      }
+    }
+    pg->unlock();
+  };
+}
+
+void PgScrubber::prepare_incremental_scan(ScrubMapBuilder& pos)
+{
+  const auto& conf = get_pg_cct()->_conf;
+  if (!conf.get_val<bool>("osd_deep_scrub_incremental") ||
+      !m_pg->get_pgbackend()->incremental_deep_scrub_supported()) {
+    return;
+  }
+
+  // we collect new verification records even when performing a full sweep
+  pos.incremental = true;
+  if (!m_deep_full_sweep) {
+    pos.verified_since = ceph_clock_now();
+    pos.verified_since -= conf.get_val<double>("osd_deep_scrub_incremental_max_age");
+    pos.verified = get_verified_store().load(pos.ls);
+  }
+  dout(15) << __func__ << " " << pos.verified.size() << " of " << pos.ls.size()
+	   << " objects have verification records" << dendl;
+}
+
+void PgScrubber::persist_verified(ScrubMapBuilder& pos, const hobject_t& end)
+{
+  ObjectStore::Transaction t;
+  get_verified_store().persist(&t, pos.newly_verified);
+  if (end.is_max()) {
+    // a resumed scrub completes a full sweep only if the shard has read
+    // the objects below the resume point as part of the same sweep
+    if (m_deep_full_sweep && m_sweep_from_start) {
+      dout(10) << __func__ << " full sweep completed" << dendl;
+      get_verified_store().set_last_full_sweep(&t, ceph_clock_now());
+    }
+    m_sweep_from_start = false;
+  }
+  dout(15) << __func__ << " " << pos.newly_verified.size() << " of " << pos.ls.size()
+	   << " objects (re)verified" << dendl;
+
+  if (!t.empty()) {
+    m_pg->osd->store->queue_transaction(m_pg->ch, std::move(t), nullptr);
+  }
+  pos.verified.clear();
+  pos.newly_verified.clear();
+}
+
+Scrub::VerifiedStore& PgScrubber::get_verified_store()
+{
+  return m_pg->get_verified_store();
+}
+
+bool PgScrubber::full_sweep_due()
+{
+  const auto& conf = get_pg_cct()->_conf;
+  if (!conf.get_val<bool>("osd_deep_scrub_incremental") ||
+      !m_pg->get_pgbackend()->incremental_deep_scrub_supported()) {
+    return true;
+  }
+  auto last_full = get_verified_store().get_last_full_sweep();
+  bool due = !last_full ||
+    double(ceph_clock_now() - *last_full) >
+      conf.get_val<double>("osd_deep_scrub_incremental_full_interval");
+  dout(10) << __func__ << " last full sweep: "
+	   << (last_full ? *last_full : utime_t{})
+	   << (due ? ". Performing a full sweep" : "") << dendl;
+  return due;
+}
+
+void PgScrubber::maybe_resume_from_checkpoint()
+{
+  const auto& conf = get_pg_cct()->_conf;
+  if (!m_is_deep || !conf.get_val<bool>("osd_deep_scrub_checkpoint")) {
+    return;
+  }
+
+  auto ckpt = get_verified_store().get_checkpoint();
+  if (!ckpt) {
+    return;
+  }
+  m_has_checkpoint = true;
+  dout(10) << __func__ << " found checkpoint at " << ckpt->boundary << " ("
+	   << ckpt->version << ", started " << ckpt->started << ")" << dendl;
+
+  // the PG's contents since the checkpoint must be known from the log: the
+  // checkpoint's version must be part of the log's (non-divergent) history
+  const auto& info = m_pg->info;
+  const auto& log = m_pg->recovery_state.get_pg_log().get_log();
+  auto in_log = [&]() {
+    if (ckpt->version == log.tail) {
+      return true;
+    }
+    return ckpt->version > log.tail && ckpt->version <= info.last_update &&
+	   std::any_of(log.log.crbegin(), log.log.crend(),
+		       [&](const auto& e) { return e.version == ckpt->version; });
+  };
+
+  std::string_view reason;
+  if (m_flags.required || m_is_repair) {
+    reason = "requested scrub";
+  } else if (info.stats.stats_invalid) {
+    reason = "PG stats are invalid";
+  } else if (double(ceph_clock_now() - ckpt->started) >
+	     conf.get_val<double>("osd_deep_scrub_checkpoint_max_age")) {
+    reason = "too old";
+  } else if (!in_log()) {
+    reason = "not covered by the log";
+  }
+
+  if (!reason.empty()) {
+    dout(10) << __func__ << " starting from scratch: " << reason << dendl;
+    ObjectStore::Transaction t;
+    clear_checkpoint(&t);
+    m_pg->osd->store->queue_transaction(m_pg->ch, std::move(t), nullptr);
+    return;
+  }
+
+  // objects below the boundary that were modified since the checkpoint must be
+  // scrubbed again: resume from the first of them. The stats of the objects
+  // between it and the boundary are then counted twice, and are not verified.
+  std::optional<hobject_t> first_modified;
+  auto note_modified = [&](const pg_log_entry_t& e) {
+    if (e.version > ckpt->version && e.soid < ckpt->boundary &&
+	(!first_modified || e.soid < *first_modified)) {
+      first_modified = e.soid;
+    }
+  };
+  for (auto p = log.log.crbegin();
+       p != log.log.crend() && p->version > ckpt->version; ++p) {
+    note_modified(*p);
+  }
+  for (const auto& e : m_pg->projected_log.log) {
+    note_modified(e);
+  }
+  m_resumed_prefix_modified = first_modified.has_value();
+
+  m_start = first_modified ?
+    std::min(first_modified->get_object_boundary(), ckpt->boundary) :
+    ckpt->boundary;
+  m_deep_full_sweep = ckpt->full_sweep;
+  m_sweep_from_start = true;
+  m_omap_stats.large_omap_objects = ckpt->large_omap_objects;
+  m_omap_stats.omap_bytes = ckpt->omap_bytes;
+  m_omap_stats.omap_keys = ckpt->omap_keys;
+  _scrub_restore_stats(ckpt->cstat);
+  m_resumed = std::move(ckpt);
+
+  m_osds->clog->debug() << info.pgid << " " << m_mode_desc << " resumed from "
+			<< m_start;
+  dout(10) << __func__ << " resuming from " << m_start
+	   << (m_resumed_prefix_modified ?
+		 " (rescrubbing modified objects, stats will not be verified)" : "")
+	   << dendl;
+}
+
+void PgScrubber::maybe_checkpoint()
+{
+  const auto& conf = get_pg_cct()->_conf;
+  if (!m_is_deep || m_is_repair || m_flags.required || m_end.is_max() ||
+      !conf.get_val<bool>("osd_deep_scrub_checkpoint")) {
+    return;
+  }
+
+  // only an error-free prefix is worth resuming after. Also - the boundary must
+  // not split a head from its clones.
+  if (m_shallow_errors || m_deep_errors || !m_cleaned_meta_map.objects.empty()) {
+    return;
+  }
+
+  utime_t now = ceph_clock_now();
+  if (double(now - m_last_checkpoint) <
+      conf.get_val<double>("osd_deep_scrub_checkpoint_interval")) {
+    return;
+  }
+
+  scrub_checkpoint_t ckpt;
+  ckpt.boundary = m_start;
+  ckpt.version = m_pg->info.last_update;
+  ckpt.started = m_resumed ? m_resumed->started : m_scrub_started;
+  ckpt.stamp = now;
+  ckpt.full_sweep = m_deep_full_sweep;
+  ckpt.cstat = _scrub_get_stats();
+  ckpt.large_omap_objects = m_omap_stats.large_omap_objects;
+  ckpt.omap_bytes = m_omap_stats.omap_bytes;
+  ckpt.omap_keys = m_omap_stats.omap_keys;
+  dout(15) << __func__ << " at " << ckpt.boundary << " (" << ckpt.version << ")"
+	   << dendl;
+
+  ObjectStore::Transaction t;
+  get_verified_store().set_checkpoint(&t, ckpt);
+  m_pg->osd->store->queue_transaction(m_pg->ch, std::move(t), nullptr);
+  m_last_checkpoint = now;
+  m_has_checkpoint = true;
+}
+
+void PgScrubber::clear_checkpoint(ObjectStore::Transaction* t)
+{
+  if (!m_has_checkpoint) {
+    return;
+  }
+  get_verified_store().clear_checkpoint(t);
+  m_has_checkpoint = false;
+}
+
 /*
  * Process:
  * Building a map of objects suitable for snapshot validation.
@@ -1176,6 +1553,7 @@ void PgScrubber::maps_compare_n_cleanup()
 {
   scrub_compare_maps();
   m_start = m_end;
+  maybe_checkpoint();
   run_callbacks();
   requeue_waiting();
   m_osds->queue_scrub_maps_compared(m_pg, Scrub::scrub_prio_t::low_priority);
@@ -1220,6 +1598,14 @@ void PgScrubber::replica_scrub_op(OpRequestRef op)
   m_end = msg->end;
   m_max_end = msg->end;
   m_is_deep = msg->deep;
+  m_compact_replica_map = msg->compact_map;
+  if (m_is_deep) {
+    // a full sweep if the primary asks for one, or if this shard is due one
+    m_deep_full_sweep = msg->deep_full_sweep || full_sweep_due();
+    if (m_start == m_pg->info.pgid.pgid.get_hobj_start()) {
+      m_sweep_from_start = true;
+    }
+  }
   m_interval_start = m_pg->info.history.same_interval_since;
   m_replica_request_priority = msg->high_priority ? Scrub::scrub_prio_t::high_priority
 						  : Scrub::scrub_prio_t::low_priority;
@@ -1270,6 +1656,10 @@ void PgScrubber::set_op_parameters(requested_scrub_t& request)
     // not calling update_op_mode_text() yet, as m_is_deep not set yet
   }
 
+  // decided once for the whole deep scrub, and passed on to the replicas
+  m_deep_full_sweep = state_test(PG_STATE_DEEP_SCRUB) &&
+    (m_flags.required || m_is_repair || full_sweep_due());
+
   // the publishing here seems to be required for tests synchronization
   m_pg->publish_stats_to_osd();
   m_flags.deep_scrub_on_error = request.deep_scrub_on_error;
@@ -1382,11 +1772,70 @@ ScrubMachineListener::MsgAndEpoch PgScrubber::prep_replica_map_msg(
 				  m_replica_min_epoch, m_pg_whoami);
 
   reply->preempted = (was_preempted == PreemptionNoted::preempted);
-  ::encode(replica_scrubmap, reply->get_data());
+  if (m_compact_replica_map) {
+    encode_compact_map(*reply);
+  } else {
+    ::encode(replica_scrubmap, reply->get_data());
+  }
 
   return ScrubMachineListener::MsgAndEpoch{reply, m_replica_min_epoch};
 }
 
+void PgScrubber::encode_compact_map(MOSDRepScrubMap& reply)
+{
+  const auto& conf = get_pg_cct()->_conf;
+
+  const auto min_attr = conf.get_val<Option::size_t>("osd_scrub_map_attr_digest_min");
+  for (auto& [hoid, obj] : replica_scrubmap.objects) {
+    obj.digest_attrs(min_attr);
+  }
+
+  bufferlist bl;
+  ::encode(replica_scrubmap, bl);
+
+  const auto alg = conf.get_val<std::string>("osd_scrub_map_compression");
+  if (alg != "none" &&
+      bl.length() >= conf.get_val<Option::size_t>("osd_scrub_map_compression_min_size")) {
+    if (auto compressor = Compressor::create(get_pg_cct(), alg); compressor) {
+      bufferlist compressed;
+      boost::optional<int32_t> compressor_message;
+      if (compressor->compress(bl, compressed, compressor_message) == 0 &&
+	  compressed.length() < bl.length()) {
+	dout(15) << __func__ << " map compressed (" << alg << ") from " << bl.length()
+		 << " to " << compressed.length() << " bytes" << dendl;
+	reply.compression = compressor->get_type();
+	reply.compressor_message = compressor_message;
+	reply.get_data().claim_append(compressed);
+	return;
+      }
+    }
+  }
+  reply.get_data().claim_append(bl);
+}
+
+bool PgScrubber::decode_replica_map(const MOSDRepScrubMap& m, ScrubMap& map) const
+{
+  bufferlist bl;
+  if (m.compression) {
+    auto compressor = Compressor::create(get_pg_cct(), m.compression);
+    if (!compressor || compressor->decompress(m.get_data(), bl, m.compressor_message)) {
+      derr << __func__ << " failed to decompress the map from " << m.from << " ("
+	   << Compressor::get_comp_alg_name(m.compression) << ")" << dendl;
+      return false;
+    }
+  }
+
+  try {
+    auto p = m.compression ? bl.cbegin() : m.get_data().cbegin();
+    map.decode(p, m_pg->info.pgid.pool());
+  } catch (const ceph::buffer::error& e) {
+    derr << __func__ << " failed to decode the map from " << m.from << ": "
+	 << e.what() << dendl;
+    return false;
+  }
+  return true;
+}
+
 void PgScrubber::send_replica_map(const MsgAndEpoch& preprepared)
 {
   m_pg->send_cluster_message(m_pg->get_primary().osd, preprepared.m_msg,
@@ -1423,9 +1872,49 @@ void PgScrubber::map_from_replica(OpRequestRef op)
     return;
   }
 
-  auto p = const_cast<bufferlist&>(m->get_data()).cbegin();
+  // which chunk was this replica scanning for us?
+  std::optional<hobject_t> chunk_start;
+  if (auto scanning = m_repl_scanning.find(m->from); scanning != m_repl_scanning.end()) {
+    chunk_start = scanning->second;
+    m_repl_scanning.erase(scanning);
+  }
+
+  if (m_deferred_requests.erase(m->from)) {
+    // a map for a prefetched chunk we have discarded. We can now ask for the
+    // current chunk.
+    dout(10) << __func__ << " discarding a stale map from " << m->from << dendl;
+    _request_scrub_map(m->from, m_subset_last_update, m_start, m_end, m_is_deep,
+		       preemption_data.is_preemptable());
+    return;
+  }
+
+  if (chunk_start) {
+    if (auto chunk = m_prefetched.find_requested(*chunk_start, m->from); chunk) {
+      if (m->preempted) {
+	// we will ask again when the chunk is scrubbed
+	chunk->requested.erase(m->from);
+      } else if (!decode_replica_map(*m, chunk->maps[m->from])) {
+	// as if preempted: we will ask again when the chunk is scrubbed
+	chunk->maps.erase(m->from);
+	chunk->requested.erase(m->from);
+      } else {
+	dout(15) << __func__ << " prefetched map for " << *chunk_start
+		 << " version is " << chunk->maps[m->from].valid_through << dendl;
+      }
+      prefetch_next_chunk(m->from);
+      return;
+    }
+  }
 
-  m_received_maps[m->from].decode(p, m_pg->info.pgid.pool());
+  if (!decode_replica_map(*m, m_received_maps[m->from])) {
+    // the chunk cannot be compared without this replica's map. Abort this
+    // scrub only: it remains due, and will be scheduled again.
+    m_osds->clog->error() << m_pg->info.pgid << " " << m_mode_desc
+			  << " aborted: undecodable scrub map from osd." << m->from;
+    m_received_maps.erase(m->from);
+    scrub_clear_state();
+    return;
+  }
   dout(15) << "map version is " << m_received_maps[m->from].valid_through << dendl;
 
   auto [is_ok, err_txt] = m_maps_status.mark_arriving_map(m->from);
@@ -1442,6 +1931,9 @@ void PgScrubber::map_from_replica(OpRequestRef op)
     preemption_data.do_preempt();
   }
 
+  // the replica is free to scan ahead
+  prefetch_next_chunk(m->from);
+
   if (m_maps_status.are_all_maps_available()) {
     dout(15) << __func__ << " all repl-maps available" << dendl;
     m_osds->queue_scrub_got_repl_maps(m_pg, m_pg->is_scrub_blocking_ops());
@@ -1529,6 +2021,33 @@ void PgScrubber::handle_scrub_reserve_reject(OpRequestRef op, pg_shard_t from)
   }
 }
 
+void PgScrubber::on_active_advmap(const OSDMap& osdmap)
+{
+  if (m_reservations.has_value()) {
+    m_reservations->on_new_osdmap(osdmap);
+  }
+}
+
+void PgScrubber::handle_scrub_slot_reply(OpRequestRef op)
+{
+  dout(10) << __func__ << " " << *op->get_req() << dendl;
+  op->mark_started();
+  auto m = op->get_req<MOSDScrubReserve>();
+
+  if (m_reservations.has_value()) {
+    m_reservations->handle_slot_reply(op);
+  } else if (m->type == MOSDScrubReserve::SLOT_GRANT) {
+    // we are no longer reserving. Do not hold on to the slot.
+    dout(10) << __func__ << ": releasing an unsolicited slot of bucket " << m->bucket
+	     << dendl;
+    m_osds->send_message_osd_cluster(
+      m->from.osd,
+      new MOSDScrubReserve(m_pg_id, get_osdmap_epoch(), MOSDScrubReserve::SLOT_RELEASE,
+			   m_pg_whoami, m->bucket),
+      get_osdmap_epoch());
+  }
+}
+
 void PgScrubber::handle_scrub_reserve_release(OpRequestRef op)
 {
   dout(10) << __func__ << " " << *op->get_req() << dendl;
@@ -1721,7 +2240,10 @@ void PgScrubber::scrub_finish()
     m_pg->recovery_state.update_stats(
       [this](auto& history, auto& stats) {
 	dout(10) << "m_pg->recovery_state.update_stats()" << dendl;
-	utime_t now = ceph_clock_now();
+	// a resumed scrub is dated by the start of the attempt completing it:
+	// older than its end, but not than the objects its first attempt read
+	// and was not to re-read
+	utime_t now = m_resumed ? m_scrub_started : ceph_clock_now();
 	history.last_scrub = m_pg->recovery_state.get_info().last_update;
 	history.last_scrub_stamp = now;
 	if (m_is_deep) {
@@ -1734,9 +2256,12 @@ void PgScrubber::scrub_finish()
 	    history.last_clean_scrub_stamp = now;
 	  stats.stats.sum.num_shallow_scrub_errors = m_shallow_errors;
 	  stats.stats.sum.num_deep_scrub_errors = m_deep_errors;
-	  stats.stats.sum.num_large_omap_objects = m_omap_stats.large_omap_objects;
-	  stats.stats.sum.num_omap_bytes = m_omap_stats.omap_bytes;
-	  stats.stats.sum.num_omap_keys = m_omap_stats.omap_keys;
+	  if (!stats_unverifiable()) {
+	    // (otherwise some objects were counted twice)
+	    stats.stats.sum.num_large_omap_objects = m_omap_stats.large_omap_objects;
+	    stats.stats.sum.num_omap_bytes = m_omap_stats.omap_bytes;
+	    stats.stats.sum.num_omap_keys = m_omap_stats.omap_keys;
+	  }
 	  dout(25) << "scrub_finish shard " << m_pg_whoami
 		   << " num_omap_bytes = " << stats.stats.sum.num_omap_bytes
 		   << " num_omap_keys = " << stats.stats.sum.num_omap_keys << dendl;
@@ -1760,6 +2285,7 @@ void PgScrubber::scrub_finish()
 	return true;
       },
       &t);
+    clear_checkpoint(&t);
     int tr = m_osds->store->queue_transaction(m_pg->ch, std::move(t), nullptr);
     ceph_assert(tr == 0);
 
@@ -1977,6 +2503,9 @@ void PgScrubber::reset_internal_state()
   preemption_data.reset();
   m_maps_status.reset();
   m_received_maps.clear();
+  m_prefetched.clear();
+  m_repl_scanning.clear();
+  m_deferred_requests.clear();
 
   m_start = hobject_t{};
   m_end = hobject_t{};
@@ -1986,6 +2515,10 @@ void PgScrubber::reset_internal_state()
   m_deep_errors = 0;
   m_fixed_count = 0;
   m_omap_stats = (const struct omap_stat_t){0};
+  m_resumed.reset();
+  m_resumed_prefix_modified = false;
+  m_last_checkpoint = utime_t{};
+  m_last_step_cost = 0;
 
   run_callbacks();
 
@@ -2066,6 +2599,173 @@ void ReplicaReservations::release_replica(pg_shard_t peer, epoch_t epoch)
   m_osds->send_message_osd_cluster(peer.osd, m, epoch);
 }
 
+void ReplicaReservations::release_slot(int bucket, int coordinator, epoch_t epoch)
+{
+  if (coordinator == m_pg->pg_whoami.osd) {
+    m_osds->get_scrub_services().release_slot(bucket, m_pg->info.pgid.pgid);
+    return;
+  }
+  auto m = new MOSDScrubReserve(m_pg->pg_id, epoch, MOSDScrubReserve::SLOT_RELEASE,
+				m_pg->pg_whoami, bucket);
+  m_osds->send_message_osd_cluster(coordinator, m, epoch);
+}
+
+void ReplicaReservations::release_all_slots(epoch_t epoch)
+{
+  for (const auto& [bucket, coordinator] : m_reserved_slots) {
+    release_slot(bucket, coordinator, epoch);
+  }
+  m_reserved_slots.clear();
+  for (const auto& [bucket, coordinator] : m_waited_for_slots) {
+    release_slot(bucket, coordinator, epoch);
+  }
+  m_waited_for_slots.clear();
+}
+
+int ReplicaReservations::request_slots(epoch_t epoch)
+{
+  auto osdmap = m_pg->get_osdmap();
+  if (osdmap->require_osd_release < ceph_release_t::quincy) {
+    // older OSDs do not know about scrub slots
+    return 0;
+  }
+
+  std::set<int> osds;
+  for (const auto& p : m_acting_set) {
+    osds.insert(p.osd);
+  }
+  auto& scrub_queue = m_osds->get_scrub_services();
+  const auto buckets = scrub_queue.get_slot_buckets(*osdmap, osds);
+  const int whoami = m_pg->pg_whoami.osd;
+
+  // the buckets we are coordinating ourselves are handled first, so that no
+  // request is sent if one of them is full
+  for (const auto& b : buckets) {
+    if (b.coordinator != whoami) {
+      continue;
+    }
+    if (!scrub_queue.grant_slot(b.bucket, m_pg->info.pgid.pgid, whoami, b.limit)) {
+      dout(10) << __func__ << " <ReplicaReservations> no free slot in bucket "
+	       << b.bucket << dendl;
+      m_had_rejections = true;
+      return 0;
+    }
+    m_reserved_slots[b.bucket] = whoami;
+  }
+
+  int requested = 0;
+  for (const auto& b : buckets) {
+    if (b.coordinator == whoami) {
+      continue;
+    }
+    auto m = new MOSDScrubReserve(m_pg->pg_id, epoch, MOSDScrubReserve::SLOT_REQUEST,
+				  m_pg->pg_whoami, b.bucket);
+    m_osds->send_message_osd_cluster(b.coordinator, m, epoch);
+    m_waited_for_slots[b.bucket] = b.coordinator;
+    ++requested;
+    dout(10) << __func__ << " <ReplicaReservations> slot of bucket " << b.bucket
+	     << " <-> " << b.coordinator << dendl;
+  }
+  if (requested) {
+    arm_slots_timeout();
+  }
+  return requested;
+}
+
+void ReplicaReservations::arm_slots_timeout()
+{
+  const double timeout =
+    m_pg->get_cct()->_conf.get_val<double>("osd_scrub_slot_request_timeout");
+  if (timeout <= 0) {
+    return;
+  }
+  m_slots_timeout = new LambdaContext(
+    [this, osds = m_osds, pgid = m_pg->pg_id,
+     alive = std::weak_ptr<bool>{m_alive}]([[maybe_unused]] int r) {
+      PGRef pg = osds->osd->lookup_lock_pg(pgid);
+      if (!pg) {
+	return;
+      }
+      // we are destroyed under the PG lock
+      if (!alive.expired()) {
+	handle_slots_timeout();
+      }
+      pg->unlock();
+    });
+  std::lock_guard l(m_osds->sleep_lock);
+  m_osds->sleep_timer.add_event_after(timeout, m_slots_timeout);
+}
+
+void ReplicaReservations::cancel_slots_timeout()
+{
+  if (m_slots_timeout) {
+    std::lock_guard l(m_osds->sleep_lock);
+    m_osds->sleep_timer.cancel_event(m_slots_timeout);
+    m_slots_timeout = nullptr;
+  }
+}
+
+void ReplicaReservations::handle_slots_timeout()
+{
+  m_slots_timeout = nullptr;  // already fired
+  if (m_waited_for_slots.empty() || m_had_rejections) {
+    return;
+  }
+  dout(5) << __func__ << " <ReplicaReservations> no reply to the slot requests of "
+	  << m_waited_for_slots << dendl;
+  m_had_rejections = true;  // preventing any additional notifications
+  send_reject();
+}
+
+void ReplicaReservations::on_new_osdmap(const OSDMap& osdmap)
+{
+  // a request whose coordinator is gone - or has restarted - will not be
+  // answered
+  for (const auto& [bucket, coordinator] : m_waited_for_slots) {
+    if (m_had_rejections) {
+      break;
+    }
+    if (ScrubQueue::get_slot_coordinator(osdmap, bucket) != coordinator ||
+	osdmap.get_up_from(coordinator) > m_slots_announced_at) {
+      dout(10) << __func__ << " <ReplicaReservations> the coordinator of bucket "
+	       << bucket << " has changed" << dendl;
+      m_had_rejections = true;
+      send_reject();
+    }
+  }
+
+  // coordinators keep their granted slots in memory only: a new or a
+  // restarted coordinator must be told about the slots we are holding
+  const int whoami = m_pg->pg_whoami.osd;
+  const epoch_t epoch = osdmap.get_epoch();
+  bool announced = false;
+  for (auto& [bucket, coordinator] : m_reserved_slots) {
+    const int current = ScrubQueue::get_slot_coordinator(osdmap, bucket);
+    if (current < 0 || (current == coordinator &&
+			osdmap.get_up_from(current) <= m_slots_announced_at)) {
+      continue;
+    }
+    dout(10) << __func__ << " <ReplicaReservations> announcing the slot of bucket "
+	     << bucket << " to osd." << current << dendl;
+    coordinator = current;
+    announced = true;
+    if (current == whoami) {
+      // over the limit if the slots were re-granted meanwhile, but only until
+      // this scrub is done
+      auto& scrub_queue = m_osds->get_scrub_services();
+      scrub_queue.grant_slot(bucket, m_pg->info.pgid.pgid, whoami,
+			     std::numeric_limits<unsigned>::max());
+    } else {
+      auto m = new MOSDScrubReserve(m_pg->pg_id, epoch, MOSDScrubReserve::SLOT_REQUEST,
+				    m_pg->pg_whoami, bucket);
+      m_osds->send_message_osd_cluster(current, m, epoch);
+    }
+  }
+  if (announced) {
+    m_slots_announced_at = epoch;
+  }
+}
+
 ReplicaReservations::ReplicaReservations(PG* pg, pg_shard_t whoami)
     : m_pg{pg}
     , m_acting_set{pg->get_actingset()}
@@ -2073,9 +2773,15 @@ ReplicaReservations::ReplicaReservations(PG* pg, pg_shard_t whoami)
     , m_pending{static_cast<int>(m_acting_set.size()) - 1}
 {
   epoch_t epoch = m_pg->get_osdmap_epoch();
+  m_slots_announced_at = epoch;
+  m_pending += request_slots(epoch);
 
-  // handle the special case of no replicas
-  if (m_pending <= 0) {
+  if (m_had_rejections) {
+    // a bucket we coordinate has no free slots
+    send_reject();
+
+  } else if (m_pending <= 0) {
+    // handle the special case of no replicas (and no capped buckets)
     // just signal the scrub state-machine to continue
     send_all_done();
 
@@ -2095,11 +2801,15 @@ ReplicaReservations::ReplicaReservations(PG* pg, pg_shard_t whoami)
 
 void ReplicaReservations::send_all_done()
 {
+  m_osds->get_scrub_services().clear_penalty(m_pg->info.pgid);
   m_osds->queue_for_scrub_granted(m_pg, scrub_prio_t::low_priority);
 }
 
 void ReplicaReservations::send_reject()
 {
+  // delay the next attempt to scrub this PG, so that we do not keep trying to
+  // reserve the same busy replicas at each tick
+  m_osds->get_scrub_services().penalize(m_pg->info.pgid, ceph_clock_now());
   m_osds->queue_for_scrub_denied(m_pg, scrub_prio_t::low_priority);
 }
 
@@ -2110,6 +2820,11 @@ void ReplicaReservations::discard_all()
   m_had_rejections = true;  // preventing late-coming responses from triggering events
   m_reserved_peers.clear();
   m_waited_for_peers.clear();
+
+  // the slots' coordinators are not members of the PG, and are not aware of the
+  // interval change
+  cancel_slots_timeout();
+  release_all_slots(m_pg->get_osdmap_epoch());
 }
 
 ReplicaReservations::~ReplicaReservations()
@@ -2133,6 +2848,9 @@ ReplicaReservations::~ReplicaReservations()
     release_replica(p, epoch);
   }
   m_waited_for_peers.clear();
+
+  cancel_slots_timeout();
+  release_all_slots(epoch);
 }
 
 /**
@@ -2203,6 +2921,44 @@ void ReplicaReservations::handle_reserve_reject(OpRequestRef op, pg_shard_t from
   }
 }
 
+void ReplicaReservations::handle_slot_reply(OpRequestRef op)
+{
+  auto m = op->get_req<MOSDScrubReserve>();
+  dout(10) << __func__ << " <ReplicaReservations> " << *m << dendl;
+  op->mark_started();
+
+  auto w = m_waited_for_slots.find(m->bucket);
+  if (w == m_waited_for_slots.end()) {
+    // possibly the reply to a slot announcement (see on_new_osdmap())
+    dout(10) << " not waiting for the slot of bucket " << m->bucket << dendl;
+    if (m->type == MOSDScrubReserve::SLOT_GRANT && !m_reserved_slots.count(m->bucket)) {
+      release_slot(m->bucket, m->from.osd, m_pg->get_osdmap_epoch());
+    }
+    return;
+  }
+  const int coordinator = w->second;
+  m_waited_for_slots.erase(w);
+  if (m_waited_for_slots.empty()) {
+    cancel_slots_timeout();
+  }
+
+  if (m->type == MOSDScrubReserve::SLOT_GRANT) {
+    if (m_had_rejections) {
+      dout(10) << " releasing late-coming slot of bucket " << m->bucket << dendl;
+      release_slot(m->bucket, coordinator, m_pg->get_osdmap_epoch());
+    } else {
+      m_reserved_slots[m->bucket] = coordinator;
+      if (--m_pending == 0) {
+	send_all_done();
+      }
+    }
+  } else if (!m_had_rejections) {
+    dout(10) << " no free slot in bucket " << m->bucket << dendl;
+    m_had_rejections = true;  // preventing any additional notifications
+    send_reject();
+  }
+}
+
 
 // ///////////////////// LocalReservation //////////////////////////////////
 
@@ -2298,6 +3054,96 @@ ostream& operator<<(ostream& out, const MapsCollectionStatus& sf)
   return out << " ] ";
 }
 
+// ///////////////////// PrefetchWindow ///////////////////////////////
+
+/*
+ * A prefetched chunk was not write-blocked while the replicas were scanning it.
+ * Its maps may only be used if no update to the chunk was logged since they were
+ * requested, and no object was recovered in the meantime.
+ */
+bool prefetched_chunk_t::is_valid(const hobject_t& end,
+				  eversion_t subset_last_update,
+				  eversion_t log_tail,
+				  bool is_clean) const
+{
+  if (this->end != end || !is_clean) {
+    return false;
+  }
+
+  // if the log was trimmed past the point where the chunk was selected, we cannot
+  // tell whether the chunk was modified since
+  if (log_tail > selected_at) {
+    return false;
+  }
+  return this->subset_last_update == subset_last_update;
+}
+
+void PrefetchWindow::drop_before(const hobject_t& start)
+{
+  while (!m_chunks.empty() && m_chunks.front().start < start) {
+    m_chunks.pop_front();
+  }
+}
+
+std::optional<hobject_t> PrefetchWindow::front_end(const hobject_t& start) const
+{
+  if (m_chunks.empty() || m_chunks.front().start != start) {
+    return std::nullopt;
+  }
+  return m_chunks.front().end;
+}
+
+hobject_t PrefetchWindow::front_start() const
+{
+  return m_chunks.empty() ? hobject_t::get_max() : m_chunks.front().start;
+}
+
+std::optional<prefetched_chunk_t> PrefetchWindow::pop_front(const hobject_t& start)
+{
+  if (m_chunks.empty() || m_chunks.front().start != start) {
+    return std::nullopt;
+  }
+  auto chunk = std::move(m_chunks.front());
+  m_chunks.pop_front();
+  return chunk;
+}
+
+prefetched_chunk_t* PrefetchWindow::find_requested(const hobject_t& start,
+						   pg_shard_t replica)
+{
+  auto chunk = std::find_if(m_chunks.begin(), m_chunks.end(),
+			    [&](const auto& c) { return c.start == start; });
+  if (chunk == m_chunks.end() || !chunk->requested.count(replica)) {
+    return nullptr;
+  }
+  return &*chunk;
+}
+
+prefetched_chunk_t* PrefetchWindow::request_next(pg_shard_t replica,
+						 size_t depth,
+						 const hobject_t& from,
+						 const chunk_selector_t& select)
+{
+  auto chunk =
+    std::find_if(m_chunks.begin(), m_chunks.end(),
+		 [replica](const auto& c) { return !c.requested.count(replica); });
+
+  if (chunk == m_chunks.end()) {
+    if (m_chunks.size() >= depth) {
+      return nullptr;
+    }
+    hobject_t start = m_chunks.empty() ? from : m_chunks.back().end;
+    if (start.is_max()) {
+      return nullptr;
+    }
+    m_chunks.push_back(select(start));
+    chunk = std::prev(m_chunks.end());
+  }
+
+  chunk->requested.insert(replica);
+  return &*chunk;
+}
+
 // ///////////////////// blocked_range_t ///////////////////////////////
 
 blocked_range_t::blocked_range_t(OSDService* osds, ceph::timespan waittime, spg_t pg_id)
@@ -5,6 +5,8 @@
 
 #include <cassert>
 #include <chrono>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <optional>
@@ -14,10 +16,12 @@
 
 #include "PG.h"
 #include "ScrubStore.h"
+#include "ScrubVerifiedStore.h"
 #include "scrub_machine_lstnr.h"
 #include "scrubber_common.h"
 
 class Callback;
+class MOSDRepScrubMap;
 
 namespace Scrub {
 class ScrubMachine;
@@ -26,7 +30,9 @@ struct BuildMap;
 /**
  * Reserving/freeing scrub resources at the replicas.
  *
- *  When constructed - sends reservation requests to the acting_set.
+ *  When constructed - sends reservation requests to the acting_set, and slot
+ *  requests to the coordinators of the capped hosts & failure domains the acting
+ *  set spans (see ScrubQueue).
  *  A rejection triggers a "couldn't acquire the replicas' scrub resources" event.
  *  All previous requests, whether already granted or not, are explicitly released.
  *
@@ -43,11 +49,34 @@ class ReplicaReservations {
   OSDService* m_osds;
   std::vector<pg_shard_t> m_waited_for_peers;
   std::vector<pg_shard_t> m_reserved_peers;
+  /// host & failure-domain slots: bucket -> its coordinator
+  std::map<int, int> m_waited_for_slots;
+  std::map<int, int> m_reserved_slots;
+  /// the reserved slots are known to coordinators that were up at this epoch
+  epoch_t m_slots_announced_at{0};
+  /// fails the reservation if slot requests are not answered in time
+  Context* m_slots_timeout{nullptr};
+  /// lets the timeout callback (holding the PG lock) know we still exist
+  std::shared_ptr<bool> m_alive{std::make_shared<bool>(true)};
   bool m_had_rejections{false};
   int m_pending{-1};
 
   void release_replica(pg_shard_t peer, epoch_t epoch);
 
+  /// send slot requests to the coordinators. @returns the number of requests
+  int request_slots(epoch_t epoch);
+
+  void release_slot(int bucket, int coordinator, epoch_t epoch);
+
+  /// release all slots, granted or requested
+  void release_all_slots(epoch_t epoch);
+
+  void arm_slots_timeout();
+  void cancel_slots_timeout();
+
+  /// slot requests were not answered in time: handled as a rejection
+  void handle_slots_timeout();
+
   void send_all_done();	 ///< all reservations are granted
 
   /// notify the scrubber that we have failed to reserve replicas' resources
@@ -69,6 +98,15 @@ class ReplicaReservations {
   void handle_reserve_grant(OpRequestRef op, pg_shard_t from);
 
   void handle_reserve_reject(OpRequestRef op, pg_shard_t from);
+
+  void handle_slot_reply(OpRequestRef op);
+
+  /**
+   * a pending slot request whose coordinator has changed or restarted is
+   * lost: fail the reservation. The slots already held are announced to the
+   * new (or restarted) coordinators, which have no record of them.
+   */
+  void on_new_osdmap(const OSDMap& osdmap);
 };
 
 /**
@@ -139,6 +177,78 @@ class MapsCollectionStatus {
   friend ostream& operator<<(ostream& out, const MapsCollectionStatus& sf);
 };
 
+/**
+ * Pipelining (osd_scrub_pipeline_depth): once a replica has sent us its map,
+ * it is asked to scan the following chunk(s) while we are still building,
+ * comparing and updating the current one. PrefetchWindow tracks those chunks, in
+ * order. The prefetched chunks are not write-blocked. Their maps are only used
+ * if the chunk was not modified since they were requested (see
+ * prefetched_chunk_t::is_valid()).
+ */
+struct prefetched_chunk_t {
+  hobject_t start;
+  hobject_t end;
+  /// the replicas scan the chunk once they have applied this version
+  eversion_t subset_last_update;
+  /// the PG's last_update when the chunk was selected
+  eversion_t selected_at;
+  /// the replicas that were asked for their maps
+  std::set<pg_shard_t> requested;
+  /// the maps received so far
+  std::map<pg_shard_t, ScrubMap> maps;
+
+  /**
+   * may the maps be used for scrubbing the chunk ending at 'end'? Not if an
+   * update to the chunk was logged since they were requested (the chunk's
+   * 'subset_last_update' is now 'subset_last_update'), if the log was trimmed
+   * past that point (to 'log_tail'), or if the PG is no longer clean.
+   */
+  bool is_valid(const hobject_t& end,
+		eversion_t subset_last_update,
+		eversion_t log_tail,
+		bool is_clean) const;
+};
+
+class PrefetchWindow {
+ public:
+  /// selects the chunk starting at the given object
+  using chunk_selector_t = std::function<prefetched_chunk_t(const hobject_t&)>;
+
+  /// drop the chunks starting before 'start' (skipped following a preemption)
+  void drop_before(const hobject_t& start);
+
+  /// the end of the first chunk, if it starts at 'start'
+  std::optional<hobject_t> front_end(const hobject_t& start) const;
+
+  /// the start of the first chunk (hobject_t::get_max() if none)
+  hobject_t front_start() const;
+
+  /// remove the first chunk if it starts at 'start', and return it
+  std::optional<prefetched_chunk_t> pop_front(const hobject_t& start);
+
+  /// the chunk starting at 'start', if 'replica' was asked to scan it
+  prefetched_chunk_t* find_requested(const hobject_t& start, pg_shard_t replica);
+
+  /**
+   * mark 'replica' as asked to scan the first chunk it was not yet asked for.
+   * If there is none, and fewer than 'depth' chunks are in the window, a new
+   * chunk is selected, following the last one (or starting at 'from' if the
+   * window is empty).
+   * @returns nullptr if the window is full, or the end of the PG was reached
+   */
+  prefetched_chunk_t* request_next(pg_shard_t replica,
+				   size_t depth,
+				   const hobject_t& from,
+				   const chunk_selector_t& select);
+
+  size_t size() const { return m_chunks.size(); }
+  bool empty() const { return m_chunks.empty(); }
+  void clear() { m_chunks.clear(); }
+
+ private:
+  std::deque<prefetched_chunk_t> m_chunks;
+};
+
 
 }  // namespace Scrub
 
@@ -247,8 +357,11 @@ class PgScrubber : public ScrubPgIF, public ScrubMachineListener {
 
   void handle_scrub_reserve_grant(OpRequestRef op, pg_shard_t from) final;
   void handle_scrub_reserve_reject(OpRequestRef op, pg_shard_t from) final;
+  void handle_scrub_slot_reply(OpRequestRef op) final;
   void handle_scrub_reserve_release(OpRequestRef op) final;
   void discard_replica_reservations() final;
+
+  void on_active_advmap(const OSDMap& osdmap) final;
   void clear_scrub_reservations() final;  // PG::clear... fwds to here
   void unreserve_replicas() final;
 
@@ -289,6 +402,8 @@ class PgScrubber : public ScrubPgIF, public ScrubMachineListener {
   /// the version that refers to m_flags.priority
   unsigned int scrub_requeue_priority(Scrub::scrub_prio_t with_priority) const final;
 
+  int scrub_requeue_cost() const final;
+
   void add_callback(Context* context) final { m_callbacks.push_back(context); }
 
   [[nodiscard]] bool are_callbacks_pending() const final  // used for an assert in PG.cc
@@ -352,6 +467,10 @@ class PgScrubber : public ScrubPgIF, public ScrubMachineListener {
   /// walk the log to find the latest update that affects our chunk
   eversion_t search_log_for_updates() const final;
 
+  /// walk the log to find the latest update that affects [start, end)
+  eversion_t search_log_for_updates(const hobject_t& start,
+				    const hobject_t& end) const;
+
   eversion_t get_last_update_applied() const final
   {
     return m_pg->recovery_state.get_last_update_applied();
@@ -423,6 +542,13 @@ class PgScrubber : public ScrubPgIF, public ScrubMachineListener {
 
   virtual void _scrub_clear_state() {}
 
+  /// the derivative-specific part of the stats collected by the scrub
+  virtual object_stat_collection_t _scrub_get_stats() const { return {}; }
+  virtual void _scrub_restore_stats(const object_stat_collection_t& stats) {}
+
+  /// the stats collected by a resumed scrub cannot be compared with the PG's
+  [[nodiscard]] bool stats_unverifiable() const { return m_resumed_prefix_modified; }
+
   utime_t m_scrub_reg_stamp;  ///< stamp we registered for
 
   ostream& show(ostream& out) const override;
@@ -548,6 +674,65 @@ class PgScrubber : public ScrubPgIF, public ScrubMachineListener {
 			    hobject_t end,
 			    bool deep);
 
+  /// the requeue callback handed to the hashing pool via ScrubMapBuilder
+  std::function<void()> hasher_waker(bool replica) const;
+
+  /**
+   * incremental deep scrub (osd_deep_scrub_incremental): fetch the verification
+   * records of the objects listed in 'pos', unless performing a full sweep.
+   */
+  void prepare_incremental_scan(ScrubMapBuilder& pos);
+
+  /// is this shard due a full sweep (or not scrubbing incrementally at all)?
+  bool full_sweep_due();
+
+  /// persist the verification records collected while scanning the chunk
+  void persist_verified(ScrubMapBuilder& pos, const hobject_t& end);
+
+  /// should this deep scrub ignore the verification records? Decided by the
+  /// primary when the scrub is set up. A replica also performs one when it is
+  /// due one itself.
+  bool m_deep_full_sweep{true};
+
+  /// has this shard scanned the current deep scrub from the start of the PG? Only
+  /// then is a full sweep recorded as completed.
+  bool m_sweep_from_start{false};
+
+  Scrub::VerifiedStore& get_verified_store();
+
+  // ---- deep scrub checkpoints (osd_deep_scrub_checkpoint). Primary only.
+
+  /**
+   * at the start of a deep scrub: continue from where a previous, interrupted,
+   * attempt has stopped - if its checkpoint is still valid.
+   */
+  void maybe_resume_from_checkpoint();
+
+  /// after a chunk was compared: record our progress (if error-free)
+  void maybe_checkpoint();
+
+  void clear_checkpoint(ObjectStore::Transaction* t);
+
+  /// the checkpoint the running scrub was resumed from
+  std::optional<scrub_checkpoint_t> m_resumed;
+
+  /// were objects below the checkpoint's boundary modified after it was
+  /// written? They are scrubbed again, but the stats collected are then not
+  /// accurate.
+  bool m_resumed_prefix_modified{false};
+
+  /// when was the running scrub (or, if resumed, its current attempt) started
+  utime_t m_scrub_started;
+
+  utime_t m_last_checkpoint;
+
+  /// a valid checkpoint exists in the store (and should be removed)
+  bool m_has_checkpoint{false};
+
+  /// the (mClock) cost of the last map-building step: the metadata of the
+  /// objects it scanned, and the data it read. 0 if not measured yet.
+  int m_last_step_cost{0};
+
   std::unique_ptr<Scrub::ScrubMachine> m_fsm;
   const spg_t m_pg_id;	///< a local copy of m_pg->pg_id
   OSDService* const m_osds;
@@ -642,6 +827,9 @@ private:
    */
   bool select_range();
 
+  /// the end of a chunk starting at 'start' (not checked for availability)
+  hobject_t select_chunk_end(const hobject_t& start) const;
+
   std::list<Context*> m_callbacks;
 
   /**
@@ -668,9 +856,29 @@ private:
 			  bool deep,
 			  bool allow_preemption);
 
+  /**
+   * decode the map sent by a replica, decompressing it if it is compressed.
+   * @returns false if the map could not be decompressed or decoded
+   */
+  bool decode_replica_map(const MOSDRepScrubMap& m, ScrubMap& map) const;
 
   Scrub::MapsCollectionStatus m_maps_status;
 
+  /// the chunks following the current one (osd_scrub_pipeline_depth)
+  Scrub::PrefetchWindow m_prefetched;
+
+  /// the start of the chunk each replica is scanning for us
+  std::map<pg_shard_t, hobject_t> m_repl_scanning;
+
+  /// replicas that must be asked for the current chunk once they are done
+  /// scanning a discarded prefetched chunk
+  std::set<pg_shard_t> m_deferred_requests;
+
+  bool is_prefetched_chunk_valid(const Scrub::prefetched_chunk_t& chunk) const;
+
+  /// ask a replica that has just sent us its map for the next chunk in the window
+  void prefetch_next_chunk(pg_shard_t replica);
+
   omap_stat_t m_omap_stats = (const struct omap_stat_t){0};
 
   /// Maps from objects with errors to inconsistent peers
@@ -686,6 +894,12 @@ private:
   ScrubMapBuilder replica_scrubmap_pos;
   ScrubMap replica_scrubmap;
 
+  /// the primary has asked for a compact map (osd_scrub_compact_replica_maps)
+  bool m_compact_replica_map{false};
+
+  /// digest the large xattrs of replica_scrubmap, then encode and compress it
+  void encode_compact_map(MOSDRepScrubMap& reply);
+
   /**
    * we mark the request priority as it arrived. It influences the queuing priority
    * when we wait for local updates
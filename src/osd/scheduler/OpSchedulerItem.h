@@ -34,6 +34,7 @@ enum class op_scheduler_class : uint8_t {
   background_best_effort,
   immediate,
   client,
+  background_scrub,
 };
 
 class OpSchedulerItem {
@@ -321,7 +322,7 @@ public:
   void run(
     OSD *osd, OSDShard *sdata, PGRef& pg, ThreadPool::TPHandle &handle) final;
   op_scheduler_class get_scheduler_class() const final {
-    return op_scheduler_class::background_best_effort;
+    return op_scheduler_class::background_scrub;
   }
 };
 
@@ -344,7 +345,7 @@ class PGScrubItem : public PGOpQueueable {
 	   ThreadPool::TPHandle& handle) override = 0;
   op_scheduler_class get_scheduler_class() const final
   {
-    return op_scheduler_class::background_best_effort;
+    return op_scheduler_class::background_scrub;
   }
 };
 
@@ -46,14 +46,19 @@ mClockScheduler::mClockScheduler(CephContext *cct,
   cct->_conf.add_observer(this);
   ceph_assert(num_shards > 0);
   set_max_osd_capacity();
+  set_max_osd_bandwidth();
   set_osd_mclock_cost_per_io();
   set_osd_mclock_cost_per_byte();
   set_mclock_profile();
   enable_mclock_profile_settings();
-  client_registry.update_from_config(cct->_conf);
+  client_registry.update_from_config(
+    cct->_conf, osd_mclock_cost_per_io, osd_mclock_cost_per_byte);
 }
 
-void mClockScheduler::ClientRegistry::update_from_config(const ConfigProxy &conf)
+void mClockScheduler::ClientRegistry::update_from_config(
+  const ConfigProxy &conf,
+  double cost_per_io,
+  double cost_per_byte)
 {
   default_external_client_info.update(
     conf.get_val<uint64_t>("osd_mclock_scheduler_client_res"),
@@ -71,6 +76,19 @@ void mClockScheduler::ClientRegistry::update_from_config(const ConfigProxy &conf
     conf.get_val<uint64_t>("osd_mclock_scheduler_background_best_effort_res"),
     conf.get_val<uint64_t>("osd_mclock_scheduler_background_best_effort_wgt"),
     conf.get_val<uint64_t>("osd_mclock_scheduler_background_best_effort_lim"));
+
+  // as calc_scaled_cost() charges them, taking a scrub item to read a deep
+  // scrub stride
+  const double scrub_stride =
+    std::max<uint64_t>(conf->osd_deep_scrub_stride, 1);
+  const double scrub_cost_per_byte = cost_per_byte + cost_per_io / scrub_stride;
+  internal_client_infos[
+    static_cast<size_t>(op_scheduler_class::background_scrub)].update(
+    scrub_cost_per_byte *
+      conf.get_val<Option::size_t>("osd_mclock_scheduler_background_scrub_res"),
+    conf.get_val<uint64_t>("osd_mclock_scheduler_background_scrub_wgt"),
+    scrub_cost_per_byte *
+      conf.get_val<Option::size_t>("osd_mclock_scheduler_background_scrub_lim"));
 }
 
 const dmc::ClientInfo *mClockScheduler::ClientRegistry::get_external_client(
@@ -114,6 +132,23 @@ void mClockScheduler::set_max_osd_capacity()
           << dendl;
 }
 
+void mClockScheduler::set_max_osd_bandwidth()
+{
+  if (is_rotational) {
+    max_osd_bandwidth = cct->_conf.get_val<Option::size_t>(
+      "osd_mclock_max_sequential_bandwidth_hdd");
+  } else {
+    max_osd_bandwidth = cct->_conf.get_val<Option::size_t>(
+      "osd_mclock_max_sequential_bandwidth_ssd");
+  }
+  // Set per op-shard bandwidth limit
+  max_osd_bandwidth /= num_shards;
+  dout(1) << __func__ << " #op shards: " << num_shards
+          << std::fixed << std::setprecision(2)
+          << " max osd bandwidth(bytes/sec) per shard: " << max_osd_bandwidth
+          << dendl;
+}
+
 void mClockScheduler::set_osd_mclock_cost_per_io()
 {
   std::chrono::seconds sec(1);
@@ -181,6 +216,8 @@ void mClockScheduler::set_balanced_profile_allocations()
   //   reservation: 40% | weight: 1 | limit: 150% |
   // Background Best Effort Allocation:
   //   reservation: 20% | weight: 2 | limit: max |
+  // Background Scrub Allocation (bytes/sec):
+  //   reservation: 10% | weight: 1 | limit: 100% |
 
   // Client
   uint64_t client_res = static_cast<uint64_t>(
@@ -202,6 +239,13 @@ void mClockScheduler::set_balanced_profile_allocations()
   uint64_t best_effort_lim = default_max;
   uint64_t best_effort_wgt = 2;
 
+  // Background Scrub
+  uint64_t scrub_res = static_cast<uint64_t>(
+    std::round(0.10 * max_osd_bandwidth));
+  uint64_t scrub_lim = static_cast<uint64_t>(
+    std::round(max_osd_bandwidth));
+  uint64_t scrub_wgt = default_min;
+
   // Set the allocations for the mclock clients
   client_allocs[
     static_cast<size_t>(op_scheduler_class::client)].update(
@@ -218,6 +262,11 @@ void mClockScheduler::set_balanced_profile_allocations()
       best_effort_res,
       best_effort_wgt,
       best_effort_lim);
+  client_allocs[
+    static_cast<size_t>(op_scheduler_class::background_scrub)].update(
+      scrub_res,
+      scrub_wgt,
+      scrub_lim);
 }
 
 void mClockScheduler::set_high_recovery_ops_profile_allocations()
@@ -228,6 +277,8 @@ void mClockScheduler::set_high_recovery_ops_profile_allocations()
   //   reservation: 60% | weight: 2 | limit: 200% |
   // Background Best Effort Allocation:
   //   reservation: 1 | weight: 2 | limit: max |
+  // Background Scrub Allocation (bytes/sec):
+  //   reservation: 5% | weight: 1 | limit: 50% |
 
   // Client
   uint64_t client_res = static_cast<uint64_t>(
@@ -248,6 +299,13 @@ void mClockScheduler::set_high_recovery_ops_profile_allocations()
   uint64_t best_effort_lim = default_max;
   uint64_t best_effort_wgt = 2;
 
+  // Background Scrub
+  uint64_t scrub_res = static_cast<uint64_t>(
+    std::round(0.05 * max_osd_bandwidth));
+  uint64_t scrub_lim = static_cast<uint64_t>(
+    std::round(0.50 * max_osd_bandwidth));
+  uint64_t scrub_wgt = default_min;
+
   // Set the allocations for the mclock clients
   client_allocs[
     static_cast<size_t>(op_scheduler_class::client)].update(
@@ -264,6 +322,11 @@ void mClockScheduler::set_high_recovery_ops_profile_allocations()
       best_effort_res,
       best_effort_wgt,
       best_effort_lim);
+  client_allocs[
+    static_cast<size_t>(op_scheduler_class::background_scrub)].update(
+      scrub_res,
+      scrub_wgt,
+      scrub_lim);
 }
 
 void mClockScheduler::set_high_client_ops_profile_allocations()
@@ -274,6 +337,8 @@ void mClockScheduler::set_high_client_ops_profile_allocations()
   //   reservation: 25% | weight: 1 | limit: 100% |
   // Background Best Effort Allocation:
   //   reservation: 25% | weight: 2 | limit: max |
+  // Background Scrub Allocation (bytes/sec):
+  //   reservation: 5% | weight: 1 | limit: 100% |
 
   // Client
   uint64_t client_res = static_cast<uint64_t>(
@@ -294,6 +359,13 @@ void mClockScheduler::set_high_client_ops_profile_allocations()
   uint64_t best_effort_lim = default_max;
   uint64_t best_effort_wgt = 2;
 
+  // Background Scrub
+  uint64_t scrub_res = static_cast<uint64_t>(
+    std::round(0.05 * max_osd_bandwidth));
+  uint64_t scrub_lim = static_cast<uint64_t>(
+    std::round(max_osd_bandwidth));
+  uint64_t scrub_wgt = default_min;
+
   // Set the allocations for the mclock clients
   client_allocs[
     static_cast<size_t>(op_scheduler_class::client)].update(
@@ -310,6 +382,11 @@ void mClockScheduler::set_high_client_ops_profile_allocations()
       best_effort_res,
       best_effort_wgt,
       best_effort_lim);
+  client_allocs[
+    static_cast<size_t>(op_scheduler_class::background_scrub)].update(
+      scrub_res,
+      scrub_wgt,
+      scrub_lim);
 }
 
 void mClockScheduler::enable_mclock_profile_settings()
@@ -343,6 +420,8 @@ void mClockScheduler::set_profile_config()
     static_cast<size_t>(op_scheduler_class::background_recovery)];
   ClientAllocs best_effort = client_allocs[
     static_cast<size_t>(op_scheduler_class::background_best_effort)];
+  ClientAllocs scrub = client_allocs[
+    static_cast<size_t>(op_scheduler_class::background_scrub)];
 
   // Set external client params
   cct->_conf.set_val("osd_mclock_scheduler_client_res",
@@ -367,6 +446,14 @@ void mClockScheduler::set_profile_config()
     std::to_string(best_effort.wgt));
   cct->_conf.set_val("osd_mclock_scheduler_background_best_effort_lim",
     std::to_string(best_effort.lim));
+
+  // Set background scrub client params
+  cct->_conf.set_val("osd_mclock_scheduler_background_scrub_res",
+    std::to_string(scrub.res));
+  cct->_conf.set_val("osd_mclock_scheduler_background_scrub_wgt",
+    std::to_string(scrub.wgt));
+  cct->_conf.set_val("osd_mclock_scheduler_background_scrub_lim",
+    std::to_string(scrub.lim));
 }
 
 int mClockScheduler::calc_scaled_cost(int item_cost)
@@ -448,6 +535,9 @@ const char** mClockScheduler::get_tracked_conf_keys() const
     "osd_mclock_scheduler_background_best_effort_res",
     "osd_mclock_scheduler_background_best_effort_wgt",
     "osd_mclock_scheduler_background_best_effort_lim",
+    "osd_mclock_scheduler_background_scrub_res",
+    "osd_mclock_scheduler_background_scrub_wgt",
+    "osd_mclock_scheduler_background_scrub_lim",
     "osd_mclock_cost_per_io_usec",
     "osd_mclock_cost_per_io_usec_hdd",
     "osd_mclock_cost_per_io_usec_ssd",
@@ -456,7 +546,10 @@ const char** mClockScheduler::get_tracked_conf_keys() const
     "osd_mclock_cost_per_byte_usec_ssd",
     "osd_mclock_max_capacity_iops_hdd",
     "osd_mclock_max_capacity_iops_ssd",
+    "osd_mclock_max_sequential_bandwidth_hdd",
+    "osd_mclock_max_sequential_bandwidth_ssd",
     "osd_mclock_profile",
+    "osd_deep_scrub_stride",
     NULL
   };
   return KEYS;
@@ -470,25 +563,39 @@ void mClockScheduler::handle_conf_change(
       changed.count("osd_mclock_cost_per_io_usec_hdd") ||
       changed.count("osd_mclock_cost_per_io_usec_ssd")) {
     set_osd_mclock_cost_per_io();
+    // the scrub allocations are converted using the costs per io and byte
+    client_registry.update_from_config(
+      conf, osd_mclock_cost_per_io, osd_mclock_cost_per_byte);
+  }
+  if (changed.count("osd_deep_scrub_stride")) {
+    client_registry.update_from_config(
+      conf, osd_mclock_cost_per_io, osd_mclock_cost_per_byte);
   }
   if (changed.count("osd_mclock_cost_per_byte_usec") ||
       changed.count("osd_mclock_cost_per_byte_usec_hdd") ||
       changed.count("osd_mclock_cost_per_byte_usec_ssd")) {
     set_osd_mclock_cost_per_byte();
+    client_registry.update_from_config(
+      conf, osd_mclock_cost_per_io, osd_mclock_cost_per_byte);
   }
   if (changed.count("osd_mclock_max_capacity_iops_hdd") ||
-      changed.count("osd_mclock_max_capacity_iops_ssd")) {
+      changed.count("osd_mclock_max_capacity_iops_ssd") ||
+      changed.count("osd_mclock_max_sequential_bandwidth_hdd") ||
+      changed.count("osd_mclock_max_sequential_bandwidth_ssd")) {
     set_max_osd_capacity();
+    set_max_osd_bandwidth();
     if (mclock_profile != "custom") {
       enable_mclock_profile_settings();
-      client_registry.update_from_config(conf);
+      client_registry.update_from_config(
+        conf, osd_mclock_cost_per_io, osd_mclock_cost_per_byte);
     }
   }
   if (changed.count("osd_mclock_profile")) {
     set_mclock_profile();
     if (mclock_profile != "custom") {
       enable_mclock_profile_settings();
-      client_registry.update_from_config(conf);
+      client_registry.update_from_config(
+        conf, osd_mclock_cost_per_io, osd_mclock_cost_per_byte);
     }
   }
   if (changed.count("osd_mclock_scheduler_client_res") ||
@@ -499,9 +606,13 @@ void mClockScheduler::handle_conf_change(
       changed.count("osd_mclock_scheduler_background_recovery_lim") ||
       changed.count("osd_mclock_scheduler_background_best_effort_res") ||
       changed.count("osd_mclock_scheduler_background_best_effort_wgt") ||
-      changed.count("osd_mclock_scheduler_background_best_effort_lim")) {
+      changed.count("osd_mclock_scheduler_background_best_effort_lim") ||
+      changed.count("osd_mclock_scheduler_background_scrub_res") ||
+      changed.count("osd_mclock_scheduler_background_scrub_wgt") ||
+      changed.count("osd_mclock_scheduler_background_scrub_lim")) {
     if (mclock_profile == "custom") {
-      client_registry.update_from_config(conf);
+      client_registry.update_from_config(
+        conf, osd_mclock_cost_per_io, osd_mclock_cost_per_byte);
     }
   }
 }
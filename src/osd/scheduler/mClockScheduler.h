@@ -67,6 +67,7 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
   const uint32_t num_shards;
   bool is_rotational;
   double max_osd_capacity;
+  double max_osd_bandwidth;
   double osd_mclock_cost_per_io;
   double osd_mclock_cost_per_byte;
   std::string mclock_profile = "high_client_ops";
@@ -87,22 +88,26 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
   };
   std::array<
     ClientAllocs,
-    static_cast<size_t>(op_scheduler_class::client) + 1
+    static_cast<size_t>(op_scheduler_class::background_scrub) + 1
   > client_allocs = {
     // Placeholder, get replaced with configured values
     ClientAllocs(1, 1, 1), // background_recovery
     ClientAllocs(1, 1, 1), // background_best_effort
     ClientAllocs(1, 1, 1), // immediate (not used)
-    ClientAllocs(1, 1, 1)  // client
+    ClientAllocs(1, 1, 1), // client
+    ClientAllocs(0, 1, 0)  // background_scrub (bytes/sec)
   };
   class ClientRegistry {
     std::array<
       crimson::dmclock::ClientInfo,
-      static_cast<size_t>(op_scheduler_class::immediate)
+      static_cast<size_t>(op_scheduler_class::background_scrub) + 1
     > internal_client_infos = {
       // Placeholder, gets replaced with configured values
-      crimson::dmclock::ClientInfo(1, 1, 1),
-      crimson::dmclock::ClientInfo(1, 1, 1)
+      crimson::dmclock::ClientInfo(1, 1, 1), // background_recovery
+      crimson::dmclock::ClientInfo(1, 1, 1), // background_best_effort
+      crimson::dmclock::ClientInfo(1, 1, 1), // immediate (not used)
+      crimson::dmclock::ClientInfo(1, 1, 1), // client (not used)
+      crimson::dmclock::ClientInfo(1, 1, 1)  // background_scrub
     };
 
     crimson::dmclock::ClientInfo default_external_client_info = {1, 1, 1};
@@ -111,7 +116,14 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
     const crimson::dmclock::ClientInfo *get_external_client(
       const client_profile_id_t &client) const;
   public:
-    void update_from_config(const ConfigProxy &conf);
+    /**
+     * The scrub reservation and limit are configured in bytes/sec. They are
+     * converted into the units of the (scaled) costs of the scheduled items
+     * using the cost per io and the cost per byte.
+     */
+    void update_from_config(const ConfigProxy &conf,
+			    double cost_per_io,
+			    double cost_per_byte);
     const crimson::dmclock::ClientInfo *get_info(
       const scheduler_id_t &id) const;
   } client_registry;
@@ -142,6 +154,9 @@ public:
   // Set the max osd capacity in iops
   void set_max_osd_capacity();
 
+  // Set the max osd sequential bandwidth in bytes/sec
+  void set_max_osd_bandwidth();
+
   // Set the cost per io for the osd
   void set_osd_mclock_cost_per_io();
 
@@ -202,6 +202,9 @@ struct ScrubPgIF {
   virtual unsigned int scrub_requeue_priority(Scrub::scrub_prio_t with_priority,
 					      unsigned int suggested_priority) const = 0;
 
+  /// the cost of the on-going scrub's work items, as charged by the op scheduler
+  virtual int scrub_requeue_cost() const = 0;
+
   virtual void add_callback(Context* context) = 0;
 
   /// should we requeue blocked ops?
@@ -251,6 +254,9 @@ struct ScrubPgIF {
    */
   virtual void discard_replica_reservations() = 0;
 
+  /// a new map, while active: the scrub-slot coordinators may have changed
+  virtual void on_active_advmap(const OSDMap& osdmap) = 0;
+
   /**
    * clear both local and OSD-managed resource reservation flags
    */
@@ -271,6 +277,8 @@ struct ScrubPgIF {
   // and on the primary:
   virtual void handle_scrub_reserve_grant(OpRequestRef op, pg_shard_t from) = 0;
   virtual void handle_scrub_reserve_reject(OpRequestRef op, pg_shard_t from) = 0;
+  /// a host/failure-domain coordinator's response to our slot request
+  virtual void handle_scrub_slot_reply(OpRequestRef op) = 0;
 
   virtual void reg_next_scrub(const requested_scrub_t& request_flags) = 0;
   virtual void unreg_next_scrub() = 0;
@@ -4,7 +4,9 @@
  * In memory space allocator benchmarks.
  * Author: Igor Fedotov, ifedotov@suse.com
  */
+#include <deque>
 #include <iostream>
+#include <thread>
 #include <boost/scoped_ptr.hpp>
 #include <gtest/gtest.h>
 
@@ -13,6 +15,7 @@
 #include "include/stringify.h"
 #include "include/Context.h"
 #include "os/bluestore/Allocator.h"
+#include "os/bluestore/ShardedAllocator.h"
 
 #include <boost/random/uniform_int.hpp>
 typedef boost::mt11213b gen_type;
@@ -326,6 +329,92 @@ TEST_P(AllocTest, test_alloc_bench_10_300)
   doOverwriteTest(capacity, prefill, overwrite);
 }
 
+// allocation latency on a fragmented device: every other alloc unit is free
+TEST_P(AllocTest, test_alloc_bench_fragmented)
+{
+  uint64_t capacity = uint64_t(4) * 1024 * 1024 * 1024;
+  uint64_t alloc_unit = 4096;
+  const unsigned num_ops = 100000;
+
+  init_alloc(capacity, alloc_unit);
+  for (uint64_t offset = 0; offset < capacity; offset += 2 * alloc_unit) {
+    alloc->init_add_free(offset, alloc_unit);
+  }
+
+  for (uint64_t want : {alloc_unit, alloc_unit * 16}) {
+    PExtentVector tmp;
+    utime_t start = ceph_clock_now();
+    for (unsigned i = 0; i < num_ops; ++i) {
+      tmp.clear();
+      ASSERT_EQ((int64_t)want, alloc->allocate(want, alloc_unit, 0, 0, &tmp));
+      alloc->release(tmp);
+    }
+    std::cout << GetParam() << ": " << num_ops << " allocations of 0x"
+	      << std::hex << want << std::dec << " executed in "
+	      << ceph_clock_now() - start << std::endl;
+  }
+  ASSERT_EQ(capacity / 2, alloc->get_free());
+}
+
+// small allocations and releases from concurrent threads, as issued by the
+// OSD's op shards, with and without the per-CPU caches in front
+TEST_P(AllocTest, test_alloc_bench_threads)
+{
+  uint64_t capacity = uint64_t(64) * 1024 * 1024 * 1024;
+  uint64_t alloc_unit = 4096;
+  const unsigned num_threads = 16;
+  const unsigned ops_per_thread = 100000;
+  const size_t held_per_thread = 4096;
+
+  for (bool sharded : {false, true}) {
+    std::unique_ptr<Allocator> a(
+      Allocator::create(g_ceph_context, GetParam(), capacity, alloc_unit));
+    ASSERT_NE(a, nullptr);
+    a->init_add_free(0, capacity);
+    if (sharded) {
+      a.reset(new ShardedAllocator(g_ceph_context, a.release(), num_threads,
+				   4 * _1m, 0x10000, ""));
+    }
+
+    std::vector<std::deque<PExtentVector>> held(num_threads);
+    auto worker = [&](unsigned t) {
+      gen_type rng(t);
+      boost::uniform_int<> u1(0, 4); // 4K-64K
+      for (unsigned i = 0; i < ops_per_thread; ++i) {
+	PExtentVector tmp;
+	uint64_t want = alloc_unit << u1(rng);
+	ASSERT_EQ((int64_t)want, a->allocate(want, alloc_unit, 0, 0, &tmp));
+	held[t].emplace_back(std::move(tmp));
+	if (held[t].size() > held_per_thread) {
+	  a->release(held[t].front());
+	  held[t].pop_front();
+	}
+      }
+    };
+
+    utime_t start = ceph_clock_now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < num_threads; ++t) {
+      threads.emplace_back(worker, t);
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    std::cout << (sharded ? "sharded " : "") << GetParam()
+	      << ": executed in " << ceph_clock_now() - start
+	      << ", fragmentation " << a->get_fragmentation()
+	      << ", score " << a->get_fragmentation_score() << std::endl;
+
+    for (auto& h : held) {
+      for (auto& e : h) {
+	a->release(e);
+      }
+    }
+    ASSERT_EQ(capacity, a->get_free());
+    a->shutdown();
+  }
+}
+
 TEST_P(AllocTest, mempoolAccounting)
 {
   uint64_t bytes = mempool::bluestore_alloc::allocated_bytes();
@@ -13,6 +13,7 @@
 #include "include/stringify.h"
 #include "include/Context.h"
 #include "os/bluestore/Allocator.h"
+#include "os/bluestore/ShardedAllocator.h"
 
 typedef boost::mt11213b gen_type;
 
@@ -558,6 +559,91 @@ TEST_P(AllocTest, test_alloc_50656_first_fit)
   EXPECT_EQ(got, 0x400000);
 }
 
+TEST_P(AllocTest, test_alloc_sharded)
+{
+  uint64_t block_size = 0x1000;
+  uint64_t capacity = 0x4000000;
+  Allocator* backend = Allocator::create(g_ceph_context, GetParam(), capacity,
+					 block_size);
+  backend->init_add_free(0, capacity);
+  alloc.reset(new ShardedAllocator(g_ceph_context, backend, 4, 0x100000, 0,
+				   ""));
+  ASSERT_EQ(capacity, alloc->get_free());
+
+  // every byte can be allocated, including those held by the caches
+  std::vector<PExtentVector> allocated;
+  uint64_t total = 0;
+  while (total < capacity) {
+    PExtentVector tmp;
+    ASSERT_EQ(0x10000, alloc->allocate(0x10000, block_size, 0, 0, &tmp));
+    total += 0x10000;
+    allocated.emplace_back(std::move(tmp));
+  }
+  ASSERT_EQ(0u, alloc->get_free());
+  PExtentVector tmp;
+  EXPECT_GT(0x10000, alloc->allocate(0x10000, block_size, 0, 0, &tmp));
+
+  // released space goes to the caches, and is reported as free
+  for (size_t i = 0; i < allocated.size(); i += 2) {
+    alloc->release(allocated[i]);
+  }
+  ASSERT_EQ(capacity / 2, alloc->get_free());
+  uint64_t dumped = 0;
+  alloc->dump([&](uint64_t offset, uint64_t length) {
+    dumped += length;
+  });
+  ASSERT_EQ(capacity / 2, dumped);
+
+  // requests larger than a cache go to the allocator
+  tmp.clear();
+  ASSERT_EQ(0x200000, alloc->allocate(0x200000, block_size, 0, 0, &tmp));
+  alloc->release(tmp);
+  for (size_t i = 1; i < allocated.size(); i += 2) {
+    alloc->release(allocated[i]);
+  }
+  ASSERT_EQ(capacity, alloc->get_free());
+}
+
+TEST_P(AllocTest, test_alloc_sharded_short_extents)
+{
+  uint64_t block_size = 0x1000;
+  uint64_t capacity = 0x4000000;
+  Allocator* backend = Allocator::create(g_ceph_context, GetParam(), capacity,
+					 block_size);
+  backend->init_add_free(0, capacity);
+  alloc.reset(new ShardedAllocator(g_ceph_context, backend, 1, 0x100000,
+				   0x2000, ""));
+
+  // the cache is refilled with a single extent
+  std::vector<PExtentVector> allocated(3);
+  for (auto& a : allocated) {
+    ASSERT_EQ(0x2000, alloc->allocate(0x2000, block_size, 0, 0, &a));
+  }
+  ASSERT_EQ(capacity - 0x100000, backend->get_free());
+
+  // a long enough released extent stays cached, and counts in the
+  // fragmentation
+  alloc->release(allocated[1]);
+  ASSERT_EQ(capacity - 0x100000, backend->get_free());
+  ASSERT_EQ(capacity - 0x4000, alloc->get_free());
+  if (backend->get_fragmentation() == 0) {
+    EXPECT_GT(alloc->get_fragmentation(), 0);
+  }
+
+  // what is left of it after an allocation is too short, and goes back
+  PExtentVector tmp;
+  ASSERT_EQ(block_size, alloc->allocate(block_size, block_size, 0, 0, &tmp));
+  ASSERT_EQ(capacity - 0x100000 + block_size, backend->get_free());
+
+  // so does a released block which can't be merged into a long enough extent
+  alloc->release(tmp);
+  ASSERT_EQ(capacity - 0x100000 + 2 * block_size, backend->get_free());
+  // while one which can stays cached
+  alloc->release(allocated[2]);
+  ASSERT_EQ(capacity - 0x100000 + 2 * block_size, backend->get_free());
+  ASSERT_EQ(capacity - 0x2000, alloc->get_free());
+}
+
 INSTANTIATE_TEST_SUITE_P(
   Allocator,
   AllocTest,
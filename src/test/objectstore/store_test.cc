@@ -2751,6 +2751,72 @@ TEST_P(StoreTest, ZeroLengthZero) {
   ASSERT_EQ(0, r);
 }
 
+TEST_P(StoreTest, VerifyDigest) {
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("foo", CEPH_NOSNAP)));
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.touch(cid, hoid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(0, r);
+  }
+  {
+    // data, a hole, unaligned data, and a partial overwrite
+    bufferlist a, b, c;
+    for (unsigned i = 0; i < 1048576 / 8; ++i) {
+      a.append((const char*)&i, sizeof(i));
+      a.append((const char*)&i, sizeof(i));
+    }
+    b.append(std::string(5000, 'b'));
+    c.append(std::string(3000, 'c'));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, a.length(), a);
+    t.write(cid, hoid, 3 * 1048576 + 1234, b.length(), b);
+    t.write(cid, hoid, 4096 + 100, c.length(), c);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(0, r);
+  }
+
+  struct stat st;
+  r = store->stat(ch, hoid, &st);
+  ASSERT_EQ(0, r);
+
+  auto check = [&](uint64_t off, uint64_t len) {
+    bufferlist bl;
+    int r = store->read(ch, hoid, off, len, bl);
+    ASSERT_LE(0, r);
+    uint32_t digest = -1;
+    ASSERT_EQ(r, store->verify(ch, hoid, off, len, &digest));
+    ASSERT_EQ(bl.crc32c(-1), digest);
+  };
+  check(0, st.st_size);
+  check(0, 4096);
+  check(4096 + 17, 100000);
+  check(1048576 - 10, 3 * 1048576);
+  check(st.st_size, 4096);
+
+  // chained over strides, as deep scrub does
+  bufferlist all;
+  r = store->read(ch, hoid, 0, st.st_size, all);
+  ASSERT_EQ(st.st_size, r);
+  uint32_t digest = -1;
+  for (uint64_t off = 0; off < (uint64_t)st.st_size; off += 524288) {
+    ASSERT_LT(0, store->verify(ch, hoid, off, 524288, &digest));
+  }
+  ASSERT_EQ(all.crc32c(-1), digest);
+
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(0, r);
+  }
+}
+
 TEST_P(StoreTest, SimpleAttrTest) {
   int r;
   coll_t cid;
@@ -4933,6 +4999,86 @@ TEST_P(StoreTestSpecificAUSize, SyntheticMatrixSharding) {
   do_matrix(m, std::bind(&StoreTest::doSyntheticTest, this, _1, _2, _3, _4));
 }
 
+TEST_P(StoreTestSpecificAUSize, SyntheticMatrixShardingAdaptive) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  const char *m[][10] = {
+    { "bluestore_min_alloc_size", "4096", 0 }, // must be the first!
+    { "num_ops", "50000", 0 },
+    { "max_write", "65536", 0 },
+    { "max_size", "262144", 0 },
+    { "alignment", "4096", 0 },
+    { "bluestore_max_blob_size", "65536", 0 },
+    { "bluestore_extent_map_shard_min_size", "60", 0 },
+    { "bluestore_extent_map_shard_max_size", "600", 0 },
+    { "bluestore_extent_map_shard_target_size", "300", 0 },
+    { "bluestore_extent_map_shard_adaptive", "true", 0 },
+    { "bluestore_extent_map_shard_adaptive_min_size", "100", 0 },
+    { 0 },
+  };
+  do_matrix(m, std::bind(&StoreTest::doSyntheticTest, this, _1, _2, _3, _4));
+
+  // the same small random overwrites of an object, without and with the
+  // adaptive sizing: the latter must end up with smaller, thus more, shards
+  // every overwrite goes to a new blob
+  SetVal(g_conf(), "bluestore_prefer_deferred_size_hdd", "0");
+  SetVal(g_conf(), "bluestore_prefer_deferred_size_ssd", "0");
+  g_conf().apply_changes(nullptr);
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  auto count_shards = [&]() {
+    // to be inline with BlueStore.cc
+    const string PREFIX_OBJ = "O";
+    size_t cnt = 0;
+    auto it = bstore->get_kv()->get_iterator(PREFIX_OBJ);
+    for (it->lower_bound(string()); it->valid(); it->next()) {
+      if (it->key().back() == 'x') {
+	++cnt;
+      }
+    }
+    return cnt;
+  };
+  const uint64_t pool = 556;
+  coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const unsigned blocks = 256;
+  auto overwrite = [&](const ghobject_t& hoid) {
+    bufferlist bl;
+    bl.append(std::string(blocks * 4096, 'a'));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, bl.length(), bl);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    for (unsigned i = 0; i < 2 * blocks; ++i) {
+      bufferlist bl;
+      bl.append(std::string(4096, 'b' + i % 24));
+      ObjectStore::Transaction t;
+      t.write(cid, hoid, (i * 97 + 13) % blocks * 4096, bl.length(), bl);
+      int r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  };
+  size_t before = count_shards();
+  SetVal(g_conf(), "bluestore_extent_map_shard_adaptive", "false");
+  g_conf().apply_changes(nullptr);
+  overwrite(ghobject_t(hobject_t(sobject_t("fixed", CEPH_NOSNAP),
+				 "", 0, pool, "")));
+  size_t fixed = count_shards() - before;
+  SetVal(g_conf(), "bluestore_extent_map_shard_adaptive", "true");
+  g_conf().apply_changes(nullptr);
+  overwrite(ghobject_t(hobject_t(sobject_t("adaptive", CEPH_NOSNAP),
+				 "", 0, pool, "")));
+  size_t adaptive = count_shards() - before - fixed;
+  ASSERT_GT(fixed, 1u);
+  ASSERT_GT(adaptive, fixed);
+}
+
 TEST_P(StoreTestSpecificAUSize, ZipperPatternSharded) {
   if(string(GetParam()) != "bluestore")
     return;
@@ -6988,6 +7134,62 @@ TEST_P(StoreTestSpecificAUSize, BlobReuseOnOverwrite) {
   }
 }
 
+TEST_P(StoreTestSpecificAUSize, DeferredSubmitOnIdle) {
+
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  size_t block_size = 4096;
+  StartDeferred(block_size);
+  SetVal(g_conf(), "bluestore_prefer_deferred_size", "65536");
+  // never submit on the batch size alone
+  SetVal(g_conf(), "bluestore_deferred_batch_ops", "65535");
+  SetVal(g_conf(), "bluestore_deferred_submit_on_idle", "true");
+  g_conf().apply_changes(nullptr);
+
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t("test", "", CEPH_NOSNAP, 0, -1, ""));
+  const PerfCounters* logger = store->get_perf_counters();
+
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(std::string(block_size * 16, 'a'));
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, bl.length(), bl, CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  uint64_t deferred_ops = logger->get(l_bluestore_deferred_write_ops);
+  for (size_t off = 0; off < block_size * 16; off += block_size * 4) {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(std::string(block_size, 'b'));
+    t.write(cid, hoid, off, bl.length(), bl, CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // the deferred writes are applied once the store is idle
+  for (int i = 0; i < 100; ++i) {
+    if (logger->get(l_bluestore_deferred_write_ops) > deferred_ops) {
+      break;
+    }
+    usleep(10000);
+  }
+  ASSERT_GT(logger->get(l_bluestore_deferred_idle_submits), 0u);
+  ASSERT_GT(logger->get(l_bluestore_deferred_write_ops), deferred_ops);
+  {
+    bufferlist bl;
+    r = store->read(ch, hoid, 0, block_size * 16, bl);
+    ASSERT_EQ(r, (int)block_size * 16);
+    for (size_t off = 0; off < block_size * 16; off += block_size) {
+      ASSERT_EQ(bl[off], (off % (block_size * 4)) ? 'a' : 'b');
+    }
+  }
+}
+
 TEST_P(StoreTestSpecificAUSize, DeferredOnBigOverwrite) {
 
   if (string(GetParam()) != "bluestore")
@@ -8144,6 +8346,74 @@ namespace {
   }
 }
 
+TEST_P(StoreTestSpecificAUSize, BluestoreAllocationFromFile) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_allocation_from_file", "true");
+  SetVal(g_conf(), "bluestore_fsck_on_mount", "false");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "false");
+  StartDeferred(0x10000);
+
+  int r;
+  int64_t poolid = 11;
+  coll_t cid(spg_t(pg_t(0, poolid), shard_id_t::NO_SHARD));
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bufferlist bl;
+  bl.append(std::string(0x30000, 'a'));
+  auto write_objects = [&](int from, int to) {
+    for (int i = from; i < to; ++i) {
+      ObjectStore::Transaction t;
+      t.write(cid, make_object(stringify(i).c_str(), poolid), 0,
+	      bl.length(), bl);
+      r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  };
+  write_objects(0, 16);
+  {
+    ObjectStore::Transaction t;
+    for (int i = 0; i < 16; i += 3) {
+      t.remove(cid, make_object(stringify(i).c_str(), poolid));
+    }
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // clean shutdown: the allocations are loaded from the snapshot
+  ch.reset();
+  EXPECT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(false), 0);
+  EXPECT_EQ(store->mount(), 0);
+  ch = store->open_collection(cid);
+  {
+    bufferlist in;
+    r = store->read(ch, make_object("1", poolid), 0, bl.length(), in);
+    ASSERT_EQ(r, (int)bl.length());
+    ASSERT_TRUE(bl_eq(bl, in));
+  }
+  write_objects(16, 24);
+
+  // a writable open discards the snapshot: the allocations are then
+  // rebuilt from the onodes
+  ch.reset();
+  EXPECT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(true), 0);
+  EXPECT_EQ(store->mount(), 0);
+  ch = store->open_collection(cid);
+  write_objects(24, 32);
+  ch.reset();
+  EXPECT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(false), 0);
+  EXPECT_EQ(store->mount(), 0);
+}
+
 TEST_P(StoreTestSpecificAUSize, BluestoreRepairTest) {
   if (string(GetParam()) != "bluestore")
     return;
@@ -8339,6 +8609,562 @@ TEST_P(StoreTestSpecificAUSize, BluestoreRepairTest) {
 
 }
 
+TEST_P(StoreTestSpecificAUSize, BluestoreMultithreadedFsckTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  const size_t offs_base = 65536 / 2;
+
+  SetVal(g_conf(), "bluestore_fsck_on_mount", "false");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "false");
+  SetVal(g_conf(), "bluestore_max_blob_size",
+    stringify(2 * offs_base).c_str());
+  SetVal(g_conf(), "bluestore_extent_map_shard_max_size", "12000");
+  SetVal(g_conf(), "bluestore_fsck_threads", "4");
+
+  StartDeferred(0x10000);
+
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+
+  const uint64_t pool = 555;
+  coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+  auto ch = store->create_new_collection(cid);
+
+  ghobject_t hoid = make_object("Object 1", pool);
+  ghobject_t hoid_dup = make_object("Object 1(dup)", pool);
+  bufferlist bl;
+  bl.append("1234512345");
+  int r;
+  const size_t repeats = 16;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (auto i = 0ul; i < repeats; ++i) {
+      t.write(cid, hoid, i * offs_base, bl.length(), bl);
+      t.write(cid, hoid_dup, i * offs_base, bl.length(), bl);
+    }
+    for (int i = 0; i < 64; ++i) {
+      ghobject_t o = make_object(stringify(i).c_str(), pool);
+      t.write(cid, o, 0, bl.length(), bl);
+      ghobject_t o_cloned = o;
+      o_cloned.hobj.snap = 1;
+      t.clone(cid, o, o_cloned);
+    }
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  bstore->umount();
+  ASSERT_EQ(bstore->fsck(false), 0);
+  ASSERT_EQ(bstore->fsck(true), 0);
+
+  bstore->mount();
+  bstore->inject_misreference(cid, hoid, cid, hoid_dup, 0);
+  bstore->inject_misreference(cid, hoid, cid, hoid_dup, offs_base * (repeats - 1));
+  bstore->umount();
+  // the same errors as when checked by a single thread
+  ASSERT_EQ(bstore->fsck(false), 4);
+  ASSERT_EQ(bstore->fsck(true), 4);
+  ASSERT_EQ(bstore->repair(false), 0);
+  ASSERT_EQ(bstore->fsck(true), 0);
+  bstore->mount();
+}
+
+TEST_P(StoreTestSpecificAUSize, BluestoreKVSyncShardsTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_kv_sync_shards", "4");
+  // have the pipelines raise nid_max and blobid_max concurrently
+  SetVal(g_conf(), "bluestore_nid_prealloc", "16");
+  SetVal(g_conf(), "bluestore_blobid_prealloc", "16");
+
+  StartDeferred(0x10000);
+
+  const uint64_t pool = 555;
+  const unsigned num_colls = 8;
+  const unsigned rounds = 64;
+  vector<coll_t> cids;
+  vector<ObjectStore::CollectionHandle> chs;
+  for (unsigned i = 0; i < num_colls; ++i) {
+    coll_t cid(spg_t(pg_t(i, pool), shard_id_t::NO_SHARD));
+    auto ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    cids.push_back(cid);
+    chs.push_back(ch);
+  }
+
+  ghobject_t hoid = make_object("Object 1", pool);
+  for (unsigned round = 0; round < rounds; ++round) {
+    for (unsigned i = 0; i < num_colls; ++i) {
+      bufferlist bl;
+      bl.append(std::string(4096, 'a' + (round + i) % 26));
+      ObjectStore::Transaction t;
+      // overwrites of the same object must be applied in order...
+      t.write(cids[i], hoid, 0, bl.length(), bl);
+      // ... and each of the new ones takes a nid and a blobid
+      t.write(cids[i], make_object(stringify(round).c_str(), pool),
+	      0, bl.length(), bl);
+      int r = queue_transaction(store, chs[i], std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+
+  auto verify = [&]() {
+    for (unsigned i = 0; i < num_colls; ++i) {
+      bufferlist expected, bl;
+      expected.append(std::string(4096, 'a' + (rounds - 1 + i) % 26));
+      int r = store->read(chs[i], hoid, 0, expected.length(), bl);
+      ASSERT_EQ(r, (int)expected.length());
+      ASSERT_TRUE(bl_eq(expected, bl));
+      vector<ghobject_t> objects;
+      r = collection_list(store, chs[i], ghobject_t(), ghobject_t::get_max(),
+			  INT_MAX, &objects, 0);
+      ASSERT_EQ(r, 0);
+      ASSERT_EQ(objects.size(), rounds + 1);
+    }
+  };
+  for (auto& ch : chs) {
+    ch->flush();
+  }
+  verify();
+
+  // nid_max and blobid_max must have been persisted past the ids in use
+  chs.clear();
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  bstore->umount();
+  ASSERT_EQ(bstore->fsck(false), 0);
+  bstore->mount();
+  for (auto& cid : cids) {
+    chs.push_back(store->open_collection(cid));
+  }
+  verify();
+}
+
+TEST_P(StoreTestSpecificAUSize, BluestoreReadaheadTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_readahead_window", "262144");
+  SetVal(g_conf(), "bluestore_readahead_min_sequential", "2");
+  SetVal(g_conf(), "bluestore_default_buffered_read", "false");
+  SetVal(g_conf(), "bluestore_default_buffered_write", "false");
+
+  StartDeferred(0x10000);
+
+  const PerfCounters* logger = store->get_perf_counters();
+  const uint64_t pool = 555;
+  const size_t obj_size = 1 << 20;
+  const size_t read_size = 0x10000;
+  coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+  ghobject_t hoid = make_object("Object 1", pool);
+  auto ch = store->create_new_collection(cid);
+  bufferlist data;
+  for (size_t i = 0; i < obj_size / read_size; ++i) {
+    data.append(std::string(read_size, 'a' + i % 26));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, data.length(), data);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // start with a cold cache
+  ch.reset();
+  store->umount();
+  store->mount();
+  ch = store->open_collection(cid);
+
+  for (size_t off = 0; off < obj_size; off += read_size) {
+    bufferlist bl, expected;
+    expected.substr_of(data, off, read_size);
+    int r = store->read(ch, hoid, off, read_size, bl);
+    ASSERT_EQ(r, (int)read_size);
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+  uint64_t ra_bytes = logger->get(l_bluestore_readahead_bytes);
+  ASSERT_GT(ra_bytes, 0u);
+  ASSERT_LE(ra_bytes, obj_size);
+  // all of it was consumed by the stream
+  ASSERT_EQ(logger->get(l_bluestore_readahead_hit_bytes), ra_bytes);
+  ASSERT_EQ(logger->get(l_bluestore_readahead_wasted_bytes), 0u);
+
+  // random reads don't read ahead
+  for (size_t off : {0x80000, 0x20000, 0xc0000, 0x40000}) {
+    bufferlist bl, expected;
+    expected.substr_of(data, off, read_size);
+    int r = store->read(ch, hoid, off, read_size, bl);
+    ASSERT_EQ(r, (int)read_size);
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+  ASSERT_EQ(logger->get(l_bluestore_readahead_bytes), ra_bytes);
+}
+
+TEST_P(StoreTestSpecificAUSize, BluestoreReadCopiedBytesTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_default_buffered_read", "false");
+  SetVal(g_conf(), "bluestore_default_buffered_write", "false");
+
+  StartDeferred(0x10000);
+
+  const PerfCounters* logger = store->get_perf_counters();
+  const uint64_t pool = 555;
+  coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+  ghobject_t hoid = make_object("Object 1", pool);
+  auto ch = store->create_new_collection(cid);
+  bufferlist data;
+  data.append(std::string(0x10000, 'a'));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, data.length(), data);
+    t.write(cid, hoid, 0x20000, data.length(), data);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  store->umount();
+  store->mount();
+  ch = store->open_collection(cid);
+
+  // aligned, uncompressed data is handed over as is
+  uint64_t copied = logger->get(l_bluestore_read_copied_bytes);
+  {
+    bufferlist bl;
+    int r = store->read(ch, hoid, 0, 0x10000, bl);
+    ASSERT_EQ(r, 0x10000);
+    ASSERT_TRUE(bl_eq(data, bl));
+    ASSERT_TRUE(bl.is_aligned(CEPH_PAGE_SIZE));
+  }
+  ASSERT_EQ(logger->get(l_bluestore_read_copied_bytes), copied);
+
+  // the hole is zero filled
+  {
+    bufferlist bl, expected;
+    expected.append(data);
+    expected.append_zero(0x10000);
+    expected.append(data);
+    int r = store->read(ch, hoid, 0, 0x30000, bl);
+    ASSERT_EQ(r, 0x30000);
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+  ASSERT_EQ(logger->get(l_bluestore_read_copied_bytes), copied + 0x10000);
+}
+
+TEST_P(StoreTestSpecificAUSize, BluestoreInlineDataTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_inline_data_max_size", "4096");
+  SetVal(g_conf(), "bluestore_fsck_on_mount", "true");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "true");
+
+  StartDeferred(0x10000);
+
+  const PerfCounters* logger = store->get_perf_counters();
+  const uint64_t pool = 555;
+  coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+  ghobject_t hoid = make_object("Object 1", pool);
+  ghobject_t hoid2 = make_object("Object 2", pool);
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  auto check = [&](const ghobject_t& oid, bufferlist& expected) {
+    bufferlist bl;
+    int r = store->read(ch, oid, 0, expected.length() + 1, bl);
+    ASSERT_EQ(r, (int)expected.length());
+    ASSERT_TRUE(bl_eq(expected, bl));
+  };
+
+  bufferlist expected;
+  expected.append(std::string(100, 'a'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, expected.length(), expected);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_write_inline), 1u);
+  {
+    // older releases can no longer mount us
+    BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+    bufferlist bl;
+    // to be inline with BlueStore.cc
+    const string PREFIX_SUPER = "S";
+    int r = bstore->get_kv()->get(PREFIX_SUPER, "min_compat_ondisk_format", &bl);
+    ASSERT_EQ(r, 0);
+    int32_t compat;
+    auto p = bl.cbegin();
+    decode(compat, p);
+    ASSERT_EQ(compat, bstore->inline_data_compat_ondisk_format);
+  }
+  {
+    struct store_statfs_t statfs;
+    int r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(statfs.allocated, 0u);
+    ASSERT_EQ(statfs.data_stored, 100u);
+  }
+  check(hoid, expected);
+
+  // overwrite, zero, extend and clone, all within the onode
+  {
+    bufferlist bl;
+    bl.append(std::string(10, 'b'));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 50, bl.length(), bl);
+    t.zero(cid, hoid, 10, 10);
+    t.truncate(cid, hoid, 200);
+    t.clone(cid, hoid, hoid2);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    bufferlist e;
+    e.append(std::string(10, 'a'));
+    e.append_zero(10);
+    e.append(std::string(30, 'a'));
+    e.append(bl);
+    e.append(std::string(40, 'a'));
+    e.append_zero(100);
+    expected.swap(e);
+  }
+  check(hoid, expected);
+  check(hoid2, expected);
+  {
+    struct store_statfs_t statfs;
+    int r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(statfs.allocated, 0u);
+    ASSERT_EQ(statfs.data_stored, 400u);
+  }
+  ch.reset();
+  store->umount();
+  store->mount();
+  ch = store->open_collection(cid);
+  check(hoid, expected);
+
+  // growing past the limit moves the data to the device
+  {
+    bufferlist bl;
+    bl.append(std::string(8192, 'c'));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, expected.length(), bl.length(), bl);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    expected.append(bl);
+  }
+  check(hoid, expected);
+  {
+    bufferlist e;
+    e.substr_of(expected, 0, 200);
+    check(hoid2, e);
+  }
+  {
+    struct store_statfs_t statfs;
+    int r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(statfs.allocated, 0x10000u);
+    ASSERT_EQ(statfs.data_stored, 200u + expected.length());
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, hoid2);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    struct store_statfs_t statfs;
+    int r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(statfs.allocated, 0u);
+    ASSERT_EQ(statfs.data_stored, 0u);
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, BluestoreSharedBlobMergeRefsTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_shared_blob_merge_refs", "true");
+  SetVal(g_conf(), "bluestore_fsck_on_mount", "true");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "true");
+
+  StartDeferred(0x10000);
+
+  const uint64_t pool = 555;
+  coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+  ghobject_t hoid = make_object("Object 1", pool);
+  ghobject_t hoid2 = make_object("Object 2", pool);
+  ghobject_t hoid3 = make_object("Object 3", pool);
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  auto check = [&](const ghobject_t& oid, bufferlist& expected) {
+    bufferlist bl;
+    int r = store->read(ch, oid, 0, expected.length() + 1, bl);
+    ASSERT_EQ(r, (int)expected.length());
+    ASSERT_TRUE(bl_eq(expected, bl));
+  };
+  auto remount = [&]() {
+    ch.reset();
+    store->umount();
+    store->mount();
+    ch = store->open_collection(cid);
+  };
+
+  bufferlist expected;
+  expected.append(std::string(0x30000, 'a'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, expected.length(), expected);
+    t.clone(cid, hoid, hoid2);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // the shared blobs are no longer loaded, so the next clone merges its refs
+  remount();
+  {
+    ObjectStore::Transaction t;
+    t.clone(cid, hoid, hoid3);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // older releases can no longer mount us
+    BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+    bufferlist bl;
+    // to be inline with BlueStore.cc
+    const string PREFIX_SUPER = "S";
+    int r = bstore->get_kv()->get(PREFIX_SUPER, "min_compat_ondisk_format", &bl);
+    ASSERT_EQ(r, 0);
+    int32_t compat;
+    auto p = bl.cbegin();
+    decode(compat, p);
+    ASSERT_EQ(compat, bstore->shared_blob_merge_compat_ondisk_format);
+  }
+  check(hoid, expected);
+  check(hoid2, expected);
+  check(hoid3, expected);
+
+  // the merged refs are accounted for when the clones release theirs
+  remount();
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid2);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  remount();
+  check(hoid, expected);
+  check(hoid3, expected);
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, hoid3);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    struct store_statfs_t statfs;
+    int r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(statfs.allocated, 0u);
+    ASSERT_EQ(statfs.data_stored, 0u);
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, BluestoreDefragTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_defrag", "true");
+  SetVal(g_conf(), "bluestore_defrag_min_extents", "4");
+  SetVal(g_conf(), "bluestore_defrag_min_extent_size", "65536");
+  SetVal(g_conf(), "bluestore_defrag_max_bytes_per_sec", "0");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "true");
+
+  StartDeferred(0x1000);
+
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  const PerfCounters* logger = store->get_perf_counters();
+  const uint64_t pool = 555;
+  coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+  ghobject_t hoid = make_object("Object 1", pool);
+  ghobject_t hoid2 = make_object("Object 2", pool);
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // interleave the appends to both objects, so that their blocks alternate
+  bufferlist data, data2;
+  for (unsigned i = 0; i < 16; ++i) {
+    bufferlist bl, bl2;
+    bl.append(std::string(0x1000, 'a' + i));
+    bl2.append(std::string(0x1000, 'A' + i));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, i * 0x1000, bl.length(), bl);
+    t.write(cid, hoid2, i * 0x1000, bl2.length(), bl2);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    data.append(bl);
+    data2.append(bl2);
+  }
+
+  bstore->request_defrag();
+  for (int i = 0; i < 500; ++i) {
+    if (logger->get(l_bluestore_defrag_onodes) >= 2) {
+      break;
+    }
+    usleep(10000);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_defrag_onodes), 2u);
+  ASSERT_EQ(logger->get(l_bluestore_defrag_bytes), 2u * 0x10000);
+  ASSERT_GT(logger->get(l_bluestore_defrag_extents_reclaimed), 0u);
+
+  auto check = [&](const ghobject_t& oid, bufferlist& expected) {
+    bufferlist bl;
+    int r = store->read(ch, oid, 0, expected.length() + 1, bl);
+    ASSERT_EQ(r, (int)expected.length());
+    ASSERT_TRUE(bl_eq(expected, bl));
+  };
+  check(hoid, data);
+  check(hoid2, data2);
+  ch.reset();
+  store->umount();
+  store->mount();
+  ch = store->open_collection(cid);
+  check(hoid, data);
+  check(hoid2, data2);
+
+  // nothing left to do
+  bstore->request_defrag();
+  for (int i = 0; i < 500; ++i) {
+    if (logger->get(l_bluestore_defrag_onodes) > 2) {
+      break;
+    }
+    usleep(1000);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_defrag_onodes), 2u);
+}
+
 TEST_P(StoreTestSpecificAUSize, BluestoreBrokenZombieRepairTest) {
   if (string(GetParam()) != "bluestore")
     return;
@@ -3,7 +3,10 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
 #include <iostream>
+#include <list>
+#include <thread>
 #include <gtest/gtest.h>
 #include "global/global_init.h"
 #include "global/global_context.h"
@@ -13,6 +16,8 @@
 #include "common/errno.h"
 
 #include "blk/BlockDevice.h"
+#include "blk/kernel/io_uring.h"
+#include "common/perf_counters_collection.h"
 
 class TempBdev {
 public:
@@ -89,6 +94,91 @@ TEST(KernelDevice, Ticket45337) {
   b->close();
 }
 
+TEST(KernelDevice, ioring_concurrent_writes) {
+  // unaligned writes are copied to the registered buffers when io_uring is
+  // used, and the writes of concurrent submits all land, whichever thread
+  // hands them to the kernel
+  if (!ioring_queue_t::supported()) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+  g_ceph_context->_conf.set_val_or_die("bdev_ioring", "true");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  uint64_t size = 1048576ull * 64;
+  TempBdev bdev{ size };
+
+  std::unique_ptr<BlockDevice> b(
+    BlockDevice::create(g_ceph_context, bdev.path, NULL, NULL,
+      [](void* handle, void* aio) {}, NULL));
+  int r = b->open(bdev.path);
+  if (r < 0) {
+    g_ceph_context->_conf.set_val_or_die("bdev_ioring", "false");
+    g_ceph_context->_conf.apply_changes(nullptr);
+    GTEST_SKIP() << "open " << bdev.path << " failed";
+  }
+
+  const unsigned num_threads = 4;
+  const unsigned per_thread = 64;
+  const uint64_t len = 0x2000;
+  auto data = [&](unsigned n) {
+    // off by one byte, so that the data isn't aligned in memory
+    bufferptr p = buffer::create(len + 1);
+    memset(p.c_str(), 'a' + n % 26, len + 1);
+    bufferlist bl;
+    bl.append(p, 1, len);
+    return bl;
+  };
+
+  // the threads start together and only wait for their writes at the end,
+  // so that their submits overlap
+  std::atomic<bool> go = false;
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t] {
+      std::list<IOContext> iocs;
+      while (!go) {
+	std::this_thread::yield();
+      }
+      for (unsigned i = 0; i < per_thread; i++) {
+	unsigned n = t * per_thread + i;
+	IOContext& ioc = iocs.emplace_back(g_ceph_context, nullptr);
+	bufferlist bl = data(n);
+	ASSERT_EQ(0, b->aio_write(n * len, bl, &ioc, false));
+	b->aio_submit(&ioc);
+      }
+      for (auto& ioc : iocs) {
+	ioc.aio_wait();
+      }
+    });
+  }
+  go = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (unsigned n = 0; n < num_threads * per_thread; n++) {
+    IOContext ioc(g_ceph_context, NULL);
+    bufferlist bl;
+    ASSERT_EQ(0, b->read(n * len, len, &bl, &ioc, false));
+    ASSERT_TRUE(bl.contents_equal(data(n)));
+  }
+
+  uint64_t fixed_ios = 0;
+  std::string prefix = "bdev-" + bdev.path.substr(bdev.path.rfind('/') + 1);
+  g_ceph_context->get_perfcounters_collection()->with_counters(
+    [&](const PerfCountersCollectionImpl::CounterMap& by_path) {
+      if (auto p = by_path.find(prefix + ".fixed_ios"); p != by_path.end()) {
+	fixed_ios = p->second.data->u64;
+      }
+    });
+  b->close();
+
+  g_ceph_context->_conf.set_val_or_die("bdev_ioring", "false");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  EXPECT_GT(fixed_ios, 0u);
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
@@ -503,6 +503,65 @@ TEST(BlueFS, test_flush_3) {
   fs.umount();
 }
 
+TEST(BlueFS, test_concurrent_flush) {
+  uint64_t size = 1048576 * 128;
+  TempBdev bdev{size};
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_concurrent_flush", "true");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false, 1048576));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("dir"));
+
+  const unsigned num_threads = 4;
+  const unsigned num_appends = 300;
+  auto line = [](unsigned t, unsigned i) {
+    return "thread " + to_string(t) + " append " + to_string(i) + "\n";
+  };
+  // small appends, so that most flushes rewrite the previous partial block
+  auto writer = [&](unsigned t) {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "file." + to_string(t), &h, false));
+    for (unsigned i = 0; i < num_appends; ++i) {
+      string s = line(t, i);
+      h->append(s.c_str(), s.length());
+      if (i % 3 == 0) {
+        ASSERT_EQ(0, fs.fsync(h));
+      } else {
+        fs.flush(h, true);
+      }
+    }
+    ASSERT_EQ(0, fs.fsync(h));
+    fs.close_writer(h);
+  };
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back(writer, t);
+  }
+  join_all(threads);
+
+  fs.umount();
+  ASSERT_EQ(0, fs.mount());
+  for (unsigned t = 0; t < num_threads; ++t) {
+    string expected;
+    for (unsigned i = 0; i < num_appends; ++i) {
+      expected += line(t, i);
+    }
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "file." + to_string(t), &h));
+    bufferlist bl;
+    ASSERT_EQ((int64_t)expected.length(),
+              fs.read(h, 0, expected.length() + 1, &bl, NULL));
+    ASSERT_EQ(expected, bl.to_str());
+    delete h;
+  }
+  fs.umount();
+}
+
 TEST(BlueFS, test_simple_compaction_sync) {
   g_ceph_context->_conf.set_val(
     "bluefs_compact_log_sync",
@@ -1497,6 +1497,75 @@ TEST(GarbageCollector, BasicTest)
   }
 }
 
+// 'scan_refs': the number of times each onode of the scan is accessed in a row
+static bool onode_cache_keeps_hot_onodes_over_scan(const char *type,
+						   unsigned scan_refs = 1)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  PerfCountersBuilder b(g_ceph_context, "onode_cache_test",
+			l_bluestore_onode_hits - 1,
+			l_bluestore_onode_protected_hits + 1);
+  b.add_u64_counter(l_bluestore_onode_hits, "onode_hits", "");
+  b.add_u64_counter(l_bluestore_onode_misses, "onode_misses", "");
+  b.add_u64_counter(l_bluestore_onode_probation_hits, "onode_probation_hits", "");
+  b.add_u64_counter(l_bluestore_onode_protected_hits, "onode_protected_hits", "");
+  std::unique_ptr<PerfCounters> logger(b.create_perf_counters());
+  BlueStore::OnodeCacheShard *oc = BlueStore::OnodeCacheShard::create(
+    g_ceph_context, type, logger.get());
+  BlueStore::BufferCacheShard *bc = BlueStore::BufferCacheShard::create(
+    g_ceph_context, "lru", NULL);
+  oc->set_max(10);
+
+  bool kept = true;
+  {
+    auto coll = ceph::make_ref<BlueStore::Collection>(&store, oc, bc, coll_t());
+    auto add = [&](const ghobject_t& oid) {
+      BlueStore::OnodeRef o(new BlueStore::Onode(coll.get(), oid, ""));
+      o->exists = true;
+      coll->onode_map.add(oid, o);
+    };
+    auto oid = [](const std::string& name) {
+      return ghobject_t(hobject_t(sobject_t(name, CEPH_NOSNAP)));
+    };
+
+    // four onodes accessed twice ...
+    for (unsigned i = 0; i < 4; ++i) {
+      add(oid("hot" + stringify(i)));
+    }
+    for (unsigned i = 0; i < 4; ++i) {
+      ceph_assert(coll->onode_map.lookup(oid("hot" + stringify(i))));
+    }
+    // ... and a scan through many more
+    for (unsigned i = 0; i < 100; ++i) {
+      add(oid("cold" + stringify(i)));
+      for (unsigned j = 1; j < scan_refs; ++j) {
+	ceph_assert(coll->onode_map.lookup(oid("cold" + stringify(i))));
+      }
+    }
+    for (unsigned i = 0; i < 4; ++i) {
+      kept = kept && coll->onode_map.lookup(oid("hot" + stringify(i)));
+    }
+    coll->onode_map.clear();
+  }
+  delete bc;
+  delete oc;
+  return kept;
+}
+
+TEST(OnodeCacheShard, slru_scan_resistance)
+{
+  ASSERT_FALSE(onode_cache_keeps_hot_onodes_over_scan("lru"));
+  ASSERT_TRUE(onode_cache_keeps_hot_onodes_over_scan("slru"));
+}
+
+TEST(OnodeCacheShard, slru_scan_resistance_correlated_refs)
+{
+  // e.g. a scrub's stat & getattrs: the scanned onodes are accessed more than
+  // once, in a row
+  ASSERT_FALSE(onode_cache_keeps_hot_onodes_over_scan("lru", 3));
+  ASSERT_TRUE(onode_cache_keeps_hot_onodes_over_scan("slru", 3));
+}
+
 TEST(BlueStoreRepairer, StoreSpaceTracker)
 {
   BlueStoreRepairer::StoreSpaceTracker bmap0;
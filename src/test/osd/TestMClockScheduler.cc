@@ -169,3 +169,28 @@ TEST_F(mClockSchedulerTest, TestMultiClientOrderedEnqueueDequeue) {
   }
   ASSERT_TRUE(q.empty());
 }
+
+TEST_F(mClockSchedulerTest, TestScrubAllocations) {
+  // the built-in profile derives the scrub allocations (in bytes/sec) from the
+  // sequential bandwidth of the (single shard, non-rotational) OSD
+  auto bandwidth = g_ceph_context->_conf.get_val<Option::size_t>(
+    "osd_mclock_max_sequential_bandwidth_ssd");
+  ASSERT_EQ("high_client_ops", q.get_mclock_profile());
+  ASSERT_EQ(static_cast<uint64_t>(std::round(0.05 * bandwidth)),
+	    g_ceph_context->_conf.get_val<Option::size_t>(
+	      "osd_mclock_scheduler_background_scrub_res"));
+  ASSERT_EQ(bandwidth,
+	    g_ceph_context->_conf.get_val<Option::size_t>(
+	      "osd_mclock_scheduler_background_scrub_lim"));
+
+  for (unsigned i = 100; i < 103; ++i) {
+    q.enqueue(create_item(i, client1, op_scheduler_class::background_scrub));
+    std::this_thread::sleep_for(std::chrono::microseconds(1));
+  }
+  for (unsigned i = 100; i < 103; ++i) {
+    ASSERT_FALSE(q.empty());
+    auto r = get_item(q.dequeue());
+    ASSERT_EQ(i, r.get_map_epoch());
+  }
+  ASSERT_TRUE(q.empty());
+}
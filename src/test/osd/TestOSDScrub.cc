@@ -24,10 +24,16 @@
 #include <gtest/gtest.h>
 #include "common/async/context_pool.h"
 #include "osd/OSD.h"
+#include "osd/ScrubHasher.h"
+#include "osd/ScrubStore.h"
+#include "osd/osd_scrub_sched.h"
+#include "osd/pg_scrubber.h"
 #include "os/ObjectStore.h"
 #include "mon/MonClient.h"
 #include "common/ceph_argparse.h"
 #include "msg/Messenger.h"
+#include "common/scrub_types.h"
+#include "test/objectstore/store_test_fixture.h"
 
 class TestOSDScrub: public OSD {
 
@@ -198,6 +204,400 @@ TEST(TestOSDScrub, scrub_time_permit) {
   ASSERT_FALSE(ret);
 }
 
+TEST(TestOSDScrub, scrub_queue_order) {
+  ScrubQueue sq(g_ceph_context);
+  const utime_t now = ceph_clock_now();
+  const spg_t pg1{pg_t{1, 1}}, pg2{pg_t{2, 1}}, pg3{pg_t{3, 1}};
+
+  // a regular scrub, due an hour ago, with no deadline
+  utime_t t1 = now;
+  t1 -= 3600;
+  sq.register_job(pg1, t1, 0, 0, true);
+  // a scrub that is past its deadline, but was scheduled after pg1's
+  utime_t t2 = now;
+  t2 -= 1800;
+  sq.register_job(pg2, t2, 0, 0, true);
+  // not due yet
+  utime_t t3 = now;
+  t3 += 3600;
+  sq.register_job(pg3, t3, 0, 0, true);
+  ASSERT_EQ(3u, sq.size());
+
+  auto ready = sq.ready_jobs(now);
+  ASSERT_EQ(2u, ready.size());
+  // 'must' jobs have their deadline set to the sched time: both are overdue
+  ASSERT_EQ(pg1, ready[0].pgid);
+  ASSERT_EQ(pg2, ready[1].pgid);
+
+  // an operator request is served first
+  sq.register_job(pg2, PgScrubber::scrub_must_stamp(), 0, 0, true);
+  ASSERT_EQ(3u, sq.size());
+  ready = sq.ready_jobs(now);
+  ASSERT_EQ(2u, ready.size());
+  ASSERT_EQ(pg2, ready[0].pgid);
+  ASSERT_EQ(ScrubQueue::urgency_t::must_scrub, ready[0].urgency(now));
+
+  sq.remove_job(pg2);
+  ASSERT_EQ(2u, sq.size());
+  ready = sq.ready_jobs(now);
+  ASSERT_EQ(1u, ready.size());
+  ASSERT_EQ(pg1, ready[0].pgid);
+}
+
+TEST(TestOSDScrub, scrub_queue_penalty) {
+  g_ceph_context->_conf.set_val("osd_scrub_reservation_backoff", "10");
+  g_ceph_context->_conf.set_val("osd_scrub_reservation_backoff_max", "25");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  ScrubQueue sq(g_ceph_context);
+  const utime_t now = ceph_clock_now();
+  const spg_t pg1{pg_t{1, 1}};
+  utime_t t1 = now;
+  t1 -= 60;
+  sq.register_job(pg1, t1, 0, 0, true);
+  ASSERT_EQ(1u, sq.ready_jobs(now).size());
+
+  sq.penalize(pg1, now);
+  ASSERT_TRUE(sq.ready_jobs(now).empty());
+  utime_t later = now;
+  later += 11;
+  ASSERT_EQ(1u, sq.ready_jobs(later).size());
+
+  // the delay is doubled, and capped
+  sq.penalize(pg1, now);
+  ASSERT_TRUE(sq.ready_jobs(later).empty());
+  sq.penalize(pg1, now);
+  later += 15;
+  ASSERT_EQ(1u, sq.ready_jobs(later).size());
+  ASSERT_EQ(3, sq.ready_jobs(later)[0].penalty_count);
+
+  sq.clear_penalty(pg1);
+  ASSERT_EQ(1u, sq.ready_jobs(now).size());
+  ASSERT_EQ(0, sq.ready_jobs(now)[0].penalty_count);
+
+  // re-registering forgives the PG, too
+  sq.penalize(pg1, now);
+  ASSERT_TRUE(sq.ready_jobs(now).empty());
+  sq.register_job(pg1, t1, 0, 0, true);
+  ASSERT_EQ(1u, sq.ready_jobs(now).size());
+  ASSERT_EQ(0, sq.ready_jobs(now)[0].penalty_count);
+
+  // a must-scrub job is never delayed
+  const spg_t pg2{pg_t{2, 1}};
+  sq.register_job(pg2, PgScrubber::scrub_must_stamp(), 0, 0, true);
+  sq.penalize(pg2, now);
+  sq.penalize(pg2, now);
+  auto ready = sq.ready_jobs(now);
+  ASSERT_EQ(2u, ready.size());
+  ASSERT_EQ(pg2, ready[0].pgid);
+  ASSERT_EQ(0, ready[0].penalty_count);
+}
+
+TEST(TestOSDScrub, scrub_queue_slots) {
+  ScrubQueue sq(g_ceph_context);
+  const int host = -2;
+  const pg_t pg1{1, 1}, pg2{2, 1}, pg3{3, 1};
+
+  ASSERT_TRUE(sq.grant_slot(host, pg1, 0, 2));
+  ASSERT_TRUE(sq.grant_slot(host, pg2, 1, 2));
+  ASSERT_FALSE(sq.grant_slot(host, pg3, 2, 2));
+  // a slot already held is re-granted, possibly to a new primary
+  ASSERT_TRUE(sq.grant_slot(host, pg1, 3, 2));
+  // other buckets are counted separately
+  ASSERT_TRUE(sq.grant_slot(-3, pg3, 2, 2));
+
+  sq.release_slot(host, pg2);
+  ASSERT_TRUE(sq.grant_slot(host, pg3, 2, 2));
+
+  // drop the slots held by osd.2
+  sq.prune_slots([](int, pg_t, int holder) { return holder != 2; });
+  ASSERT_TRUE(sq.grant_slot(host, pg2, 1, 2));
+  ASSERT_FALSE(sq.grant_slot(host, pg3, 2, 2));
+}
+
+TEST(TestOSDScrub, scrub_pending_digest) {
+  bufferlist a, b, c;
+  a.append(std::string(4096, 'a'));
+  b.append(std::string(1000, 'b'));
+  c.append("ccc");
+
+  bufferhash h(-1);
+  h << a;
+  h << b;
+  h << c;
+
+  // segments completed out of order, one of them empty
+  Scrub::PendingDigest d;
+  auto ia = d.add_segment(a.length());
+  auto ie = d.add_segment(0);
+  auto ib = d.add_segment(b.length());
+  d.append(c);
+  ASSERT_FALSE(d.is_done());
+  d.set_segment(ib, b.crc32c(0));
+  d.set_segment(ie, 0);
+  ASSERT_FALSE(d.is_done());
+  d.set_segment(ia, a.crc32c(0));
+  ASSERT_TRUE(d.is_done());
+  ASSERT_EQ(h.digest(), d.digest());
+
+  // the waker is called once no more than the requested segments are pending
+  Scrub::PendingDigest w;
+  int woken = 0;
+  auto i0 = w.add_segment(a.length());
+  auto i1 = w.add_segment(b.length());
+  ASSERT_FALSE(w.wait_for(2, [&woken] { ++woken; }));
+  ASSERT_TRUE(w.wait_for(0, [&woken] { ++woken; }));
+  w.set_segment(i1, b.crc32c(0));
+  ASSERT_EQ(0, woken);
+  w.set_segment(i0, a.crc32c(0));
+  ASSERT_EQ(1, woken);
+  ASSERT_FALSE(w.wait_for(0, [&woken] { ++woken; }));
+
+  // no data at all
+  Scrub::PendingDigest empty;
+  empty.append(bufferlist{});
+  ASSERT_EQ(bufferhash(-1).digest(), empty.digest());
+}
+
+TEST(TestOSDScrub, scrub_map_attr_digests) {
+  ScrubMap::object obj;
+  obj.attrs[OI_ATTR] = ceph::buffer::copy(std::string(100, 'o').c_str(), 100);
+  obj.attrs[SS_ATTR] = ceph::buffer::copy(std::string(100, 's').c_str(), 100);
+  obj.attrs["_small"] = ceph::buffer::copy("v", 1);
+  obj.attrs["_large"] = ceph::buffer::copy(std::string(100, 'l').c_str(), 100);
+  const auto large_digest = obj.get_attr_digest("_large");
+
+  // only the large user xattrs are replaced by their digests
+  ScrubMap::object compact = obj;
+  compact.digest_attrs(64);
+  ASSERT_EQ(3u, compact.attrs.size());
+  ASSERT_EQ(1u, compact.attr_digests.size());
+  ASSERT_TRUE(compact.has_attr("_large"));
+  ASSERT_FALSE(compact.attrs.count("_large"));
+  ASSERT_EQ(large_digest, compact.get_attr_digest("_large"));
+
+  // and survive the encoding
+  bufferlist bl;
+  encode(compact, bl);
+  ScrubMap::object decoded;
+  auto p = bl.cbegin();
+  decode(decoded, p);
+  ASSERT_EQ(compact.attr_digests, decoded.attr_digests);
+  ASSERT_EQ(3u, decoded.attrs.size());
+}
+
+TEST(TestOSDScrub, scrub_checkpoint_encoding) {
+  scrub_checkpoint_t ckpt;
+  ckpt.boundary = hobject_t(object_t("obj"), "", CEPH_NOSNAP, 0x1234, 1, "");
+  ckpt.version = eversion_t(5, 100);
+  ckpt.started = utime_t(1000, 0);
+  ckpt.stamp = utime_t(2000, 0);
+  ckpt.full_sweep = false;
+  ckpt.cstat.sum.num_objects = 7;
+  ckpt.cstat.sum.num_bytes = 7 << 20;
+  ckpt.omap_keys = 3;
+
+  bufferlist bl;
+  encode(ckpt, bl);
+  scrub_checkpoint_t decoded;
+  auto p = bl.cbegin();
+  decode(decoded, p);
+  ASSERT_EQ(ckpt.boundary, decoded.boundary);
+  ASSERT_EQ(ckpt.version, decoded.version);
+  ASSERT_EQ(ckpt.started, decoded.started);
+  ASSERT_EQ(ckpt.stamp, decoded.stamp);
+  ASSERT_FALSE(decoded.full_sweep);
+  ASSERT_EQ(7, decoded.cstat.sum.num_objects);
+  ASSERT_EQ(7 << 20, decoded.cstat.sum.num_bytes);
+  ASSERT_EQ(3u, decoded.omap_keys);
+}
+
+namespace {
+hobject_t chunk_boundary(uint32_t n) {
+  return hobject_t(object_t("obj" + std::to_string(n)), "", CEPH_NOSNAP, n, 1, "");
+}
+}
+
+TEST(TestOSDScrub, scrub_prefetch_window_depth) {
+  // chunks [obj0, obj1), [obj1, obj2), [obj2, obj3) and [obj3, max)
+  unsigned selected = 0;
+  auto select = [&selected](const hobject_t& start) {
+    ++selected;
+    Scrub::prefetched_chunk_t chunk;
+    chunk.start = start;
+    chunk.end = start.get_hash() < 3 ? chunk_boundary(start.get_hash() + 1)
+				      : hobject_t::get_max();
+    return chunk;
+  };
+  const pg_shard_t r1{1, shard_id_t::NO_SHARD};
+  const pg_shard_t r2{2, shard_id_t::NO_SHARD};
+  Scrub::PrefetchWindow window;
+
+  // the first replica to be free fills the window
+  auto chunk = window.request_next(r1, 2, chunk_boundary(0), select);
+  ASSERT_NE(nullptr, chunk);
+  ASSERT_EQ(chunk_boundary(0), chunk->start);
+  chunk = window.request_next(r1, 2, chunk_boundary(0), select);
+  ASSERT_NE(nullptr, chunk);
+  ASSERT_EQ(chunk_boundary(1), chunk->start);
+  ASSERT_EQ(nullptr, window.request_next(r1, 2, chunk_boundary(0), select));
+  ASSERT_EQ(2u, window.size());
+  ASSERT_EQ(2u, selected);
+
+  // the other replicas are asked for the same chunks
+  chunk = window.request_next(r2, 2, chunk_boundary(0), select);
+  ASSERT_NE(nullptr, chunk);
+  ASSERT_EQ(chunk_boundary(0), chunk->start);
+  ASSERT_EQ(2u, selected);
+  ASSERT_NE(nullptr, window.find_requested(chunk_boundary(0), r2));
+  ASSERT_EQ(nullptr, window.find_requested(chunk_boundary(1), r2));
+
+  // scrubbing the first chunk makes room for another one
+  auto scrubbed = window.pop_front(chunk_boundary(0));
+  ASSERT_TRUE(scrubbed);
+  ASSERT_EQ(2u, scrubbed->requested.size());
+  ASSERT_EQ(chunk_boundary(1), window.front_start());
+  chunk = window.request_next(r1, 2, chunk_boundary(1), select);
+  ASSERT_NE(nullptr, chunk);
+  ASSERT_EQ(chunk_boundary(2), chunk->start);
+  ASSERT_EQ(2u, window.size());
+
+  // nothing is selected past the end of the PG
+  window.pop_front(chunk_boundary(1));
+  chunk = window.request_next(r1, 2, chunk_boundary(2), select);
+  ASSERT_NE(nullptr, chunk);
+  ASSERT_TRUE(chunk->end.is_max());
+  window.pop_front(chunk_boundary(2));
+  ASSERT_EQ(nullptr, window.request_next(r1, 2, chunk_boundary(3), select));
+  ASSERT_EQ(1u, window.size());
+  ASSERT_EQ(4u, selected);
+}
+
+TEST(TestOSDScrub, scrub_prefetch_discarded_on_write) {
+  Scrub::prefetched_chunk_t chunk;
+  chunk.start = chunk_boundary(1);
+  chunk.end = chunk_boundary(2);
+  chunk.subset_last_update = eversion_t(5, 90);
+  chunk.selected_at = eversion_t(5, 100);
+  const eversion_t tail(5, 50);
+
+  // no write to the chunk's range since it was requested
+  ASSERT_TRUE(chunk.is_valid(chunk.end, eversion_t(5, 90), tail, true));
+
+  // a write landed in the chunk's range while the replicas were scanning it
+  ASSERT_FALSE(chunk.is_valid(chunk.end, eversion_t(5, 110), tail, true));
+
+  // the log was trimmed past the point the chunk was selected at
+  ASSERT_FALSE(chunk.is_valid(chunk.end, eversion_t(5, 90), eversion_t(5, 101), true));
+
+  // the PG is no longer clean, or the chunk is not the one being scrubbed
+  ASSERT_FALSE(chunk.is_valid(chunk.end, eversion_t(5, 90), tail, false));
+  ASSERT_FALSE(chunk.is_valid(chunk_boundary(3), eversion_t(5, 90), tail, true));
+}
+
+class ScrubStoreTest : public StoreTestFixture {
+public:
+  ScrubStoreTest() : StoreTestFixture("memstore") {}
+
+  void SetUp() override {
+    StoreTestFixture::SetUp();
+    coll = coll_t(pgid);
+    ch = store->create_new_collection(coll);
+    ObjectStore::Transaction t;
+    t.create_collection(coll, 0);
+    store->queue_transaction(ch, std::move(t));
+  }
+  void TearDown() override {
+    if (errors) {
+      ObjectStore::Transaction t;
+      errors->cleanup(&t);
+      store->queue_transaction(ch, std::move(t));
+      errors.reset();
+    }
+    ch.reset();
+    StoreTestFixture::TearDown();
+  }
+
+  void create(uint64_t max_cached) {
+    ObjectStore::Transaction t;
+    errors.reset(Scrub::Store::create(store.get(), &t, pgid, coll,
+				      max_cached));
+    store->queue_transaction(ch, std::move(t));
+  }
+  /// add the errors of a chunk, then commit them
+  void add_chunk(const std::vector<std::string>& names, uint64_t flags) {
+    for (auto& name : names) {
+      inconsistent_obj_wrapper e{hobject_t{object_t{name}, "", CEPH_NOSNAP,
+					   0, pool, ""}};
+      e.errors = flags;
+      errors->add_object_error(pool, e);
+    }
+    ObjectStore::Transaction t;
+    errors->flush(&t);
+    store->queue_transaction(ch, std::move(t));
+  }
+  /// list the errors, max_return at a time
+  std::vector<std::pair<std::string, uint64_t>> list(uint64_t max_return) {
+    std::vector<std::pair<std::string, uint64_t>> listed;
+    librados::object_id_t start;
+    while (true) {
+      auto page = errors->get_object_errors(pool, start, max_return);
+      EXPECT_LE(page.size(), max_return);
+      for (auto& bl : page) {
+	inconsistent_obj_wrapper e{hobject_t{}};
+	auto p = bl.cbegin();
+	e.decode(p);
+	listed.emplace_back(e.object.name, e.errors);
+	start = e.object;
+      }
+      if (page.size() < max_return) {
+	return listed;
+      }
+    }
+  }
+
+  const int64_t pool = 1;
+  const spg_t pgid{pg_t(0, pool)};
+  coll_t coll;
+  std::unique_ptr<Scrub::Store> errors;
+};
+
+TEST_F(ScrubStoreTest, cached) {
+  create(1 << 20);
+  add_chunk({"b", "d", "a"}, 1);
+  // a later chunk overrides the errors of an object
+  add_chunk({"c", "b"}, 2);
+  // not committed
+  add_chunk({}, 0);
+  inconsistent_obj_wrapper e{hobject_t{object_t{"e"}, "", CEPH_NOSNAP,
+				       0, pool, ""}};
+  errors->add_object_error(pool, e);
+  errors->flush(nullptr);
+
+  std::vector<std::pair<std::string, uint64_t>> expected{
+    {"a", 1}, {"b", 2}, {"c", 2}, {"d", 1}};
+  for (uint64_t max_return : {1, 3, 100}) {
+    ASSERT_EQ(expected, list(max_return));
+  }
+  ASSERT_TRUE(errors->get_object_errors(pool + 1, {}, 100).empty());
+}
+
+TEST_F(ScrubStoreTest, spilled) {
+  // the first chunk is cached, the second spills it all into the omap,
+  // and the third is written there too
+  create(300);
+  add_chunk({"b", "d"}, 1);
+  add_chunk({"a", "c", "f", "g"}, 2);
+  add_chunk({"e", "b"}, 4);
+
+  std::vector<std::pair<std::string, uint64_t>> expected{
+    {"a", 2}, {"b", 4}, {"c", 2}, {"d", 1}, {"e", 4}, {"f", 2}, {"g", 2}};
+  for (uint64_t max_return : {1, 3, 100}) {
+    ASSERT_EQ(expected, list(max_return));
+  }
+  ASSERT_TRUE(errors->get_object_errors(pool + 1, {}, 100).empty());
+}
+
 // Local Variables:
 // compile-command: "cd ../.. ; make unittest_osdscrub ; ./unittest_osdscrub --log-to-stderr=true  --debug-osd=20 # --gtest_filter=*.* "
 // End:
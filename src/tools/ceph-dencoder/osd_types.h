@@ -50,6 +50,7 @@ TYPE_FEATUREFUL(PullOp)
 TYPE_FEATUREFUL(PushOp)
 TYPE(ScrubMap::object)
 TYPE(ScrubMap)
+TYPE(scrub_verified_t)
 TYPE_FEATUREFUL(obj_list_watch_response_t)
 TYPE(clone_info)
 TYPE(obj_list_snap_response_t)